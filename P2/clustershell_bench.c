@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "clustershell_frame.h"
+
+#define MAX_NUM_CLI 64
+#define MAX_CMD_LEN 1024
+#define MAX_BUF_SIZE 4096
+#define BENCH_IP "127.0.0.1"
+#define BENCH_PORT 5300
+#define BENCH_NODE_PORT 6100
+#define BENCH_DEAD_PORT 6900    // nothing listens there
+#define BENCH_CONFIG_FILE "/tmp/clustershell_bench.cfg"
+#define SERVER_BIN "./clustershell_server.o"
+#define CLIENT_BIN "./clustershell_client.o"
+#define LARGE_PAYLOAD 4194304
+
+
+typedef struct _SCENARIO {
+    char * name;
+    char cmd[MAX_CMD_LEN];
+    char * expected;
+    size_t expected_len;
+    int fanout;
+    char * setup;           // session command sent first, relay counters reported if set
+    bool cold;              // every round on a new session, so on a new node worker
+    int dead;               // nodes in the config that are down
+} SCENARIO;
+
+typedef struct _RELAY_REPORT {
+    uint64_t spliced;
+    uint64_t copied;
+    double cpu_ms;
+} RELAY_REPORT;
+
+
+void err_exit(const char * err_msg, int sock_fd) {
+    perror(err_msg);
+    if (sock_fd > 0) {
+        close(sock_fd);
+        printf("Closed socket %d...\n", sock_fd);
+    }
+    exit(EXIT_FAILURE);
+}
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+pid_t spawn(char * const argv[]) {
+    pid_t pid = fork();
+    if (pid < 0)
+        err_exit("Error in fork. Exiting...\n", -1);
+    else if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, 1);
+        close(null_fd);
+        execv(argv[0], argv);
+        err_exit("Error in exec. Exiting...\n", -1);
+    }
+    return pid;
+}
+
+void kill_all(pid_t * pids, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        kill(pids[i], SIGTERM);
+    for (size_t i = 0; i < n; ++i)
+        waitpid(pids[i], NULL, 0);
+}
+
+// Retries until the listener is up
+int connect_retry(int port) {
+    struct sockaddr_in serv_addr = {0};
+    serv_addr.sin_family = AF_INET;
+    inet_aton(BENCH_IP, &(serv_addr.sin_addr));
+    serv_addr.sin_port = htons(port);
+
+    for (int retries = 0; retries < 500; ++retries) {
+        int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(sock_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) == 0)
+            return sock_fd;
+        close(sock_fd);
+        usleep(10000);
+    }
+    err_exit("Error in connect. Exiting...\n", -1);
+    return -1;
+}
+
+// Simulated node 'i' listens on BENCH_IP:(BENCH_NODE_PORT + i)
+void start_nodes(pid_t * node_pids, size_t from, size_t to) {
+    for (size_t i = from; i < to; ++i) {
+        char port_txt[8];
+        sprintf(port_txt, "%zu", BENCH_NODE_PORT + i);
+        char * client_argv[] = {CLIENT_BIN, "-d", "-b", BENCH_IP, "-p", port_txt, NULL};
+        node_pids[i] = spawn(client_argv);
+
+        // an empty request is answered with empty output
+        close(connect_retry(BENCH_NODE_PORT + i));
+    }
+}
+
+pid_t start_server(size_t n_nodes, int fanout, int dead, int port) {
+    FILE * config_fp = fopen(BENCH_CONFIG_FILE, "w");
+    if (config_fp == NULL)
+        err_exit("Error writing config. Exiting...\n", -1);
+
+    if (fanout > 0)
+        fprintf(config_fp, "fanout %d\n", fanout);
+    for (size_t i = 0; i < n_nodes; ++i)
+        fprintf(config_fp, "n%zu %s %zu\n", i + 1, BENCH_IP, BENCH_NODE_PORT + i);
+    for (int i = 0; i < dead; ++i)
+        fprintf(config_fp, "n%zu %s %d\n", n_nodes + i + 1, BENCH_IP, BENCH_DEAD_PORT + i);
+    fclose(config_fp);
+
+    char port_txt[8];
+    sprintf(port_txt, "%d", port);
+    char * server_argv[] = {SERVER_BIN, BENCH_CONFIG_FILE, port_txt, NULL};
+    pid_t server_pid = spawn(server_argv);
+
+    // wait for the server to listen, the probe connection never sends anything
+    close(connect_retry(port));
+
+    return server_pid;
+}
+
+void write_frame(int sock_fd, FRAME_TYPE type, uint32_t req_id, const char * payload, size_t len) {
+    FRAME_HDR hdr = {htonl(type), htonl(req_id), htonl(len)};
+    struct iovec iov[2] = {{&hdr, sizeof(FRAME_HDR)}, {(char *) payload, len}};
+    if (writev(sock_fd, iov, 2) != sizeof(FRAME_HDR) + len)
+        err_exit("Error in writing to server. Exiting...\n", sock_fd);
+}
+
+// Opens a session with the node 'n1' as the self node
+int open_session(int port) {
+    int sock_fd = connect_retry(port);
+
+    int nodelay = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    char node_port_txt[8];
+    int node_port_len = sprintf(node_port_txt, "%d", BENCH_NODE_PORT);
+    write_frame(sock_fd, FRAME_HELLO, 0, node_port_txt, node_port_len);
+
+    return sock_fd;
+}
+
+char * repeat(const char * txt, size_t n, size_t * len) {
+    *len = strlen(txt) * n;
+    char * out = malloc(*len + 1);
+    out[0] = '\0';
+    for (size_t i = 0; i < n; ++i)
+        strcat(out, txt);
+    return out;
+}
+
+int cmp_double(const void * a, const void * b) {
+    double diff = *(const double *) a - *(const double *) b;
+    return (diff > 0) - (diff < 0);
+}
+
+// Sends a session command as request 0 and returns its whole output
+char * session_cmd(int sock_fd, const char * cmd) {
+    write_frame(sock_fd, FRAME_CMD, 0, cmd, strlen(cmd));
+
+    char * out = calloc(1, 1);
+    size_t out_len = 0;
+    while (true) {
+        FRAME_HDR hdr;
+        if (!read_exact(sock_fd, &hdr, sizeof(FRAME_HDR)) || ntohl(hdr.req_id) != 0)
+            err_exit("Error in reading from server. Exiting...\n", sock_fd);
+        uint32_t len = ntohl(hdr.len);
+        out = realloc(out, out_len + len + 1);
+        if (!read_exact(sock_fd, out + out_len, len))
+            err_exit("Error in reading from server. Exiting...\n", sock_fd);
+        out_len += len;
+        out[out_len] = '\0';
+        if (ntohl(hdr.type) == FRAME_END)
+            return out;
+    }
+}
+
+// With dead nodes, the server and the relaying nodes add a '[...]' line for
+// each node left out, the output is the expected one without them
+bool check_response(SCENARIO * scenario, const char * resp, size_t len) {
+    if (scenario->dead == 0)
+        return len == scenario->expected_len && memcmp(resp, scenario->expected, len) == 0;
+
+    size_t matched = 0, n_notes = 0;
+    for (const char * line = resp; line < resp + len; ) {
+        const char * eol = memchr(line, '\n', resp + len - line);
+        size_t line_len = (eol != NULL) ? eol - line + 1 : resp + len - line;
+        if (line[0] == '[')
+            ++n_notes;
+        else if (matched + line_len > scenario->expected_len ||
+                memcmp(line, scenario->expected + matched, line_len) != 0)
+            return false;
+        else
+            matched += line_len;
+        line += line_len;
+    }
+    return matched == scenario->expected_len && n_notes > 0;
+}
+
+double percentile(double * sorted, size_t n, double p) {
+    size_t idx = (size_t) (p * (n - 1) + 0.5);
+    return sorted[idx];
+}
+
+// Runs each round on a session of its own. The session is set up first with
+// a command the server answers itself, so that only the cost of starting
+// the node workers of the session is measured.
+void run_cold_client(SCENARIO * scenario, int port, int rounds, int report_fd) {
+    double * latency = malloc(rounds * sizeof(double));
+    int errors = 0;
+
+    for (int i = 0; i < rounds; ++i) {
+        int sock_fd = open_session(port);
+        free(session_cmd(sock_fd, "nodes"));
+
+        double start = now_ms();
+        char * resp = session_cmd(sock_fd, scenario->cmd);
+        latency[i] = now_ms() - start;
+        if (!check_response(scenario, resp, strlen(resp)))
+            ++errors;
+        free(resp);
+        close(sock_fd);
+    }
+
+    write(report_fd, &errors, sizeof(errors));
+    write(report_fd, latency, rounds * sizeof(double));
+    free(latency);
+}
+
+// Each client runs the scenario 'rounds' times on its own session, keeping
+// up to 'window' commands in flight, and reports
+// '<errors> <latency> <latency> ... [RELAY_REPORT]' over 'report_fd'
+void run_client(SCENARIO * scenario, int port, int rounds, int window, int report_fd) {
+    if (scenario->cold) {
+        run_cold_client(scenario, port, rounds, report_fd);
+        return;
+    }
+
+    int sock_fd = open_session(port);
+    if (scenario->setup != NULL)
+        free(session_cmd(sock_fd, scenario->setup));
+
+    // request ids are 1..rounds, 0 is unused
+    double * start = malloc((rounds + 1) * sizeof(double));
+    char ** resp = calloc(rounds + 1, sizeof(char *));
+    size_t * resp_len = calloc(rounds + 1, sizeof(size_t));
+    double * latency = malloc(rounds * sizeof(double));
+
+    int errors = 0, n_sent = 0, n_done = 0;
+    while (n_done < rounds) {
+        while (n_sent < rounds && n_sent - n_done < window) {
+            ++n_sent;
+            start[n_sent] = now_ms();
+            write_frame(sock_fd, FRAME_CMD, n_sent, scenario->cmd, strlen(scenario->cmd));
+        }
+
+        FRAME_HDR hdr;
+        if (!read_exact(sock_fd, &hdr, sizeof(FRAME_HDR)))
+            err_exit("Error in reading from server. Exiting...\n", sock_fd);
+        uint32_t req_id = ntohl(hdr.req_id), len = ntohl(hdr.len);
+        if (req_id < 1 || req_id > rounds)
+            err_exit("Unexpected request id. Exiting...\n", sock_fd);
+
+        resp[req_id] = realloc(resp[req_id], resp_len[req_id] + len);
+        if (!read_exact(sock_fd, resp[req_id] + resp_len[req_id], len))
+            err_exit("Error in reading from server. Exiting...\n", sock_fd);
+        resp_len[req_id] += len;
+
+        if (ntohl(hdr.type) == FRAME_END) {
+            latency[n_done++] = now_ms() - start[req_id];
+            if (!check_response(scenario, resp[req_id], resp_len[req_id]))
+                ++errors;
+            free(resp[req_id]);
+            resp[req_id] = NULL;
+        }
+    }
+
+    RELAY_REPORT relay = {0};
+    if (scenario->setup != NULL) {
+        char * stats_txt = session_cmd(sock_fd, "splice");
+        char * line = strstr(stats_txt, "spliced:");
+        if (line != NULL)
+            sscanf(line, "spliced: %lu bytes copied: %lu bytes cpu: %lf ms", &relay.spliced, &relay.copied, &relay.cpu_ms);
+        free(stats_txt);
+    }
+    close(sock_fd);
+
+    write(report_fd, &errors, sizeof(errors));
+    write(report_fd, latency, rounds * sizeof(double));
+    if (scenario->setup != NULL)
+        write(report_fd, &relay, sizeof(relay));
+    free(latency);
+    free(resp_len);
+    free(resp);
+    free(start);
+}
+
+void bench(SCENARIO * scenario, size_t n_nodes, int clients, int rounds, int window, int port) {
+    pid_t server_pid = start_server(n_nodes, scenario->fanout, scenario->dead, port);
+
+    // one report pipe per client so that reports never interleave
+    int (* report_fd)[2] = malloc(clients * sizeof(int[2]));
+    pid_t * client_pids = malloc(clients * sizeof(pid_t));
+    double start = now_ms();
+    for (int i = 0; i < clients; ++i) {
+        if (pipe(report_fd[i]) < 0)
+            err_exit("Error in pipe. Exiting...\n", -1);
+
+        client_pids[i] = fork();
+        if (client_pids[i] < 0)
+            err_exit("Error in fork. Exiting...\n", -1);
+        else if (client_pids[i] == 0) {
+            close(report_fd[i][0]);
+            run_client(scenario, port, rounds, window, report_fd[i][1]);
+            _exit(EXIT_SUCCESS);
+        }
+        close(report_fd[i][1]);
+    }
+
+    size_t n_latency = 0;
+    double * latency = malloc(clients * rounds * sizeof(double));
+    int errors = 0;
+    RELAY_REPORT relay = {0};
+    for (int i = 0; i < clients; ++i) {
+        int client_errors;
+        if (read(report_fd[i][0], &client_errors, sizeof(client_errors)) == sizeof(client_errors)) {
+            errors += client_errors;
+
+            size_t want = rounds * sizeof(double), got = 0;
+            while (got < want) {
+                ssize_t nbytes = read(report_fd[i][0], (char *) (latency + n_latency) + got, want - got);
+                if (nbytes <= 0)
+                    break;
+                got += nbytes;
+            }
+            n_latency += got / sizeof(double);
+
+            RELAY_REPORT client_relay;
+            if (scenario->setup != NULL &&
+                    read(report_fd[i][0], &client_relay, sizeof(client_relay)) == sizeof(client_relay)) {
+                relay.spliced += client_relay.spliced;
+                relay.copied += client_relay.copied;
+                relay.cpu_ms += client_relay.cpu_ms;
+            }
+        }
+        close(report_fd[i][0]);
+    }
+    free(report_fd);
+    for (int i = 0; i < clients; ++i)
+        waitpid(client_pids[i], NULL, 0);
+    free(client_pids);
+    double elapsed = now_ms() - start;
+
+    kill_all(&server_pid, 1);
+
+    if (n_latency == 0) {
+        printf("%-18s %-6zu no results\n", scenario->name, n_nodes);
+        free(latency);
+        return;
+    }
+    qsort(latency, n_latency, sizeof(double), cmp_double);
+
+    printf("%-18s %-6zu %-8zu %-7d %-10.1f %-10.3f %-10.3f %-10.3f\n", scenario->name, n_nodes,
+        n_latency, errors, n_latency * 1000.0 / elapsed,
+        percentile(latency, n_latency, 0.50),
+        percentile(latency, n_latency, 0.99),
+        latency[n_latency - 1]);
+
+    if (scenario->setup != NULL) {
+        double relayed_gb = (relay.spliced + relay.copied) / 1e9;
+        printf("  %-16s spliced %.1f MB, copied %.1f MB, server cpu %.1f ms per relayed GB\n",
+            scenario->setup, relay.spliced / 1e6, relay.copied / 1e6,
+            (relayed_gb > 0) ? relay.cpu_ms / relayed_gb : 0.0);
+    }
+
+    free(latency);
+}
+
+void print_header() {
+    printf("%-18s %-6s %-8s %-7s %-10s %-10s %-10s %-10s\n",
+        "scenario", "nodes", "cmds", "errors", "cmds/s", "p50(ms)", "p99(ms)", "max(ms)");
+}
+
+int main(int argc, char * argv[]) {
+    // -n <nodes> simulated nodes, -f <fanout> for tree dispatch,
+    // -c <clients> concurrent sessions, -r <rounds> per session,
+    // -w <window> commands in flight per session,
+    // -s sweeps the number of nodes for flat and tree broadcasts instead
+    size_t n_nodes = 8;
+    int fanout = 4, clients = 1, rounds = 50, window = 1;
+    bool sweep = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:f:c:r:w:s")) != -1) {
+        switch (opt) {
+            case 'n': n_nodes = atoi(optarg); break;
+            case 'f': fanout = atoi(optarg); break;
+            case 'c': clients = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 's': sweep = true; break;
+            default:
+                n_nodes = 0;
+        }
+    }
+    if (sweep && argc == 2)
+        n_nodes = MAX_NUM_CLI;
+    if (n_nodes < 3 || n_nodes > MAX_NUM_CLI || fanout < 1 || clients < 1 || rounds < 1 || window < 1)
+        err_exit("Usage: ./clustershell_bench.o [-n nodes (3-64)] [-f fanout] [-c clients] [-r rounds] [-w window] [-s]\n", -1);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t * node_pids = malloc(n_nodes * sizeof(pid_t));
+    int port = BENCH_PORT;
+
+    print_header();
+
+    if (sweep) {
+        SCENARIO broadcast = {"broadcast", "n*.echo hi"};
+        size_t started = 0;
+        for (size_t n = 2; ; n *= 2) {
+            if (n > n_nodes)
+                n = n_nodes;
+
+            // grow the simulated cluster up to 'n' node daemons
+            start_nodes(node_pids, started, n);
+            started = n;
+
+            broadcast.expected = repeat("hi\n", n, &broadcast.expected_len);
+            broadcast.name = "broadcast-flat";
+            broadcast.fanout = 0;
+            bench(&broadcast, n, clients, rounds, window, port++);
+            broadcast.name = "broadcast-tree";
+            broadcast.fanout = fanout;
+            bench(&broadcast, n, clients, rounds, window, port++);
+            free(broadcast.expected);
+
+            if (n == n_nodes)
+                break;
+        }
+    }
+    else {
+        start_nodes(node_pids, 0, n_nodes);
+
+        char payload_len[16];
+        sprintf(payload_len, "%d\n", LARGE_PAYLOAD);
+
+        SCENARIO scenarios[] = {
+            {"self", "echo hi | wc -c"},
+            {"broadcast-flat", "n*.echo hi"},
+            {"broadcast-tree", "n*.echo hi"},
+            {"chain", "n1.seq 1 10000 | n2.sort -rn | n3.head -1"},
+            {"large-payload", ""},
+            {"large-payload-raw", ""},
+            {"large-broadcast", ""},
+            {"relay-splice", ""},
+            {"relay-copy", ""},
+            {"worker-cold", "n1.echo hi"},
+            {"worker-warm", "n1.echo hi"},
+            {"broadcast-outage", "n*.echo hi"},
+        };
+        size_t n_scenarios = sizeof(scenarios) / sizeof(SCENARIO);
+
+        scenarios[0].expected = repeat("3\n", 1, &scenarios[0].expected_len);
+        scenarios[1].expected = repeat("hi\n", n_nodes, &scenarios[1].expected_len);
+        scenarios[2].expected = repeat("hi\n", n_nodes, &scenarios[2].expected_len);
+        scenarios[2].fanout = fanout;
+        scenarios[3].expected = repeat("10000\n", 1, &scenarios[3].expected_len);
+        sprintf(scenarios[4].cmd, "n1.head -c %d /dev/zero | n2.tr '\\\\0' a | n3.wc -c", LARGE_PAYLOAD);
+        scenarios[4].expected = repeat(payload_len, 1, &scenarios[4].expected_len);
+        // same pipeline with compression off
+        snprintf(scenarios[5].cmd, MAX_CMD_LEN, "-z %.*s", MAX_CMD_LEN - 4, scenarios[4].cmd);
+        scenarios[5].expected = repeat(payload_len, 1, &scenarios[5].expected_len);
+        sprintf(scenarios[6].cmd, "n1.head -c %d /dev/zero | n*.wc -c", LARGE_PAYLOAD);
+        scenarios[6].expected = repeat(payload_len, n_nodes, &scenarios[6].expected_len);
+        scenarios[6].fanout = fanout;
+        // stage to stage relay of an uncompressed stream, spliced or copied
+        sprintf(scenarios[7].cmd, "-z n1.head -c %d /dev/zero | n2.wc -c", LARGE_PAYLOAD);
+        scenarios[7].expected = repeat(payload_len, 1, &scenarios[7].expected_len);
+        scenarios[7].setup = "splice on";
+        strcpy(scenarios[8].cmd, scenarios[7].cmd);
+        scenarios[8].expected = repeat(payload_len, 1, &scenarios[8].expected_len);
+        scenarios[8].setup = "splice off";
+        // first command of a session on a node, and the ones after it
+        scenarios[9].expected = repeat("hi\n", 1, &scenarios[9].expected_len);
+        scenarios[9].cold = true;
+        scenarios[10].expected = repeat("hi\n", 1, &scenarios[10].expected_len);
+        // a tree broadcast with two of the nodes down
+        scenarios[11].expected = repeat("hi\n", n_nodes, &scenarios[11].expected_len);
+        scenarios[11].fanout = fanout;
+        scenarios[11].dead = 2;
+
+        for (size_t i = 0; i < n_scenarios; ++i) {
+            bench(&scenarios[i], n_nodes, clients, rounds, window, port++);
+            free(scenarios[i].expected);
+        }
+    }
+
+    kill_all(node_pids, n_nodes);
+    free(node_pids);
+    unlink(BENCH_CONFIG_FILE);
+
+    return EXIT_SUCCESS;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -5,7 +7,19 @@
 #include <stdbool.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "clustershell_lz.h"
+#include "clustershell_frame.h"
 
 #define MAX_NUM_CLI 64
 #define MAX_CMD_LEN 1024
@@ -13,6 +27,16 @@
 #define CLIENT_PORT 5100
 #define SERVER_PORT 5200
 #define CONFIG_FILE "clustershell.cfg"
+#define RELAY_TAG "\x1brelay"
+#define COMPRESS_TAG "\x1blz"
+#define SESSION_TAG "\x1bsession"
+#define MAX_SESSION_LEN 64
+#define MAX_WORKERS 16
+#define WORKER_IDLE_SEC 60
+#define CONNECT_TIMEOUT_MS 500
+#define SESSION_TIMEOUT_MS 500    // to read the session tag of a request on the accept loop
+// commands without any of these are run without a shell
+#define SHELL_CHARS "|&;<>()$`\\\"'*?[]#~=%{}!\n\t"
 
 
 typedef struct _CONFIG_ENTRY {
@@ -25,6 +49,46 @@ typedef struct _CMD_STRUCT {
     char * cmd;
 } CMD_STRUCT;
 
+// A command sent to the server whose output hasn't fully arrived yet.
+// Output of background jobs is held back until the job is done.
+typedef struct _JOB {
+    uint32_t req_id;
+    char * cmd;
+    bool background;
+    bool done;
+    char * out;
+    size_t out_len;
+    struct _JOB * next;
+} JOB;
+
+// A warm executor of the node daemon, tied to one client session. It runs
+// all the requests of the session so that its cwd and environment persist.
+typedef struct _WORKER {
+    char session[MAX_SESSION_LEN];
+    pid_t pid;
+    int ctl_sock;       // requests are handed over as file descriptors
+    time_t last_used;
+} WORKER;
+
+// What the node daemon passes to a worker along with the request socket:
+// the bytes it has already read from the socket.
+typedef struct _HANDOFF {
+    size_t prefix_len;
+    char prefix[MAX_SESSION_LEN];
+} HANDOFF;
+
+JOB * JOBS = NULL;
+pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+// Session of this worker and the requests it is running. cwd and environment
+// changes are made under 'state_lock' so that no command is forked mid-change.
+char SESSION_ID[MAX_SESSION_LEN] = "";
+pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t active_cond = PTHREAD_COND_INITIALIZER;
+int N_ACTIVE = 0;
+
 
 void err_exit(const char * err_msg, int sock_fd) {
     perror(err_msg);
@@ -66,7 +130,7 @@ void free_config(CONFIG_ENTRY ** config) {
     free(config);
 }
 
-int server_init(int port) {
+int server_init(char * ip, int port) {
     struct sockaddr_in serv_addr = {0};
 
     int serv_sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -78,13 +142,16 @@ int server_init(int port) {
         err_exit("Error in setsockopt. Exiting...\n", serv_sock);
 
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (ip == NULL)
+        serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    else
+        inet_aton(ip, &(serv_addr.sin_addr));
     serv_addr.sin_port = htons(port);
 
     if (bind(serv_sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
         err_exit("Error in bind. Exiting...\n", serv_sock);
 
-    if (listen(serv_sock, 5) < 0)
+    if (listen(serv_sock, SOMAXCONN) < 0)
         err_exit("Error in listen. Exiting...\n", serv_sock);
 
     return serv_sock;
@@ -108,122 +175,832 @@ int client_init(char * ip, int port) {
     return client_sock;
 }
 
-char * execute_single_cmd(char * cmd, size_t cmd_size, size_t * out_size) {
+// Connects to another node with a deadline of 'timeout_ms'. Returns -1 if
+// it can't be reached in time.
+int connect_node(char * ip, int port, int timeout_ms) {
+    struct sockaddr_in serv_addr = {0};
+
+    serv_addr.sin_family = AF_INET;
+    inet_aton(ip, &(serv_addr.sin_addr));
+    serv_addr.sin_port = htons(port);
+
+    int node_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (node_sock < 0)
+        return -1;
+
+    if (connect(node_sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        if (errno != EINPROGRESS) {
+            close(node_sock);
+            return -1;
+        }
+
+        struct pollfd conn_fd = {node_sock, POLLOUT, 0};
+        int ready;
+        while ((ready = poll(&conn_fd, 1, timeout_ms)) < 0 && errno == EINTR);
+
+        int sock_err = ETIMEDOUT;
+        socklen_t err_len = sizeof(sock_err);
+        if (ready > 0)
+            getsockopt(node_sock, SOL_SOCKET, SO_ERROR, &sock_err, &err_len);
+        if (sock_err != 0) {
+            close(node_sock);
+            return -1;
+        }
+    }
+
+    // the rest of the exchange is blocking
+    fcntl(node_sock, F_SETFL, fcntl(node_sock, F_GETFL) & ~O_NONBLOCK);
+    return node_sock;
+}
+
+void write_all(int sock_fd, const char * buf, size_t len) {
+    while (len > 0) {
+        ssize_t nbytes = write(sock_fd, buf, len);
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+        if (nbytes <= 0)
+            err_exit("Error in writing. Exiting...\n", sock_fd);
+        buf += nbytes;
+        len -= nbytes;
+    }
+}
+
+// Reads until EOF. The returned buffer is always '\0' terminated, 'len'
+// excludes the terminator.
+char * read_all(int fd, size_t * len) {
+    size_t cap = MAX_BUF_SIZE;
+    char * buf = malloc(cap + 1);
+    *len = 0;
+
+    while (true) {
+        if (*len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap + 1);
+        }
+        ssize_t nbytes = read(fd, buf + *len, cap - *len);
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+        if (nbytes < 0)
+            err_exit("Error in read. Exiting...\n", fd);
+        if (nbytes == 0)
+            break;
+        *len += nbytes;
+    }
+    buf[*len] = '\0';
+
+    return buf;
+}
+
+// Header and payload go out in one write so that Nagle doesn't hold back
+// the payload of a small frame
+void write_frame(int sock_fd, FRAME_TYPE type, uint32_t req_id, const char * payload, size_t len) {
+    FRAME_HDR hdr = {htonl(type), htonl(req_id), htonl(len)};
+    struct iovec iov[2] = {{&hdr, sizeof(FRAME_HDR)}, {(char *) payload, len}};
+    ssize_t nbytes = writev(sock_fd, iov, 2);
+    if (nbytes < 0)
+        err_exit("Error in writing. Exiting...\n", sock_fd);
+    if (nbytes < sizeof(FRAME_HDR))
+        write_all(sock_fd, (char *) &hdr + nbytes, sizeof(FRAME_HDR) - nbytes);
+    if (nbytes < sizeof(FRAME_HDR) + len) {
+        size_t off = (nbytes > sizeof(FRAME_HDR)) ? nbytes - sizeof(FRAME_HDR) : 0;
+        write_all(sock_fd, payload + off, len - off);
+    }
+}
+
+// Handles the commands that change the state of the session: 'cd <dir>',
+// 'export NAME=VALUE' and 'unset NAME'. Returns false for anything else.
+bool run_builtin(char * cmd) {
     char * tmp_cmd = strdup(cmd);
     char * strtok_saveptr;
-
-    *out_size = 0;
+    bool builtin = true;
 
     char * token = strtok_r(tmp_cmd, " ", &strtok_saveptr);
+    char * arg = strtok_r(NULL, "|", &strtok_saveptr); // remaining token
+    while (arg != NULL && *arg == ' ')
+        ++arg;
+
+    pthread_mutex_lock(&state_lock);
     if (token == NULL)
-        return NULL;
-    if (strcmp(token, "cd") == 0) {
-        // handle 'cd
-        token = strtok_r(NULL, "|", &strtok_saveptr); // remaining token
-        if (chdir(token) < 0)
+        ;
+    else if (strcmp(token, "cd") == 0) {
+        // handle 'cd'
+        if (arg == NULL || chdir(arg) < 0)
             perror("Error in changing directory...");
+    }
+    else if (strcmp(token, "export") == 0) {
+        char * value = (arg != NULL) ? strchr(arg, '=') : NULL;
+        if (value == NULL)
+            fprintf(stderr, "Usage: export NAME=VALUE\n");
+        else {
+            *value++ = '\0';
+            if (setenv(arg, value, 1) < 0)
+                perror("Error in export...");
+        }
+    }
+    else if (strcmp(token, "unset") == 0) {
+        if (arg == NULL || unsetenv(arg) < 0)
+            perror("Error in unset...");
+    }
+    else
+        builtin = false;
+    pthread_mutex_unlock(&state_lock);
 
-        *out_size = 0;
-        return "";
+    free(tmp_cmd);
+    return builtin;
+}
+
+// Runs a command with 'data' as its input and returns its output. Simple
+// commands are executed directly, anything using shell syntax through
+// '/bin/sh -c'. Safe to call from several threads at once.
+char * execute_single_cmd(char * cmd, char * data, size_t data_size, size_t * out_size) {
+    *out_size = 0;
+    if (run_builtin(cmd))
+        return calloc(1, 1);
+
+    // close-on-exec so that commands forked concurrently don't hold them open
+    int in_fd[2], out_fd[2];
+    if (pipe2(in_fd, O_CLOEXEC) < 0 || pipe2(out_fd, O_CLOEXEC) < 0)
+        err_exit("Error in pipe. Exiting...\n", -1);
+
+    // split before forking, only exec is done in the child
+    char * argv[MAX_CMD_LEN / 2 + 1];
+    char * tmp_cmd = strdup(cmd);
+    size_t argc = 0;
+    bool use_shell = (strpbrk(cmd, SHELL_CHARS) != NULL);
+    if (!use_shell) {
+        char * strtok_saveptr;
+        char * token = strtok_r(tmp_cmd, " ", &strtok_saveptr);
+        while (token != NULL && argc < MAX_CMD_LEN / 2) {
+            argv[argc++] = token;
+            token = strtok_r(NULL, " ", &strtok_saveptr);
+        }
+    }
+    if (argc == 0) {
+        use_shell = true;
+        argv[argc++] = "sh";
+        argv[argc++] = "-c";
+        argv[argc++] = cmd;
+    }
+    argv[argc] = NULL;
+
+    pthread_mutex_lock(&state_lock);
+    pid_t cmd_pid = fork();
+    if (cmd_pid == 0) {
+        dup2(in_fd[0], 0);
+        dup2(out_fd[1], 1);
+        signal(SIGPIPE, SIG_DFL);
+        if (use_shell)
+            execv("/bin/sh", argv);
+        else
+            execvp(argv[0], argv);
+        // only async-signal-safe calls between fork and exec
+        write(2, argv[0], strlen(argv[0]));
+        write(2, ": command not found\n", 20);
+        _exit(127);
+    }
+    pthread_mutex_unlock(&state_lock);
+    free(tmp_cmd);
+    close(in_fd[0]);
+    close(out_fd[1]);
+
+    if (cmd_pid < 0) {
+        perror("Error in fork...\n");
+        close(in_fd[1]);
+        close(out_fd[0]);
+        return calloc(1, 1);
     }
-    else {
-        // run the command through shell
-        char * data = cmd + strlen(cmd) + 1;
-        
-        int pipe_fd[2];
-        if (pipe(pipe_fd) < 0)
-            err_exit("Error in pipe. Exiting...\n", -1);
 
-        write(pipe_fd[1], data, cmd_size-strlen(cmd)-1);
-        close(pipe_fd[1]);
-        dup2(pipe_fd[0], 0);
+    // feed the input while reading the output, either may fill its pipe
+    size_t cap = MAX_BUF_SIZE;
+    char * cmd_out = malloc(cap + 1);
+    fcntl(in_fd[1], F_SETFL, O_NONBLOCK);
+    if (data_size == 0) {
+        close(in_fd[1]);
+        in_fd[1] = -1;
+    }
 
-        FILE * cmd_fp = popen(cmd, "r");
-        if (cmd_fp == NULL)
-            perror("Error in popen. Exiting...\n");
+    while (true) {
+        struct pollfd fds[2] = {{out_fd[0], POLLIN, 0}, {in_fd[1], POLLOUT, 0}};
+        if (poll(fds, (in_fd[1] >= 0) ? 2 : 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
 
-        char * cmd_out = malloc((MAX_BUF_SIZE+1) * sizeof(char));
-        *out_size = fread(cmd_out, 1, MAX_BUF_SIZE+1, cmd_fp);
-        if (*out_size < 0)
-            err_exit("Error in fread. Exiting...\n", -1);
+        if (in_fd[1] >= 0 && fds[1].revents != 0) {
+            ssize_t nbytes = write(in_fd[1], data, data_size);
+            if (nbytes > 0) {
+                data += nbytes;
+                data_size -= nbytes;
+            }
+            if ((nbytes < 0 && errno != EAGAIN) || data_size == 0) {
+                // done, or the command doesn't read its input
+                close(in_fd[1]);
+                in_fd[1] = -1;
+            }
+        }
 
-        cmd_out[*out_size] = '\0';
+        if (fds[0].revents != 0) {
+            if (*out_size == cap) {
+                cap *= 2;
+                cmd_out = realloc(cmd_out, cap + 1);
+            }
+            ssize_t nbytes = read(out_fd[0], cmd_out + *out_size, cap - *out_size);
+            if (nbytes < 0 && errno == EINTR)
+                continue;
+            if (nbytes <= 0)
+                break;
+            *out_size += nbytes;
+        }
+    }
+    cmd_out[*out_size] = '\0';
+
+    if (in_fd[1] >= 0)
+        close(in_fd[1]);
+    close(out_fd[0]);
+    waitpid(cmd_pid, NULL, 0);
 
-        pclose(cmd_fp);
+    return cmd_out;
+}
 
-        return cmd_out;
+// Handles one request from the server: '[relay_hdr \0] [COMPRESS_TAG \0] cmd \0 data',
+// the session tag having been taken off by the node daemon.
+// A relay header lists the subtree below this node, which is split into
+// 'fanout' contiguous chunks whose first node relays to the rest of it.
+// With the compression tag, data is a compressed stream and so is the reply.
+// The subtree gets the stream as it is and its replies are passed on as they are.
+void handle_request(int client_sock, char * req, size_t req_len) {
+    char * relay_hdr = NULL;
+    char * cmd = req;
+    if (strncmp(cmd, RELAY_TAG, strlen(RELAY_TAG)) == 0) {
+        relay_hdr = cmd;
+        cmd = cmd + strlen(cmd) + 1;
+    }
+    bool compress = false;
+    if (cmd < req + req_len && strcmp(cmd, COMPRESS_TAG) == 0) {
+        compress = true;
+        cmd = cmd + strlen(cmd) + 1;
+    }
+    if (cmd >= req + req_len)
+        return;
+
+    char * data = cmd + strlen(cmd) + 1;
+    size_t data_size = (data < req + req_len) ? (req + req_len) - data : 0;
+
+    char ** subtree = NULL;
+    int * child_socks = NULL;
+    size_t n_children = 0;
+    char * notes = NULL;
+    size_t notes_len = 0;
+
+    if (relay_hdr != NULL) {
+        // every ip in the header is preceded by a space
+        subtree = malloc((strlen(relay_hdr) / 2 + 1) * sizeof(char *));
+
+        char * strtok_saveptr;
+        strtok_r(relay_hdr, " ", &strtok_saveptr); // RELAY_TAG
+        char * token = strtok_r(NULL, " ", &strtok_saveptr);
+        int fanout = (token != NULL) ? atoi(token) : 0;
+
+        size_t n_subtree = 0;
+        while ((token = strtok_r(NULL, " ", &strtok_saveptr)) != NULL)
+            subtree[n_subtree++] = token;
+
+        size_t chunk = 1;
+        if (fanout > 0 && n_subtree > fanout)
+            chunk = (n_subtree + fanout - 1) / fanout;
+        n_children = (n_subtree + chunk - 1) / chunk;
+        child_socks = malloc((n_children + 1) * sizeof(int));
+
+        // forward before running locally so that the subtrees run concurrently.
+        // If the root of a subtree can't be reached, the next node takes its place
+        // and a note in the output names the one left out.
+        for (size_t i = 0; i < n_children; ++i) {
+            size_t start = i * chunk;
+            size_t end = (start + chunk < n_subtree) ? start + chunk : n_subtree;
+
+            for (child_socks[i] = -1; start < end && child_socks[i] < 0; ++start) {
+                // subtree entries are '<ip>:<port>'
+                char * port_sep = strchr(subtree[start], ':');
+                int port = CLIENT_PORT;
+                if (port_sep != NULL) {
+                    *port_sep = '\0';
+                    port = atoi(port_sep + 1);
+                }
+                child_socks[i] = connect_node(subtree[start], port, CONNECT_TIMEOUT_MS);
+                if (child_socks[i] < 0) {
+                    fprintf(stderr, "Node %s:%d is unreachable, skipping it...\n", subtree[start], port);
+                    size_t note_cap = strlen(subtree[start]) + strlen(cmd) + 64;
+                    notes = realloc(notes, notes_len + note_cap);
+                    notes_len += snprintf(notes + notes_len, note_cap, "[%s:%d is unreachable, left out of n*.%s]\n",
+                        subtree[start], port, cmd);
+                }
+            }
+            if (child_socks[i] < 0)
+                continue;
+            --start;
+            if (SESSION_ID[0] != '\0') {
+                char session_field[MAX_SESSION_LEN + 16];
+                int len = sprintf(session_field, "%s %s", SESSION_TAG, SESSION_ID);
+                write_all(child_socks[i], session_field, len + 1);
+            }
+            if (end - start > 1) {
+                char child_hdr[MAX_CMD_LEN];
+                int off = snprintf(child_hdr, MAX_CMD_LEN, "%s %d", RELAY_TAG, fanout);
+                write_all(child_socks[i], child_hdr, off);
+                for (size_t j = start + 1; j < end; ++j) {
+                    write_all(child_socks[i], " ", 1);
+                    write_all(child_socks[i], subtree[j], strlen(subtree[j]));
+                }
+                write_all(child_socks[i], "", 1);
+            }
+            if (compress)
+                write_all(child_socks[i], COMPRESS_TAG, strlen(COMPRESS_TAG) + 1);
+            write_all(child_socks[i], cmd, strlen(cmd) + 1);
+            write_all(child_socks[i], data, data_size);
+            shutdown(child_socks[i], SHUT_WR);
+        }
     }
 
-    free(tmp_cmd);
-    
-    return "";
+    LZ_STATS lz_stats = {0};
+    char * raw_data = data;
+    if (compress) {
+        raw_data = lz_decode(data, data_size, &data_size, &lz_stats);
+        if (raw_data == NULL) {
+            fprintf(stderr, "Corrupt input stream, ignoring it...\n");
+            raw_data = calloc(1, 1);
+            data_size = 0;
+        }
+    }
+
+    size_t out_size;
+    char * cmd_out = execute_single_cmd(cmd, raw_data, data_size, &out_size);
+    if (notes_len > 0) {
+        cmd_out = realloc(cmd_out, out_size + notes_len);
+        memcpy(cmd_out + out_size, notes, notes_len);
+        out_size += notes_len;
+        free(notes);
+    }
+
+    if (compress) {
+        free(raw_data);
+
+        char * raw_out = cmd_out;
+        cmd_out = lz_encode(raw_out, out_size, &out_size, &lz_stats);
+        cmd_out = lz_add_trailer(cmd_out, &out_size, lz_stats.cpu_ns);
+        free(raw_out);
+    }
+
+    // reply back to server with response of the command, then of the subtree
+    write_all(client_sock, cmd_out, out_size);
+    free(cmd_out);
+
+    for (size_t i = 0; i < n_children; ++i) {
+        if (child_socks[i] < 0)
+            continue;
+        size_t child_out_size;
+        char * child_out = read_all(child_socks[i], &child_out_size);
+        close(child_socks[i]);
+
+        write_all(client_sock, child_out, child_out_size);
+        free(child_out);
+    }
+
+    free(child_socks);
+    free(subtree);
+}
+
+// Runs one request handed over by the node daemon
+void * worker_request_thread(void * args) {
+    int client_sock = ((int *) args)[0];
+    HANDOFF * handoff = (HANDOFF *) ((int *) args + 1);
+
+    size_t rest_len;
+    char * rest = read_all(client_sock, &rest_len);
+    size_t req_len = handoff->prefix_len + rest_len;
+    char * req = malloc(req_len + 1);
+    memcpy(req, handoff->prefix, handoff->prefix_len);
+    memcpy(req + handoff->prefix_len, rest, rest_len + 1);
+    free(rest);
+    free(args);
+
+    handle_request(client_sock, req, req_len);
+    free(req);
+    close(client_sock);
+
+    pthread_mutex_lock(&active_lock);
+    if (--N_ACTIVE == 0)
+        pthread_cond_broadcast(&active_cond);
+    pthread_mutex_unlock(&active_lock);
+
+    return NULL;
+}
+
+// Main loop of a worker: every request of its session arrives on 'ctl_sock'
+// as a socket and runs on its own thread. Exits once the daemon closes
+// 'ctl_sock' and the running requests are done.
+void worker_loop(int ctl_sock) {
+    while (true) {
+        // the socket followed by the HANDOFF
+        void * args = malloc(sizeof(int) + sizeof(HANDOFF));
+        struct iovec iov = {(int *) args + 1, sizeof(HANDOFF)};
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t nbytes = recvmsg(ctl_sock, &msg, MSG_CMSG_CLOEXEC);
+        if (nbytes < 0 && errno == EINTR) {
+            free(args);
+            continue;
+        }
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        if (nbytes <= 0 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+            free(args);
+            break;
+        }
+        memcpy(args, CMSG_DATA(cmsg), sizeof(int));
+
+        pthread_mutex_lock(&active_lock);
+        ++N_ACTIVE;
+        pthread_mutex_unlock(&active_lock);
+
+        pthread_t tid;
+        pthread_create(&tid, NULL, worker_request_thread, args);
+        pthread_detach(tid);
+    }
+
+    pthread_mutex_lock(&active_lock);
+    while (N_ACTIVE > 0)
+        pthread_cond_wait(&active_cond, &active_lock);
+    pthread_mutex_unlock(&active_lock);
+    exit(EXIT_SUCCESS);
+}
+
+// Starts a worker for the session in 'workers[n_workers]'. The request on
+// 'client_sock' is handed to it like any other.
+void spawn_worker(WORKER * workers, size_t n_workers, int serv_sock, int client_sock, const char * session) {
+    WORKER * worker = &workers[n_workers];
+    int ctl_socks[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctl_socks) < 0)
+        err_exit("Error in socketpair. Exiting...\n", -1);
+
+    pid_t pid = fork();
+    if (pid < 0)
+        err_exit("Error in fork. Exiting...\n", -1);
+    else if (pid == 0) {
+        // only the daemon may hold these, a worker exits when its one is closed
+        close(ctl_socks[0]);
+        for (size_t i = 0; i < n_workers; ++i)
+            close(workers[i].ctl_sock);
+        close(serv_sock);
+        close(client_sock);
+        strcpy(SESSION_ID, session);
+        worker_loop(ctl_socks[1]);
+    }
+    close(ctl_socks[1]);
+
+    strcpy(worker->session, session);
+    worker->pid = pid;
+    worker->ctl_sock = ctl_socks[0];
+    worker->last_used = time(NULL);
+}
+
+void retire_worker(WORKER * workers, size_t * n_workers, size_t idx) {
+    // the worker exits on its own once its requests are done
+    close(workers[idx].ctl_sock);
+    workers[idx] = workers[--(*n_workers)];
+}
+
+// Passes the request socket to the worker. Returns false if the worker is gone.
+bool hand_off(WORKER * worker, int client_sock, HANDOFF * handoff) {
+    struct iovec iov = {handoff, sizeof(HANDOFF)};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &client_sock, sizeof(int));
+
+    while (sendmsg(worker->ctl_sock, &msg, 0) < 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    worker->last_used = time(NULL);
+    return true;
+}
+
+// Reads the session tag, the first field of a request, if there is one.
+// Whatever is read of a request without one is kept in 'handoff'. Returns
+// the bytes read, 0 for a connection closed without a request, which is
+// how the server checks the node is up, and for a peer that doesn't send
+// the field within SESSION_TIMEOUT_MS, so that it can't hold up the
+// accept loop.
+size_t read_session(int client_sock, char * session, HANDOFF * handoff) {
+    size_t tag_len = strlen(SESSION_TAG);
+    size_t len = 0;
+    session[0] = '\0';
+    handoff->prefix_len = 0;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // byte by byte, the rest of the request is left for the worker
+    char field[MAX_SESSION_LEN];
+    while (len < MAX_SESSION_LEN) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left_ms = SESSION_TIMEOUT_MS - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+        struct pollfd read_fd = {client_sock, POLLIN, 0};
+        int ready = (left_ms > 0) ? poll(&read_fd, 1, left_ms) : 0;
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0) {
+            fprintf(stderr, "Request without its session tag in time, dropping it...\n");
+            return 0;
+        }
+
+        ssize_t nbytes = read(client_sock, field + len, 1);
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+        if (nbytes <= 0)
+            break;
+        ++len;
+        if (field[len - 1] == '\0' || (len <= tag_len && field[len - 1] != SESSION_TAG[len - 1]))
+            break;
+    }
+
+    if (len > tag_len + 1 && field[len - 1] == '\0' && strncmp(field, SESSION_TAG " ", tag_len + 1) == 0) {
+        strcpy(session, field + tag_len + 1);
+        return len;
+    }
+    // not a session tag
+    handoff->prefix_len = len;
+    memcpy(handoff->prefix, field, len);
+    return len;
+}
+
+// Handle communication with server and run commands requested by server.
+// Each request goes to the worker of its session, started on its first
+// request. At most MAX_WORKERS are kept, the least recently used one is
+// retired to make room and any idle for WORKER_IDLE_SEC is retired too.
+void node_loop(char * bind_ip, int node_port) {
+    int client_sock; // 'client_sock' represents actual server
+    int serv_sock = server_init(bind_ip, node_port); // 'ser_sock' is the current node (this client)
+
+    signal(SIGPIPE, SIG_IGN);
+
+    WORKER workers[MAX_WORKERS];
+    size_t n_workers = 0;
+
+    while (true) {
+        struct pollfd accept_fd = {serv_sock, POLLIN, 0};
+        int ready = poll(&accept_fd, 1, 1000);
+
+        // retire idle workers and reap the ones that exited
+        time_t now = time(NULL);
+        for (size_t i = 0; i < n_workers; ) {
+            if (now - workers[i].last_used >= WORKER_IDLE_SEC)
+                retire_worker(workers, &n_workers, i);
+            else
+                ++i;
+        }
+        while (waitpid(-1, NULL, WNOHANG) > 0);
+
+        if (ready <= 0)
+            continue;
+
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        client_sock = accept(serv_sock, (struct sockaddr *) &client_addr, &client_len);
+        if (client_sock < 0)
+            err_exit("Error in accept. Exiting...\n", client_sock);
+
+        char session[MAX_SESSION_LEN];
+        HANDOFF handoff;
+        if (read_session(client_sock, session, &handoff) == 0) {
+            close(client_sock); // heartbeat
+            continue;
+        }
+
+        size_t idx = 0;
+        while (idx < n_workers && strcmp(workers[idx].session, session) != 0)
+            ++idx;
+
+        // a worker that died is replaced, with a fresh session state
+        if (idx < n_workers && !hand_off(&workers[idx], client_sock, &handoff)) {
+            retire_worker(workers, &n_workers, idx);
+            idx = n_workers;
+        }
+        if (idx == n_workers) {
+            if (n_workers == MAX_WORKERS) {
+                size_t lru = 0;
+                for (size_t i = 1; i < n_workers; ++i)
+                    if (workers[i].last_used < workers[lru].last_used)
+                        lru = i;
+                retire_worker(workers, &n_workers, lru);
+                idx = n_workers;
+            }
+            spawn_worker(workers, n_workers, serv_sock, client_sock, session);
+            ++n_workers;
+            if (!hand_off(&workers[idx], client_sock, &handoff))
+                perror("Error in handing off request...\n");
+        }
+        close(client_sock);
+    }
 }
 
 void prompt() {
     char cwd[200];
     getcwd(cwd, 200);
     printf("\n(%s) >> ", cwd);
+    fflush(stdout);
 }
 
-int main() {
-    pid_t conn_handler = fork();
-    if (conn_handler < 0)
-        err_exit("Error in fork. Exiting...\n", -1);
-    else if (conn_handler == 0) {
-        // Handle communication with server and run commands requested by server
-        int client_sock; // 'client_sock' represents actual server
-        int serv_sock = server_init(CLIENT_PORT); // 'ser_sock' is the current node (this client)
+// Receives the output of all the jobs of the session as it arrives
+void * response_thread(void * args) {
+    int client_connect = *((int *) args);
+
+    while (true) {
+        FRAME_HDR hdr;
+        char * payload = read_frame(client_connect, &hdr, MAX_FRAME_SIZE);
+        if (payload == NULL)
+            err_exit("Error in reading from server. Exiting...\n", client_connect);
+
+        pthread_mutex_lock(&jobs_lock);
+
+        JOB * job = JOBS;
+        while (job != NULL && job->req_id != hdr.req_id)
+            job = job->next;
+
+        if (job != NULL && hdr.type == FRAME_DATA) {
+            if (!job->background) {
+                fwrite(payload, 1, hdr.len, stdout);
+                fflush(stdout);
+            }
+            else {
+                job->out = realloc(job->out, job->out_len + hdr.len);
+                memcpy(job->out + job->out_len, payload, hdr.len);
+                job->out_len += hdr.len;
+            }
+        }
+        else if (job != NULL && hdr.type == FRAME_END) {
+            job->done = true;
+            if (job->background) {
+                printf("\n[%u] Done\t%s\n", job->req_id, job->cmd);
+                fwrite(job->out, 1, job->out_len, stdout);
+                prompt();
+
+                // background jobs are removed here, foreground ones by the shell
+                JOB ** prev = &JOBS;
+                while (*prev != job)
+                    prev = &((*prev)->next);
+                *prev = job->next;
+                free(job->out);
+                free(job->cmd);
+                free(job);
+            }
+            pthread_cond_broadcast(&jobs_cond);
+        }
 
-        while (true) {
-            struct sockaddr_in client_addr;
-            int client_len = sizeof(client_addr);
+        pthread_mutex_unlock(&jobs_lock);
+        free(payload);
+    }
 
-            client_sock = accept(serv_sock, (struct sockaddr *) &client_addr, &client_len);
-            if (client_sock < 0)
-                err_exit("Error in accept. Exiting...\n", client_sock);
-            
-            char cmd[MAX_CMD_LEN+1];
-            size_t nbytes = read(client_sock, cmd, MAX_CMD_LEN+1);
-            if (nbytes < 0)
-                err_exit("Error in read. Exiting...\n", client_sock);
-            
-            cmd[nbytes] = '\0';
+    return NULL;
+}
 
-            size_t out_size;
-            char * cmd_out = execute_single_cmd(cmd, nbytes, &out_size);
+void list_jobs() {
+    pthread_mutex_lock(&jobs_lock);
+    for (JOB * job = JOBS; job != NULL; job = job->next)
+        if (job->background)
+            printf("[%u] Running\t%s\n", job->req_id, job->cmd);
+    pthread_mutex_unlock(&jobs_lock);
+}
 
-            // reply back to server with response of the command
-            write(client_sock, cmd_out, out_size);
-            
-            free(cmd_out);
-            close(client_sock);
+int main(int argc, char * argv[]) {
+    // -d runs the node daemon only, without a shell
+    // -b <ip> and -p <port> set the address the node listens on
+    // -s <ip> and -P <port> set the address of the server
+    bool daemon_only = false;
+    char * bind_ip = NULL;
+    char * server_ip = NULL;
+    int node_port = CLIENT_PORT, server_port = SERVER_PORT;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "db:p:s:P:")) != -1) {
+        switch (opt) {
+            case 'd': daemon_only = true; break;
+            case 'b': bind_ip = optarg; break;
+            case 'p': node_port = atoi(optarg); break;
+            case 's': server_ip = optarg; break;
+            case 'P': server_port = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-d] [-b bind_ip] [-p node_port] [-s server_ip] [-P server_port]\n", argv[0]);
+                exit(EXIT_FAILURE);
         }
+    }
 
+    if (daemon_only) {
+        node_loop(bind_ip, node_port);
+        return EXIT_SUCCESS;
+    }
+
+    pid_t conn_handler = fork();
+    if (conn_handler < 0)
+        err_exit("Error in fork. Exiting...\n", -1);
+    else if (conn_handler == 0) {
+        node_loop(bind_ip, node_port);
     }
     else {
         // Handle shell
-        int client_connect = client_init(NULL, SERVER_PORT);
-        while(true) {
-            prompt();
-            char * cmd = malloc(sizeof(char) * (MAX_CMD_LEN + 1));
-            size_t max_cmd_len = MAX_CMD_LEN;
-            size_t cmd_len = getline(&cmd, &max_cmd_len, stdin);
-            cmd[cmd_len - 1] = '\0';
-            cmd_len = strlen(cmd);
+        int client_connect = client_init(server_ip, server_port);
 
-            if(write(client_connect, cmd, cmd_len) < 0)
-                err_exit("Error in writing to server. Exiting...\n", client_connect);
+        int nodelay = 1;
+        setsockopt(client_connect, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
-            char* server_resp = malloc(sizeof(char) * (MAX_BUF_SIZE + 1));
+        // tell the server which port our node listens on, for self commands
+        char node_port_txt[8];
+        int node_port_len = sprintf(node_port_txt, "%d", node_port);
+        write_frame(client_connect, FRAME_HELLO, 0, node_port_txt, node_port_len);
 
-            size_t resp_size = read(client_connect, server_resp, MAX_BUF_SIZE);
+        pthread_t thread_id;
+        pthread_create(&thread_id, NULL, response_thread, &client_connect);
 
-            if(resp_size < 0)
-                err_exit("Error in reading from server. Exiting...\n", client_connect);
-            
-            server_resp[resp_size] = '\0';
-            printf("%s\n", server_resp);
+        uint32_t next_req_id = 1;
+        char * cmd = malloc(sizeof(char) * (MAX_CMD_LEN + 1));
+        size_t max_cmd_len = MAX_CMD_LEN;
+        while(true) {
+            prompt();
+            ssize_t cmd_len = getline(&cmd, &max_cmd_len, stdin);
+            if (cmd_len < 0)
+                break;
+
+            // trim the newline and trailing spaces
+            while (cmd_len > 0 && (cmd[cmd_len - 1] == '\n' || cmd[cmd_len - 1] == ' '))
+                cmd[--cmd_len] = '\0';
+
+            // a trailing '&' runs the command in the background
+            bool background = false;
+            if (cmd_len > 0 && cmd[cmd_len - 1] == '&') {
+                background = true;
+                cmd[--cmd_len] = '\0';
+                while (cmd_len > 0 && cmd[cmd_len - 1] == ' ')
+                    cmd[--cmd_len] = '\0';
+            }
+
+            if (cmd_len == 0)
+                continue;
+            if (cmd_len > MAX_CMD_LEN) {
+                printf("Command too long...\n");
+                continue;
+            }
+            if (strcmp(cmd, "jobs") == 0) {
+                list_jobs();
+                continue;
+            }
+
+            JOB * job = calloc(1, sizeof(JOB));
+            job->req_id = next_req_id++;
+            job->cmd = strdup(cmd);
+            job->background = background;
+
+            pthread_mutex_lock(&jobs_lock);
+            job->next = JOBS;
+            JOBS = job;
+            pthread_mutex_unlock(&jobs_lock);
+
+            write_frame(client_connect, FRAME_CMD, job->req_id, cmd, cmd_len);
+
+            if (background) {
+                printf("[%u] %s\n", job->req_id, job->cmd);
+                continue;
+            }
+
+            // wait for the foreground job, its output is printed as it arrives
+            pthread_mutex_lock(&jobs_lock);
+            while (!job->done)
+                pthread_cond_wait(&jobs_cond, &jobs_lock);
+
+            JOB ** prev = &JOBS;
+            while (*prev != job)
+                prev = &((*prev)->next);
+            *prev = job->next;
+            pthread_mutex_unlock(&jobs_lock);
+
+            free(job->cmd);
+            free(job);
+            printf("\n");
         }
+        free(cmd);
         close(client_connect);
     }
 
@@ -0,0 +1,71 @@
+#ifndef CLUSTERSHELL_FRAME_H
+#define CLUSTERSHELL_FRAME_H
+
+// Client session protocol, shared by the server and the shell. Every message
+// is a header followed by 'len' bytes of payload, all fields in network byte
+// order. The client tags each command with a request id and the output of
+// concurrent commands is streamed back as DATA frames carrying that id,
+// closed by an END frame. A reader names the largest payload it accepts, so a
+// length off the wire is never trusted with an allocation.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define MAX_FRAME_SIZE 65536    // payload of a DATA frame
+
+typedef enum _FRAME_TYPE {
+    FRAME_HELLO = 1,    // client -> server, port of the client's node
+    FRAME_CMD,          // client -> server, a pipeline to run
+    FRAME_DATA,         // server -> client, a chunk of a pipeline's output
+    FRAME_END           // server -> client, the pipeline is complete
+} FRAME_TYPE;
+
+typedef struct _FRAME_HDR {
+    uint32_t type;
+    uint32_t req_id;
+    uint32_t len;
+} FRAME_HDR;
+
+// Reads exactly 'len' bytes, returns false if the peer closed the connection
+static inline bool read_exact(int sock_fd, void * buf, size_t len) {
+    while (len > 0) {
+        ssize_t nbytes = read(sock_fd, buf, len);
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+        if (nbytes <= 0)
+            return false;
+        buf = (char *) buf + nbytes;
+        len -= nbytes;
+    }
+    return true;
+}
+
+// Reads one frame, the payload is '\0' terminated. Returns NULL on EOF or if
+// the payload is over 'max_len' bytes, before reading it: the stream is out
+// of step after that and the connection is to be dropped.
+static inline char * read_frame(int sock_fd, FRAME_HDR * hdr, size_t max_len) {
+    if (!read_exact(sock_fd, hdr, sizeof(FRAME_HDR)))
+        return NULL;
+    hdr->type = ntohl(hdr->type);
+    hdr->req_id = ntohl(hdr->req_id);
+    hdr->len = ntohl(hdr->len);
+    if (hdr->len > max_len)
+        return NULL;
+
+    char * payload = malloc((size_t) hdr->len + 1);
+    if (payload == NULL)
+        return NULL;
+    if (!read_exact(sock_fd, payload, hdr->len)) {
+        free(payload);
+        return NULL;
+    }
+    payload[hdr->len] = '\0';
+
+    return payload;
+}
+
+#endif
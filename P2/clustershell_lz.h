@@ -0,0 +1,341 @@
+#ifndef CLUSTERSHELL_LZ_H
+#define CLUSTERSHELL_LZ_H
+
+// Stream compression for the data exchanged between the server and the nodes.
+//
+// A stream is a sequence of chunks, each a header of two network order
+// uint32_t fields 'raw_len' and 'stored_len' followed by 'stored_len' bytes.
+// A chunk whose 'stored_len' equals 'raw_len' is stored as is, otherwise it
+// is compressed with the LZ77 block format below. A chunk with 'raw_len' 0
+// is a trailer carrying the CPU time, in nanoseconds, the sender spent on
+// compression. Streams can be concatenated as they are.
+//
+// A block is a sequence of 'token [literal_len...] literals offset [match_len...]'
+// where the high nibble of the token is the literal count and the low nibble
+// the match length minus LZ_MIN_MATCH, 15 meaning more length bytes follow
+// (255 meaning more again). The offset is two bytes, little endian. The last
+// sequence has literals only.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define LZ_CHUNK_SIZE 65536
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_SKIP_STREAK 4    // incompressible chunks in a row before skipping
+#define LZ_SKIP_CHUNKS 16   // chunks stored without trying to compress them
+
+typedef struct _LZ_STATS {
+    uint64_t raw_bytes;     // bytes before compression
+    uint64_t wire_bytes;    // bytes of the stream, headers included
+    uint64_t cpu_ns;        // CPU time spent compressing and decompressing
+} LZ_STATS;
+
+typedef struct _LZ_CHUNK_HDR {
+    uint32_t raw_len;
+    uint32_t stored_len;
+} LZ_CHUNK_HDR;
+
+static inline uint64_t lz_cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t lz_read32(const unsigned char * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline unsigned char * lz_put_len(unsigned char * op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static inline unsigned char * lz_put_seq(unsigned char * op, const unsigned char * lit, size_t lit_len, size_t offset, size_t match_len) {
+    unsigned char * token = op++;
+    *token = ((lit_len < 15) ? lit_len : 15) << 4;
+    if (lit_len >= 15)
+        op = lz_put_len(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0)
+        return op; // last sequence
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match_len -= LZ_MIN_MATCH;
+    *token |= (match_len < 15) ? match_len : 15;
+    if (match_len >= 15)
+        op = lz_put_len(op, match_len - 15);
+    return op;
+}
+
+// Worst case size of a compressed block of 'len' bytes
+static inline size_t lz_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+// Compresses one block of at most LZ_CHUNK_SIZE bytes into 'dst', which
+// must hold lz_bound(len) bytes. Returns the compressed size.
+static inline size_t lz_compress(const unsigned char * src, size_t len, unsigned char * dst) {
+    uint32_t table[1 << LZ_HASH_BITS]; // position + 1, 0 is empty
+    memset(table, 0, sizeof(table));
+
+    unsigned char * op = dst;
+    size_t ip = 0, anchor = 0;
+    // the last bytes are always literals, matches never read past 'limit'
+    size_t limit = (len > 12) ? len - 12 : 0;
+
+    while (ip < limit) {
+        uint32_t seq = lz_read32(src + ip);
+        uint32_t h = lz_hash(seq);
+        size_t ref = table[h];
+        table[h] = ip + 1;
+
+        if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || lz_read32(src + ref - 1) != seq) {
+            // skip faster over data that doesn't match
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        --ref;
+
+        size_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < len - 5 && src[ref + match_len] == src[ip + match_len])
+            ++match_len;
+
+        op = lz_put_seq(op, src + anchor, ip - anchor, ip - ref, match_len);
+        ip += match_len;
+        anchor = ip;
+    }
+
+    op = lz_put_seq(op, src + anchor, len - anchor, 0, 0);
+    return op - dst;
+}
+
+static inline bool lz_get_len(const unsigned char ** ip, const unsigned char * end, size_t * len) {
+    unsigned char b;
+    do {
+        if (*ip >= end)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompresses one block into 'dst' of 'dst_len' bytes.
+// Returns false if the block is corrupt.
+static inline bool lz_decompress(const unsigned char * src, size_t len, unsigned char * dst, size_t dst_len) {
+    const unsigned char * ip = src, * end = src + len;
+    size_t op = 0;
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !lz_get_len(&ip, end, &lit_len))
+            return false;
+        if (lit_len > end - ip || lit_len > dst_len - op)
+            return false;
+        memcpy(dst + op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == end)
+            break; // last sequence
+
+        if (end - ip < 2)
+            return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !lz_get_len(&ip, end, &match_len))
+            return false;
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || match_len > dst_len - op)
+            return false;
+        // byte by byte, the match may overlap what it is copying
+        for (size_t i = 0; i < match_len; ++i, ++op)
+            dst[op] = dst[op - offset];
+    }
+
+    return op == dst_len;
+}
+
+static inline void lz_append(unsigned char ** out, size_t * out_len, size_t * cap, const void * buf, size_t len) {
+    if (*out_len + len > *cap) {
+        *cap = (*out_len + len) * 2;
+        *out = realloc(*out, *cap);
+    }
+    memcpy(*out + *out_len, buf, len);
+    *out_len += len;
+}
+
+// Encodes 'src' as a stream of chunks. Chunks that don't shrink by at least
+// an eighth are stored as is, and after LZ_SKIP_STREAK of those in a row the
+// next LZ_SKIP_CHUNKS chunks are stored without trying. Returns a malloc'd
+// buffer; the trailer isn't added here.
+static inline char * lz_encode(const char * src, size_t len, size_t * out_len, LZ_STATS * stats) {
+    uint64_t cpu_start = lz_cpu_ns();
+
+    size_t cap = lz_bound(len) + (len / LZ_CHUNK_SIZE + 1) * sizeof(LZ_CHUNK_HDR);
+    unsigned char * out = malloc(cap);
+    unsigned char * block = malloc(lz_bound(LZ_CHUNK_SIZE));
+    *out_len = 0;
+
+    int streak = 0, skip = 0;
+    for (size_t off = 0; off < len; off += LZ_CHUNK_SIZE) {
+        size_t raw_len = (len - off < LZ_CHUNK_SIZE) ? len - off : LZ_CHUNK_SIZE;
+        const unsigned char * raw = (const unsigned char *) src + off;
+
+        size_t stored_len = raw_len;
+        if (skip > 0)
+            --skip;
+        else {
+            stored_len = lz_compress(raw, raw_len, block);
+            if (stored_len >= raw_len - raw_len / 8) {
+                stored_len = raw_len;
+                if (++streak == LZ_SKIP_STREAK) {
+                    streak = 0;
+                    skip = LZ_SKIP_CHUNKS;
+                }
+            }
+            else
+                streak = 0;
+        }
+
+        LZ_CHUNK_HDR hdr = {htonl(raw_len), htonl(stored_len)};
+        lz_append(&out, out_len, &cap, &hdr, sizeof(hdr));
+        lz_append(&out, out_len, &cap, (stored_len == raw_len) ? raw : block, stored_len);
+    }
+    free(block);
+
+    if (stats != NULL) {
+        stats->raw_bytes += len;
+        stats->wire_bytes += *out_len;
+        stats->cpu_ns += lz_cpu_ns() - cpu_start;
+    }
+
+    return (char *) out;
+}
+
+// Appends the trailer carrying 'cpu_ns' to an encoded stream
+static inline char * lz_add_trailer(char * stream, size_t * len, uint64_t cpu_ns) {
+    stream = realloc(stream, *len + sizeof(LZ_CHUNK_HDR) + sizeof(uint64_t));
+
+    LZ_CHUNK_HDR hdr = {0, htonl(sizeof(uint64_t))};
+    uint32_t cpu[2] = {htonl(cpu_ns >> 32), htonl(cpu_ns & 0xffffffff)};
+    memcpy(stream + *len, &hdr, sizeof(hdr));
+    memcpy(stream + *len + sizeof(hdr), cpu, sizeof(cpu));
+    *len += sizeof(hdr) + sizeof(cpu);
+
+    return stream;
+}
+
+// Bytes of the first chunk of 'stream', header included, or 0 if it isn't
+// all in the first 'len' bytes yet. A stream read piece by piece can be
+// decoded a chunk at a time.
+static inline size_t lz_chunk_len(const char * stream, size_t len) {
+    if (len < sizeof(LZ_CHUNK_HDR))
+        return 0;
+    LZ_CHUNK_HDR hdr;
+    memcpy(&hdr, stream, sizeof(hdr));
+    size_t stored_len = ntohl(hdr.stored_len);
+    return (stored_len <= len - sizeof(hdr)) ? sizeof(hdr) + stored_len : 0;
+}
+
+// Walks the chunks of a stream. Adds the raw and wire sizes to 'stats' and
+// the CPU time of the trailers to 'peer_cpu_ns'. Returns false if corrupt.
+static inline bool lz_scan(const char * stream, size_t len, LZ_STATS * stats, uint64_t * peer_cpu_ns) {
+    size_t off = 0;
+    while (off < len) {
+        if (len - off < sizeof(LZ_CHUNK_HDR))
+            return false;
+        LZ_CHUNK_HDR hdr;
+        memcpy(&hdr, stream + off, sizeof(hdr));
+        size_t raw_len = ntohl(hdr.raw_len), stored_len = ntohl(hdr.stored_len);
+        off += sizeof(hdr);
+        if (stored_len > len - off)
+            return false;
+
+        if (raw_len == 0 && stored_len == sizeof(uint64_t)) {
+            uint32_t cpu[2];
+            memcpy(cpu, stream + off, sizeof(cpu));
+            if (peer_cpu_ns != NULL)
+                *peer_cpu_ns += ((uint64_t) ntohl(cpu[0]) << 32) | ntohl(cpu[1]);
+        }
+        else if (stats != NULL) {
+            stats->raw_bytes += raw_len;
+            stats->wire_bytes += sizeof(hdr) + stored_len;
+        }
+        off += stored_len;
+    }
+    return true;
+}
+
+// Decodes a stream into a malloc'd, '\0' terminated buffer. Trailers are
+// skipped. Returns NULL if the stream is corrupt.
+static inline char * lz_decode(const char * stream, size_t len, size_t * out_len, LZ_STATS * stats) {
+    uint64_t cpu_start = lz_cpu_ns();
+
+    size_t cap = len + 1;
+    unsigned char * out = malloc(cap);
+    *out_len = 0;
+
+    size_t off = 0;
+    while (off < len) {
+        if (len - off < sizeof(LZ_CHUNK_HDR))
+            break;
+        LZ_CHUNK_HDR hdr;
+        memcpy(&hdr, stream + off, sizeof(hdr));
+        size_t raw_len = ntohl(hdr.raw_len), stored_len = ntohl(hdr.stored_len);
+        off += sizeof(hdr);
+        if (stored_len > len - off || raw_len > LZ_CHUNK_SIZE)
+            break;
+
+        if (raw_len > 0) {
+            if (*out_len + raw_len + 1 > cap) {
+                cap = (*out_len + raw_len + 1) * 2;
+                out = realloc(out, cap);
+            }
+            if (stored_len == raw_len)
+                memcpy(out + *out_len, stream + off, raw_len);
+            else if (!lz_decompress((const unsigned char *) stream + off, stored_len, out + *out_len, raw_len))
+                break;
+            *out_len += raw_len;
+        }
+        off += stored_len;
+    }
+
+    if (off != len) {
+        free(out);
+        return NULL;
+    }
+    out[*out_len] = '\0';
+
+    if (stats != NULL)
+        stats->cpu_ns += lz_cpu_ns() - cpu_start;
+
+    return (char *) out;
+}
+
+#endif
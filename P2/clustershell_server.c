@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -5,7 +7,21 @@
 #include <stdbool.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <time.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "clustershell_lz.h"
+#include "clustershell_frame.h"
 
 #define MAX_NUM_CLI 64
 #define MAX_CMD_LEN 1024
@@ -13,18 +29,171 @@
 #define CLIENT_PORT 5100
 #define SERVER_PORT 5200
 #define CONFIG_FILE "clustershell.cfg"
+#define CONFIG_FANOUT "fanout"
+#define RELAY_TAG "\x1brelay"
+#define COMPRESS_TAG "\x1blz"
+#define SESSION_TAG "\x1bsession"
+#define MAX_SESSION_LEN 64
+#define MAX_INFLIGHT 32
+#define SPLICE_CHUNK 65536
+#define CONNECT_TIMEOUT_MS 500
+#define HEARTBEAT_MS 1000
+#define BREAKER_THRESHOLD 3     // failed connects in a row before a node is down
+#define METRICS_BUCKETS 24      // latency buckets, the last one is unbounded
+#define METRICS_STAGES 8        // pipeline stages counted apart, the last one takes the rest
 
 
 typedef struct _CONFIG_ENTRY {
     char * name;
     char * ip;
+    int port;
+    int slot;       // index in HEALTH and METRICS 'nodes', kept across reloads
 } CONFIG_ENTRY;
 
+// The config as a session sees it. A request holds a reference for its whole
+// run, so it uses the same node table from start to end, and the session
+// swaps in a newer one as soon as the generation changes.
+typedef struct _CONFIG_SNAPSHOT {
+    CONFIG_ENTRY ** config;
+    size_t n_nodes;
+    int fanout;
+    uint64_t generation;
+    int refs;           // under the session's 'inflight_lock'
+} CONFIG_SNAPSHOT;
+
 typedef struct _CMD_STRUCT {
     int node;
     char * cmd;
 } CMD_STRUCT;
 
+typedef struct _SESSION {
+    int client_sock;
+    char client_ip[20];
+    int client_port;
+    int self_port;
+    char session_id[MAX_SESSION_LEN];   // names the session to the nodes
+    CONFIG_SNAPSHOT * config;           // the newest one, under 'inflight_lock'
+    pthread_mutex_t write_lock;
+    pthread_mutex_t inflight_lock;
+    pthread_cond_t inflight_cond;
+    int n_inflight;
+    // compression of the streams to and from the nodes
+    bool compress;
+    pthread_mutex_t stats_lock;
+    LZ_STATS to_nodes;
+    LZ_STATS from_nodes;
+    uint64_t server_cpu_ns;
+    uint64_t node_cpu_ns;
+    // stage outputs relayed to the next stage by splice or through memory
+    bool splice;
+    uint64_t spliced_bytes;
+    uint64_t copied_bytes;
+} SESSION;
+
+// Latencies in buckets of powers of two microseconds: bucket i counts the
+// ones below 2^(i+1) us.
+typedef struct _HISTOGRAM {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t buckets[METRICS_BUCKETS];
+} HISTOGRAM;
+
+typedef struct _NODE_METRICS {
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t timeouts;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    HISTOGRAM connect;      // connect()
+    HISTOGRAM dispatch;     // connected until the request and its input are sent
+    HISTOGRAM execute;      // request sent until the whole response is read
+} NODE_METRICS;
+
+typedef struct _STAGE_METRICS {
+    uint64_t runs;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} STAGE_METRICS;
+
+// Counters of the whole coordinator. They are in a shared mapping made
+// before the client handlers are forked so that every session adds to the
+// same counters, always with atomic operations.
+typedef struct _METRICS {
+    time_t started;
+    uint64_t sessions;
+    uint64_t active_sessions;
+    uint64_t commands;
+    uint64_t active_commands;
+    uint64_t peak_commands;
+    uint64_t inflight_waits;        // commands held back by MAX_INFLIGHT
+    uint64_t errors;                // missing nodes and corrupt outputs
+    HISTOGRAM command;
+    STAGE_METRICS stages[METRICS_STAGES];
+    NODE_METRICS nodes[MAX_NUM_CLI + 1];    // 0 is the self node, then the slots of the config
+} METRICS;
+
+// A node request whose response hasn't been read yet
+typedef struct _NODE_CONN {
+    int sock;
+    int node;           // slot in METRICS 'nodes'
+    double sent_ms;     // when the request was sent whole
+} NODE_CONN;
+
+typedef enum _NODE_STATE {
+    NODE_UP = 0,
+    NODE_DOWN
+} NODE_STATE;
+
+// Circuit breaker of a node. After BREAKER_THRESHOLD failed connects in a
+// row, by heartbeats or requests, the node is down and requests to it fail
+// at once until a heartbeat reaches it again.
+typedef struct _NODE_HEALTH {
+    uint64_t state;
+    uint64_t failures;
+    uint64_t rtt_us;        // connect time of the last heartbeat
+} NODE_HEALTH;
+
+// A node of the config, as copied into the shared mapping
+typedef struct _NODE_ADDR {
+    char name[12];
+    char ip[20];
+    int port;
+    int slot;
+} NODE_ADDR;
+
+// Shared by all the session handlers like METRICS. 'generation' counts the
+// config reloads so that the sessions pick up the new config. The main
+// process replaces the node table and bumps 'generation' under 'lock', a
+// process shared mutex, and a session copies the table from here, so its
+// node indices always match those of 'nodes' and of METRICS 'nodes'.
+typedef struct _HEALTH_TABLE {
+    pthread_mutex_t lock;
+    uint64_t generation;
+    int fanout;
+    size_t n_nodes;
+    NODE_ADDR addrs[MAX_NUM_CLI];
+    NODE_HEALTH nodes[MAX_NUM_CLI + 1];     // same slots as METRICS 'nodes'
+} HEALTH_TABLE;
+
+typedef struct _REQUEST {
+    SESSION * session;
+    uint32_t req_id;
+    char * cmd;
+} REQUEST;
+
+// Number of relay nodes the coordinator (and every relay) forwards an 'n*'
+// sub-command to. 0 disables the tree and sends to every node directly.
+int FANOUT = 0;
+
+METRICS * STATS = NULL;
+HEALTH_TABLE * HEALTH = NULL;
+
+// Config of the main process, reloaded on SIGHUP by the heartbeat thread
+const char * CONFIG_PATH = CONFIG_FILE;
+CONFIG_ENTRY ** CONFIG = NULL;
+pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile sig_atomic_t RELOAD = 0;
+
 
 void print_cmd_struct(CMD_STRUCT * cmd) {
     printf("*************\n");
@@ -42,22 +211,102 @@ void err_exit(const char * err_msg, int sock_fd) {
     exit(EXIT_FAILURE);
 }
 
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+void metrics_init() {
+    STATS = mmap(NULL, sizeof(METRICS), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    HEALTH = mmap(NULL, sizeof(HEALTH_TABLE), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (STATS == MAP_FAILED || HEALTH == MAP_FAILED)
+        err_exit("Error in mmap. Exiting...\n", -1);
+    STATS->started = time(NULL);
+
+    // robust, a session handler may die holding it
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&HEALTH->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void health_lock() {
+    if (pthread_mutex_lock(&HEALTH->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&HEALTH->lock);
+}
+
+void metric_add(uint64_t * counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+void metric_max(uint64_t * counter, uint64_t value) {
+    uint64_t cur = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (cur < value && !__atomic_compare_exchange_n(counter, &cur, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint64_t metric_get(uint64_t * counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void hist_observe(HISTOGRAM * hist, double ms) {
+    uint64_t us = (ms > 0) ? (uint64_t) (ms * 1000) : 0;
+    size_t bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && us >= (2ULL << bucket))
+        ++bucket;
+    metric_add(&hist->count, 1);
+    metric_add(&hist->sum_us, us);
+    metric_add(&hist->buckets[bucket], 1);
+}
+
+// Upper bound of the bucket holding the 'q' quantile, in ms
+double hist_quantile(HISTOGRAM * hist, double q) {
+    uint64_t count = metric_get(&hist->count);
+    if (count == 0)
+        return 0;
+    uint64_t rank = (uint64_t) (q * (count - 1)) + 1, seen = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS; ++i) {
+        seen += metric_get(&hist->buckets[i]);
+        if (seen >= rank)
+            return (2ULL << i) / 1000.0;
+    }
+    return (2ULL << (METRICS_BUCKETS - 1)) / 1000.0;
+}
+
+// Returns NULL if the file can't be opened
 CONFIG_ENTRY ** read_config(const char * filename) {
-    CONFIG_ENTRY ** config = malloc((MAX_NUM_CLI + 1) * sizeof(CONFIG_ENTRY *));
     FILE * config_fp = fopen(filename, "r");
     if (config_fp == NULL)
-        err_exit("Error opening config. Exiting...\n", -1);
+        return NULL;
+    CONFIG_ENTRY ** config = malloc((MAX_NUM_CLI + 1) * sizeof(CONFIG_ENTRY *));
+    FANOUT = 0;
 
-    char name[12], ip[20];
-    size_t i;
-    while(fscanf(config_fp, " %s", name) != EOF) {
-        fscanf(config_fp, " %s", ip);
+    // each line is 'name ip [port]', the port defaults to CLIENT_PORT
+    char line[MAX_CMD_LEN], name[12], ip[20];
+    int port;
+    size_t i = 0;
+    while(fgets(line, MAX_CMD_LEN, config_fp) != NULL) {
+        port = CLIENT_PORT;
+        if (sscanf(line, " %11s %19s %d", name, ip, &port) < 2)
+            continue;
+        if (strcmp(name, CONFIG_FANOUT) == 0) {
+            // 'fanout <k>' enables tree dispatch for broadcasts
+            FANOUT = atoi(ip);
+            continue;
+        }
+        if (i == MAX_NUM_CLI)
+            break;
         config[i] = malloc(sizeof(CONFIG_ENTRY));
         config[i]->name = strdup(name);
         config[i]->ip = strdup(ip);
+        config[i]->port = port;
+        config[i]->slot = i + 1;
         ++i;
     }
     config[i] = NULL;
+    fclose(config_fp);
 
     return config;
 }
@@ -73,31 +322,96 @@ void free_config(CONFIG_ENTRY ** config) {
     free(config);
 }
 
-int server_init(int port) {
+size_t config_len(CONFIG_ENTRY ** config) {
+    size_t n = 0;
+    while (config[n] != NULL)
+        ++n;
+    return n;
+}
+
+// Copies the config of the main process into the shared node table, with
+// the HEALTH lock held
+void publish_config(CONFIG_ENTRY ** config) {
+    HEALTH->fanout = FANOUT;
+    HEALTH->n_nodes = config_len(config);
+    for (size_t i = 0; i < HEALTH->n_nodes; ++i) {
+        snprintf(HEALTH->addrs[i].name, sizeof(HEALTH->addrs[i].name), "%s", config[i]->name);
+        snprintf(HEALTH->addrs[i].ip, sizeof(HEALTH->addrs[i].ip), "%s", config[i]->ip);
+        HEALTH->addrs[i].port = config[i]->port;
+        HEALTH->addrs[i].slot = config[i]->slot;
+    }
+}
+
+// A snapshot of the config last published by the main process, with the
+// generation it goes with. The caller holds its one reference.
+CONFIG_SNAPSHOT * copy_config() {
+    CONFIG_SNAPSHOT * snapshot = malloc(sizeof(CONFIG_SNAPSHOT));
+    CONFIG_ENTRY ** config = malloc((MAX_NUM_CLI + 1) * sizeof(CONFIG_ENTRY *));
+
+    health_lock();
+    size_t n_nodes = HEALTH->n_nodes;
+    for (size_t i = 0; i < n_nodes; ++i) {
+        config[i] = malloc(sizeof(CONFIG_ENTRY));
+        config[i]->name = strdup(HEALTH->addrs[i].name);
+        config[i]->ip = strdup(HEALTH->addrs[i].ip);
+        config[i]->port = HEALTH->addrs[i].port;
+        config[i]->slot = HEALTH->addrs[i].slot;
+    }
+    config[n_nodes] = NULL;
+    snapshot->generation = HEALTH->generation;
+    snapshot->fanout = HEALTH->fanout;
+    pthread_mutex_unlock(&HEALTH->lock);
+
+    snapshot->config = config;
+    snapshot->n_nodes = n_nodes;
+    snapshot->refs = 1;
+    return snapshot;
+}
+
+// Drops a reference, with the session's 'inflight_lock' held
+void release_config(CONFIG_SNAPSHOT * snapshot) {
+    if (--snapshot->refs > 0)
+        return;
+    free_config(snapshot->config);
+    free(snapshot);
+}
+
+// Listens on 'port'. Returns -1 if it can't, with errno set.
+int listen_port(int port) {
     struct sockaddr_in serv_addr = {0};
 
     int serv_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (serv_sock < 0)
-        err_exit("Error in socket. Exiting...\n", -1);
+        return -1;
 
     int sockopt_optval = 1;
-    if (setsockopt(serv_sock, SOL_SOCKET, SO_REUSEADDR, &sockopt_optval, sizeof(sockopt_optval)) < 0)
-        err_exit("Error in setsockopt. Exiting...\n", serv_sock);
+    setsockopt(serv_sock, SOL_SOCKET, SO_REUSEADDR, &sockopt_optval, sizeof(sockopt_optval));
 
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     serv_addr.sin_port = htons(port);
 
-    if (bind(serv_sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
-        err_exit("Error in bind. Exiting...\n", serv_sock);
+    if (bind(serv_sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0 || listen(serv_sock, SOMAXCONN) < 0) {
+        int bind_errno = errno;
+        close(serv_sock);
+        errno = bind_errno;
+        return -1;
+    }
+
+    return serv_sock;
+}
 
-    if (listen(serv_sock, 5) < 0)
-        err_exit("Error in listen. Exiting...\n", serv_sock);
+int server_init(int port) {
+    int serv_sock = listen_port(port);
+    if (serv_sock < 0)
+        err_exit("Error in bind. Exiting...\n", -1);
 
     return serv_sock;
 }
 
-int client_init(char * ip, int port) {
+// Connects with a deadline of 'timeout_ms'. Returns -1 if the node can't be
+// reached in time, with errno set to ETIMEDOUT if the deadline passed.
+int client_init(char * ip, int port, int timeout_ms) {
     struct sockaddr_in serv_addr = {0};
 
     serv_addr.sin_family = AF_INET;
@@ -107,14 +421,405 @@ int client_init(char * ip, int port) {
         inet_aton(ip, &(serv_addr.sin_addr));
     serv_addr.sin_port = htons(port);
 
-    int client_sock = socket(AF_INET, SOCK_STREAM, 0);
+    int client_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (client_sock < 0)
+        return -1;
 
-    if (connect(client_sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
-        err_exit("Error in connect. Exiting...\n", client_sock);
+    if (connect(client_sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        if (errno != EINPROGRESS) {
+            close(client_sock);
+            return -1;
+        }
 
+        struct pollfd conn_fd = {client_sock, POLLOUT, 0};
+        int ready;
+        while ((ready = poll(&conn_fd, 1, timeout_ms)) < 0 && errno == EINTR);
+
+        int sock_err = ETIMEDOUT;
+        socklen_t err_len = sizeof(sock_err);
+        if (ready > 0)
+            getsockopt(client_sock, SOL_SOCKET, SO_ERROR, &sock_err, &err_len);
+        if (sock_err != 0) {
+            close(client_sock);
+            errno = sock_err;
+            return -1;
+        }
+    }
+
+    // the rest of the exchange is blocking
+    fcntl(client_sock, F_SETFL, fcntl(client_sock, F_GETFL) & ~O_NONBLOCK);
     return client_sock;
 }
 
+bool node_is_down(int node) {
+    return node > 0 && metric_get(&HEALTH->nodes[node].state) == NODE_DOWN;
+}
+
+// Counts a failed connect against the breaker of the node
+void breaker_miss(int node) {
+    if (node > 0 && __atomic_add_fetch(&HEALTH->nodes[node].failures, 1, __ATOMIC_RELAXED) >= BREAKER_THRESHOLD)
+        __atomic_store_n(&HEALTH->nodes[node].state, NODE_DOWN, __ATOMIC_RELAXED);
+}
+
+// A request couldn't connect to the node
+void node_failed(int node, bool timeout) {
+    metric_add(timeout ? &STATS->nodes[node].timeouts : &STATS->nodes[node].errors, 1);
+    breaker_miss(node);
+}
+
+void node_reached(int node) {
+    if (node > 0 && metric_get(&HEALTH->nodes[node].failures) > 0)
+        __atomic_store_n(&HEALTH->nodes[node].failures, 0, __ATOMIC_RELAXED);
+}
+
+void write_all(int sock_fd, const char * buf, size_t len) {
+    while (len > 0) {
+        ssize_t nbytes = write(sock_fd, buf, len);
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+        if (nbytes <= 0)
+            err_exit("Error in writing. Exiting...\n", sock_fd);
+        buf += nbytes;
+        len -= nbytes;
+    }
+}
+
+// Reads until the peer closes the connection. The returned buffer is always
+// '\0' terminated, 'len' excludes the terminator.
+char * read_all(int sock_fd, size_t * len) {
+    size_t cap = MAX_BUF_SIZE;
+    char * buf = malloc(cap + 1);
+    *len = 0;
+
+    while (true) {
+        if (*len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap + 1);
+        }
+        ssize_t nbytes = read(sock_fd, buf + *len, cap - *len);
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+        if (nbytes < 0)
+            err_exit("Error in read. Exiting...\n", sock_fd);
+        if (nbytes == 0)
+            break;
+        *len += nbytes;
+    }
+    buf[*len] = '\0';
+
+    return buf;
+}
+
+// Header and payload go out in one write so that Nagle doesn't hold back
+// the payload of a small frame
+void write_frame_iov(int sock_fd, FRAME_HDR * hdr, const char * payload, size_t len) {
+    struct iovec iov[2] = {{hdr, sizeof(FRAME_HDR)}, {(char *) payload, len}};
+    ssize_t nbytes = writev(sock_fd, iov, 2);
+    if (nbytes < 0)
+        err_exit("Error in writing. Exiting...\n", sock_fd);
+    if (nbytes < sizeof(FRAME_HDR))
+        write_all(sock_fd, (char *) hdr + nbytes, sizeof(FRAME_HDR) - nbytes);
+    if (nbytes < sizeof(FRAME_HDR) + len) {
+        size_t off = (nbytes > sizeof(FRAME_HDR)) ? nbytes - sizeof(FRAME_HDR) : 0;
+        write_all(sock_fd, payload + off, len - off);
+    }
+}
+
+// Frames of different requests may interleave but never overlap
+void write_frame(SESSION * session, FRAME_TYPE type, uint32_t req_id, const char * payload, size_t len) {
+    FRAME_HDR hdr = {htonl(type), htonl(req_id), htonl(len)};
+
+    pthread_mutex_lock(&session->write_lock);
+    write_frame_iov(session->client_sock, &hdr, payload, len);
+    pthread_mutex_unlock(&session->write_lock);
+}
+
+void append_txt(char ** txt, size_t * len, size_t * cap, const char * fmt, ...) {
+    va_list args;
+    while (true) {
+        va_start(args, fmt);
+        int n = vsnprintf(*txt + *len, *cap - *len, fmt, args);
+        va_end(args);
+        if (*len + n < *cap) {
+            *len += n;
+            return;
+        }
+        *cap = (*len + n + 1) * 2;
+        *txt = realloc(*txt, *cap);
+    }
+}
+
+// Builds the relay header for a subtree: '<RELAY_TAG> <fanout> <ip>:<port> ...'.
+// The receiving node runs the sub-command itself and forwards it to 'nodes'.
+char * build_relay_hdr(CONFIG_ENTRY ** nodes, size_t n_nodes, int fanout) {
+    size_t hdr_len = strlen(RELAY_TAG) + 16;
+    for (size_t i = 0; i < n_nodes; ++i)
+        hdr_len += strlen(nodes[i]->ip) + 8;
+
+    char * hdr = malloc(hdr_len);
+    int off = sprintf(hdr, "%s %d", RELAY_TAG, fanout);
+    for (size_t i = 0; i < n_nodes; ++i)
+        off += sprintf(hdr + off, " %s:%d", nodes[i]->ip, nodes[i]->port);
+
+    return hdr;
+}
+
+// Connects to the node and sends 'SESSION_TAG session \0 [relay_hdr \0] [COMPRESS_TAG \0] cmd \0'.
+// The input has to follow, after which the connection is half-closed so the
+// node knows the input is complete. With 'compress' set, the input is a
+// compressed stream and the node replies with one too. The node runs the
+// requests of a session on the same worker, which keeps its cwd and
+// environment. 'node' is the slot of the node in the metrics. Returns -1
+// if the node can't be reached.
+int open_node_request(int node, char * ip, int port, const char * session, const char * relay_hdr, bool compress, const char * cmd) {
+    double start = now_ms();
+    int node_sock = client_init(ip, port, CONNECT_TIMEOUT_MS);
+    metric_add(&STATS->nodes[node].requests, 1);
+    if (node_sock < 0) {
+        node_failed(node, errno == ETIMEDOUT);
+        return -1;
+    }
+    node_reached(node);
+    hist_observe(&STATS->nodes[node].connect, now_ms() - start);
+
+    char session_field[MAX_CMD_LEN];
+    int len = snprintf(session_field, MAX_CMD_LEN, "%s %s", SESSION_TAG, session);
+    write_all(node_sock, session_field, len + 1);
+    if (relay_hdr != NULL)
+        write_all(node_sock, relay_hdr, strlen(relay_hdr) + 1);
+    if (compress)
+        write_all(node_sock, COMPRESS_TAG, strlen(COMPRESS_TAG) + 1);
+    write_all(node_sock, cmd, strlen(cmd) + 1);
+
+    return node_sock;
+}
+
+// Half-closes the request once its input is sent
+NODE_CONN finish_node_request(int node, int node_sock, double start, size_t input_len) {
+    shutdown(node_sock, SHUT_WR);
+
+    NODE_CONN conn = {node_sock, node, now_ms()};
+    metric_add(&STATS->nodes[node].bytes_sent, input_len);
+    hist_observe(&STATS->nodes[node].dispatch, conn.sent_ms - start);
+    return conn;
+}
+
+// Sends the request with its input from memory. With 'sent' set, the input
+// is compressed and 'sent' counts its bytes. Returns the connection on which
+// the response has to be read, whose socket is -1 if the node can't be reached.
+NODE_CONN dispatch_cmd(int node, char * ip, int port, const char * session, const char * relay_hdr, LZ_STATS * sent, const char * cmd, const char * input, size_t input_len) {
+    int node_sock = open_node_request(node, ip, port, session, relay_hdr, sent != NULL, cmd);
+    if (node_sock < 0)
+        return (NODE_CONN) {-1, node, 0};
+    double start = now_ms();
+
+    if (sent != NULL)
+        lz_scan(input, input_len, sent, NULL);
+    write_all(node_sock, input, input_len);
+
+    return finish_node_request(node, node_sock, start, input_len);
+}
+
+// Runs the sub-command on every node that isn't down. With 'fanout' set, the
+// nodes are split into 'fanout' contiguous subtrees and only the root of each
+// one is contacted, the roots relay to the rest; if a root can't be reached
+// the next node of its subtree takes its place. Nodes left out are listed
+// in 'notes'. Returns the connections to read the responses from;
+// concatenated in order, they are in config order.
+NODE_CONN * broadcast_cmd(CONFIG_ENTRY ** config, int fanout, const char * session, LZ_STATS * sent, const char * cmd, const char * input, size_t input_len,
+        size_t * n_conns, char ** notes, size_t * notes_len, size_t * notes_cap) {
+    CONFIG_ENTRY * up[MAX_NUM_CLI];
+    int up_idx[MAX_NUM_CLI];
+    size_t n_nodes = 0;
+    for (size_t i = 0; config[i] != NULL; ++i) {
+        if (node_is_down(config[i]->slot)) {
+            append_txt(notes, notes_len, notes_cap, "[%s is down, left out of n*.%s]\n", config[i]->name, cmd);
+            continue;
+        }
+        up_idx[n_nodes] = config[i]->slot;
+        up[n_nodes++] = config[i];
+    }
+
+    size_t chunk = 1;
+    if (fanout > 0 && n_nodes > fanout)
+        chunk = (n_nodes + fanout - 1) / fanout;
+
+    size_t n_chunks = (n_nodes + chunk - 1) / chunk;
+    NODE_CONN * conns = malloc((n_chunks + 1) * sizeof(NODE_CONN));
+    *n_conns = 0;
+
+    // send to all relay roots first so that the subtrees execute concurrently
+    for (size_t i = 0; i < n_chunks; ++i) {
+        size_t end = ((i + 1) * chunk < n_nodes) ? (i + 1) * chunk : n_nodes;
+
+        for (size_t root = i * chunk; root < end; ++root) {
+            char * relay_hdr = NULL;
+            if (end - root > 1)
+                relay_hdr = build_relay_hdr(up + root + 1, end - root - 1, fanout);
+
+            conns[*n_conns] = dispatch_cmd(up_idx[root], up[root]->ip, up[root]->port, session, relay_hdr, sent, cmd, input, input_len);
+            free(relay_hdr);
+            if (conns[*n_conns].sock >= 0) {
+                ++(*n_conns);
+                break;
+            }
+            append_txt(notes, notes_len, notes_cap, "[%s is unreachable, left out of n*.%s]\n", up[root]->name, cmd);
+        }
+    }
+
+    return conns;
+}
+
+// Counts a response read whole
+void node_response_done(NODE_CONN * conn, size_t resp_len) {
+    metric_add(&STATS->nodes[conn->node].bytes_received, resp_len);
+    hist_observe(&STATS->nodes[conn->node].execute, now_ms() - conn->sent_ms);
+}
+
+// Reads the responses in order, concatenated, and closes the connections
+char * collect_responses(NODE_CONN * conns, size_t n_conns, size_t * out_len) {
+    size_t cap = MAX_BUF_SIZE;
+    char * response_all = malloc(cap + 1);
+    *out_len = 0;
+    for (size_t i = 0; i < n_conns; ++i) {
+        size_t resp_len;
+        char * resp = read_all(conns[i].sock, &resp_len);
+        close(conns[i].sock);
+        node_response_done(&conns[i], resp_len);
+
+        if (*out_len + resp_len > cap) {
+            cap = *out_len + resp_len;
+            response_all = realloc(response_all, cap + 1);
+        }
+        memcpy(response_all + *out_len, resp, resp_len);
+        *out_len += resp_len;
+        free(resp);
+    }
+    response_all[*out_len] = '\0';
+
+    return response_all;
+}
+
+// Sends the responses to the client as they are read, in order, as DATA
+// frames of request 'req_id', and closes the connections. A compressed
+// response is decoded a chunk at a time, 'from_nodes', 'node_cpu_ns' and
+// 'server' count it as lz_scan() and lz_decode() do. Returns the bytes read.
+size_t stream_responses(SESSION * session, uint32_t req_id, NODE_CONN * conns, size_t n_conns, bool compressed,
+        LZ_STATS * from_nodes, uint64_t * node_cpu_ns, LZ_STATS * server) {
+    // room for a whole chunk of a compressed stream, header and trailer included
+    size_t cap = lz_bound(LZ_CHUNK_SIZE) + 2 * sizeof(LZ_CHUNK_HDR) + MAX_FRAME_SIZE;
+    char * buf = malloc(cap);
+    size_t total = 0;
+    for (size_t i = 0; i < n_conns; ++i) {
+        size_t resp_len = 0, buf_len = 0;
+        bool corrupt = false;
+        while (true) {
+            ssize_t nbytes = read(conns[i].sock, buf + buf_len, compressed ? cap - buf_len : MAX_FRAME_SIZE);
+            if (nbytes < 0 && errno == EINTR)
+                continue;
+            if (nbytes < 0)
+                metric_add(&STATS->nodes[conns[i].node].errors, 1);
+            if (nbytes <= 0)
+                break;
+            resp_len += nbytes;
+            if (!compressed) {
+                write_frame(session, FRAME_DATA, req_id, buf, nbytes);
+                continue;
+            }
+            buf_len += nbytes;
+            if (corrupt) {
+                buf_len = 0; // drained to the end of the response
+                continue;
+            }
+
+            size_t off = 0, chunk_len;
+            while ((chunk_len = lz_chunk_len(buf + off, buf_len - off)) > 0) {
+                size_t raw_len;
+                char * raw = NULL;
+                if (lz_scan(buf + off, chunk_len, from_nodes, node_cpu_ns))
+                    raw = lz_decode(buf + off, chunk_len, &raw_len, server);
+                if (raw == NULL) {
+                    corrupt = true;
+                    break;
+                }
+                if (raw_len > 0)
+                    write_frame(session, FRAME_DATA, req_id, raw, raw_len);
+                free(raw);
+                off += chunk_len;
+            }
+            if (off == 0 && buf_len == cap)
+                corrupt = true; // a chunk longer than any encoder writes
+            buf_len = corrupt ? 0 : buf_len - off;
+            memmove(buf, buf + off, buf_len);
+        }
+        if (compressed && (corrupt || buf_len > 0)) {
+            metric_add(&STATS->errors, 1);
+            const char * msg = "Corrupt output from the nodes...\n";
+            write_frame(session, FRAME_DATA, req_id, msg, strlen(msg));
+        }
+        close(conns[i].sock);
+        node_response_done(&conns[i], resp_len);
+        total += resp_len;
+    }
+    free(buf);
+
+    return total;
+}
+
+// Moves everything 'from_sock' sends to 'to_sock'. With 'pipe_fd' the bytes
+// go socket -> pipe -> socket with splice and never enter user space,
+// otherwise, or if splice isn't supported, they are copied through a buffer.
+// Returns false if either side failed, the pipe is left empty either way.
+bool relay_stream(int from_sock, int to_sock, int pipe_fd[2], uint64_t * spliced, uint64_t * copied) {
+    while (pipe_fd != NULL) {
+        ssize_t nbytes = splice(from_sock, NULL, pipe_fd[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+        if (nbytes < 0 && errno == EINVAL && *spliced == 0)
+            break; // fall back to copying
+        if (nbytes < 0)
+            return false;
+        if (nbytes == 0)
+            return true;
+
+        while (nbytes > 0) {
+            ssize_t moved = splice(pipe_fd[0], NULL, to_sock, NULL, nbytes, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (moved < 0 && errno == EINTR)
+                continue;
+            if (moved <= 0)
+                break;
+            nbytes -= moved;
+            *spliced += moved;
+        }
+        if (nbytes > 0) {
+            // the pipe is reused by the next relay, drop what is left in it
+            char drain[MAX_BUF_SIZE];
+            while (nbytes > 0) {
+                ssize_t dropped = read(pipe_fd[0], drain, (nbytes < MAX_BUF_SIZE) ? nbytes : MAX_BUF_SIZE);
+                if (dropped < 0 && errno == EINTR)
+                    continue;
+                if (dropped <= 0)
+                    break;
+                nbytes -= dropped;
+            }
+            return false;
+        }
+    }
+
+    char buf[SPLICE_CHUNK];
+    while (true) {
+        ssize_t nbytes = read(from_sock, buf, SPLICE_CHUNK);
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+        if (nbytes < 0)
+            return false;
+        if (nbytes == 0)
+            return true;
+        write_all(to_sock, buf, nbytes);
+        *copied += nbytes;
+    }
+}
+
 CMD_STRUCT * parse_single_cmd(const char * cmd) {
     char * tmp_cmd = strdup(cmd);
 
@@ -224,146 +929,794 @@ CMD_STRUCT ** parse_multiple_pipe_cmd(char * cmd, size_t * n_pipe_cmds) {
     return pipe_cmds;
 }
 
-int main() {
-    int serv_sock = server_init(SERVER_PORT);
+// Reports the compression counters of the session
+char * compress_stats(SESSION * session, size_t * out_len) {
+    char * stats_txt = malloc(MAX_BUF_SIZE);
 
-    struct sockaddr_in client_addr;
-    int client_sock, client_len = client_len = sizeof(client_addr);
+    pthread_mutex_lock(&session->stats_lock);
+    LZ_STATS * dir[2] = {&session->to_nodes, &session->from_nodes};
+    char * dir_name[2] = {"to nodes", "from nodes"};
+
+    *out_len = sprintf(stats_txt, "compression: %s\n", session->compress ? "on" : "off");
+    for (int i = 0; i < 2; ++i) {
+        double saved = (dir[i]->raw_bytes > 0) ? 100.0 - 100.0 * dir[i]->wire_bytes / dir[i]->raw_bytes : 0;
+        *out_len += sprintf(stats_txt + *out_len, "%-10s : %lu bytes raw, %lu bytes on the wire, %.1f%% saved\n",
+            dir_name[i], dir[i]->raw_bytes, dir[i]->wire_bytes, saved);
+    }
+    *out_len += sprintf(stats_txt + *out_len, "cpu        : %.3f ms on the server, %.3f ms on the nodes\n",
+        session->server_cpu_ns / 1000000.0, session->node_cpu_ns / 1000000.0);
+    pthread_mutex_unlock(&session->stats_lock);
+
+    return stats_txt;
+}
+
+// Reports the relay counters of the session and the CPU time its
+// handler has used
+char * relay_stats(SESSION * session, size_t * out_len) {
+    char * stats_txt = malloc(MAX_BUF_SIZE);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu_ms = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+                    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+
+    pthread_mutex_lock(&session->stats_lock);
+    *out_len = sprintf(stats_txt, "splice: %s\nspliced: %lu bytes\ncopied: %lu bytes\ncpu: %.3f ms\n",
+        session->splice ? "on" : "off", session->spliced_bytes, session->copied_bytes, cpu_ms);
+    pthread_mutex_unlock(&session->stats_lock);
 
-    CONFIG_ENTRY ** config = read_config(CONFIG_FILE);
+    return stats_txt;
+}
 
-    printf("Server started at port '%d'\n", SERVER_PORT);
+STAGE_METRICS * stage_metrics(size_t stage) {
+    return &STATS->stages[(stage < METRICS_STAGES) ? stage : METRICS_STAGES - 1];
+}
+
+// Reports the coordinator metrics, of all the sessions
+char * coordinator_stats(CONFIG_ENTRY ** config, size_t n_nodes, size_t * out_len) {
+    size_t cap = MAX_BUF_SIZE + (n_nodes + 1 + METRICS_STAGES) * 160;
+    char * stats_txt = malloc(cap);
+
+    uint64_t active_sessions = metric_get(&STATS->active_sessions);
+    uint64_t active_commands = metric_get(&STATS->active_commands);
+    double utilization = (active_sessions > 0) ? 100.0 * active_commands / (active_sessions * MAX_INFLIGHT) : 0;
+
+    *out_len = sprintf(stats_txt, "uptime %ld s, sessions %lu (%lu active), commands %lu, errors %lu\n",
+        (long) (time(NULL) - STATS->started), metric_get(&STATS->sessions), active_sessions,
+        metric_get(&STATS->commands), metric_get(&STATS->errors));
+    *out_len += sprintf(stats_txt + *out_len, "pool: %lu commands in flight (peak %lu), %.1f%% of the session slots, %lu waited for a slot\n",
+        active_commands, metric_get(&STATS->peak_commands), utilization, metric_get(&STATS->inflight_waits));
+    HISTOGRAM * cmd_hist = &STATS->command;
+    *out_len += sprintf(stats_txt + *out_len, "command latency: p50 %.3f ms, p99 %.3f ms, mean %.3f ms\n\n",
+        hist_quantile(cmd_hist, 0.50), hist_quantile(cmd_hist, 0.99),
+        (cmd_hist->count > 0) ? metric_get(&cmd_hist->sum_us) / 1000.0 / metric_get(&cmd_hist->count) : 0);
+
+    *out_len += sprintf(stats_txt + *out_len, "%-6s %-8s %-6s %-8s %-12s %-12s %-17s %-17s %-17s\n",
+        "node", "requests", "errors", "timeouts", "sent", "received", "connect p50/p99", "dispatch p50/p99", "execute p50/p99");
+    for (size_t i = 0; i <= n_nodes && i <= MAX_NUM_CLI; ++i) {
+        NODE_METRICS * node = &STATS->nodes[(i == 0) ? 0 : config[i - 1]->slot];
+        if (metric_get(&node->requests) == 0)
+            continue;
+        HISTOGRAM * hist[3] = {&node->connect, &node->dispatch, &node->execute};
+        char latency[3][24];
+        for (int h = 0; h < 3; ++h)
+            snprintf(latency[h], sizeof(latency[h]), "%.3f/%.3f", hist_quantile(hist[h], 0.50), hist_quantile(hist[h], 0.99));
+        *out_len += sprintf(stats_txt + *out_len, "%-6s %-8lu %-6lu %-8lu %-12lu %-12lu %-17s %-17s %-17s\n",
+            (i == 0) ? "self" : config[i - 1]->name, metric_get(&node->requests), metric_get(&node->errors),
+            metric_get(&node->timeouts), metric_get(&node->bytes_sent), metric_get(&node->bytes_received),
+            latency[0], latency[1], latency[2]);
+    }
+
+    *out_len += sprintf(stats_txt + *out_len, "\n%-6s %-8s %-12s %-12s\n", "stage", "runs", "bytes in", "bytes out");
+    for (size_t i = 0; i < METRICS_STAGES; ++i) {
+        STAGE_METRICS * stage = &STATS->stages[i];
+        if (metric_get(&stage->runs) == 0)
+            continue;
+        char name[8];
+        sprintf(name, (i == METRICS_STAGES - 1) ? "%zu+" : "%zu", i + 1);
+        *out_len += sprintf(stats_txt + *out_len, "%-6s %-8lu %-12lu %-12lu\n", name,
+            metric_get(&stage->runs), metric_get(&stage->bytes_in), metric_get(&stage->bytes_out));
+    }
+
+    return stats_txt;
+}
+
+void append_hist(char ** txt, size_t * len, size_t * cap, const char * name, const char * labels, HISTOGRAM * hist) {
+    // cumulative buckets in seconds, up to the last one in use
+    size_t last = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS; ++i)
+        if (metric_get(&hist->buckets[i]) > 0)
+            last = i;
+    uint64_t seen = 0;
+    for (size_t i = 0; i <= last && i < METRICS_BUCKETS - 1; ++i) {
+        seen += metric_get(&hist->buckets[i]);
+        append_txt(txt, len, cap, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, (*labels != '\0') ? "," : "",
+            (2ULL << i) / 1e6, seen);
+    }
+    append_txt(txt, len, cap, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, (*labels != '\0') ? "," : "", metric_get(&hist->count));
+    char braced[MAX_CMD_LEN] = "";
+    if (*labels != '\0')
+        snprintf(braced, sizeof(braced), "{%s}", labels);
+    append_txt(txt, len, cap, "%s_sum%s %g\n", name, braced, metric_get(&hist->sum_us) / 1e6);
+    append_txt(txt, len, cap, "%s_count%s %lu\n", name, braced, metric_get(&hist->count));
+}
+
+// The coordinator metrics in the Prometheus text format, for the scrape endpoint
+char * scrape_metrics(CONFIG_ENTRY ** config, size_t n_nodes, size_t * out_len) {
+    size_t cap = MAX_BUF_SIZE * 4;
+    char * txt = malloc(cap);
+    *out_len = 0;
+
+    append_txt(&txt, out_len, &cap, "clustershell_uptime_seconds %ld\n", (long) (time(NULL) - STATS->started));
+    append_txt(&txt, out_len, &cap, "clustershell_sessions_total %lu\n", metric_get(&STATS->sessions));
+    append_txt(&txt, out_len, &cap, "clustershell_sessions_active %lu\n", metric_get(&STATS->active_sessions));
+    append_txt(&txt, out_len, &cap, "clustershell_commands_total %lu\n", metric_get(&STATS->commands));
+    append_txt(&txt, out_len, &cap, "clustershell_commands_active %lu\n", metric_get(&STATS->active_commands));
+    append_txt(&txt, out_len, &cap, "clustershell_commands_peak %lu\n", metric_get(&STATS->peak_commands));
+    append_txt(&txt, out_len, &cap, "clustershell_inflight_waits_total %lu\n", metric_get(&STATS->inflight_waits));
+    append_txt(&txt, out_len, &cap, "clustershell_errors_total %lu\n", metric_get(&STATS->errors));
+    append_hist(&txt, out_len, &cap, "clustershell_command_seconds", "", &STATS->command);
+
+    for (size_t i = 0; i <= n_nodes && i <= MAX_NUM_CLI; ++i) {
+        NODE_METRICS * node = &STATS->nodes[(i == 0) ? 0 : config[i - 1]->slot];
+        if (metric_get(&node->requests) == 0)
+            continue;
+        char labels[64];
+        snprintf(labels, sizeof(labels), "node=\"%s\"", (i == 0) ? "self" : config[i - 1]->name);
+
+        append_txt(&txt, out_len, &cap, "clustershell_node_requests_total{%s} %lu\n", labels, metric_get(&node->requests));
+        append_txt(&txt, out_len, &cap, "clustershell_node_errors_total{%s} %lu\n", labels, metric_get(&node->errors));
+        append_txt(&txt, out_len, &cap, "clustershell_node_timeouts_total{%s} %lu\n", labels, metric_get(&node->timeouts));
+        append_txt(&txt, out_len, &cap, "clustershell_node_sent_bytes_total{%s} %lu\n", labels, metric_get(&node->bytes_sent));
+        append_txt(&txt, out_len, &cap, "clustershell_node_received_bytes_total{%s} %lu\n", labels, metric_get(&node->bytes_received));
+        append_hist(&txt, out_len, &cap, "clustershell_node_connect_seconds", labels, &node->connect);
+        append_hist(&txt, out_len, &cap, "clustershell_node_dispatch_seconds", labels, &node->dispatch);
+        append_hist(&txt, out_len, &cap, "clustershell_node_execute_seconds", labels, &node->execute);
+    }
+
+    for (size_t i = 0; i < METRICS_STAGES; ++i) {
+        STAGE_METRICS * stage = &STATS->stages[i];
+        if (metric_get(&stage->runs) == 0)
+            continue;
+        append_txt(&txt, out_len, &cap, "clustershell_stage_runs_total{stage=\"%zu\"} %lu\n", i + 1, metric_get(&stage->runs));
+        append_txt(&txt, out_len, &cap, "clustershell_stage_in_bytes_total{stage=\"%zu\"} %lu\n", i + 1, metric_get(&stage->bytes_in));
+        append_txt(&txt, out_len, &cap, "clustershell_stage_out_bytes_total{stage=\"%zu\"} %lu\n", i + 1, metric_get(&stage->bytes_out));
+    }
+
+    return txt;
+}
+
+// Serves the metrics over plain HTTP to whoever connects. The coordinator
+// runs on without them if the port can't be had.
+void * scrape_thread(void * args) {
+    int scrape_sock = listen_port(*(int *) args);
+    if (scrape_sock < 0) {
+        perror("Error listening on the metrics port, not serving metrics...\n");
+        return NULL;
+    }
+    printf("Metrics served at port '%d'\n", *(int *) args);
 
     while (true) {
-        client_sock = accept(serv_sock, (struct sockaddr *) &client_addr, &client_len);
+        int client_sock = accept(scrape_sock, NULL, NULL);
         if (client_sock < 0)
-            err_exit("Error in accept. Exiting...\n", client_sock);
+            continue;
+
+        // the request itself doesn't matter, every path gets the metrics
+        char req[MAX_BUF_SIZE];
+        recv(client_sock, req, sizeof(req), 0);
+
+        size_t txt_len;
+        pthread_mutex_lock(&config_lock);
+        char * txt = scrape_metrics(CONFIG, config_len(CONFIG), &txt_len);
+        pthread_mutex_unlock(&config_lock);
+        char hdr[MAX_CMD_LEN];
+        int hdr_len = sprintf(hdr, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", txt_len);
+
+        // a scraper going away must not take the server down with write_all
+        struct iovec iov[2] = {{hdr, hdr_len}, {txt, txt_len}};
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        while (iov[1].iov_len > 0) {
+            ssize_t nbytes = sendmsg(client_sock, &msg, MSG_NOSIGNAL);
+            if (nbytes <= 0)
+                break;
+            for (size_t i = 0; i < 2; ++i) {
+                size_t done = ((size_t) nbytes < iov[i].iov_len) ? (size_t) nbytes : iov[i].iov_len;
+                iov[i].iov_base = (char *) iov[i].iov_base + done;
+                iov[i].iov_len -= done;
+                nbytes -= done;
+            }
+        }
+        free(txt);
+        close(client_sock);
+    }
 
-        printf("Client Connected: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    return NULL;
+}
 
-        pid_t client_handler = fork();
-        if (client_handler < 0)
-            err_exit("Error in fork. Exiting...\n", -1);
-        else if (client_handler == 0) {
-            // close serv_sock to stop accepting connections
-            close(serv_sock);
+// Runs the whole pipeline of request 'req_id', each stage's output being the
+// next one's input. The output of the last stage, when it comes from nodes,
+// is sent to the client as it is read, so that the output of concurrent
+// commands interleaves. Returns what is left to send after it: the output
+// of a stage the server runs itself, errors and notes.
+//
+// A stage's output is left unread on the node sockets and, when the next
+// stage runs on a single node, relayed to it socket to socket, with splice
+// unless 'splice off' is set for the session. It is only read into memory
+// when it has to be: for a broadcast, a change of compression or the final
+// output.
+//
+// With compression on, stage outputs stay compressed on the server and are
+// passed to the next stage as they are, only the final output is decoded,
+// a chunk at a time.
+// 'compress on|off' sets it for the session, a leading '+z' or '-z' for
+// one command.
+char * run_pipeline(SESSION * session, CONFIG_SNAPSHOT * snapshot, uint32_t req_id, char * cmd, size_t * out_len) {
+    CONFIG_ENTRY ** config = snapshot->config;
+    size_t n_nodes = snapshot->n_nodes;
+
+    if (strcmp(cmd, "nodes") == 0) {
+        char * nodes_txt = malloc(n_nodes * (12 + 20 + 8 + 32) + 1);
+        *out_len = 0;
+        for (size_t i = 0; i < n_nodes; ++i) {
+            NODE_HEALTH * health = &HEALTH->nodes[config[i]->slot];
+            *out_len += sprintf(nodes_txt + *out_len, "%s %s %d %s %.3f ms\n", config[i]->name, config[i]->ip, config[i]->port,
+                node_is_down(config[i]->slot) ? "down" : "up", metric_get(&health->rtt_us) / 1000.0);
+        }
+        nodes_txt[*out_len] = '\0';
 
-            while (true) {
-                // Handle commands
-                char cmd[MAX_CMD_LEN+1];
+        return nodes_txt;
+    }
 
-                int cmd_len = read(client_sock, cmd, MAX_CMD_LEN);
-                if (cmd_len < 0)
-                    err_exit("Error in read. Exiting...\n", -1);
-                cmd[cmd_len] = '\0';
+    if (strcmp(cmd, "stats") == 0)
+        return coordinator_stats(config, n_nodes, out_len);
 
-                printf("'%s:%d' sent '%s'\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), cmd);
+    if (strncmp(cmd, "compress", 8) == 0 && (cmd[8] == ' ' || cmd[8] == '\0')) {
+        if (strcmp(cmd, "compress on") == 0)
+            session->compress = true;
+        else if (strcmp(cmd, "compress off") == 0)
+            session->compress = false;
+        return compress_stats(session, out_len);
+    }
 
-                if (strcmp(cmd, "nodes") == 0) {
-                    FILE * config_fp = fopen(CONFIG_FILE, "r");
-                    fseek(config_fp, 0L, SEEK_END);
-                    size_t config_size = ftell(config_fp);
-                    char * raw_config_txt = malloc((config_size+1) * sizeof(char));
-                    rewind(config_fp);
+    if (strncmp(cmd, "splice", 6) == 0 && (cmd[6] == ' ' || cmd[6] == '\0')) {
+        if (strcmp(cmd, "splice on") == 0)
+            session->splice = true;
+        else if (strcmp(cmd, "splice off") == 0)
+            session->splice = false;
+        return relay_stats(session, out_len);
+    }
 
-                    config_size = fread(raw_config_txt, sizeof(char), config_size, config_fp);
-                    raw_config_txt[config_size] = '\0';
-                    ++config_size;
+    bool compress = session->compress;
+    if (strncmp(cmd, "+z ", 3) == 0 || strncmp(cmd, "-z ", 3) == 0) {
+        compress = (cmd[0] == '+');
+        cmd += 3;
+    }
 
-                    write(client_sock, raw_config_txt, config_size);
+    LZ_STATS to_nodes = {0}, from_nodes = {0}, server = {0};
+    uint64_t node_cpu_ns = 0, spliced = 0, copied = 0;
+
+    int pipe_fd[2];
+    bool use_splice = session->splice && pipe(pipe_fd) == 0;
+
+    // nodes left out of broadcasts, reported after the output
+    size_t notes_cap = MAX_BUF_SIZE, notes_len = 0;
+    char * notes = malloc(notes_cap);
+
+    // output of the previous stage, either in memory or on 'upstream'
+    char * prev_input = calloc(1, 1);
+    size_t prev_input_len = 0;
+    bool prev_compressed = false;
+    NODE_CONN * upstream = NULL;
+    size_t n_upstream = 0;
+
+    size_t n_cmds;
+    CMD_STRUCT ** cmds = parse_multiple_pipe_cmd(cmd, &n_cmds);
+
+    for(size_t cmd_idx = 0; cmd_idx < n_cmds; ++cmd_idx) {
+        // for each command
+        bool down = (cmds[cmd_idx]->node > 0 && cmds[cmd_idx]->node <= (int) n_nodes &&
+            node_is_down(config[cmds[cmd_idx]->node - 1]->slot));
+        bool relay = (n_upstream > 0 && cmds[cmd_idx]->node != 0 && !down &&
+            cmds[cmd_idx]->node <= (int) n_nodes && compress == prev_compressed);
+
+        if (n_upstream > 0 && !relay) {
+            free(prev_input);
+            prev_input = collect_responses(upstream, n_upstream, &prev_input_len);
+            metric_add(&stage_metrics(cmd_idx - 1)->bytes_out, prev_input_len);
+            if (prev_compressed)
+                lz_scan(prev_input, prev_input_len, &from_nodes, &node_cpu_ns);
+            free(upstream);
+            upstream = NULL;
+            n_upstream = 0;
+        }
 
-                    free(raw_config_txt);
-                    continue;
+        metric_add(&stage_metrics(cmd_idx)->runs, 1);
+        if (cmds[cmd_idx]->node > (int) n_nodes) {
+            metric_add(&STATS->errors, 1);
+            free(prev_input);
+            prev_input = malloc(MAX_CMD_LEN);
+            prev_input_len = sprintf(prev_input, "Node n%d not found...\n", cmds[cmd_idx]->node);
+            prev_compressed = false;
+        }
+        else if (down) {
+            // fail fast, the heartbeats tell when it is back
+            free(prev_input);
+            prev_input = malloc(MAX_CMD_LEN);
+            prev_input_len = sprintf(prev_input, "Node n%d is down...\n", cmds[cmd_idx]->node);
+            prev_compressed = false;
+        }
+        else {
+            if (!relay && compress != prev_compressed) {
+                // stage input has to match what the node is asked for
+                char * converted = compress ?
+                    lz_encode(prev_input, prev_input_len, &prev_input_len, &server) :
+                    lz_decode(prev_input, prev_input_len, &prev_input_len, &server);
+                free(prev_input);
+                prev_input = (converted != NULL) ? converted : calloc(1, 1);
+                if (converted == NULL)
+                    prev_input_len = 0;
+            }
+            LZ_STATS * sent = compress ? &to_nodes : NULL;
+
+            NODE_CONN * conns;
+            size_t n_conns = 1;
+            if (cmds[cmd_idx]->node == 0) {
+                // send to all
+                conns = broadcast_cmd(config, snapshot->fanout, session->session_id, sent, cmds[cmd_idx]->cmd, prev_input, prev_input_len,
+                    &n_conns, &notes, &notes_len, &notes_cap);
+                metric_add(&stage_metrics(cmd_idx)->bytes_in, prev_input_len * n_conns);
+                if (n_conns == 0) {
+                    free(prev_input);
+                    prev_input = calloc(1, 1);
+                    prev_input_len = 0;
                 }
+            }
+            else {
+                // send to particular node
+                char * ip = session->client_ip; // self
+                int port = session->self_port;
+                int node = (cmds[cmd_idx]->node == -1) ? 0 : cmds[cmd_idx]->node, slot = 0;
+                if (node != 0) {
+                    // non-self node on cluster
+                    ip = config[node - 1]->ip;
+                    port = config[node - 1]->port;
+                    slot = config[node - 1]->slot;
+                }
+
+                conns = malloc(sizeof(NODE_CONN));
+                if (relay) {
+                    // only the header is written by the server itself
+                    int node_sock = open_node_request(slot, ip, port, session->session_id, NULL, compress, cmds[cmd_idx]->cmd);
+                    double start = now_ms();
+                    uint64_t relayed = 0;
+                    for (size_t i = 0; i < n_upstream && node_sock < 0; ++i)
+                        close(upstream[i].sock);
+                    for (size_t i = 0; i < n_upstream && node_sock >= 0; ++i) {
+                        uint64_t before = spliced + copied;
+                        if (!relay_stream(upstream[i].sock, node_sock, use_splice ? pipe_fd : NULL, &spliced, &copied)) {
+                            perror("Error in relaying stage output...\n");
+                            metric_add(&STATS->nodes[upstream[i].node].errors, 1);
+                        }
+                        close(upstream[i].sock);
+                        node_response_done(&upstream[i], spliced + copied - before);
+                        relayed += spliced + copied - before;
+                    }
+                    conns[0] = (NODE_CONN) {-1, slot, 0};
+                    if (node_sock >= 0)
+                        conns[0] = finish_node_request(slot, node_sock, start, relayed);
+                    metric_add(&stage_metrics(cmd_idx - 1)->bytes_out, relayed);
+                    metric_add(&stage_metrics(cmd_idx)->bytes_in, relayed);
+                    free(upstream);
+                }
+                else {
+                    conns[0] = dispatch_cmd(slot, ip, port, session->session_id, NULL, sent, cmds[cmd_idx]->cmd, prev_input, prev_input_len);
+                    metric_add(&stage_metrics(cmd_idx)->bytes_in, prev_input_len);
+                    if (cmd_idx > 0)
+                        copied += prev_input_len;
+                }
+
+                if (conns[0].sock < 0) {
+                    free(prev_input);
+                    prev_input = malloc(MAX_CMD_LEN);
+                    prev_input_len = (node == 0) ?
+                        sprintf(prev_input, "Self node is unreachable...\n") :
+                        sprintf(prev_input, "Node n%d is unreachable...\n", node);
+                    n_conns = 0;
+                }
+            }
+
+            upstream = conns;
+            n_upstream = n_conns;
+            prev_compressed = (n_conns > 0) ? compress : false;
+            if (n_conns == 0) {
+                free(conns);
+                upstream = NULL;
+            }
+        }
+
+        free(cmds[cmd_idx]->cmd);
+        free(cmds[cmd_idx]);
+    }
+    free(cmds);
+
+    if (n_upstream > 0) {
+        size_t streamed = stream_responses(session, req_id, upstream, n_upstream, prev_compressed,
+            &from_nodes, &node_cpu_ns, &server);
+        metric_add(&stage_metrics(n_cmds - 1)->bytes_out, streamed);
+        free(upstream);
+        free(prev_input);
+        prev_input = calloc(1, 1);
+        prev_input_len = 0;
+    }
+    if (use_splice) {
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+    }
 
-                char prev_input[MAX_BUF_SIZE+1];
-                memset(prev_input, 0, MAX_BUF_SIZE+1);
-                size_t prev_input_len = 0;
+    if (notes_len > 0) {
+        prev_input = realloc(prev_input, prev_input_len + notes_len + 1);
+        memcpy(prev_input + prev_input_len, notes, notes_len + 1);
+        prev_input_len += notes_len;
+    }
+    free(notes);
+
+    pthread_mutex_lock(&session->stats_lock);
+    session->to_nodes.raw_bytes += to_nodes.raw_bytes;
+    session->to_nodes.wire_bytes += to_nodes.wire_bytes;
+    session->from_nodes.raw_bytes += from_nodes.raw_bytes;
+    session->from_nodes.wire_bytes += from_nodes.wire_bytes;
+    session->server_cpu_ns += server.cpu_ns;
+    session->node_cpu_ns += node_cpu_ns;
+    session->spliced_bytes += spliced;
+    session->copied_bytes += copied;
+    pthread_mutex_unlock(&session->stats_lock);
+
+    *out_len = prev_input_len;
+    return prev_input;
+}
 
-                size_t n_cmds;
-                CMD_STRUCT ** cmds = parse_multiple_pipe_cmd(cmd, &n_cmds);
+void reload_handler(int signum) {
+    RELOAD = 1;
+}
 
-                for(size_t cmd_idx = 0; cmd_idx < n_cmds; ++cmd_idx) {
-                    // for each command
+// Zeroes counters of the shared mappings one at a time, the sessions may
+// still be adding to them
+void counters_clear(void * counters, size_t size) {
+    for (size_t i = 0; i < size / sizeof(uint64_t); ++i)
+        __atomic_store_n((uint64_t *) counters + i, 0, __ATOMIC_RELAXED);
+}
 
-                    if (cmds[cmd_idx]->node == 0) {
-                        // send to all
-                        char response_all[MAX_BUF_SIZE];
-                        memset(response_all, 0, MAX_BUF_SIZE+1);
+// Reloads the config of the main process. A node kept from the old config,
+// same address and port, keeps its slot and so its health and metrics, which
+// the sessions go on updating in place. A new node gets a cleared slot, one
+// the old config didn't use if there is one left. The sessions pick the new
+// config up from the shared node table by the generation.
+void reload_config() {
+    CONFIG_ENTRY ** config = read_config(CONFIG_PATH);
+    if (config == NULL) {
+        perror("Error reloading config, keeping the old one...\n");
+        return;
+    }
 
-                        CONFIG_ENTRY ** tmp_config = config;
-                        while(*tmp_config != NULL) {
-                            int client_sock2 = client_init((*tmp_config)->ip, CLIENT_PORT);
+    pthread_mutex_lock(&config_lock);
+    bool taken[MAX_NUM_CLI + 1] = {false}, was_used[MAX_NUM_CLI + 1] = {false};
+    for (size_t j = 0; CONFIG[j] != NULL; ++j)
+        was_used[CONFIG[j]->slot] = true;
+    for (size_t i = 0; config[i] != NULL; ++i) {
+        config[i]->slot = 0;
+        for (size_t j = 0; CONFIG[j] != NULL && config[i]->slot == 0; ++j) {
+            if (strcmp(config[i]->ip, CONFIG[j]->ip) == 0 && config[i]->port == CONFIG[j]->port && !taken[CONFIG[j]->slot])
+                config[i]->slot = CONFIG[j]->slot;
+        }
+        taken[config[i]->slot] = true;
+    }
+    for (size_t i = 0; config[i] != NULL; ++i) {
+        if (config[i]->slot != 0)
+            continue;
+        int slot = 1;
+        while (slot <= MAX_NUM_CLI && (taken[slot] || was_used[slot]))
+            ++slot;
+        if (slot > MAX_NUM_CLI)
+            for (slot = 1; taken[slot]; ++slot);
+        taken[slot] = true;
+        config[i]->slot = slot;
+        counters_clear(&HEALTH->nodes[slot], sizeof(NODE_HEALTH));
+        counters_clear(&STATS->nodes[slot], sizeof(NODE_METRICS));
+    }
 
-                            char cmd_prev_response[MAX_CMD_LEN+1 + MAX_BUF_SIZE+1];
-                            memset(cmd_prev_response, 0, MAX_CMD_LEN+1 + MAX_BUF_SIZE+1);
-                            strcpy(cmd_prev_response, cmds[cmd_idx]->cmd);
-                            strcpy(cmd_prev_response+strlen(cmds[cmd_idx]->cmd)+1, prev_input);
-                            size_t cmd_prev_response_len = strlen(cmds[cmd_idx]->cmd)+1 + strlen(prev_input)+1;
+    free_config(CONFIG);
+    CONFIG = config;
+    health_lock();
+    publish_config(CONFIG);
+    metric_add(&HEALTH->generation, 1);
+    pthread_mutex_unlock(&HEALTH->lock);
+    pthread_mutex_unlock(&config_lock);
 
-                            int nbytes = write(client_sock2, cmd_prev_response, cmd_prev_response_len);
-                            if (nbytes != cmd_prev_response_len)
-                                err_exit("Error in writing. Exiting...\n", client_sock2);
+    printf("Config reloaded: %zu nodes, fanout %d\n", config_len(config), FANOUT);
+}
 
-                            char tmp_response[MAX_BUF_SIZE+1];
-                            nbytes = read(client_sock2, tmp_response, MAX_BUF_SIZE+1);
-                            tmp_response[nbytes] = '\0';
+// Connects to every node at once every HEARTBEAT_MS and updates the health
+// table: a node is down after BREAKER_THRESHOLD misses in a row and up again
+// on the first heartbeat that reaches it. Also reloads the config on SIGHUP.
+void * heartbeat_thread(void * args) {
+    while (true) {
+        double round_start = now_ms();
+        if (RELOAD) {
+            RELOAD = 0;
+            reload_config();
+        }
 
-                            strcat(response_all, tmp_response);
+        // copy the addresses so that the connects don't hold the lock
+        char names[MAX_NUM_CLI][12];
+        int slots[MAX_NUM_CLI];
+        struct sockaddr_in addrs[MAX_NUM_CLI] = {0};
+        pthread_mutex_lock(&config_lock);
+        size_t n_nodes = config_len(CONFIG);
+        for (size_t i = 0; i < n_nodes; ++i) {
+            strcpy(names[i], CONFIG[i]->name);
+            slots[i] = CONFIG[i]->slot;
+            addrs[i].sin_family = AF_INET;
+            inet_aton(CONFIG[i]->ip, &addrs[i].sin_addr);
+            addrs[i].sin_port = htons(CONFIG[i]->port);
+        }
+        uint64_t generation = metric_get(&HEALTH->generation);
+        pthread_mutex_unlock(&config_lock);
+
+        struct pollfd fds[MAX_NUM_CLI];
+        bool reached[MAX_NUM_CLI] = {false};
+        size_t pending = 0;
+        for (size_t i = 0; i < n_nodes; ++i) {
+            fds[i].fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            fds[i].events = POLLOUT;
+            if (fds[i].fd >= 0 && connect(fds[i].fd, (struct sockaddr *) &addrs[i], sizeof(addrs[i])) == 0) {
+                reached[i] = true;
+                __atomic_store_n(&HEALTH->nodes[slots[i]].rtt_us, (uint64_t) ((now_ms() - round_start) * 1000), __ATOMIC_RELAXED);
+            }
+            else if (fds[i].fd >= 0 && errno == EINPROGRESS) {
+                ++pending;
+                continue;
+            }
+            if (fds[i].fd >= 0)
+                close(fds[i].fd);
+            fds[i].fd = -1; // poll skips it
+        }
 
-                            close(client_sock2);
+        double deadline = now_ms() + CONNECT_TIMEOUT_MS;
+        while (pending > 0 && now_ms() < deadline) {
+            if (poll(fds, n_nodes, deadline - now_ms() + 1) <= 0)
+                continue;
+            for (size_t i = 0; i < n_nodes; ++i) {
+                if (fds[i].fd < 0 || fds[i].revents == 0)
+                    continue;
+                int sock_err = 0;
+                socklen_t err_len = sizeof(sock_err);
+                getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &sock_err, &err_len);
+                reached[i] = (sock_err == 0);
+                if (reached[i])
+                    __atomic_store_n(&HEALTH->nodes[slots[i]].rtt_us, (uint64_t) ((now_ms() - round_start) * 1000), __ATOMIC_RELAXED);
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                --pending;
+            }
+        }
 
-                            ++tmp_config;
-                        }
+        for (size_t i = 0; i < n_nodes; ++i)
+            if (fds[i].fd >= 0)
+                close(fds[i].fd); // missed the deadline
+
+        // results of an old config are dropped
+        pthread_mutex_lock(&config_lock);
+        for (size_t i = 0; i < n_nodes && generation == metric_get(&HEALTH->generation); ++i) {
+            bool was_down = node_is_down(slots[i]);
+            if (reached[i]) {
+                __atomic_store_n(&HEALTH->nodes[slots[i]].failures, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&HEALTH->nodes[slots[i]].state, NODE_UP, __ATOMIC_RELAXED);
+            }
+            else
+                breaker_miss(slots[i]);
+            if (was_down != node_is_down(slots[i]))
+                printf("Node %s is %s\n", names[i], was_down ? "up" : "down");
+        }
+        pthread_mutex_unlock(&config_lock);
 
-                        strcpy(prev_input, response_all);
-                        prev_input_len = strlen(response_all) + 1;
+        double elapsed = now_ms() - round_start;
+        if (elapsed < HEARTBEAT_MS)
+            usleep((HEARTBEAT_MS - elapsed) * 1000);
+    }
 
-                    }
-                    else {
-                        // send to particular node
-                        int client_sock2;
-                        if (cmds[cmd_idx]->node == -1) {
-                            // self
-                            client_sock2 = client_init(inet_ntoa(client_addr.sin_addr), CLIENT_PORT);
-                        }
-                        else {
-                            // non-self node on cluster
-                            client_sock2 = client_init(config[cmds[cmd_idx]->node - 1]->ip, CLIENT_PORT);
-                        }
+    return NULL;
+}
 
-                        char cmd_prev_response[MAX_CMD_LEN+1 + MAX_BUF_SIZE+1];
-                        memset(cmd_prev_response, 0, MAX_CMD_LEN+1 + MAX_BUF_SIZE+1);
-                        strcpy(cmd_prev_response, cmds[cmd_idx]->cmd);
-                        strcpy(cmd_prev_response+strlen(cmds[cmd_idx]->cmd)+1, prev_input);
-                        size_t cmd_prev_response_len = strlen(cmds[cmd_idx]->cmd)+1 + strlen(prev_input)+1;
+void * request_thread(void * args) {
+    REQUEST * req = (REQUEST *) args;
+    SESSION * session = req->session;
 
-                        int nbytes = write(client_sock2, cmd_prev_response, cmd_prev_response_len);
-                        if (nbytes != cmd_prev_response_len)
-                            err_exit("Error in writing. Exiting...\n", client_sock2);
+    // pick up a reloaded config, the commands still running keep theirs
+    pthread_mutex_lock(&session->inflight_lock);
+    if (session->config->generation != metric_get(&HEALTH->generation)) {
+        release_config(session->config);
+        session->config = copy_config();
+    }
+    CONFIG_SNAPSHOT * snapshot = session->config;
+    ++snapshot->refs;
+    pthread_mutex_unlock(&session->inflight_lock);
+
+    size_t out_len;
+    double start = now_ms();
+    char * out = run_pipeline(session, snapshot, req->req_id, req->cmd, &out_len);
+    hist_observe(&STATS->command, now_ms() - start);
+
+    // the rest of the output, in chunks so that other requests interleave
+    for (size_t off = 0; off < out_len; off += MAX_FRAME_SIZE) {
+        size_t chunk = (out_len - off < MAX_FRAME_SIZE) ? out_len - off : MAX_FRAME_SIZE;
+        write_frame(session, FRAME_DATA, req->req_id, out + off, chunk);
+    }
+    write_frame(session, FRAME_END, req->req_id, NULL, 0);
 
-                        prev_input_len = read(client_sock2, prev_input, MAX_BUF_SIZE+1);
+    free(out);
+    free(req->cmd);
+    free(req);
 
-                        close(client_sock2);
+    metric_add(&STATS->active_commands, -1);
+    pthread_mutex_lock(&session->inflight_lock);
+    release_config(snapshot);
+    --session->n_inflight;
+    pthread_cond_broadcast(&session->inflight_cond);
+    pthread_mutex_unlock(&session->inflight_lock);
 
-                    }
+    return NULL;
+}
 
-                }
+// Serves one client. Every command runs on its own thread, up to
+// MAX_INFLIGHT at a time, so a long pipeline doesn't block the session.
+void handle_client(SESSION * session) {
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+
+    while (true) {
+        FRAME_HDR hdr;
+        // commands and hellos are small, a larger frame ends the session
+        char * payload = read_frame(session->client_sock, &hdr, MAX_CMD_LEN);
+        if (payload == NULL)
+            break; // client disconnected
+
+        if (hdr.type == FRAME_HELLO) {
+            session->self_port = atoi(payload);
+            if (session->self_port <= 0)
+                session->self_port = CLIENT_PORT;
+            free(payload);
+            continue;
+        }
+        if (hdr.type != FRAME_CMD) {
+            free(payload);
+            continue;
+        }
 
-                prev_input[prev_input_len++] = '\0';
+        printf("'%s:%d' sent [%u] '%s'\n", session->client_ip, session->client_port, hdr.req_id, payload);
 
-                // write back to connected client
-                write(client_sock, prev_input, prev_input_len);
-                // printf("'%s' sent back to '%s:%d'\n", prev_input, inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-            }
+        pthread_mutex_lock(&session->inflight_lock);
+        if (session->n_inflight == MAX_INFLIGHT)
+            metric_add(&STATS->inflight_waits, 1);
+        while (session->n_inflight == MAX_INFLIGHT)
+            pthread_cond_wait(&session->inflight_cond, &session->inflight_lock);
+        ++session->n_inflight;
+        pthread_mutex_unlock(&session->inflight_lock);
+
+        metric_add(&STATS->commands, 1);
+        metric_add(&STATS->active_commands, 1);
+        metric_max(&STATS->peak_commands, metric_get(&STATS->active_commands));
+
+        REQUEST * req = malloc(sizeof(REQUEST));
+        req->session = session;
+        req->req_id = hdr.req_id;
+        req->cmd = payload;
+
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, &thread_attr, request_thread, req) != 0)
+            err_exit("Error in pthread_create. Exiting...\n", session->client_sock);
+    }
+
+    // let the in-flight requests finish before the handler exits
+    pthread_mutex_lock(&session->inflight_lock);
+    while (session->n_inflight > 0)
+        pthread_cond_wait(&session->inflight_cond, &session->inflight_lock);
+    pthread_mutex_unlock(&session->inflight_lock);
+
+    pthread_attr_destroy(&thread_attr);
+}
+
+int main(int argc, char * argv[]) {
+    // optional arguments: config file, server port and metrics scrape port
+    const char * config_file = (argc > 1) ? argv[1] : CONFIG_FILE;
+    int server_port = (argc > 2) ? atoi(argv[2]) : SERVER_PORT;
+    int scrape_port = (argc > 3) ? atoi(argv[3]) : 0;
+
+    int serv_sock = server_init(server_port);
+
+    struct sockaddr_in client_addr;
+    int client_sock, client_len = client_len = sizeof(client_addr);
+
+    CONFIG_PATH = config_file;
+    CONFIG = read_config(config_file);
+    if (CONFIG == NULL)
+        err_exit("Error opening config. Exiting...\n", -1);
+
+    // client handlers are never waited for
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGHUP reloads the config
+    struct sigaction reload_action = {0};
+    reload_action.sa_handler = reload_handler;
+    reload_action.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &reload_action, NULL);
+
+    metrics_init();
+    publish_config(CONFIG);
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, heartbeat_thread, NULL) != 0)
+        err_exit("Error in pthread_create. Exiting...\n", -1);
+    pthread_detach(thread_id);
+    if (scrape_port > 0) {
+        if (pthread_create(&thread_id, NULL, scrape_thread, &scrape_port) != 0)
+            err_exit("Error in pthread_create. Exiting...\n", -1);
+        pthread_detach(thread_id);
+    }
+
+    printf("Server started at port '%d'\n", server_port);
+    if (FANOUT > 0)
+        printf("Broadcasts use tree dispatch with fanout %d\n", FANOUT);
+
+    while (true) {
+        client_sock = accept(serv_sock, (struct sockaddr *) &client_addr, &client_len);
+        if (client_sock < 0)
+            err_exit("Error in accept. Exiting...\n", client_sock);
+
+        printf("Client Connected: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+        metric_add(&STATS->sessions, 1);
+        metric_add(&STATS->active_sessions, 1);
+
+        pid_t client_handler = fork();
+        if (client_handler < 0)
+            err_exit("Error in fork. Exiting...\n", -1);
+        else if (client_handler == 0) {
+            // close serv_sock to stop accepting connections
+            close(serv_sock);
+
+            // frames are written whole, don't let Nagle delay the END frame
+            int nodelay = 1;
+            setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+            SESSION session = {0};
+            session.client_sock = client_sock;
+            strcpy(session.client_ip, inet_ntoa(client_addr.sin_addr));
+            session.client_port = ntohs(client_addr.sin_port);
+            session.self_port = CLIENT_PORT;
+            snprintf(session.session_id, MAX_SESSION_LEN, "%s:%d:%d", session.client_ip, session.client_port, getpid());
+            // from the shared table, which goes with its generation even if a
+            // reload came after the fork
+            session.config = copy_config();
+            pthread_mutex_init(&session.write_lock, NULL);
+            pthread_mutex_init(&session.inflight_lock, NULL);
+            pthread_cond_init(&session.inflight_cond, NULL);
+            pthread_mutex_init(&session.stats_lock, NULL);
+            session.compress = true;
+            session.splice = true;
+
+            handle_client(&session);
+            metric_add(&STATS->active_sessions, -1);
 
             close(client_sock);
+            exit(EXIT_SUCCESS);
         }
 
         close(client_sock);
     }
 
-    free_config(config);
+    free_config(CONFIG);
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
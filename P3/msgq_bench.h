@@ -0,0 +1,65 @@
+#ifndef MSGQ_BENCH_H
+#define MSGQ_BENCH_H
+
+// What the benchmarks of the server have in common. The server is compiled
+// in, its main() renamed msgq_server_main(), so a bench calls its functions
+// directly or runs it on a thread of its own. A bench user is a queue drained
+// by a thread until its SHUTDOWN_MSG.
+#define main msgq_server_main
+#include "msgq_server.c"
+#undef main
+
+#include <ftw.h>
+
+typedef struct _BENCH_USER {
+    char name[MAX_NAME_LEN];
+    int id;
+    pthread_t tid;
+} BENCH_USER;
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Empties the queue of a user until its SHUTDOWN_MSG
+void * drain_thread(void * args) {
+    BENCH_USER * user = (BENCH_USER *) args;
+    size_t cap = WIRE_BUF_SIZE;
+    WIRE_MSG * wire = malloc(cap);
+    while (true) {
+        ssize_t size = recv_wire(user->id, &wire, &cap, 0);
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size < 0 || wire->type == SHUTDOWN_MSG)
+            break;
+    }
+    free(wire);
+    return NULL;
+}
+
+// For nftw(), to remove the history directory of a bench
+int remove_entry(const char * path, const struct stat * st, int flag, struct FTW * ftw) {
+    return remove(path);
+}
+
+void start_user(BENCH_USER * user, const char * name) {
+    strcpy(user->name, name);
+    user->id = get_queue_id(name);
+    pthread_create(&user->tid, NULL, drain_thread, user);
+}
+
+// Stops the drain thread and removes the queue
+void stop_user(BENCH_USER * user) {
+    MSG msg = {0};
+    msg.type = SHUTDOWN_MSG;
+    WIRE_MSG * wire = pack_msg(&msg);
+    if (send_wire(user->id, wire, 0) < 0)
+        perror("Error in msgsnd...\n");
+    free(wire);
+    pthread_join(user->tid, NULL);
+    msgctl(user->id, IPC_RMID, NULL);
+}
+
+#endif
@@ -1,13 +1,20 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/select.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <pthread.h>
+#include "msgq_ring.h"
+#include "msgq_partition.h"
 
 #define MAX_CMD_LEN 50
 #define MAX_NAME_LEN 30
@@ -15,6 +22,11 @@
 #define MAX_NUM_GROUPS 64
 #define MAX_OLD_MSG 128
 #define MAX_MSG_SIZE 2048
+#define WIRE_BUF_SIZE 256   // initial receive buffer, grown for larger messages
+#define PRIO_CONTROL 1      // mtype of requests and replies other than chat
+#define PRIO_CHAT 2         // of private and group messages
+#define PRIO_REPLAY 3       // of the history replayed to a user joining a group
+#define HEARTBEAT_SEC 60    // between two heartbeats, well within the server's presence TTL
 
 typedef enum _MSG_TYPE {
     PRIVATE_MSG,
@@ -22,7 +34,12 @@ typedef enum _MSG_TYPE {
     CREATE_GROUP_MSG,
     LIST_GROUP_MSG,
     JOIN_GROUP_MSG,
-    AUTO_DELETE_MSG
+    AUTO_DELETE_MSG,
+    SHUTDOWN_MSG,   // sent by a client to its own queue to stop its receive thread
+    STATS_MSG,
+    HEARTBEAT_MSG,  // tells the server the client is still there
+    SEARCH_MSG,
+    DIRECTORY_MSG   // the group names and what changes in them, kept in 'dir_names'
 } MSG_TYPE;
 
 typedef struct _MSG {
@@ -33,26 +50,198 @@ typedef struct _MSG {
     char group[MAX_NAME_LEN];
     time_t time;
     time_t delete_time;
+    size_t body_len;
 } MSG;
 
+// A MSG as sent on the queues: a fixed header followed by the sender,
+// receiver, group and body, each of its own length and without '\0'
+typedef struct _WIRE_MSG {
+    long mtype;                 // the priority class, received lowest first
+    uint8_t type;
+    uint8_t sender_len;
+    uint8_t receiver_len;
+    uint8_t group_len;
+    uint16_t body_len;
+    int64_t time;
+    int64_t delete_time;
+    char data[];
+} WIRE_MSG;
+
+// Output waiting for the print thread
+typedef struct _PRINT_ITEM {
+    char* text;
+    struct _PRINT_ITEM* next;
+} PRINT_ITEM;
+
 int msg_id;
+int msg_id_client;
 char* user_name;
-pthread_mutex_t lock;
+
+// with '-t shm' messages go through the shared memory transport and
+// arrive on 'ring', else on the SysV queues; 'ring_epoch' is the epoch of the
+// ring when it was claimed
+SHM shm;
+SHM_RING* ring = NULL;
+uint32_t ring_epoch;
+bool rcv_stop = false;
+
+// both threads print through the queue, 'print_lock' is only held to link an item
+PRINT_ITEM* print_head = NULL;
+PRINT_ITEM* print_tail = NULL;
+bool print_done = false;
+pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t print_cond = PTHREAD_COND_INITIALIZER;
+
+// set by the receive thread once the reply to 'stats' or 'search' is printed
 int is_rcvd_mssg = 0;
+pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t list_cond = PTHREAD_COND_INITIALIZER;
+
+// The names of all the groups, sorted, kept by the receive thread from a
+// snapshot of the server and the deltas after it, so 'list' asks nothing.
+// 'dir_synced' is false while a snapshot is on its way.
+char (*dir_names)[MAX_NAME_LEN] = NULL;
+size_t n_dir_names = 0;
+size_t dir_names_cap = 0;
+long dir_epoch = 0;
+unsigned long long dir_version = 0;
+bool dir_synced = false;
+pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dir_cond = PTHREAD_COND_INITIALIZER;
+
+
+void print_out(const char* fmt, ...) {
+    PRINT_ITEM* item = malloc(sizeof(PRINT_ITEM));
+    va_list args;
+    va_start(args, fmt);
+    if(vasprintf(&item -> text, fmt, args) < 0) {
+        va_end(args);
+        free(item);
+        return;
+    }
+    va_end(args);
+    item -> next = NULL;
+
+    pthread_mutex_lock(&print_lock);
+    if(print_tail == NULL)
+        print_head = item;
+    else
+        print_tail -> next = item;
+    print_tail = item;
+    pthread_cond_signal(&print_cond);
+    pthread_mutex_unlock(&print_lock);
+}
 
+// Writes out the print queue until 'print_done' is set and the queue is empty
+void* print_mssg() {
+    while(true) {
+        pthread_mutex_lock(&print_lock);
+        while(print_head == NULL && !print_done)
+            pthread_cond_wait(&print_cond, &print_lock);
+        PRINT_ITEM* item = print_head;
+        print_head = print_tail = NULL;
+        pthread_mutex_unlock(&print_lock);
+
+        if(item == NULL)
+            break;
+        while(item != NULL) {
+            fputs(item -> text, stdout);
+            PRINT_ITEM* next = item -> next;
+            free(item -> text);
+            free(item);
+            item = next;
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
 
 void prompt() {
-    printf("[%s] ", user_name);
-    fflush(stdout);
+    print_out("[%s] ", user_name);
 }
 
 void err_exit(const char *err_msg) {
     perror(err_msg);
 }
 
+size_t wire_size(const WIRE_MSG * wire) {
+    return offsetof(WIRE_MSG, data) + wire->sender_len + wire->receiver_len + wire->group_len + wire->body_len;
+}
+
+long msg_priority(int type) {
+    return (type == PRIVATE_MSG || type == GROUP_MSG || type == DIRECTORY_MSG) ? PRIO_CHAT : PRIO_CONTROL;
+}
+
+// Returns a malloc'd WIRE_MSG of exactly wire_size() bytes
+WIRE_MSG * pack_msg(const MSG * msg) {
+    size_t lens[4] = {strlen(msg->sender), strlen(msg->receiver), strlen(msg->group), msg->body_len};
+    const char * fields[4] = {msg->sender, msg->receiver, msg->group, msg->body};
+
+    WIRE_MSG * wire = malloc(offsetof(WIRE_MSG, data) + lens[0] + lens[1] + lens[2] + lens[3]);
+    wire->mtype = msg_priority(msg->type);
+    wire->type = msg->type;
+    wire->sender_len = lens[0];
+    wire->receiver_len = lens[1];
+    wire->group_len = lens[2];
+    wire->body_len = lens[3];
+    wire->time = msg->time;
+    wire->delete_time = msg->delete_time;
+
+    char * p = wire->data;
+    for (size_t i = 0; i < 4; ++i) {
+        memcpy(p, fields[i], lens[i]);
+        p += lens[i];
+    }
+    return wire;
+}
+
+// Fills 'msg' from a received 'wire' of 'size' bytes. Returns false if it is malformed.
+bool unpack_msg(const WIRE_MSG * wire, size_t size, MSG * msg) {
+    if (size < offsetof(WIRE_MSG, data) || size != wire_size(wire) || wire->sender_len >= MAX_NAME_LEN ||
+            wire->receiver_len >= MAX_NAME_LEN || wire->group_len >= MAX_NAME_LEN || wire->body_len >= MAX_MSG_SIZE)
+        return false;
+
+    size_t lens[4] = {wire->sender_len, wire->receiver_len, wire->group_len, wire->body_len};
+    char * fields[4] = {msg->sender, msg->receiver, msg->group, msg->body};
+    const char * p = wire->data;
+    for (size_t i = 0; i < 4; ++i) {
+        memcpy(fields[i], p, lens[i]);
+        fields[i][lens[i]] = '\0';
+        p += lens[i];
+    }
+    msg->type = wire->type;
+    msg->body_len = wire->body_len;
+    msg->time = wire->time;
+    msg->delete_time = wire->delete_time;
+    return true;
+}
+
+// Receives the next message into '*buf', grown as needed, of the lowest
+// priority class waiting: control first, then chat, then replayed history.
+// Returns its size, mtype included, or -1 on error.
+ssize_t recv_wire(int id, WIRE_MSG ** buf, size_t * cap, int flags) {
+    while (true) {
+        ssize_t nbytes = msgrcv(id, *buf, *cap - sizeof(long), -PRIO_REPLAY, flags);
+        if (nbytes >= 0)
+            return nbytes + sizeof(long);
+        if (errno != E2BIG)
+            return -1;
+        *cap *= 2;
+        *buf = realloc(*buf, *cap);
+    }
+}
+
+// Only the used part of 'msg' goes on the queue
 void send_mssg(MSG* msg) {
-    if(msgsnd(msg_id, msg, sizeof(MSG), 0) < 0)
+    msg -> body_len = strlen(msg -> body);
+    WIRE_MSG* wire = pack_msg(msg);
+    if(ring != NULL) {
+        if(!shm_send(&shm, wire, wire_size(wire)))
+            err_exit("Error sending message to server. Exiting...");
+    }
+    else if(msgsnd(msg_id, wire, wire_size(wire) - sizeof(long), 0) < 0)
         err_exit("Error sending message to server. Exiting...");
+    free(wire);
 }
 
 unsigned long hash(unsigned char *str)
@@ -66,115 +255,339 @@ unsigned long hash(unsigned char *str)
     return hash;
 }
 
-void* rcv_mssg() {
-    
-    MSG* msg = malloc(sizeof(MSG));
+// Asks the server for the group names. With 'is_forced' or without a copy it
+// sends a snapshot, else only if the copy is of an earlier run of the server.
+void request_directory(bool is_forced) {
+    MSG* msg = calloc(1, sizeof(MSG));
+    msg -> type = DIRECTORY_MSG;
+    strcpy(msg -> sender, user_name);
+    pthread_mutex_lock(&dir_lock);
+    if(!is_forced && dir_synced)
+        snprintf(msg -> body, MAX_MSG_SIZE, "%ld", dir_epoch);
+    pthread_mutex_unlock(&dir_lock);
+    send_mssg(msg);
+    free(msg);
+}
 
-    // key_t key_client = ftok(user_name, 'z');
-    key_t key_client = hash(strdup(user_name));
-    int msg_id_client = msgget(key_client, 0644 | IPC_CREAT);
+// Tells the server every HEARTBEAT_SEC that the client is there, so it keeps
+// the client queue, and that it keeps the group names, so a server started
+// again sends them. The first one goes out at once, for what was spooled.
+void* heartbeat() {
+    MSG* msg = calloc(1, sizeof(MSG));
+    msg -> type = HEARTBEAT_MSG;
+    strcpy(msg -> sender, user_name);
+    while(true) {
+        send_mssg(msg);
+        request_directory(false);
+        sleep(HEARTBEAT_SEC);
+    }
+    free(msg);
+    return NULL;
+}
 
-    if(msg_id < 0) {
-        err_exit("Error while creating message queue. Exiting...");
+int compare_names(const void* a, const void* b) {
+    return strcmp((const char*) a, (const char*) b);
+}
+
+// Adds 'name' to the sorted 'dir_names' unless it is there, under 'dir_lock'
+void dir_add(const char* name) {
+    size_t lo = 0, hi = n_dir_names;
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(strcmp(dir_names[mid], name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo < n_dir_names && strcmp(dir_names[lo], name) == 0)
+        return;
+    if(n_dir_names == dir_names_cap) {
+        dir_names_cap = (dir_names_cap == 0) ? MAX_NUM_GROUPS : dir_names_cap * 2;
+        dir_names = realloc(dir_names, dir_names_cap * sizeof(*dir_names));
+    }
+    memmove(dir_names[lo + 1], dir_names[lo], (n_dir_names - lo) * sizeof(*dir_names));
+    strncpy(dir_names[lo], name, MAX_NAME_LEN - 1);
+    dir_names[lo][MAX_NAME_LEN - 1] = '\0';
+    ++n_dir_names;
+}
+
+// Removes 'name' from 'dir_names', under 'dir_lock'
+void dir_remove(const char* name) {
+    char* found = bsearch(name, dir_names, n_dir_names, sizeof(*dir_names), compare_names);
+    if(found == NULL)
+        return;
+    size_t i = (found - dir_names[0]) / sizeof(*dir_names);
+    memmove(dir_names[i], dir_names[i + 1], (n_dir_names - i - 1) * sizeof(*dir_names));
+    --n_dir_names;
+}
+
+// Applies a DIRECTORY_MSG: a page of a snapshot, first line "page <epoch>
+// <version>" or "last ..." for the last page, or a delta, "delta <epoch>
+// <version>" then '+' or '-' and a group name per line. A delta that doesn't
+// follow the copy asks for a new snapshot, the pages of which come in order.
+void update_directory(char* body) {
+    char kind[8];
+    long epoch;
+    unsigned long long version;
+    char* line = strchr(body, '\n');
+    if(line == NULL || sscanf(body, "%7s %ld %llu", kind, &epoch, &version) != 3)
+        return;
+    bool is_snapshot = strcmp(kind, "page") == 0 || strcmp(kind, "last") == 0;
+    bool is_stale = false;
+
+    pthread_mutex_lock(&dir_lock);
+    if(is_snapshot && (dir_synced || epoch != dir_epoch || version != dir_version)) {
+        // the first page
+        n_dir_names = 0;
+        dir_synced = false;
+        dir_epoch = epoch;
+        dir_version = version;
+    }
+    else if(!is_snapshot && (!dir_synced || (epoch == dir_epoch && version <= dir_version))) {
+        // before a snapshot on its way, or already in the copy
+        pthread_mutex_unlock(&dir_lock);
+        return;
+    }
+    else if(!is_snapshot && (epoch != dir_epoch || version != dir_version + 1)) {
+        dir_synced = false;
+        is_stale = true;
     }
 
+    char* saved_ptr;
+    for(char* name = strtok_r(line + 1, "\n", &saved_ptr); name != NULL && !is_stale; name = strtok_r(NULL, "\n", &saved_ptr)) {
+        if(!is_snapshot && name[0] == '-')
+            dir_remove(name + 1);
+        else
+            dir_add(is_snapshot ? name : name + 1);
+    }
+    if(!is_snapshot && !is_stale)
+        dir_version = version;
+    if(strcmp(kind, "last") == 0) {
+        dir_synced = true;
+        pthread_cond_broadcast(&dir_cond);
+    }
+    pthread_mutex_unlock(&dir_lock);
+
+    if(is_stale)
+        request_directory(true);
+}
+
+// The server removed the queue of the client, and its ring, the client having
+// been gone a while. The queue is created again, the server told the client
+// is there and the group names are sent again.
+void rejoin() {
+    msg_id_client = msgget(hash((unsigned char*) user_name), 0644 | IPC_CREAT);
+    MSG* beat = calloc(1, sizeof(MSG));
+    beat -> type = HEARTBEAT_MSG;
+    strcpy(beat -> sender, user_name);
+    send_mssg(beat);
+    free(beat);
+    request_directory(true);
+}
+
+// Blocks in msgrcv until a message arrives, without holding any lock.
+// Stops on the SHUTDOWN_MSG the main thread sends to the client queue. It is
+// sent as PRIO_CONTROL, so it is taken ahead of the chat and replay messages
+// still queued, which wait for the next run. The queue stays for them and for
+// the messages sent while the client is offline, until the server removes it
+// once the client has been gone a while. If that happens under a client that
+// was only suspended, the queue is created again.
+// On the shared memory transport it waits on the ring instead and stops once
+// 'rcv_stop' is set and the ring is empty; a ring released by the server is
+// claimed again, the same way.
+void* rcv_mssg() {
+    
+    MSG* msg = malloc(sizeof(MSG));
+    size_t cap = WIRE_BUF_SIZE;
+    WIRE_MSG* wire = malloc(cap);
+
     while(true) {
-        pthread_mutex_lock(&lock);
+        if(ring != NULL) {
+            uint32_t idx;
+            if(!shm_ring_wait(ring, ring_epoch, &idx, &rcv_stop)) {
+                if(__atomic_load_n(&rcv_stop, __ATOMIC_ACQUIRE))
+                    break;
+                SHM_RING* claimed = shm_ring_find(&shm, user_name, true);
+                if(claimed == NULL) {
+                    fprintf(stderr, "Error: no ring left on the shared memory transport. Exiting...\n");
+                    _exit(EXIT_FAILURE);
+                }
+                ring_epoch = __atomic_load_n(&claimed -> epoch, __ATOMIC_ACQUIRE);
+                __atomic_store_n(&ring, claimed, __ATOMIC_RELEASE);
+                rejoin();
+                continue;
+            }
+            SHM_SLOT* slot = shm_slot(&shm, idx);
+            bool is_valid = unpack_msg((WIRE_MSG*) slot -> data, slot -> len, msg);
+            shm_slot_release(&shm, idx);
+            if(!is_valid)
+                continue;
+        }
+        else {
+            ssize_t size = recv_wire(msg_id_client, &wire, &cap, 0);
+            if(size < 0) {
+                if(errno == EINTR)
+                    continue;
+                if(errno == EIDRM || errno == EINVAL) {
+                    rejoin();
+                    if(msg_id_client >= 0)
+                        continue;
+                }
+                err_exit("Error receiving message. Exiting...");
+                break;
+            }
+            if(!unpack_msg(wire, size, msg))
+                continue;
+        }
 
-        if(msgrcv(msg_id_client, msg, sizeof(MSG), 0, IPC_NOWAIT) < 0) {
-            //unlock and sleep
-            pthread_mutex_unlock(&lock);
-            sleep(0.2);
-            continue;
+        if(msg -> type == SHUTDOWN_MSG) {
+            break;
         }
-        if(msg -> type == GROUP_MSG) {
-            printf("\n[group][%s][%s] %s\n", msg -> group, msg -> sender, msg -> body);
+        else if(msg -> type == GROUP_MSG) {
+            print_out("\n[group][%s][%s] %s\n", msg -> group, msg -> sender, msg -> body);
         }
         else if(msg -> type == PRIVATE_MSG) {
-            printf("\n[pvt][%s] %s\n", msg -> sender, msg -> body);
+            print_out("\n[pvt][%s] %s\n", msg -> sender, msg -> body);
+        }
+        else if(msg -> type == DIRECTORY_MSG) {
+            update_directory(msg -> body);
+            continue;
         }
-        else if(msg -> type == LIST_GROUP_MSG) {
-            printf("***************\n");
-            printf("Available groups to join\n");
-            printf("%s\n", msg -> body);
-            printf("***************\n");
+        else if(msg -> type == STATS_MSG || msg -> type == SEARCH_MSG) {
+            if(msg -> type == SEARCH_MSG)
+                print_out("***************\nSearch in %s: %s***************\n", msg -> group, msg -> body);
+            else
+                print_out("***************\nServer spool\n%s***************\n", msg -> body);
+            pthread_mutex_lock(&list_lock);
             is_rcvd_mssg = 1;
+            pthread_cond_signal(&list_cond);
+            pthread_mutex_unlock(&list_lock);
+            continue;
         }
         prompt();
-
-        pthread_mutex_unlock(&lock);
     }
-    msgctl(msg_id_client, IPC_RMID, 0);
+
+    free(msg);
+    free(wire);
+    return NULL;
 }
 
 void create_group(char* group_name) {
-    MSG* msg = malloc(sizeof(MSG));
+    MSG* msg = calloc(1, sizeof(MSG));
     msg -> type = CREATE_GROUP_MSG;
     strcpy(msg -> sender, user_name);
     strcpy(msg -> group, group_name);
     send_mssg(msg);
-    pthread_mutex_unlock(&lock);
+    free(msg);
 }
 
 void join_group(char *group_name) {
-    MSG* msg = malloc(sizeof(MSG));
+    MSG* msg = calloc(1, sizeof(MSG));
     msg -> type = JOIN_GROUP_MSG;
     strcpy(msg -> sender, user_name);
     strcpy(msg -> group, group_name);
     send_mssg(msg);
-    pthread_mutex_unlock(&lock);
+    free(msg);
 }
 
+// Prints the group names from the client's copy, waiting only for the first snapshot
 void list_groups() {
-    MSG* msg = malloc(sizeof(MSG));
-    msg -> type = LIST_GROUP_MSG;
+    pthread_mutex_lock(&dir_lock);
+    while(!dir_synced)
+        pthread_cond_wait(&dir_cond, &dir_lock);
+    char* names = malloc(n_dir_names * MAX_NAME_LEN + 1);
+    size_t len = 0;
+    for(size_t i = 0; i < n_dir_names; ++i)
+        len += sprintf(names + len, "%s\n", dir_names[i]);
+    names[len] = '\0';
+    pthread_mutex_unlock(&dir_lock);
+
+    print_out("***************\nAvailable groups to join\n%s\n***************\n", names);
+    free(names);
+}
+
+// Asks for the server's spool statistics, answered like 'list'
+void server_stats() {
+    MSG* msg = calloc(1, sizeof(MSG));
+    msg -> type = STATS_MSG;
     strcpy(msg -> sender, user_name);
     send_mssg(msg);
-    pthread_mutex_unlock(&lock);
-    while(!is_rcvd_mssg) {
-        sleep(0.2);
-    }
+    free(msg);
+
+    pthread_mutex_lock(&list_lock);
+    while(!is_rcvd_mssg)
+        pthread_cond_wait(&list_cond, &list_lock);
     is_rcvd_mssg = 0;
+    pthread_mutex_unlock(&list_lock);
+}
+
+// Asks for the newest messages of a group with all of 'terms', answered like 'list'
+void search_group(char* group_name, char* terms) {
+    MSG* msg = calloc(1, sizeof(MSG));
+    msg -> type = SEARCH_MSG;
+    strcpy(msg -> sender, user_name);
+    strcpy(msg -> group, group_name);
+    strncpy(msg -> body, terms, MAX_MSG_SIZE - 1);
+    send_mssg(msg);
+    free(msg);
+
+    pthread_mutex_lock(&list_lock);
+    while(!is_rcvd_mssg)
+        pthread_cond_wait(&list_cond, &list_lock);
+    is_rcvd_mssg = 0;
+    pthread_mutex_unlock(&list_lock);
 }
 
 void send_group_mssg(char* group_name, char* mssg) {
-    MSG* msg = malloc(sizeof(MSG));
+    MSG* msg = calloc(1, sizeof(MSG));
     msg -> type = GROUP_MSG;
     strcpy(msg -> sender, user_name);
     strcpy(msg -> body, mssg);
     strcpy(msg -> group, group_name);
     send_mssg(msg);
-    pthread_mutex_unlock(&lock);
+    free(msg);
 }
 
 void send_priv_mssg(char* rcvr_name, char* mssg) {
-    MSG* msg = malloc(sizeof(MSG));
+    MSG* msg = calloc(1, sizeof(MSG));
     msg -> type = PRIVATE_MSG;
     strcpy(msg -> sender, user_name);
     strcpy(msg -> receiver, rcvr_name);
     strcpy(msg -> body, mssg);
     send_mssg(msg);
-    pthread_mutex_unlock(&lock);
+    free(msg);
 }
 
 void set_auto_delete(char* group_name, int time_sec) {
-    MSG* msg = malloc(sizeof(MSG));
+    MSG* msg = calloc(1, sizeof(MSG));
     msg -> type = AUTO_DELETE_MSG;
     strcpy(msg -> sender, user_name);
     strcpy(msg -> group, group_name);
     msg -> delete_time = time_sec;
     send_mssg(msg);
-    pthread_mutex_unlock(&lock);
+    free(msg);
 }
 
-int main() {
-
-    // key_t key = ftok("server", 'z');
-    key_t key = hash("server");
-    msg_id = msgget(key, 0666 | IPC_CREAT);
-
-    if(msg_id < 0) {
-        err_exit("Error while creating message queue. Exiting...");
+int main(int argc, char* argv[]) {
+
+    // '-t sysv|shm' picks the transport, the SysV queues by default;
+    // '-n servers' the size of the federation the server is one of
+    bool use_shm = false;
+    long n_servers = 1;
+    int opt;
+    while((opt = getopt(argc, argv, "t:n:")) != -1) {
+        if(opt == 't' && strcmp(optarg, "shm") == 0)
+            use_shm = true;
+        else if(opt == 'n' && atol(optarg) >= 1 && atol(optarg) <= PARTITION_MAX)
+            n_servers = atol(optarg);
+        else if(opt != 't' || strcmp(optarg, "sysv") != 0) {
+            fprintf(stderr, "Usage: %s [-t sysv|shm] [-n servers]\n", argv[0]);
+            _exit(EXIT_FAILURE);
+        }
+    }
+    if(use_shm && n_servers > 1) {
+        fprintf(stderr, "Error: a federation is served on the SysV queues only. Exiting...\n");
+        _exit(EXIT_FAILURE);
     }
 
     user_name = malloc(sizeof(char) * MAX_NAME_LEN);
@@ -183,31 +596,66 @@ int main() {
     size_t alias_len = getline(&user_name, &max_name_len, stdin);
     user_name[alias_len - 1] = '\0';
 
-    if(strcmp(user_name, "server") == 0) {
+    if(strcmp(user_name, "server") == 0 || strncmp(user_name, "server.", 7) == 0) {
         err_exit("Error: Username cannot be \"server\". Exiting...\n");
         _exit(EXIT_SUCCESS);
     }
 
-    if (pthread_mutex_init(&lock, NULL) != 0) {
-        err_exit("\n Error Mutex init. Exiting...\n");
+    // the home server of the user, the one owning it
+    PARTITION * servers = malloc(sizeof(PARTITION));
+    partition_init(servers, n_servers);
+    char server_name[MAX_NAME_LEN];
+    partition_queue_name(n_servers, partition_of(servers, user_name), server_name, sizeof(server_name));
+    free(servers);
+
+    // key_t key = ftok("server", 'z');
+    key_t key = hash(server_name);
+    msg_id = msgget(key, 0666 | IPC_CREAT);
+
+    if(msg_id < 0) {
+        err_exit("Error while creating message queue. Exiting...");
     }
-    
+
+    // key_t key_client = ftok(user_name, 'z');
+    key_t key_client = hash(user_name);
+    msg_id_client = msgget(key_client, 0644 | IPC_CREAT);
+
+    if(msg_id_client < 0) {
+        err_exit("Error while creating message queue. Exiting...");
+        _exit(EXIT_FAILURE);
+    }
+
+    if(use_shm) {
+        if(!shm_attach(&shm, false) || (ring = shm_ring_find(&shm, user_name, true)) == NULL) {
+            err_exit("Error attaching to the shared memory transport. Exiting...");
+            _exit(EXIT_FAILURE);
+        }
+        ring_epoch = __atomic_load_n(&ring -> epoch, __ATOMIC_ACQUIRE);
+    }
+
+    pthread_t print_thread_id;
+    pthread_create(&print_thread_id, NULL, print_mssg, NULL);
     pthread_t thread_id;
     pthread_create(&thread_id, NULL, rcv_mssg, NULL);
+    pthread_t heartbeat_id;
+    pthread_create(&heartbeat_id, NULL, heartbeat, NULL);
+    pthread_detach(heartbeat_id);
     
+    char * cmd = malloc(sizeof(char) * (MAX_CMD_LEN + 1));
+    size_t max_cmd_len = MAX_CMD_LEN;
     while(true) {
 
         bool is_error = false;
         
         prompt();
 
-        char * cmd = malloc(sizeof(char) * (MAX_CMD_LEN + 1));
-        size_t max_cmd_len = MAX_CMD_LEN;
-        size_t cmd_len = getline(&cmd, &max_cmd_len, stdin);
+        ssize_t cmd_len = getline(&cmd, &max_cmd_len, stdin);
+        if(cmd_len < 0)
+            break; // end of input, exit
         if(cmd_len == 0 || cmd[0] == '\n')
             continue;
-        pthread_mutex_lock(&lock);
-        cmd[cmd_len - 1] = '\0';
+        if(cmd[cmd_len - 1] == '\n')
+            cmd[cmd_len - 1] = '\0';
         cmd_len = strlen(cmd);
 
         char * tmp_cmd = strdup(cmd);
@@ -232,6 +680,21 @@ int main() {
             //list groups
             list_groups();
         }
+        else if(strcmp(token, "stats") == 0) {
+            //spool statistics of the server
+            server_stats();
+        }
+        else if(strcmp(token, "search") == 0) {
+            //search <group> <terms>
+            token = strtok_r(NULL, " ", &saved_ptr);
+            if(token == NULL) 
+                is_error = true;
+            char *terms = saved_ptr;
+            if(terms == NULL || *terms == '\0') 
+                is_error = true;
+            if(!is_error)
+                search_group(token, terms);
+        }
         else if(strcmp(token, "send") == 0) {
             //send -p (private) -g (group)
             token = strtok_r(NULL, " ", &saved_ptr);
@@ -287,8 +750,31 @@ int main() {
             //invalid command
             err_exit("Error: invalid command. Exiting...");
         }
+        free(tmp_cmd);
 
     }
+
+    // wake the receive thread, then let the print thread drain its queue
+    if(ring != NULL) {
+        __atomic_store_n(&rcv_stop, true, __ATOMIC_RELEASE);
+        doorbell_force(&ring -> bell);
+    }
+    else {
+        MSG* msg = calloc(1, sizeof(MSG));
+        msg -> type = SHUTDOWN_MSG;
+        strcpy(msg -> sender, user_name);
+        WIRE_MSG* wire = pack_msg(msg);
+        if(msgsnd(msg_id_client, wire, wire_size(wire) - sizeof(long), 0) < 0)
+            err_exit("Error in msgsnd...");
+        free(wire);
+        free(msg);
+    }
     pthread_join(thread_id, NULL);
+
+    pthread_mutex_lock(&print_lock);
+    print_done = true;
+    pthread_cond_signal(&print_cond);
+    pthread_mutex_unlock(&print_lock);
+    pthread_join(print_thread_id, NULL);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,114 @@
+// Microbenchmark of the group directory of the server: the cost of joining a
+// group and of sending a group message as the number of groups grows. The
+// server is compiled in, its functions are called directly from the main
+// thread, standing in for the threads of all the shards, and the members'
+// queues are drained by a thread each. Messages go to groups of two members,
+// the owner and one more, and the joins of each round to groups of their own,
+// so only the size of the directory changes from round to round. The groups'
+// history is written to a temporary directory.
+#include "msgq_bench.h"
+
+#define BENCH_USERS 16      // members joining groups, per round
+#define BENCH_OPS 20000     // joins and sends timed per round
+
+int main(int argc, char * argv[]) {
+    size_t max_groups = 50000;
+    if (argc > 1)
+        max_groups = atol(argv[1]);
+
+    // the groups' history goes to a directory of its own, removed at the end
+    char history_path[] = "/tmp/msgq_bench_XXXXXX";
+    if (mkdtemp(history_path) == NULL) {
+        perror("Error in mkdtemp...\n");
+        return EXIT_FAILURE;
+    }
+    HISTORY_PATH = history_path;
+    directory_init();
+    load_spools();
+    pthread_t spooler;
+    pthread_create(&spooler, NULL, spooler_thread, NULL);
+    pthread_detach(spooler);
+
+    BENCH_USER owner;
+    start_user(&owner, "bench_owner");
+
+    printf("%-10s %-10s %-12s %-10s %-12s %-10s\n", "groups", "joins", "join (us)", "sends", "send (us)", "spooled");
+
+    // 100, 1000, ... groups up to 'max_groups'
+    size_t counts[16], n_counts = 0;
+    for (size_t count = 100; count < max_groups && n_counts < 15; count *= 10)
+        counts[n_counts++] = count;
+    counts[n_counts++] = max_groups;
+
+    // members stay in their groups, so their queues are drained until the end;
+    // users[0] are the second members of the groups messages are sent to
+    BENCH_USER (* users)[BENCH_USERS] = malloc((n_counts + 1) * sizeof(*users));
+    char name[MAX_NAME_LEN];
+    for (size_t i = 0; i < BENCH_USERS; ++i) {
+        snprintf(name, sizeof(name), "bench_m%zu", i);
+        start_user(&users[0][i], name);
+    }
+
+    size_t n_groups = 0;
+    for (size_t round = 1; round <= n_counts; ++round) {
+        for (; n_groups < counts[round - 1]; ++n_groups) {
+            snprintf(name, sizeof(name), "bench_g%zu", n_groups);
+            create_group(name, owner.name);
+            join_group(name, users[0][n_groups % BENCH_USERS].name);
+        }
+
+        // fresh members and groups each round, every member joins every group once
+        for (size_t i = 0; i < BENCH_USERS; ++i) {
+            snprintf(name, sizeof(name), "bench_r%zu_u%zu", round, i);
+            start_user(&users[round][i], name);
+        }
+        size_t n_joins = BENCH_OPS;
+        for (size_t j = 0; j < n_joins / BENCH_USERS; ++j) {
+            snprintf(name, sizeof(name), "bench_r%zu_j%zu", round, j);
+            create_group(name, owner.name);
+        }
+
+        double start = now_us();
+        for (size_t j = 0; j < n_joins; ++j) {
+            snprintf(name, sizeof(name), "bench_r%zu_j%zu", round, j / BENCH_USERS);
+            join_group(name, users[round][j % BENCH_USERS].name);
+        }
+        double join_us = (now_us() - start) / n_joins;
+
+        // scattered over the groups, twice: the first message to a group
+        // starts its history log, the second pass is timed
+        size_t n_sends = BENCH_OPS;
+        MSG msg = {0};
+        msg.type = GROUP_MSG;
+        strcpy(msg.sender, owner.name);
+        strcpy(msg.body, "hello");
+        msg.body_len = strlen(msg.body);
+        double send_us = 0;
+        for (size_t pass = 0; pass < 2; ++pass) {
+            start = now_us();
+            for (size_t j = 0; j < n_sends; ++j) {
+                snprintf(msg.group, sizeof(msg.group), "bench_g%zu", j * 7919 % n_groups);
+                WIRE_MSG * wire = pack_msg(&msg);
+                send_group_msg(&msg, wire);
+                free(wire);
+            }
+            send_us = (now_us() - start) / n_sends;
+        }
+
+        printf("%-10zu %-10zu %-12.3f %-10zu %-12.3f %-10zu\n", count_groups(), n_joins, join_us, n_sends, send_us,
+            __atomic_load_n(&SPOOL_TOTALS.spooled, __ATOMIC_RELAXED));
+    }
+
+    // what found a full queue is delivered before the queues go
+    while (__atomic_load_n(&SPOOL_TOTALS.mem_msgs, __ATOMIC_RELAXED) > 0 ||
+            __atomic_load_n(&SPOOL_TOTALS.disk_msgs, __ATOMIC_RELAXED) > 0)
+        usleep(SPOOL_RETRY_MS * 1000);
+
+    for (size_t round = 0; round <= n_counts; ++round)
+        for (size_t i = 0; i < BENCH_USERS; ++i)
+            stop_user(&users[round][i]);
+    free(users);
+    stop_user(&owner);
+    nftw(history_path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return EXIT_SUCCESS;
+}
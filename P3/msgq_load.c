@@ -0,0 +1,646 @@
+// Load generator for the chat server. Starts SERVER_BIN with a history
+// directory of its own and M synthetic clients, each a member of a few of
+// the groups, sending group and private messages at a steady rate for a
+// while. Every message carries the time it was due to be sent, so the
+// latency of its deliveries includes any wait for a full queue, and a server
+// that can't keep up shows as latency growing over the run. Reports the
+// messages sent and delivered per second, latency percentiles, how often a
+// client found the server queue full, the CPU time of the server and its
+// spool statistics. With '-n servers' it starts a federation of that many
+// servers instead, each client sending to the server owning it, and reports
+// their CPU time summed and the statistics of each.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <pthread.h>
+#include "msgq_ring.h"
+#include "msgq_partition.h"
+
+#define MAX_NAME_LEN 30
+#define MAX_MSG_SIZE 2048
+#define WIRE_BUF_SIZE 256
+#define PRIO_CONTROL 1      // mtype of requests and replies other than chat
+#define PRIO_CHAT 2         // of private and group messages
+#define PRIO_REPLAY 3       // of the history replayed to a user joining a group
+#define SERVER_BIN "./msgq_server.o"
+#define MAX_SENDERS 8       // threads sending for the clients
+#define HIST_SUB_BITS 5     // latency buckets per power of two, as a shift
+#define HIST_SIZE (64 << HIST_SUB_BITS)
+#define DRAIN_MS 2000       // after sending, for the last deliveries
+
+typedef enum _MSG_TYPE {
+    PRIVATE_MSG,
+    GROUP_MSG,
+    CREATE_GROUP_MSG,
+    LIST_GROUP_MSG,
+    JOIN_GROUP_MSG,
+    AUTO_DELETE_MSG,
+    SHUTDOWN_MSG,
+    STATS_MSG
+} MSG_TYPE;
+
+typedef struct _MSG {
+    MSG_TYPE type;
+    char sender[MAX_NAME_LEN];
+    char receiver[MAX_NAME_LEN];
+    char body[MAX_MSG_SIZE];
+    char group[MAX_NAME_LEN];
+    time_t time;
+    time_t delete_time;
+    size_t body_len;
+} MSG;
+
+// See msgq_server.c
+typedef struct _WIRE_MSG {
+    long mtype;                 // the priority class, received lowest first
+    uint8_t type;
+    uint8_t sender_len;
+    uint8_t receiver_len;
+    uint8_t group_len;
+    uint16_t body_len;
+    int64_t time;
+    int64_t delete_time;
+    char data[];
+} WIRE_MSG;
+
+typedef struct _LOAD_CLIENT {
+    char name[MAX_NAME_LEN];
+    int id;                 // the client queue
+    int server_id;          // the queue of the server owning it
+    SHM_RING * ring;
+    uint32_t ring_epoch;    // of the ring when claimed
+    size_t * groups;        // indexes of the groups it is a member of
+    uint64_t next_ns;       // when the next message is due
+    unsigned int seed;
+    uint64_t sent;
+    uint64_t full;          // sends that found the server queue full
+    uint64_t delivered;     // received once measuring started
+    uint64_t hist[HIST_SIZE];   // latency of those, in ns
+    bool stop;
+    pthread_t tid;
+    pthread_mutex_t reply_lock; // for the reply to 'stats' or 'list'
+    pthread_cond_t reply_cond;
+    char * reply;
+} LOAD_CLIENT;
+
+typedef struct _LOAD_CONFIG {
+    size_t n_clients;
+    size_t n_groups;
+    size_t groups_per_client;
+    double rate;            // messages per second per client
+    int private_pct;
+    size_t body_len;
+    double duration;
+    double warmup;
+    bool use_shm;
+    size_t n_servers;
+} LOAD_CONFIG;
+
+LOAD_CONFIG CONFIG = {50, 10, 3, 100, 20, 64, 10, 1, false, 1};
+LOAD_CLIENT * CLIENTS;
+SHM LOAD_SHM;
+PARTITION SERVERS;
+uint64_t MEASURE_NS;        // deliveries are counted from then on
+bool SENDING;
+
+
+void err_exit(const char * err_msg) {
+    perror(err_msg);
+    exit(EXIT_FAILURE);
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+size_t wire_size(const WIRE_MSG * wire) {
+    return offsetof(WIRE_MSG, data) + wire->sender_len + wire->receiver_len + wire->group_len + wire->body_len;
+}
+
+long msg_priority(int type) {
+    return (type == PRIVATE_MSG || type == GROUP_MSG) ? PRIO_CHAT : PRIO_CONTROL;
+}
+
+// Returns a malloc'd WIRE_MSG of exactly wire_size() bytes
+WIRE_MSG * pack_msg(const MSG * msg) {
+    size_t lens[4] = {strlen(msg->sender), strlen(msg->receiver), strlen(msg->group), msg->body_len};
+    const char * fields[4] = {msg->sender, msg->receiver, msg->group, msg->body};
+
+    WIRE_MSG * wire = malloc(offsetof(WIRE_MSG, data) + lens[0] + lens[1] + lens[2] + lens[3]);
+    wire->mtype = msg_priority(msg->type);
+    wire->type = msg->type;
+    wire->sender_len = lens[0];
+    wire->receiver_len = lens[1];
+    wire->group_len = lens[2];
+    wire->body_len = lens[3];
+    wire->time = msg->time;
+    wire->delete_time = msg->delete_time;
+
+    char * p = wire->data;
+    for (size_t i = 0; i < 4; ++i) {
+        memcpy(p, fields[i], lens[i]);
+        p += lens[i];
+    }
+    return wire;
+}
+
+// Fills 'msg' from a received 'wire' of 'size' bytes. Returns false if it is malformed.
+bool unpack_msg(const WIRE_MSG * wire, size_t size, MSG * msg) {
+    if (size < offsetof(WIRE_MSG, data) || size != wire_size(wire) || wire->sender_len >= MAX_NAME_LEN ||
+            wire->receiver_len >= MAX_NAME_LEN || wire->group_len >= MAX_NAME_LEN || wire->body_len >= MAX_MSG_SIZE)
+        return false;
+
+    size_t lens[4] = {wire->sender_len, wire->receiver_len, wire->group_len, wire->body_len};
+    char * fields[4] = {msg->sender, msg->receiver, msg->group, msg->body};
+    const char * p = wire->data;
+    for (size_t i = 0; i < 4; ++i) {
+        memcpy(fields[i], p, lens[i]);
+        fields[i][lens[i]] = '\0';
+        p += lens[i];
+    }
+    msg->type = wire->type;
+    msg->body_len = wire->body_len;
+    msg->time = wire->time;
+    msg->delete_time = wire->delete_time;
+    return true;
+}
+
+// Receives the next message into '*buf', grown as needed, of the lowest
+// priority class waiting: control first, then chat, then replayed history.
+// Returns its size, mtype included, or -1 on error.
+ssize_t recv_wire(int id, WIRE_MSG ** buf, size_t * cap, int flags) {
+    while (true) {
+        ssize_t nbytes = msgrcv(id, *buf, *cap - sizeof(long), -PRIO_REPLAY, flags);
+        if (nbytes >= 0)
+            return nbytes + sizeof(long);
+        if (errno != E2BIG)
+            return -1;
+        *cap *= 2;
+        *buf = realloc(*buf, *cap);
+    }
+}
+
+unsigned long hash(unsigned char * str) {
+    unsigned long hash = 5381;
+    int c;
+    while ((c = *str++))
+        hash = ((hash << 5) + hash) + c;
+    return hash;
+}
+
+int get_queue_id(const char * username) {
+    return msgget(hash((unsigned char *) username), IPC_CREAT | 0666);
+}
+
+// Log-linear buckets: exact below 2^(HIST_SUB_BITS + 1) ns, then
+// 2^HIST_SUB_BITS buckets per power of two, within about 3%
+size_t hist_bucket(uint64_t ns) {
+    if (ns < (2 << HIST_SUB_BITS))
+        return ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (ns >> shift) - (1 << HIST_SUB_BITS);
+}
+
+uint64_t hist_value(size_t bucket) {
+    if (bucket < (2 << HIST_SUB_BITS))
+        return bucket;
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    return ((bucket & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS)) << shift;
+}
+
+// The smallest latency that 'pct' percent of the deliveries don't exceed
+uint64_t percentile(const uint64_t * hist, uint64_t total, double pct) {
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t) (total * pct / 100.0), seen = 0;
+    for (size_t i = 0; i < HIST_SIZE; ++i) {
+        seen += hist[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+    return hist_value(HIST_SIZE - 1);
+}
+
+// Sends 'msg' from 'client', waiting if the server queue or inbox is full
+void load_send(LOAD_CLIENT * client, MSG * msg) {
+    strcpy(msg->sender, client->name);
+    WIRE_MSG * wire = pack_msg(msg);
+    if (CONFIG.use_shm) {
+        if (shm_queue_count(LOAD_SHM.inbox) > LOAD_SHM.inbox->mask || shm_queue_count(LOAD_SHM.free) == 0)
+            ++client->full;
+        if (!shm_send(&LOAD_SHM, wire, wire_size(wire)))
+            err_exit("Error in shm_send. Exiting...\n");
+    }
+    else if (msgsnd(client->server_id, wire, wire_size(wire) - sizeof(long), IPC_NOWAIT) < 0) {
+        if (errno != EAGAIN)
+            err_exit("Error in msgsnd. Exiting...\n");
+        ++client->full;
+        while (msgsnd(client->server_id, wire, wire_size(wire) - sizeof(long), 0) < 0) {
+            if (errno != EINTR)
+                err_exit("Error in msgsnd. Exiting...\n");
+        }
+    }
+    free(wire);
+}
+
+// Receives for one client until stopped, recording the latency of the
+// messages sent by the load generator
+void * receive_thread(void * args) {
+    LOAD_CLIENT * client = (LOAD_CLIENT *) args;
+    size_t cap = WIRE_BUF_SIZE;
+    WIRE_MSG * wire = malloc(cap);
+    MSG * msg = malloc(sizeof(MSG));
+
+    while (true) {
+        bool is_valid;
+        if (CONFIG.use_shm) {
+            uint32_t idx;
+            if (!shm_ring_wait(client->ring, client->ring_epoch, &idx, &client->stop))
+                break;
+            SHM_SLOT * slot = shm_slot(&LOAD_SHM, idx);
+            is_valid = unpack_msg((WIRE_MSG *) slot->data, slot->len, msg);
+            shm_slot_release(&LOAD_SHM, idx);
+        }
+        else {
+            ssize_t size = recv_wire(client->id, &wire, &cap, 0);
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size < 0)
+                break;
+            is_valid = unpack_msg(wire, size, msg);
+            if (is_valid && msg->type == SHUTDOWN_MSG)
+                break;
+        }
+        if (!is_valid)
+            continue;
+
+        if (msg->type == STATS_MSG || msg->type == LIST_GROUP_MSG) {
+            pthread_mutex_lock(&client->reply_lock);
+            client->reply = strdup(msg->body);
+            pthread_cond_signal(&client->reply_cond);
+            pthread_mutex_unlock(&client->reply_lock);
+            continue;
+        }
+        uint64_t due = strtoull(msg->body, NULL, 10);
+        uint64_t now = now_ns();
+        if ((msg->type != GROUP_MSG && msg->type != PRIVATE_MSG) || now < MEASURE_NS)
+            continue;
+        size_t bucket = hist_bucket(now > due ? now - due : 0);
+        ++client->hist[bucket < HIST_SIZE ? bucket : HIST_SIZE - 1];
+        ++client->delivered;
+    }
+    free(msg);
+    free(wire);
+    return NULL;
+}
+
+void stop_receiving(LOAD_CLIENT * client) {
+    if (CONFIG.use_shm) {
+        __atomic_store_n(&client->stop, true, __ATOMIC_RELEASE);
+        doorbell_force(&client->ring->bell);
+    }
+    else {
+        MSG msg = {0};
+        msg.type = SHUTDOWN_MSG;
+        WIRE_MSG * wire = pack_msg(&msg);
+        if (msgsnd(client->id, wire, wire_size(wire) - sizeof(long), 0) < 0)
+            perror("Error in msgsnd...\n");
+        free(wire);
+    }
+    pthread_join(client->tid, NULL);
+}
+
+// Sends for the clients 'first', 'first' + MAX_SENDERS, ... each at its own
+// steady rate, a group message to one of its groups or a private message to
+// another client. A client that falls behind catches up at once.
+void * send_thread(void * args) {
+    size_t first = (size_t) args;
+    uint64_t interval = 1e9 / CONFIG.rate;
+    MSG * msg = calloc(1, sizeof(MSG));
+    memset(msg->body, 'x', CONFIG.body_len);
+
+    while (__atomic_load_n(&SENDING, __ATOMIC_ACQUIRE)) {
+        LOAD_CLIENT * next = NULL;
+        for (size_t i = first; i < CONFIG.n_clients; i += MAX_SENDERS)
+            if (next == NULL || CLIENTS[i].next_ns < next->next_ns)
+                next = &CLIENTS[i];
+        if (next == NULL)
+            break;
+
+        uint64_t now = now_ns();
+        if (next->next_ns > now) {
+            struct timespec ts = {next->next_ns / 1000000000ULL, next->next_ns % 1000000000ULL};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+
+        msg->group[0] = msg->receiver[0] = '\0';
+        if (rand_r(&next->seed) % 100 < CONFIG.private_pct) {
+            msg->type = PRIVATE_MSG;
+            strcpy(msg->receiver, CLIENTS[rand_r(&next->seed) % CONFIG.n_clients].name);
+        }
+        else {
+            msg->type = GROUP_MSG;
+            size_t g = next->groups[rand_r(&next->seed) % CONFIG.groups_per_client];
+            snprintf(msg->group, MAX_NAME_LEN, "load_g%zu", g);
+        }
+        // the time it was due, padded to the body length by the x's after it
+        int len = snprintf(msg->body, CONFIG.body_len + 1, "%llu", (unsigned long long) next->next_ns);
+        if (len < CONFIG.body_len)
+            msg->body[len] = ' ';
+        msg->body_len = CONFIG.body_len;
+
+        load_send(next, msg);
+        ++next->sent;
+        next->next_ns += interval;
+    }
+    free(msg);
+    return NULL;
+}
+
+// CPU time of a process, user and system, in seconds
+double cpu_seconds(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE * fp = fopen(path, "r");
+    if (fp == NULL)
+        return 0;
+    unsigned long utime = 0, stime = 0;
+    // the command name is in parentheses and may hold spaces
+    if (fscanf(fp, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        utime = stime = 0;
+    fclose(fp);
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+int remove_entry(const char * path, const struct stat * st, int flag, struct FTW * ftw) {
+    return remove(path);
+}
+
+// Starts server 'index' of the federation, a lone server if there is none
+pid_t start_server(char * history_path, size_t index) {
+    pid_t pid = fork();
+    if (pid < 0)
+        err_exit("Error in fork. Exiting...\n");
+    else if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, 1);
+        close(null_fd);
+        char n_arg[16], i_arg[16];
+        snprintf(n_arg, sizeof(n_arg), "%zu", CONFIG.n_servers);
+        snprintf(i_arg, sizeof(i_arg), "%zu", index);
+        char * argv[] = {SERVER_BIN, "-n", n_arg, "-i", i_arg, history_path, NULL};
+        execv(argv[0], argv);
+        err_exit("Error in exec. Exiting...\n");
+    }
+    return pid;
+}
+
+// Asks server 'index' for its statistics or its list of groups, by 'type',
+// through the first client it owns. Returns NULL if it owns none or doesn't reply.
+char * server_request(size_t index, MSG_TYPE type) {
+    LOAD_CLIENT * client = NULL;
+    for (size_t i = 0; i < CONFIG.n_clients && client == NULL; ++i)
+        if (partition_of(&SERVERS, CLIENTS[i].name) == index)
+            client = &CLIENTS[i];
+    if (client == NULL)
+        return NULL;
+    MSG * msg = calloc(1, sizeof(MSG));
+    msg->type = type;
+    load_send(client, msg);
+    free(msg);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 5;
+    pthread_mutex_lock(&client->reply_lock);
+    while (client->reply == NULL && pthread_cond_timedwait(&client->reply_cond, &client->reply_lock, &deadline) == 0);
+    char * reply = client->reply;
+    client->reply = NULL;
+    pthread_mutex_unlock(&client->reply_lock);
+    return reply;
+}
+
+// Waits for every server to list all the groups, or as many as a list holds.
+// A server lists a group of another once the owner created it, so a join sent
+// after that through any server reaches the owner after the create.
+void wait_for_groups() {
+    for (size_t s = 0; s < CONFIG.n_servers; ++s) {
+        for (int retries = 0; retries < 100; ++retries) {
+            char * list = server_request(s, LIST_GROUP_MSG);
+            size_t n_listed = 0;
+            for (char * c = list; c != NULL && *c != '\0'; ++c)
+                n_listed += *c == '\n';
+            bool is_full = list != NULL && strlen(list) + MAX_NAME_LEN >= MAX_MSG_SIZE;
+            free(list);
+            if (n_listed >= CONFIG.n_groups || is_full)
+                break;
+            usleep(10000);
+        }
+    }
+}
+
+int main(int argc, char * argv[]) {
+    // -c <clients>, -g <groups>, -j <groups joined per client>,
+    // -r <messages per second per client>, -p <percent private>,
+    // -b <body bytes>, -d <seconds measured>, -w <seconds of warm-up>,
+    // -t sysv|shm, -n <servers of a federation>
+    int opt;
+    bool is_valid = true;
+    while ((opt = getopt(argc, argv, "c:g:j:r:p:b:d:w:t:n:")) != -1) {
+        switch (opt) {
+            case 'c': CONFIG.n_clients = atoi(optarg); break;
+            case 'g': CONFIG.n_groups = atoi(optarg); break;
+            case 'j': CONFIG.groups_per_client = atoi(optarg); break;
+            case 'r': CONFIG.rate = atof(optarg); break;
+            case 'p': CONFIG.private_pct = atoi(optarg); break;
+            case 'b': CONFIG.body_len = atoi(optarg); break;
+            case 'd': CONFIG.duration = atof(optarg); break;
+            case 'w': CONFIG.warmup = atof(optarg); break;
+            case 't':
+                CONFIG.use_shm = strcmp(optarg, "shm") == 0;
+                is_valid = is_valid && (CONFIG.use_shm || strcmp(optarg, "sysv") == 0);
+                break;
+            case 'n': CONFIG.n_servers = atoi(optarg); break;
+            default:
+                is_valid = false;
+        }
+    }
+    if (!is_valid || CONFIG.n_clients < 1 || CONFIG.n_groups < 1 || CONFIG.groups_per_client < 1 ||
+            CONFIG.groups_per_client > CONFIG.n_groups || CONFIG.rate <= 0 || CONFIG.private_pct < 0 ||
+            CONFIG.private_pct > 100 || CONFIG.body_len < 24 || CONFIG.body_len >= MAX_MSG_SIZE || CONFIG.duration <= 0 ||
+            CONFIG.n_servers < 1 || CONFIG.n_servers > PARTITION_MAX || (CONFIG.use_shm && CONFIG.n_servers > 1)) {
+        fprintf(stderr, "Usage: %s [-c clients] [-g groups] [-j groups per client] [-r msgs/s per client] "
+            "[-p percent private] [-b body bytes (24-2047)] [-d seconds] [-w warm-up seconds] [-t sysv|shm] "
+            "[-n servers (1-%d, sysv only)]\n", argv[0], PARTITION_MAX);
+        return EXIT_FAILURE;
+    }
+
+    // each server has a history directory of its own
+    partition_init(&SERVERS, CONFIG.n_servers);
+    char history_paths[PARTITION_MAX][32];
+    pid_t server_pids[PARTITION_MAX];
+    for (size_t s = 0; s < CONFIG.n_servers; ++s) {
+        strcpy(history_paths[s], "/tmp/msgq_load_XXXXXX");
+        if (mkdtemp(history_paths[s]) == NULL)
+            err_exit("Error in mkdtemp. Exiting...\n");
+        server_pids[s] = start_server(history_paths[s], s);
+    }
+    if (CONFIG.use_shm) {
+        // the server creates the shared memory, or recovers it, as it starts
+        usleep(200000);
+        for (int retries = 0; !shm_attach(&LOAD_SHM, false); ++retries) {
+            if (retries == 100)
+                err_exit("Shared memory transport not available. Exiting...\n");
+            usleep(10000);
+        }
+    }
+
+    // clients, each a member of 'groups_per_client' groups in a row from a
+    // random one, the groups created by the first clients
+    CLIENTS = calloc(CONFIG.n_clients, sizeof(LOAD_CLIENT));
+    for (size_t i = 0; i < CONFIG.n_clients; ++i) {
+        LOAD_CLIENT * client = &CLIENTS[i];
+        snprintf(client->name, MAX_NAME_LEN, "load_c%zu", i);
+        client->id = get_queue_id(client->name);
+        char server_name[MAX_NAME_LEN];
+        partition_queue_name(CONFIG.n_servers, partition_of(&SERVERS, client->name), server_name, sizeof(server_name));
+        if ((client->server_id = get_queue_id(server_name)) < 0)
+            err_exit("Error in msgget. Exiting...\n");
+        client->seed = i + 1;
+        pthread_mutex_init(&client->reply_lock, NULL);
+        pthread_cond_init(&client->reply_cond, NULL);
+        if (CONFIG.use_shm && (client->ring = shm_ring_find(&LOAD_SHM, client->name, true)) == NULL)
+            err_exit("No ring left for the clients. Exiting...\n");
+        if (CONFIG.use_shm)
+            client->ring_epoch = client->ring->epoch;
+        pthread_create(&client->tid, NULL, receive_thread, client);
+
+        client->groups = malloc(CONFIG.groups_per_client * sizeof(size_t));
+        size_t start = rand_r(&client->seed) % CONFIG.n_groups;
+        for (size_t k = 0; k < CONFIG.groups_per_client; ++k)
+            client->groups[k] = (start + k) % CONFIG.n_groups;
+    }
+
+    MSG * msg = calloc(1, sizeof(MSG));
+    for (size_t g = 0; g < CONFIG.n_groups; ++g) {
+        msg->type = CREATE_GROUP_MSG;
+        snprintf(msg->group, MAX_NAME_LEN, "load_g%zu", g);
+        load_send(&CLIENTS[g % CONFIG.n_clients], msg);
+    }
+    // the joins of a group reach the thread of its shard after its create
+    wait_for_groups();
+    for (size_t i = 0; i < CONFIG.n_clients; ++i) {
+        for (size_t k = 0; k < CONFIG.groups_per_client; ++k) {
+            msg->type = JOIN_GROUP_MSG;
+            snprintf(msg->group, MAX_NAME_LEN, "load_g%zu", CLIENTS[i].groups[k]);
+            load_send(&CLIENTS[i], msg);
+        }
+    }
+    for (size_t s = 0; s < CONFIG.n_servers; ++s)
+        free(server_request(s, STATS_MSG));
+    free(msg);
+
+    printf("%zu clients, %zu groups (%zu per client), %.0f msgs/s per client, %d%% private, %zu byte bodies, %s",
+        CONFIG.n_clients, CONFIG.n_groups, CONFIG.groups_per_client, CONFIG.rate, CONFIG.private_pct,
+        CONFIG.body_len, CONFIG.use_shm ? "shared memory" : "SysV queues");
+    if (CONFIG.n_servers > 1)
+        printf(", %zu servers", CONFIG.n_servers);
+    printf("\n");
+
+    uint64_t start = now_ns();
+    MEASURE_NS = start + CONFIG.warmup * 1e9;
+    for (size_t i = 0; i < CONFIG.n_clients; ++i)
+        CLIENTS[i].next_ns = start + (uint64_t) (1e9 / CONFIG.rate) * i / CONFIG.n_clients;
+    SENDING = true;
+    size_t n_senders = (CONFIG.n_clients < MAX_SENDERS) ? CONFIG.n_clients : MAX_SENDERS;
+    pthread_t senders[MAX_SENDERS];
+    for (size_t i = 0; i < n_senders; ++i)
+        pthread_create(&senders[i], NULL, send_thread, (void *) i);
+
+    // counters at the start of the measured part
+    usleep(CONFIG.warmup * 1e6);
+    double cpu_start = 0;
+    for (size_t s = 0; s < CONFIG.n_servers; ++s)
+        cpu_start += cpu_seconds(server_pids[s]);
+    uint64_t sent_start = 0, full_start = 0;
+    for (size_t i = 0; i < CONFIG.n_clients; ++i) {
+        sent_start += __atomic_load_n(&CLIENTS[i].sent, __ATOMIC_RELAXED);
+        full_start += __atomic_load_n(&CLIENTS[i].full, __ATOMIC_RELAXED);
+    }
+    uint64_t measure_start = now_ns();
+
+    usleep(CONFIG.duration * 1e6);
+    __atomic_store_n(&SENDING, false, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < n_senders; ++i)
+        pthread_join(senders[i], NULL);
+    double measured = (now_ns() - measure_start) / 1e9;
+    double cpu = -cpu_start;
+    for (size_t s = 0; s < CONFIG.n_servers; ++s)
+        cpu += cpu_seconds(server_pids[s]);
+
+    // what is still on its way is delivered late, and counted
+    usleep(DRAIN_MS * 1000);
+    char * stats[PARTITION_MAX];
+    for (size_t s = 0; s < CONFIG.n_servers; ++s)
+        stats[s] = server_request(s, STATS_MSG);
+
+    uint64_t sent = 0, full = 0, delivered = 0;
+    uint64_t * hist = calloc(HIST_SIZE, sizeof(uint64_t));
+    for (size_t i = 0; i < CONFIG.n_clients; ++i) {
+        stop_receiving(&CLIENTS[i]);
+        sent += CLIENTS[i].sent;
+        full += CLIENTS[i].full;
+        delivered += CLIENTS[i].delivered;
+        for (size_t b = 0; b < HIST_SIZE; ++b)
+            hist[b] += CLIENTS[i].hist[b];
+        msgctl(CLIENTS[i].id, IPC_RMID, NULL);
+    }
+    sent -= sent_start;
+    full -= full_start;
+
+    printf("%-12s %10llu msgs %12.0f /s\n", "sent", (unsigned long long) sent, sent / measured);
+    printf("%-12s %10llu msgs %12.0f /s\n", "delivered", (unsigned long long) delivered, delivered / measured);
+    printf("%-12s %10s %10s %10s %10s %10s\n", "latency (us)", "p50", "p90", "p99", "p99.9", "max");
+    size_t max_bucket = 0;
+    for (size_t b = 0; b < HIST_SIZE; ++b)
+        if (hist[b] > 0)
+            max_bucket = b;
+    printf("%-12s %10.1f %10.1f %10.1f %10.1f %10.1f\n", "",
+        percentile(hist, delivered, 50) / 1e3, percentile(hist, delivered, 90) / 1e3,
+        percentile(hist, delivered, 99) / 1e3, percentile(hist, delivered, 99.9) / 1e3, hist_value(max_bucket) / 1e3);
+    printf("%-12s %10llu sends waited\n", "queue full", (unsigned long long) full);
+    printf("%-12s %10.1f%% of a core\n", "server cpu", 100 * cpu / measured);
+    for (size_t s = 0; s < CONFIG.n_servers; ++s) {
+        if (CONFIG.n_servers > 1)
+            printf("server %zu:\n", s);
+        if (stats[s] != NULL)
+            printf("%s", stats[s]);
+        free(stats[s]);
+    }
+    free(hist);
+
+    for (size_t s = 0; s < CONFIG.n_servers; ++s) {
+        kill(server_pids[s], SIGTERM);
+        waitpid(server_pids[s], NULL, 0);
+        nftw(history_paths[s], remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,84 @@
+#ifndef MSGQ_PARTITION_H
+#define MSGQ_PARTITION_H
+
+// Consistent hashing of user and group names over the servers of a
+// federation, shared by the server, the client and the load generator so
+// they agree on who owns what. Every server has PARTITION_VNODES points on a
+// ring of 64-bit hashes, and a name belongs to the server of the first point
+// at or after its own hash. Adding a server moves only the names between its
+// points and the ones before them.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define PARTITION_MAX 16        // servers in a federation
+#define PARTITION_VNODES 64     // points of each server on the ring
+
+typedef struct _PARTITION {
+    size_t n_servers;
+    size_t n_points;
+    uint64_t point[PARTITION_MAX * PARTITION_VNODES];   // ascending
+    uint8_t server[PARTITION_MAX * PARTITION_VNODES];   // owning each point
+} PARTITION;
+
+// The hash of get_queue_id(), mixed: names alike differ in its low bits only
+static uint64_t partition_hash(const char * name) {
+    uint64_t h = 5381;
+    int c;
+    while ((c = (unsigned char) *name++))
+        h = ((h << 5) + h) + c;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// The name of the server queue of server 'index', "server" for a lone one
+static void partition_queue_name(size_t n_servers, size_t index, char * name, size_t size) {
+    if (n_servers <= 1)
+        snprintf(name, size, "server");
+    else
+        snprintf(name, size, "server.%zu", index);
+}
+
+static void partition_init(PARTITION * p, size_t n_servers) {
+    p->n_servers = n_servers;
+    p->n_points = 0;
+    for (size_t s = 0; s < n_servers && s < PARTITION_MAX; ++s) {
+        for (size_t v = 0; v < PARTITION_VNODES; ++v) {
+            char key[64];
+            snprintf(key, sizeof(key), "server.%zu#%zu", s, v);
+            uint64_t h = partition_hash(key);
+            // insertion sort, the ring is built once
+            size_t i = p->n_points++;
+            while (i > 0 && p->point[i - 1] > h) {
+                p->point[i] = p->point[i - 1];
+                p->server[i] = p->server[i - 1];
+                --i;
+            }
+            p->point[i] = h;
+            p->server[i] = s;
+        }
+    }
+}
+
+// The server owning 'name', 0 without a federation
+static size_t partition_of(const PARTITION * p, const char * name) {
+    if (p->n_servers <= 1)
+        return 0;
+    uint64_t h = partition_hash(name);
+    size_t lo = 0, hi = p->n_points;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (p->point[mid] < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return p->server[(lo == p->n_points) ? 0 : lo];
+}
+
+#endif
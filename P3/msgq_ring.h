@@ -0,0 +1,431 @@
+#ifndef MSGQ_RING_H
+#define MSGQ_RING_H
+
+// Shared memory transport between the server and the clients.
+//
+// The server creates the POSIX shared memory object SHM_NAME, which holds a
+// slab of SHM_SLOTS fixed size slots, each a reference count, a length and a
+// message in its wire form. A message is written into a slot once and then
+// passed around by slot index: clients push the index on the server's inbox,
+// the server pushes it on the ring of every recipient, taking a reference
+// for each, and every reader drops its reference once it has read the
+// message. The last reference returns the slot to the free queue.
+//
+// Every client has a ring of its own, found by name, with a single producer
+// (the server, its pushes to one ring serialized by the user's spool lock) and
+// a single consumer (the client). The inbox and the free queue have many
+// producers and consumers and are bounded queues with a sequence per cell.
+// Readers sleep on a futex in shared memory, a DOORBELL, which producers ring
+// only when someone is waiting on it.
+//
+// Rings are claimed under 'rings_lock', a robust process shared mutex, and
+// are kept like the SysV queues, so messages wait in them while a client is
+// offline. Like the queues, the server releases the ring of a user gone for
+// longer than its presence TTL; a released ring is left marked, so lookups
+// of the names hashed before it go on past it, until a name claims it again.
+// A client that was only suspended sees the epoch of its ring change and
+// claims one again.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHM_NAME "/msgq_ring"
+#define SHM_MAGIC 0x4d5351524e473032ULL    // "MSQRNG02"
+#define SHM_SLOTS 16384             // messages in the slab, a power of two
+#define SHM_SLOT_SIZE 2176          // bytes of a message, the largest WIRE_MSG fits
+#define SHM_INBOX_SIZE 4096         // messages waiting for the server, a power of two
+#define SHM_RINGS 1024              // clients, a power of two
+#define SHM_RING_SIZE 256           // messages waiting for a client, a power of two
+#define SHM_OWNER_LEN 32
+
+typedef struct _DOORBELL {
+    uint32_t seq;               // the futex, bumped on every ring
+    uint32_t waiters;
+} DOORBELL;
+
+typedef struct _SHM_SLOT {
+    uint32_t refs;
+    uint32_t len;
+    char data[SHM_SLOT_SIZE];   // the WIRE_MSG, 8 byte aligned
+} SHM_SLOT;
+
+typedef struct _SHM_CELL {
+    uint64_t seq;
+    uint32_t value;
+} SHM_CELL;
+
+// Bounded queue of slot indexes for any number of producers and consumers
+typedef struct _SHM_QUEUE {
+    uint64_t enq __attribute__((aligned(64)));
+    uint64_t deq __attribute__((aligned(64)));
+    uint64_t mask;
+    SHM_CELL cells[];
+} SHM_QUEUE;
+
+typedef struct _SHM_RING {
+    char owner[SHM_OWNER_LEN];  // empty while the ring is free
+    bool released;              // free again, lookups go on past it
+    uint32_t epoch;             // bumped whenever the ring is released
+    uint32_t head __attribute__((aligned(64)));  // read by the client
+    uint32_t tail __attribute__((aligned(64)));  // written by the server
+    DOORBELL bell;
+    uint32_t idx[SHM_RING_SIZE] __attribute__((aligned(64)));
+} SHM_RING;
+
+typedef struct _SHM_HEADER {
+    uint64_t magic;
+    pthread_mutex_t rings_lock;
+    DOORBELL inbox_bell;        // the server waits for messages
+    DOORBELL inbox_room;        // clients wait for room in the inbox
+    DOORBELL free_bell;         // clients wait for a free slot
+    size_t free_off;
+    size_t inbox_off;
+    size_t rings_off;
+    size_t slots_off;
+    size_t size;
+} SHM_HEADER;
+
+// A mapping of the shared memory object
+typedef struct _SHM {
+    SHM_HEADER * hdr;
+    SHM_QUEUE * free;
+    SHM_QUEUE * inbox;
+    SHM_RING * rings;
+    SHM_SLOT * slots;
+} SHM;
+
+static inline int shm_futex(uint32_t * addr, int op, uint32_t val) {
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+// Wakes whoever waits on 'bell', if anyone does
+static inline void doorbell_ring(DOORBELL * bell) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bell->waiters, __ATOMIC_SEQ_CST) == 0)
+        return;
+    __atomic_add_fetch(&bell->seq, 1, __ATOMIC_SEQ_CST);
+    shm_futex(&bell->seq, FUTEX_WAKE, INT_MAX);
+}
+
+// Wakes the waiters of 'bell' whether or not they have anything to read
+static inline void doorbell_force(DOORBELL * bell) {
+    __atomic_add_fetch(&bell->seq, 1, __ATOMIC_SEQ_CST);
+    shm_futex(&bell->seq, FUTEX_WAKE, INT_MAX);
+}
+
+// Waiting is doorbell_prepare(), then checking for work once more, then
+// doorbell_wait() if there is none. A ring between the two makes the wait
+// return at once.
+static inline uint32_t doorbell_prepare(DOORBELL * bell) {
+    uint32_t seq = __atomic_load_n(&bell->seq, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&bell->waiters, 1, __ATOMIC_SEQ_CST);
+    return seq;
+}
+
+static inline void doorbell_wait(DOORBELL * bell, uint32_t seq, bool sleep) {
+    if (sleep)
+        shm_futex(&bell->seq, FUTEX_WAIT, seq);
+    __atomic_sub_fetch(&bell->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void shm_queue_init(SHM_QUEUE * q, size_t n) {
+    q->enq = q->deq = 0;
+    q->mask = n - 1;
+    for (size_t i = 0; i < n; ++i)
+        q->cells[i].seq = i;
+}
+
+// Slots pushed and not yet popped, those being pushed included
+static inline uint64_t shm_queue_count(SHM_QUEUE * q) {
+    return __atomic_load_n(&q->enq, __ATOMIC_SEQ_CST) - __atomic_load_n(&q->deq, __ATOMIC_SEQ_CST);
+}
+
+static inline bool shm_queue_push(SHM_QUEUE * q, uint32_t value) {
+    uint64_t pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+    SHM_CELL * cell;
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        int64_t diff = (int64_t) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (int64_t) pos;
+        if (diff == 0 && __atomic_compare_exchange_n(&q->enq, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        if (diff < 0)
+            return false;   // full
+        if (diff > 0)
+            pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+    }
+    cell->value = value;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static inline bool shm_queue_pop(SHM_QUEUE * q, uint32_t * value) {
+    uint64_t pos = __atomic_load_n(&q->deq, __ATOMIC_RELAXED);
+    SHM_CELL * cell;
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        int64_t diff = (int64_t) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (int64_t) (pos + 1);
+        if (diff == 0 && __atomic_compare_exchange_n(&q->deq, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        if (diff < 0)
+            return false;   // empty
+        if (diff > 0)
+            pos = __atomic_load_n(&q->deq, __ATOMIC_RELAXED);
+    }
+    *value = cell->value;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Only the server pushes, serialized per ring
+static inline bool shm_ring_push(SHM_RING * ring, uint32_t value) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == SHM_RING_SIZE)
+        return false;
+    ring->idx[tail & (SHM_RING_SIZE - 1)] = value;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    doorbell_ring(&ring->bell);
+    return true;
+}
+
+// The owner pops, and the server as it releases the ring
+static inline bool shm_ring_pop(SHM_RING * ring, uint32_t * value) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    do {
+        if (head == __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST))
+            return false;
+        *value = ring->idx[head & (SHM_RING_SIZE - 1)];
+    } while (!__atomic_compare_exchange_n(&ring->head, &head, head + 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return true;
+}
+
+static inline SHM_SLOT * shm_slot(SHM * shm, uint32_t idx) {
+    return &shm->slots[idx];
+}
+
+// The slot holding 'data', or -1 if it isn't in the slab
+static inline int64_t shm_slot_of(SHM * shm, const void * data) {
+    if (shm == NULL || (const char *) data < (const char *) shm->slots ||
+            (const char *) data >= (const char *) (shm->slots + SHM_SLOTS))
+        return -1;
+    return (SHM_SLOT *) ((const char *) data - offsetof(SHM_SLOT, data)) - shm->slots;
+}
+
+// Copies 'len' bytes into a free slot with one reference.
+// Returns its index, or -1 if the slab is full.
+static inline int64_t shm_slot_alloc(SHM * shm, const void * data, size_t len) {
+    uint32_t idx;
+    if (len > SHM_SLOT_SIZE || !shm_queue_pop(shm->free, &idx))
+        return -1;
+    SHM_SLOT * slot = shm_slot(shm, idx);
+    memcpy(slot->data, data, len);
+    slot->len = len;
+    __atomic_store_n(&slot->refs, 1, __ATOMIC_RELEASE);
+    return idx;
+}
+
+static inline void shm_slot_ref(SHM * shm, uint32_t idx) {
+    __atomic_add_fetch(&shm_slot(shm, idx)->refs, 1, __ATOMIC_RELAXED);
+}
+
+static inline void shm_slot_release(SHM * shm, uint32_t idx) {
+    if (__atomic_sub_fetch(&shm_slot(shm, idx)->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    shm_queue_push(shm->free, idx);
+    doorbell_ring(&shm->hdr->free_bell);
+}
+
+static inline void shm_lock(SHM * shm) {
+    if (pthread_mutex_lock(&shm->hdr->rings_lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&shm->hdr->rings_lock);
+}
+
+// The ring of 'name', claimed for it if 'claim'. Returns NULL if there is none.
+static inline SHM_RING * shm_ring_find(SHM * shm, const char * name, bool claim) {
+    size_t h = 5381;
+    for (const char * p = name; *p != '\0'; ++p)
+        h = h * 33 + (unsigned char) *p;
+
+    SHM_RING * found = NULL, * free_ring = NULL;
+    shm_lock(shm);
+    for (size_t i = 0; i < SHM_RINGS; ++i) {
+        SHM_RING * ring = &shm->rings[(h + i) & (SHM_RINGS - 1)];
+        if (ring->owner[0] == '\0') {
+            if (free_ring == NULL)
+                free_ring = ring;
+            if (ring->released)
+                continue;
+            break;
+        }
+        if (strncmp(ring->owner, name, SHM_OWNER_LEN - 1) == 0) {
+            found = ring;
+            break;
+        }
+    }
+    if (found == NULL && claim && free_ring != NULL) {
+        strncpy(free_ring->owner, name, SHM_OWNER_LEN - 1);
+        free_ring->released = false;
+        found = free_ring;
+    }
+    pthread_mutex_unlock(&shm->hdr->rings_lock);
+    return found;
+}
+
+// Frees 'ring', dropping what is left in it, and wakes its owner if it is
+// still there, to claim a ring again
+static inline void shm_ring_release(SHM * shm, SHM_RING * ring) {
+    uint32_t idx;
+    shm_lock(shm);
+    while (shm_ring_pop(ring, &idx))
+        shm_slot_release(shm, idx);
+    memset(ring->owner, 0, SHM_OWNER_LEN);
+    ring->released = true;
+    __atomic_add_fetch(&ring->epoch, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&shm->hdr->rings_lock);
+    doorbell_force(&ring->bell);
+}
+
+static inline void shm_layout(SHM * shm, char * base) {
+    shm->hdr = (SHM_HEADER *) base;
+    shm->free = (SHM_QUEUE *) (base + shm->hdr->free_off);
+    shm->inbox = (SHM_QUEUE *) (base + shm->hdr->inbox_off);
+    shm->rings = (SHM_RING *) (base + shm->hdr->rings_off);
+    shm->slots = (SHM_SLOT *) (base + shm->hdr->slots_off);
+}
+
+// Rebuilds the reference counts and the free queue from the messages still
+// in the inbox and the rings, those of messages the server held are lost
+static inline void shm_recover(SHM * shm) {
+    uint32_t * refs = calloc(SHM_SLOTS, sizeof(uint32_t));
+    for (size_t i = 0; i < SHM_RINGS; ++i) {
+        SHM_RING * ring = &shm->rings[i];
+        if (ring->owner[0] == '\0')
+            continue;
+        for (uint32_t pos = ring->head; pos != ring->tail; ++pos)
+            ++refs[ring->idx[pos & (SHM_RING_SIZE - 1)]];
+    }
+    for (uint64_t pos = shm->inbox->deq; pos != shm->inbox->enq; ++pos) {
+        SHM_CELL * cell = &shm->inbox->cells[pos & shm->inbox->mask];
+        if (cell->seq == pos + 1)
+            ++refs[cell->value];
+    }
+
+    shm_queue_init(shm->free, SHM_SLOTS);
+    for (uint32_t i = 0; i < SHM_SLOTS; ++i) {
+        shm->slots[i].refs = refs[i];
+        if (refs[i] == 0)
+            shm_queue_push(shm->free, i);
+    }
+    free(refs);
+}
+
+// Maps the shared memory object. The server creates it, or recovers the one
+// left by an earlier run; clients only attach to it. Returns false if it
+// can't be mapped.
+static inline bool shm_attach(SHM * shm, bool create) {
+    size_t free_off = (sizeof(SHM_HEADER) + 63) & ~(size_t) 63;
+    size_t inbox_off = free_off + ((sizeof(SHM_QUEUE) + SHM_SLOTS * sizeof(SHM_CELL) + 63) & ~(size_t) 63);
+    size_t rings_off = inbox_off + ((sizeof(SHM_QUEUE) + SHM_INBOX_SIZE * sizeof(SHM_CELL) + 63) & ~(size_t) 63);
+    size_t slots_off = rings_off + SHM_RINGS * sizeof(SHM_RING);
+    size_t size = slots_off + SHM_SLOTS * sizeof(SHM_SLOT);
+
+    int fd = shm_open(SHM_NAME, create ? O_RDWR | O_CREAT : O_RDWR, 0666);
+    if (fd < 0)
+        return false;
+    if (create)
+        fchmod(fd, 0666);   // like the queues, whatever the umask
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size != size && (!create || ftruncate(fd, size) < 0))) {
+        close(fd);
+        return false;
+    }
+    char * base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+
+    SHM_HEADER * hdr = (SHM_HEADER *) base;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC && hdr->size == size) {
+        shm_layout(shm, base);
+        if (create)
+            shm_recover(shm);
+        return true;
+    }
+    if (!create) {
+        munmap(base, size);
+        return false;
+    }
+
+    // a new object, or one of another layout, is laid out afresh
+    memset(hdr, 0, sizeof(SHM_HEADER));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&hdr->rings_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    hdr->free_off = free_off;
+    hdr->inbox_off = inbox_off;
+    hdr->rings_off = rings_off;
+    hdr->slots_off = slots_off;
+    hdr->size = size;
+    shm_layout(shm, base);
+    memset(shm->rings, 0, SHM_RINGS * sizeof(SHM_RING));
+    shm_queue_init(shm->inbox, SHM_INBOX_SIZE);
+    shm_queue_init(shm->free, SHM_SLOTS);
+    for (uint32_t i = 0; i < SHM_SLOTS; ++i) {
+        shm->slots[i].refs = 0;
+        shm_queue_push(shm->free, i);
+    }
+    __atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Sends 'len' bytes to the server, waiting for a free slot and for room in
+// the inbox. Returns false if the message is too large.
+static inline bool shm_send(SHM * shm, const void * data, size_t len) {
+    int64_t idx;
+    while ((idx = shm_slot_alloc(shm, data, len)) < 0) {
+        if (len > SHM_SLOT_SIZE)
+            return false;
+        uint32_t seq = doorbell_prepare(&shm->hdr->free_bell);
+        doorbell_wait(&shm->hdr->free_bell, seq, shm_queue_count(shm->free) == 0);
+    }
+    while (!shm_queue_push(shm->inbox, idx)) {
+        uint32_t seq = doorbell_prepare(&shm->hdr->inbox_room);
+        doorbell_wait(&shm->hdr->inbox_room, seq, shm_queue_count(shm->inbox) > shm->inbox->mask);
+    }
+    doorbell_ring(&shm->hdr->inbox_bell);
+    return true;
+}
+
+// Waits for the next message of 'ring' until 'stop' is set and the ring is
+// empty. Returns false once stopped, or once the ring is released, when its
+// epoch is no longer 'epoch', the one it had when claimed.
+static inline bool shm_ring_wait(SHM_RING * ring, uint32_t epoch, uint32_t * value, const bool * stop) {
+    while (__atomic_load_n(&ring->epoch, __ATOMIC_SEQ_CST) == epoch) {
+        if (shm_ring_pop(ring, value))
+            return true;
+        if (__atomic_load_n(stop, __ATOMIC_ACQUIRE))
+            return false;
+        uint32_t seq = doorbell_prepare(&ring->bell);
+        bool empty = __atomic_load_n(&ring->head, __ATOMIC_RELAXED) == __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+        doorbell_wait(&ring->bell, seq, empty && !__atomic_load_n(stop, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&ring->epoch, __ATOMIC_SEQ_CST) == epoch);
+    }
+    return false;
+}
+
+#endif
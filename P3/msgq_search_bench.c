@@ -0,0 +1,155 @@
+// Benchmark of the search index of the server. Appends messages of random
+// words, the low numbered ones the most common, to groups of up to
+// BENCH_GROUP_MSGS messages, timing the appends with the index kept up. Then
+// times a few queries on the last group, through the index as 'search' does
+// and by scanning the whole log, which is what a search would cost without
+// the index. Last, it runs again on the same directory in a process of its
+// own, timing the load of the history and its index as after a restart, and
+// the queries once more. The server is compiled in and its functions called
+// directly, as in msgq_dir_bench.c.
+#include "msgq_bench.h"
+
+#define BENCH_VOCAB 20000       // words w0 .. w19999
+#define BENCH_WORDS 8           // per message
+#define BENCH_GROUP_MSGS 500000 // per group, under HISTORY_MAX_BYTES
+#define BENCH_REPEAT 20         // runs of each query through the index
+
+const char * QUERIES[] = {"w0", "w1 w2", "w500", "w15000", "w0 w15000", "w3 w4 w5", "nothing"};
+
+// BENCH_WORDS words, word k picked about as often as 1 / k
+void make_body(unsigned int * seed, MSG * msg) {
+    size_t len = 0;
+    for (size_t i = 0; i < BENCH_WORDS; ++i) {
+        unsigned int k = rand_r(seed) % (rand_r(seed) % BENCH_VOCAB + 1);
+        len += snprintf(msg->body + len, MAX_MSG_SIZE - len, (i == 0) ? "w%u" : " w%u", k);
+    }
+    msg->body_len = len;
+}
+
+// Counts the messages of 'grp' with all the terms of 'query', reading the whole log
+size_t scan_group(GROUP * grp, const char * query) {
+    uint64_t terms[SEARCH_MAX_TERMS], found[MAX_MSG_SIZE / 2];
+    size_t n_terms = search_terms(query, strlen(query), terms, SEARCH_MAX_TERMS), n_matches = 0;
+    HISTORY_POS hpos = {0};
+    for (size_t i = 0; i < grp->history.n_segs; ++i) {
+        SEGMENT * seg = &grp->history.segs[i];
+        hpos.seq = seg->seq;
+        const char * data = history_data(grp, &hpos, seg);
+        for (size_t offset = seg->start; data != NULL && offset < seg->len; ) {
+            LOG_RECORD rec;
+            memcpy(&rec, data + offset, sizeof(rec));
+            const WIRE_MSG * wire = (const WIRE_MSG *) (data + offset + sizeof(rec));
+            const char * body = wire->data + wire->sender_len + wire->receiver_len + wire->group_len;
+            size_t n_found = search_terms(body, wire->body_len, found, MAX_MSG_SIZE / 2);
+            bool is_match = n_terms > 0;
+            for (size_t k = 0; k < n_terms && is_match; ++k)
+                is_match = bsearch(&terms[k], found, n_found, sizeof(uint64_t), compare_term) != NULL;
+            n_matches += is_match;
+            offset += record_size(rec.len);
+        }
+    }
+    history_pos_close(&hpos);
+    return n_matches;
+}
+
+// Times the queries on 'grp', and the scan of its log if 'scan'
+void run_queries(GROUP * grp, BENCH_USER * owner, bool scan) {
+    printf("%-12s %-10s %-12s %-12s\n", "query", "matches", "index (ms)", "scan (ms)");
+    for (size_t q = 0; q < sizeof(QUERIES) / sizeof(QUERIES[0]); ++q) {
+        double start = now_us();
+        for (size_t r = 0; r < BENCH_REPEAT; ++r)
+            search_group(grp->name, owner->name, QUERIES[q]);
+        double index_ms = (now_us() - start) / 1e3 / BENCH_REPEAT;
+        if (!scan) {
+            printf("%-12s %-10s %-12.3f\n", QUERIES[q], "", index_ms);
+            continue;
+        }
+        start = now_us();
+        size_t n_matches = scan_group(grp, QUERIES[q]);
+        printf("%-12s %-10zu %-12.3f %-12.1f\n", QUERIES[q], n_matches, index_ms, (now_us() - start) / 1e3);
+    }
+}
+
+// Bytes of the runs of the index of 'grp' and the postings in them
+void index_size(GROUP * grp, size_t * bytes, size_t * postings) {
+    *bytes = *postings = 0;
+    for (size_t i = 0; i < grp->search.n_runs; ++i) {
+        *bytes += grp->search.runs[i].len;
+        *postings += ((const RUN_HEADER *) grp->search.runs[i].map)->n_postings;
+    }
+}
+
+int main(int argc, char * argv[]) {
+    // '-r dir' is the second run, on the history written by the first
+    bool is_reload = argc > 2 && strcmp(argv[1], "-r") == 0;
+    size_t n_msgs = 2000000;
+    if (argc > 1 && !is_reload)
+        n_msgs = atol(argv[1]);
+
+    char history_path[] = "/tmp/msgq_bench_XXXXXX";
+    if (is_reload)
+        HISTORY_PATH = argv[2];
+    else if (mkdtemp(history_path) == NULL) {
+        perror("Error in mkdtemp...\n");
+        return EXIT_FAILURE;
+    }
+    else
+        HISTORY_PATH = history_path;
+    directory_init();
+    pthread_t spooler;
+    pthread_create(&spooler, NULL, spooler_thread, NULL);
+    pthread_detach(spooler);
+    BENCH_USER owner;
+    start_user(&owner, "sb_owner");
+
+    size_t n_groups = (n_msgs + BENCH_GROUP_MSGS - 1) / BENCH_GROUP_MSGS;
+    char name[MAX_NAME_LEN];
+    snprintf(name, sizeof(name), "sb_g%zu", n_groups - 1);
+    if (is_reload) {
+        double start = now_us();
+        load_history();
+        printf("loaded in %.1f ms, the index caught up with the log\n", (now_us() - start) / 1e3);
+        GROUP * grp = find_group(name);
+        if (grp != NULL)
+            run_queries(grp, &owner, false);
+        stop_user(&owner);
+        nftw(HISTORY_PATH, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        return EXIT_SUCCESS;
+    }
+
+    MSG msg = {0};
+    msg.type = GROUP_MSG;
+    strcpy(msg.sender, owner.name);
+    unsigned int seed = 1;
+    double append_us = 0;
+    GROUP * grp = NULL;
+    for (size_t i = 0; i < n_msgs; ++i) {
+        if (i % BENCH_GROUP_MSGS == 0) {
+            snprintf(msg.group, sizeof(msg.group), "sb_g%zu", i / BENCH_GROUP_MSGS);
+            create_group(msg.group, owner.name);
+            grp = find_group(msg.group);
+        }
+        make_body(&seed, &msg);
+        WIRE_MSG * wire = pack_msg(&msg);
+        wire->time = time(NULL);
+        double start = now_us();
+        history_append(grp, wire);
+        append_us += now_us() - start;
+        free(wire);
+    }
+    size_t bytes, postings;
+    index_size(grp, &bytes, &postings);
+    printf("%zu messages in %zu groups, %.3f us per append with the index\n", n_msgs, n_groups, append_us / n_msgs);
+    printf("last group: %zu bytes of log, %zu runs of %zu postings in %zu bytes (%.2f per posting), %zu in memory\n",
+        grp->history.total_len, grp->search.n_runs, postings, bytes, postings ? (double) bytes / postings : 0,
+        grp->search.n_tail);
+    run_queries(grp, &owner, true);
+    stop_user(&owner);
+    fflush(stdout);
+
+    char * reload_argv[] = {argv[0], "-r", history_path, NULL};
+    execv("/proc/self/exe", reload_argv);
+    perror("Error in exec...\n");
+    nftw(history_path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return EXIT_FAILURE;
+}
@@ -1,19 +1,72 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
-#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include "msgq_ring.h"
+#include "msgq_partition.h"
 
 #define MAX_NAME_LEN 30
-#define MAX_GROUP_SIZE 32
-#define MAX_NUM_GROUPS 64
-#define MAX_OLD_MSG 128
+#define DIRECTORY_BUCKETS 64  // initial buckets of the group and user indexes
+#define MEMBER_INDEX_SIZE 8    // initial slots of the member index of a group
+#define HISTORY_DIR "msgq_history"
+#define LOG_MAGIC "MSGQLOG1"
+#define SEGMENT_MIN_SIZE 4096               // a segment file starts this size and doubles
+#define SEGMENT_MAX_SIZE (1 << 20)          // then the next segment is started
+#define HISTORY_MAX_BYTES (64 << 20)        // per group, older segments are dropped
+#define HISTORY_MAX_AGE (7 * 24 * 3600)     // seconds, older messages expire
+#define INDEX_STRIDE 32                     // records between two entries of the time index
+#define HOLE_ALIGN 4096                     // expired bytes are freed on disk in blocks of this
+#define WHEEL_BITS 6                        // a level of the timer wheel has 64 slots
+#define WHEEL_LEVELS 4                      // of 1 s, 64 s, 68 min and 3 days
+#define REPLAY_BATCH 64                     // messages replayed per hold of the group lock
+#define MAX_MAPPED_SEGMENTS 16384           // mappings, below vm.max_map_count
+#define INDEX_MAGIC "MSGQIDX1"
+#define SEARCH_TERM_MAX 32                  // bytes of a word that make its term
+#define SEARCH_FLUSH 65536                  // postings of a group kept in memory, then written as a run
+#define SEARCH_TAIL_SIZE 64                 // initial slots of the terms in memory of a group
+#define SEARCH_MAX_TERMS 8                  // of a query, the rest are ignored
+#define SEARCH_RESULTS 20                   // messages returned by 'search', the newest
+#define SEARCH_SNIPPET 80                   // bytes of the body shown of each
 #define MAX_MSG_SIZE 2048
+#define NUM_SHARDS 4        // threads handling the groups, each those of its shard
+#define WORK_QUEUE_SIZE 256
+#define WIRE_BUF_SIZE 256   // initial receive buffer, grown for larger messages
+#define PRIO_CONTROL 1      // mtype of requests and replies other than chat
+#define PRIO_CHAT 2         // of private and group messages
+#define PRIO_REPLAY 3       // of the history replayed to a user joining a group
+#define SPOOL_DIR "spool"                   // under HISTORY_PATH
+#define SPOOL_USER_MEM (64 << 10)           // bytes spooled in memory per user, then on disk
+#define SPOOL_TOTAL_MEM (64 << 20)          // bytes spooled in memory for all users
+#define SPOOL_USER_DISK (16 << 20)          // bytes spooled on disk per user, then the spool is full
+#define SPOOL_RETRY_MS 20                   // between two tries of the spools waiting for room
+#define SPOOL_STATS_TOP 5                   // deepest spools listed by 'stats'
+#define SPOOL_USER_ABSENT (256 << 10)       // bytes spooled for a user without a queue, then dropped
+#define PRESENCE_TTL 600                    // seconds a user is kept present without a message or heartbeat
+#define GC_INTERVAL 60                      // seconds between two sweeps of the queues, at most
+#define PEER_FRAME_MAX 8192                 // bytes of a frame between two servers of a federation
+#define PEER_QUEUE_MAX (64 << 20)           // bytes waiting for a peer, then frames to it are dropped
+#define PEER_BACKLOG (256 << 10)            // bytes waiting for a peer that hold back replays to its users
+#define PEER_RETRY_MS 100                   // between two tries to connect to a peer
+#define NAME_INDEX_SIZE 64                  // initial slots of the index of the groups of the peers
 
 typedef enum _MSG_TYPE {
     PRIVATE_MSG,
@@ -21,7 +74,12 @@ typedef enum _MSG_TYPE {
     CREATE_GROUP_MSG,
     LIST_GROUP_MSG,
     JOIN_GROUP_MSG,
-    AUTO_DELETE_MSG
+    AUTO_DELETE_MSG,
+    SHUTDOWN_MSG,   // sent by a client to its own queue to stop its receive thread
+    STATS_MSG,
+    HEARTBEAT_MSG,  // sent by a client now and then to stay present, see PRESENCE_TTL
+    SEARCH_MSG,     // the terms in the body, the newest messages of the group with all of them in the reply
+    DIRECTORY_MSG   // asks for the group names and what changes in them, see directory_subscribe()
 } MSG_TYPE;
 
 typedef struct _MSG {
@@ -32,49 +90,440 @@ typedef struct _MSG {
     char group[MAX_NAME_LEN];
     time_t time;
     time_t delete_time;
+    size_t body_len;
 } MSG;
 
-typedef struct _OLD_MSG {
-    MSG msg[MAX_OLD_MSG];
-    int start_ptr;
-    size_t n_msg;
-} OLD_MSG;
+// A MSG as sent on the queues: a fixed header followed by the sender,
+// receiver, group and body, each of its own length and without '\0'
+typedef struct _WIRE_MSG {
+    long mtype;                 // the priority class, received lowest first
+    uint8_t type;
+    uint8_t sender_len;
+    uint8_t receiver_len;
+    uint8_t group_len;
+    uint16_t body_len;
+    int64_t time;
+    int64_t delete_time;
+    char data[];
+} WIRE_MSG;
+
+// A message in a history log: the WIRE_MSG as it was sent, padded to 8 bytes
+typedef struct _LOG_RECORD {
+    uint32_t len;               // of the WIRE_MSG, 0 past the last record
+    uint32_t reserved;          // with len 0 in the first record, the offset the kept records start at
+} LOG_RECORD;
+
+// Every INDEX_STRIDE'th record of a segment, the first of a stride
+typedef struct _INDEX_ENTRY {
+    time_t time;
+    time_t last_time;           // of the newest record of the stride
+    uint32_t offset;
+} INDEX_ENTRY;
+
+// A file of the history log, named '<group file id>.<seq>.log'
+typedef struct _SEGMENT {
+    uint64_t seq;
+    size_t start;               // of the oldest record kept, the ones before expired
+    size_t len;                 // bytes used, LOG_MAGIC included
+    size_t cap;                 // size of the file
+    size_t n_records;
+    time_t last_time;           // of the newest record
+    size_t n_index;
+    size_t index_cap;
+    INDEX_ENTRY * index;
+} SEGMENT;
+
+// The append-only log of the messages of a group, oldest segment first.
+// Only the last segment is appended to, and mapped while appending to it.
+typedef struct _HISTORY {
+    size_t n_segs;
+    size_t segs_cap;
+    SEGMENT * segs;
+    uint64_t next_seq;
+    size_t total_len;
+    char * map;                 // the last segment, NULL if not mapped
+    size_t map_len;
+} HISTORY;
+
+// A place in a history log, for replaying it
+typedef struct _HISTORY_POS {
+    uint64_t seq;
+    size_t offset;
+    char * map;                 // of segment 'map_seq', when not the mapped last one
+    size_t map_len;
+    uint64_t map_seq;
+} HISTORY_POS;
+
+// The postings of a term not written to a run yet, oldest first
+typedef struct _TAIL_TERM {
+    uint64_t term;              // 0 for an empty slot
+    size_t n;
+    size_t cap;
+    uint64_t * pos;
+} TAIL_TERM;
+
+// A run of the search index of a group, the file '<group file id>.<seq>.idx':
+// this header, the terms ascending, then the postings of each term newest
+// first, as a varint of the first position and of the difference to each next
+typedef struct _RUN_HEADER {
+    char magic[8];
+    uint64_t n_terms;
+    uint64_t n_postings;
+    uint64_t min_pos;
+    uint64_t max_pos;
+} RUN_HEADER;
+
+typedef struct _RUN_TERM {
+    uint64_t term;
+    uint64_t offset;            // of its postings in the file
+    uint32_t count;
+    uint32_t len;               // bytes of its postings
+} RUN_TERM;
+
+typedef struct _RUN {
+    uint64_t seq;
+    char * map;                 // the whole file, read only
+    size_t len;
+} RUN;
+
+// An inverted index over the history of a group, from the hash of a term to
+// the positions of the messages that have it, see history_position(). New
+// postings are kept in memory, up to SEARCH_FLUSH, then written as a run;
+// the runs cover ranges of positions one after the other, oldest first.
+typedef struct _SEARCH_INDEX {
+    TAIL_TERM * tail;           // open addressing by term
+    size_t tail_cap;            // a power of two, at least twice 'n_tail_terms'
+    size_t n_tail_terms;
+    size_t n_tail;              // postings
+    RUN * runs;
+    size_t n_runs;
+    size_t runs_cap;
+    uint64_t next_seq;
+    uint64_t indexed;           // the position of the newest message indexed
+} SEARCH_INDEX;
+
+// The positions of a term newest first: those in memory, then those of each
+// run from the newest. 'value' is the current one, 0 past the last.
+typedef struct _POSTING_CURSOR {
+    SEARCH_INDEX * index;
+    uint64_t term;
+    size_t count;               // postings in all
+    TAIL_TERM * tail;
+    size_t tail_left;
+    size_t runs_left;           // runs not opened yet, the older ones
+    const uint8_t * p;
+    const uint8_t * end;
+    bool is_first;              // of the run opened
+    uint64_t value;
+} POSTING_CURSOR;
+
+// A message waiting in memory for room in its recipient's queue
+typedef struct _SPOOL_ITEM {
+    struct _SPOOL_ITEM * next;
+    size_t len;
+    char wire[];                // the WIRE_MSG
+} SPOOL_ITEM;
+
+// Messages to a user whose queue was full, oldest first. Up to
+// SPOOL_USER_MEM bytes are kept in memory, the newer ones after that in
+// the user's spool file, which is read back once memory is empty.
+typedef struct _SPOOL {
+    pthread_mutex_t lock;
+    pthread_cond_t room;        // for SPOOL_BLOCK, signalled as the spool drains
+    SPOOL_ITEM * head;
+    SPOOL_ITEM * tail;
+    size_t mem_msgs;
+    size_t mem_bytes;
+    size_t disk_msgs;
+    off_t disk_read;            // the spool file from here on is still to be sent
+    off_t disk_len;
+    bool pending;               // on the spooler's list
+} SPOOL;
+
+typedef enum _SPOOL_POLICY {
+    SPOOL_DROP,                 // a message to a full spool is dropped
+    SPOOL_BLOCK                 // the sender waits for the spool to drain
+} SPOOL_POLICY;
+
+// Totals over all spools, updated atomically
+typedef struct _SPOOL_STATS {
+    size_t mem_msgs;
+    size_t mem_bytes;
+    size_t disk_msgs;
+    size_t disk_bytes;
+    size_t spooled;             // messages that found a full queue
+    size_t spilled;             // of those, written to disk
+    size_t drained;             // delivered from a spool later
+    size_t dropped;
+    size_t queues_removed;      // of users gone for longer than the presence TTL
+    size_t blocked;             // sends that waited with SPOOL_BLOCK
+} SPOOL_STATS;
+
+// A user, interned: groups refer to it by pointer. 'queue_id' is resolved
+// once, when the user is first seen, and again only if the queue is removed.
+// The server never creates a user's queue, the client does; until then, or
+// once the queue is removed for want of presence, 'queue_id' is -1 and
+// messages to the user are spooled, up to SPOOL_USER_ABSENT bytes.
+typedef struct _USER {
+    char name[MAX_NAME_LEN];
+    int queue_id;
+    time_t last_seen;           // of its last message or heartbeat, or when first seen
+    SHM_RING * ring;            // on the shared memory transport, else NULL for the queue
+    size_t home;                // the server of the federation owning the user
+    bool subscribed;            // to the group names, under 'subscribers_lock'
+    size_t n_groups;            // the groups the user is a member of
+    size_t groups_cap;
+    struct _GROUP ** groups;
+    SPOOL spool;
+    struct _USER * next;        // in its bucket of the user index
+} USER;
+
+typedef struct _MEMBER {
+    USER * user;
+    time_t join_time;
+} MEMBER;
 
 typedef struct _GROUP {
     char name[MAX_NAME_LEN];
     size_t n_members;
-    char members[MAX_GROUP_SIZE][MAX_NAME_LEN];
-    time_t join_time[MAX_GROUP_SIZE];
-    OLD_MSG old_msg;
+    size_t members_cap;
+    MEMBER * members;           // in order of joining
+    size_t * member_index;      // open addressing over 'members', index + 1, 0 is empty
+    size_t index_cap;           // a power of two, at least twice 'n_members'
+    HISTORY history;
+    SEARCH_INDEX search;
+    char file_id[2 * MAX_NAME_LEN];
     time_t delete_time;
+    time_t expires;             // when its oldest messages expire, 0 if not on the timer wheel
+    struct _SHARD * shard;      // the one it belongs to, by hash of its name
+    struct _GROUP * next;       // in its bucket of the directory
+    time_t timer_at;            // 'expires' as on the timer wheel
+    struct _GROUP * timer_next; // in its slot of the timer wheel
+    struct _GROUP ** timer_pprev;
 } GROUP;
 
-size_t N_GROUPS;
-GROUP ALL_GROUPS[MAX_NUM_GROUPS];
+// A chained hash table from group name to group, grown to about one group
+// per bucket. Groups are kept in order of creation too.
+typedef struct _DIRECTORY {
+    GROUP ** buckets;
+    size_t n_buckets;
+    GROUP ** groups;
+    size_t n_groups;
+    size_t groups_cap;
+} DIRECTORY;
 
-int get_old_msg(OLD_MSG * old_msg, size_t pos) {
-    if (old_msg->n_msg == 0)
-        return -1;
-    
-    return (old_msg->start_ptr + pos) % MAX_OLD_MSG;
+// The same from user name to user
+typedef struct _USER_INDEX {
+    USER ** buckets;
+    size_t n_buckets;
+    size_t n_users;
+} USER_INDEX;
+
+// A hierarchical timing wheel of the groups' expiry, in seconds. Level l has
+// slots of 64^l seconds; a group is kept in the lowest level whose span
+// reaches its expiry and moves down a level when the slot above comes up, so
+// adding, moving and firing a timer never scans the groups.
+typedef struct _WHEEL {
+    GROUP * slots[WHEEL_LEVELS][1 << WHEEL_BITS];
+    time_t next;                // the second to fire next, those before have fired
+    size_t n_timers;
+} WHEEL;
+
+// A user joining a group, replayed the history of the group a batch at a time
+typedef struct _REPLAY {
+    GROUP * grp;
+    USER * user;
+    time_t join_time;
+    HISTORY_POS pos;
+    struct _REPLAY * next;
+} REPLAY;
+
+// Received messages waiting for the thread of a shard or the private lane
+typedef struct _WORK_QUEUE {
+    WIRE_MSG * msg[WORK_QUEUE_SIZE];
+    size_t size[WORK_QUEUE_SIZE];
+    size_t head;
+    size_t n_msg;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} WORK_QUEUE;
+
+// The groups whose name hashes to it, with their history and timers, are
+// only ever touched by the thread of the shard, so they need no lock. The
+// thread takes the messages to them in order of arrival. 'lock' guards the
+// directory, written by that thread alone, for other threads listing it.
+typedef struct _SHARD {
+    DIRECTORY dir;
+    pthread_rwlock_t lock;
+    WHEEL wheel;
+    WORK_QUEUE work;
+    REPLAY * replays;           // joins replaying history, in order of joining
+} SHARD;
+
+typedef enum _PEER_KIND {
+    PEER_REQUEST,   // a message of a client, for the server owning its group or receiver
+    PEER_DELIVER,   // a message for users of the receiving server, named before it
+    PEER_GROUPS,    // names of groups of the sender, for 'list'
+    PEER_SYNC       // asks for PEER_GROUPS of all the groups of the receiver
+} PEER_KIND;
+
+// A frame between two servers of a federation, one per SOCK_SEQPACKET
+// packet: this header, 'names_len' bytes of '\0' terminated names, then the
+// WIRE_MSG if the kind has one.
+typedef struct _PEER_MSG {
+    uint8_t kind;
+    uint8_t from;               // the index of the sending server
+    uint16_t n_names;
+    uint32_t names_len;
+    char data[];
+} PEER_MSG;
+
+typedef struct _PEER_FRAME {
+    struct _PEER_FRAME * next;
+    size_t len;
+    long data[];                // the PEER_MSG
+} PEER_FRAME;
+
+// Another server of the federation. The frames to it wait here, in order,
+// for its sender thread, which holds the connection to it.
+typedef struct _PEER {
+    size_t index;
+    PEER_FRAME * head;
+    PEER_FRAME * tail;
+    size_t queued;              // bytes
+    size_t sent;                // frames
+    size_t dropped;             // frames found no room in the queue
+    bool connected;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} PEER;
+
+// A set of names, the groups of the other servers. Names are only ever added.
+typedef struct _NAME_SET {
+    char (* names)[MAX_NAME_LEN];
+    size_t n_names;
+    size_t names_cap;
+    size_t * index;             // open addressing over 'names', index + 1, 0 is empty
+    size_t index_cap;           // a power of two, at least twice 'n_names'
+    pthread_rwlock_t lock;
+} NAME_SET;
+
+// Groups are only ever added, so a GROUP stays valid once found. Users are
+// shared by all the shards and the private lane, under 'users_lock'.
+SHARD SHARDS[NUM_SHARDS];
+USER_INDEX USERS;
+pthread_rwlock_t users_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+const char * HISTORY_PATH = HISTORY_DIR;
+time_t PRESENCE_SEC = PRESENCE_TTL;
+size_t N_MAPPED;    // last segments mapped, of all groups
+SHM * SHM_MAP;      // the shared memory transport, NULL if it couldn't be set up
+
+// Users whose spool is waiting for room, handed to the spooler thread
+USER ** PENDING;
+size_t n_pending;
+size_t pending_cap;
+pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+
+SPOOL_POLICY SPOOL_MODE = SPOOL_DROP;
+SPOOL_STATS SPOOL_TOTALS;
+
+// In a federation, each server owns the users and groups SERVERS gives it and
+// hands the rest to their owner through PEERS. A lone server owns them all.
+size_t SERVER_INDEX;
+PARTITION SERVERS;
+PEER PEERS[PARTITION_MAX];
+NAME_SET REMOTE_GROUPS = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+// Users kept up to date with the names of all the groups, local and remote.
+// Every group created is one more version, pushed to them as a delta.
+USER ** SUBSCRIBERS;
+size_t n_subscribers;
+size_t subscribers_cap;
+long DIR_EPOCH;         // when the server started, in us: versions start again at 0
+uint64_t DIR_VERSION;
+pthread_mutex_t subscribers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Private messages, lists and statistics, which belong to no shard
+WORK_QUEUE PRIVATE_WORK = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER
+};
+
+size_t wire_size(const WIRE_MSG * wire) {
+    return offsetof(WIRE_MSG, data) + wire->sender_len + wire->receiver_len + wire->group_len + wire->body_len;
 }
 
-int add_old_msg(OLD_MSG * old_msg, MSG * msg) {
-    if (old_msg->n_msg == MAX_OLD_MSG) {
-        printf("Maximum number of old messages...\n");
-        return -1;
+// The directory is a stream whose order matters, a control message could pass
+// what is spooled before it
+long msg_priority(int type) {
+    return (type == PRIVATE_MSG || type == GROUP_MSG || type == DIRECTORY_MSG) ? PRIO_CHAT : PRIO_CONTROL;
+}
+
+// Returns a malloc'd WIRE_MSG of exactly wire_size() bytes
+WIRE_MSG * pack_msg(const MSG * msg) {
+    size_t lens[4] = {strlen(msg->sender), strlen(msg->receiver), strlen(msg->group), msg->body_len};
+    const char * fields[4] = {msg->sender, msg->receiver, msg->group, msg->body};
+
+    WIRE_MSG * wire = malloc(offsetof(WIRE_MSG, data) + lens[0] + lens[1] + lens[2] + lens[3]);
+    wire->mtype = msg_priority(msg->type);
+    wire->type = msg->type;
+    wire->sender_len = lens[0];
+    wire->receiver_len = lens[1];
+    wire->group_len = lens[2];
+    wire->body_len = lens[3];
+    wire->time = msg->time;
+    wire->delete_time = msg->delete_time;
+
+    char * p = wire->data;
+    for (size_t i = 0; i < 4; ++i) {
+        memcpy(p, fields[i], lens[i]);
+        p += lens[i];
     }
-    
-    if (old_msg->n_msg == 0) {
-        old_msg->start_ptr = 0;
-        old_msg->n_msg++;
-        old_msg->msg[0] = *msg;
-        return old_msg->n_msg;
+    return wire;
+}
+
+// Fills 'msg' from a received 'wire' of 'size' bytes. Returns false if it is malformed.
+bool unpack_msg(const WIRE_MSG * wire, size_t size, MSG * msg) {
+    if (size < offsetof(WIRE_MSG, data) || size != wire_size(wire) || wire->sender_len >= MAX_NAME_LEN ||
+            wire->receiver_len >= MAX_NAME_LEN || wire->group_len >= MAX_NAME_LEN || wire->body_len >= MAX_MSG_SIZE)
+        return false;
+
+    size_t lens[4] = {wire->sender_len, wire->receiver_len, wire->group_len, wire->body_len};
+    char * fields[4] = {msg->sender, msg->receiver, msg->group, msg->body};
+    const char * p = wire->data;
+    for (size_t i = 0; i < 4; ++i) {
+        memcpy(fields[i], p, lens[i]);
+        fields[i][lens[i]] = '\0';
+        p += lens[i];
     }
+    msg->type = wire->type;
+    msg->body_len = wire->body_len;
+    msg->time = wire->time;
+    msg->delete_time = wire->delete_time;
+    return true;
+}
+
+int send_wire(int id, const WIRE_MSG * wire, int flags) {
+    return msgsnd(id, wire, wire_size(wire) - sizeof(long), flags);
+}
 
-    old_msg->msg[(old_msg->start_ptr + old_msg->n_msg) % MAX_OLD_MSG] = *msg;
-    old_msg->n_msg++;
-    return old_msg->n_msg;
+// Receives the next message into '*buf', grown as needed, of the lowest
+// priority class waiting: control first, then chat, then replayed history.
+// Returns its size, mtype included, or -1 on error.
+ssize_t recv_wire(int id, WIRE_MSG ** buf, size_t * cap, int flags) {
+    while (true) {
+        ssize_t nbytes = msgrcv(id, *buf, *cap - sizeof(long), -PRIO_REPLAY, flags);
+        if (nbytes >= 0)
+            return nbytes + sizeof(long);
+        if (errno != E2BIG)
+            return -1;
+        *cap *= 2;
+        *buf = realloc(*buf, *cap);
+    }
 }
 
 unsigned long hash(unsigned char *str)
@@ -94,197 +543,2784 @@ int get_queue_id(const char * username) {
     //     id = 1234;
     // else
     //     id = ftok(username, 'z');
-    id = hash(strdup(username));
+    id = hash((unsigned char *) username);
     return msgget(id, IPC_CREAT|0666);
 }
 
-int join_group(char * groupname, char * username) {
-    GROUP * grp = NULL;
-    for (size_t grp_idx = 0; grp_idx < N_GROUPS; ++grp_idx) {
-        if (strcmp(ALL_GROUPS[grp_idx].name, groupname) == 0) {
-            grp = &ALL_GROUPS[grp_idx];
-            break;
+// The queue of 'username' if its client created it, else -1
+int find_queue_id(const char * username) {
+    return msgget(hash((unsigned char *) username), 0);
+}
+
+// Makes room for one more element of 'size' bytes in the array '*arr' of 'n' elements
+void grow_array(void ** arr, size_t * cap, size_t n, size_t size) {
+    if (n < *cap)
+        return;
+    *cap = (*cap == 0) ? 4 : *cap * 2;
+    *arr = realloc(*arr, *cap * size);
+}
+
+size_t bucket_of(const char * name, size_t n_buckets) {
+    return hash((unsigned char *) name) & (n_buckets - 1);
+}
+
+// The low bits of the hash pick the bucket within a shard, so higher ones the shard
+SHARD * shard_of(const char * groupname) {
+    return &SHARDS[(hash((unsigned char *) groupname) >> 16) % NUM_SHARDS];
+}
+
+void directory_init() {
+    for (size_t i = 0; i < NUM_SHARDS; ++i) {
+        SHARD * shard = &SHARDS[i];
+        shard->dir.n_buckets = DIRECTORY_BUCKETS;
+        shard->dir.buckets = calloc(shard->dir.n_buckets, sizeof(GROUP *));
+        pthread_rwlock_init(&shard->lock, NULL);
+        pthread_mutex_init(&shard->work.lock, NULL);
+        pthread_cond_init(&shard->work.not_empty, NULL);
+        pthread_cond_init(&shard->work.not_full, NULL);
+    }
+    USERS.n_buckets = DIRECTORY_BUCKETS;
+    USERS.buckets = calloc(USERS.n_buckets, sizeof(USER *));
+    // clients holding group names of an earlier run see they are stale
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    DIR_EPOCH = now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+size_t count_groups() {
+    size_t n = 0;
+    for (size_t i = 0; i < NUM_SHARDS; ++i)
+        n += SHARDS[i].dir.n_groups;
+    return n;
+}
+
+// On the thread of 'shard', or under its lock
+GROUP * lookup_group(SHARD * shard, const char * groupname) {
+    GROUP * grp = shard->dir.buckets[bucket_of(groupname, shard->dir.n_buckets)];
+    while (grp != NULL && strcmp(grp->name, groupname) != 0)
+        grp = grp->next;
+    return grp;
+}
+
+// Under the lock of its shard held for writing
+void insert_group(GROUP * grp) {
+    DIRECTORY * dir = &grp->shard->dir;
+    if (dir->n_groups == dir->n_buckets) {
+        size_t n_buckets = dir->n_buckets * 2;
+        GROUP ** buckets = calloc(n_buckets, sizeof(GROUP *));
+        for (size_t i = 0; i < dir->n_groups; ++i) {
+            GROUP * g = dir->groups[i];
+            size_t b = bucket_of(g->name, n_buckets);
+            g->next = buckets[b];
+            buckets[b] = g;
         }
+        free(dir->buckets);
+        dir->buckets = buckets;
+        dir->n_buckets = n_buckets;
     }
-    if (grp == NULL) {
-        printf("Group '%s' not found...\n", groupname);
-        return -1;
+
+    size_t b = bucket_of(grp->name, dir->n_buckets);
+    grp->next = dir->buckets[b];
+    dir->buckets[b] = grp;
+    grow_array((void **) &dir->groups, &dir->groups_cap, dir->n_groups, sizeof(GROUP *));
+    dir->groups[dir->n_groups++] = grp;
+}
+
+// Returns the slot of 'user' in the member index of 'grp', or of the empty slot it would take
+size_t member_slot(GROUP * grp, USER * user) {
+    size_t slot = (((uintptr_t) user >> 4) * 2654435761U) & (grp->index_cap - 1);
+    while (grp->member_index[slot] != 0 && grp->members[grp->member_index[slot] - 1].user != user)
+        slot = (slot + 1) & (grp->index_cap - 1);
+    return slot;
+}
+
+bool is_member(GROUP * grp, USER * user) {
+    return grp->member_index[member_slot(grp, user)] != 0;
+}
+
+// Adds a member that isn't one yet
+MEMBER * add_member(GROUP * grp, USER * user) {
+    if (2 * (grp->n_members + 1) > grp->index_cap) {
+        free(grp->member_index);
+        grp->index_cap *= 2;
+        grp->member_index = calloc(grp->index_cap, sizeof(size_t));
+        for (size_t i = 0; i < grp->n_members; ++i)
+            grp->member_index[member_slot(grp, grp->members[i].user)] = i + 1;
     }
-    if (grp->n_members < MAX_GROUP_SIZE) {
-        bool member_exist = false;
-        for (size_t i = 0; i < grp->n_members; ++i) {
-            if (strcmp(grp->members[i], username) == 0) {
-                member_exist = true;
-                break;
-            }
-        }
-        if (!member_exist) {
-            // add user
-            grp->join_time[grp->n_members] = time(NULL);
-            strcpy(grp->members[grp->n_members++], username);
 
-            // send old messages
-            int id = get_queue_id(username);
+    grow_array((void **) &grp->members, &grp->members_cap, grp->n_members, sizeof(MEMBER));
+    MEMBER * member = &grp->members[grp->n_members++];
+    member->user = user;
+    member->join_time = time(NULL);
+    grp->member_index[member_slot(grp, user)] = grp->n_members;
+    return member;
+}
+
+// Records 'grp' among the groups of 'user'
+void add_user_group(USER * user, GROUP * grp) {
+    pthread_rwlock_wrlock(&users_lock);
+    grow_array((void **) &user->groups, &user->groups_cap, user->n_groups, sizeof(GROUP *));
+    user->groups[user->n_groups++] = grp;
+    pthread_rwlock_unlock(&users_lock);
+}
+
+// Under 'users_lock'
+USER * lookup_user(const char * username) {
+    USER * user = USERS.buckets[bucket_of(username, USERS.n_buckets)];
+    while (user != NULL && strcmp(user->name, username) != 0)
+        user = user->next;
+    return user;
+}
+
+// Returns the user named 'username', registering it and resolving its queue
+// the first time. Users are never removed, so the pointer stays valid.
+USER * get_user(const char * username) {
+    pthread_rwlock_rdlock(&users_lock);
+    USER * user = lookup_user(username);
+    pthread_rwlock_unlock(&users_lock);
+    if (user != NULL)
+        return user;
 
-            for (size_t i = 0; i < (grp->old_msg).n_msg; ++i) {
-                if (grp->join_time[grp->n_members-1] < (grp->old_msg).msg[get_old_msg(&(grp->old_msg), i)].time +
-                        grp->delete_time) {
-                        if (msgsnd(id, &(grp->old_msg).msg[get_old_msg(&(grp->old_msg), i)], sizeof(MSG), 0) < 0) {
-                            perror("Error in msgsnd...\n");
-                        }
+    pthread_rwlock_wrlock(&users_lock);
+    user = lookup_user(username);
+    if (user == NULL) {
+        if (USERS.n_users == USERS.n_buckets) {
+            size_t n_buckets = USERS.n_buckets * 2;
+            USER ** buckets = calloc(n_buckets, sizeof(USER *));
+            for (size_t i = 0; i < USERS.n_buckets; ++i) {
+                while (USERS.buckets[i] != NULL) {
+                    USER * u = USERS.buckets[i];
+                    USERS.buckets[i] = u->next;
+                    size_t nb = bucket_of(u->name, n_buckets);
+                    u->next = buckets[nb];
+                    buckets[nb] = u;
                 }
             }
-            
-            return grp->n_members;
+            free(USERS.buckets);
+            USERS.buckets = buckets;
+            USERS.n_buckets = n_buckets;
         }
-        else {
-            printf("Member '%s' already present in group...\n", username);
-            return -1;
+        user = calloc(1, sizeof(USER));
+        strcpy(user->name, username);
+        user->queue_id = find_queue_id(username);
+        user->last_seen = time(NULL);
+        user->home = partition_of(&SERVERS, username);
+        if (SHM_MAP != NULL)
+            user->ring = shm_ring_find(SHM_MAP, username, false);
+        pthread_mutex_init(&user->spool.lock, NULL);
+        pthread_cond_init(&user->spool.room, NULL);
+        size_t b = bucket_of(username, USERS.n_buckets);
+        user->next = USERS.buckets[b];
+        USERS.buckets[b] = user;
+        ++USERS.n_users;
+    }
+    pthread_rwlock_unlock(&users_lock);
+    return user;
+}
+
+// Group names are hex encoded in file names
+void file_id_of(const char * name, char * file_id) {
+    for (size_t i = 0; name[i] != '\0'; ++i)
+        sprintf(file_id + 2 * i, "%02x", (unsigned char) name[i]);
+    file_id[2 * strlen(name)] = '\0';
+}
+
+bool name_of_file_id(const char * file_id, size_t len, char * name) {
+    if (len % 2 != 0 || len / 2 >= MAX_NAME_LEN)
+        return false;
+    for (size_t i = 0; i < len / 2; ++i) {
+        unsigned int c;
+        if (sscanf(file_id + 2 * i, "%2x", &c) != 1)
+            return false;
+        name[i] = c;
+    }
+    name[len / 2] = '\0';
+    return true;
+}
+
+void segment_path(GROUP * grp, uint64_t seq, char * path) {
+    snprintf(path, PATH_MAX, "%s/%s.%016llx.log", HISTORY_PATH, grp->file_id, (unsigned long long) seq);
+}
+
+size_t record_size(size_t len) {
+    return sizeof(LOG_RECORD) + ((len + 7) & ~(size_t) 7);
+}
+
+void spool_path(USER * user, char * path) {
+    char file_id[2 * MAX_NAME_LEN];
+    file_id_of(user->name, file_id);
+    snprintf(path, PATH_MAX, "%s/" SPOOL_DIR "/%s.spool", HISTORY_PATH, file_id);
+}
+
+// Puts 'user' on the spooler's list. Under the spool lock.
+void spool_mark_pending(USER * user) {
+    if (user->spool.pending)
+        return;
+    user->spool.pending = true;
+    pthread_mutex_lock(&pending_lock);
+    grow_array((void **) &PENDING, &pending_cap, n_pending, sizeof(USER *));
+    PENDING[n_pending++] = user;
+    pthread_cond_signal(&pending_cond);
+    pthread_mutex_unlock(&pending_lock);
+}
+
+// Whether the spool of 'user' has no room for 'len' more bytes. A user
+// without a queue has SPOOL_USER_ABSENT bytes in all, memory and disk, so
+// messages to mistyped names and users gone for good stay bounded.
+bool spool_full(USER * user, size_t len) {
+    SPOOL * spool = &user->spool;
+    size_t on_disk = spool->disk_len - spool->disk_read;
+    if (user->queue_id < 0)
+        return spool->mem_bytes + on_disk + record_size(len) > SPOOL_USER_ABSENT;
+    return on_disk + record_size(len) > SPOOL_USER_DISK;
+}
+
+// Adds 'wire' to the end of the spool of 'user'. Under the spool lock.
+bool spool_push(USER * user, const WIRE_MSG * wire) {
+    SPOOL * spool = &user->spool;
+    size_t len = wire_size(wire);
+    __atomic_add_fetch(&SPOOL_TOTALS.spooled, 1, __ATOMIC_RELAXED);
+
+    // in memory while there is room and nothing is on disk, to keep the order
+    if (spool->disk_len == spool->disk_read && spool->mem_bytes + len <= SPOOL_USER_MEM &&
+            __atomic_load_n(&SPOOL_TOTALS.mem_bytes, __ATOMIC_RELAXED) + len <= SPOOL_TOTAL_MEM) {
+        SPOOL_ITEM * item = malloc(sizeof(SPOOL_ITEM) + len);
+        item->next = NULL;
+        item->len = len;
+        memcpy(item->wire, wire, len);
+        if (spool->tail == NULL)
+            spool->head = item;
+        else
+            spool->tail->next = item;
+        spool->tail = item;
+        ++spool->mem_msgs;
+        spool->mem_bytes += len;
+        __atomic_add_fetch(&SPOOL_TOTALS.mem_msgs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&SPOOL_TOTALS.mem_bytes, len, __ATOMIC_RELAXED);
+        spool_mark_pending(user);
+        return true;
+    }
+
+    char path[PATH_MAX];
+    spool_path(user, path);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    LOG_RECORD rec = {len, 0};
+    if (fd < 0 || pwrite(fd, wire, len, spool->disk_len + sizeof(rec)) != len ||
+            pwrite(fd, &rec, sizeof(rec), spool->disk_len) != sizeof(rec)) {
+        perror("Error in writing spool...\n");
+        if (fd >= 0)
+            close(fd);
+        __atomic_add_fetch(&SPOOL_TOTALS.dropped, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    close(fd);
+    spool->disk_len += record_size(len);
+    ++spool->disk_msgs;
+    __atomic_add_fetch(&SPOOL_TOTALS.spilled, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&SPOOL_TOTALS.disk_msgs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&SPOOL_TOTALS.disk_bytes, record_size(len), __ATOMIC_RELAXED);
+    spool_mark_pending(user);
+    return true;
+}
+
+// Gives up the rest of the spool file, it can't be read
+void spool_drop_disk(SPOOL * spool) {
+    __atomic_add_fetch(&SPOOL_TOTALS.dropped, spool->disk_msgs, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&SPOOL_TOTALS.disk_msgs, spool->disk_msgs, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&SPOOL_TOTALS.disk_bytes, spool->disk_len - spool->disk_read, __ATOMIC_RELAXED);
+    spool->disk_msgs = 0;
+    spool->disk_read = spool->disk_len;
+}
+
+// Reads the next batch of the spool file into memory, once memory is empty
+void spool_load(USER * user) {
+    SPOOL * spool = &user->spool;
+    char path[PATH_MAX];
+    spool_path(user, path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error in reading spool...\n");
+        spool_drop_disk(spool);
+    }
+
+    while (fd >= 0 && spool->disk_read < spool->disk_len && spool->mem_bytes < SPOOL_USER_MEM) {
+        LOG_RECORD rec;
+        SPOOL_ITEM * item = NULL;
+        if (pread(fd, &rec, sizeof(rec), spool->disk_read) != sizeof(rec) ||
+                record_size(rec.len) > spool->disk_len - spool->disk_read ||
+                (item = malloc(sizeof(SPOOL_ITEM) + rec.len)) == NULL ||
+                pread(fd, item->wire, rec.len, spool->disk_read + sizeof(rec)) != rec.len) {
+            free(item);
+            spool_drop_disk(spool);
+            break;
         }
+        item->next = NULL;
+        item->len = rec.len;
+        if (spool->tail == NULL)
+            spool->head = item;
+        else
+            spool->tail->next = item;
+        spool->tail = item;
+        ++spool->mem_msgs;
+        spool->mem_bytes += rec.len;
+        --spool->disk_msgs;
+        spool->disk_read += record_size(rec.len);
+        __atomic_add_fetch(&SPOOL_TOTALS.mem_msgs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&SPOOL_TOTALS.mem_bytes, rec.len, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&SPOOL_TOTALS.disk_msgs, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&SPOOL_TOTALS.disk_bytes, record_size(rec.len), __ATOMIC_RELAXED);
     }
-    else {
-        printf("Group '%s' full...\n", grp->name);
+    if (fd >= 0)
+        close(fd);
+
+    // all read, the file starts over
+    if (spool->disk_read == spool->disk_len) {
+        unlink(path);
+        spool->disk_read = spool->disk_len = 0;
+    }
+}
+
+// Hands 'wire' to the transport of 'user' without waiting. On its ring, a
+// message already in a slot is shared, others are copied into one. On its
+// queue, if the queue was removed since, it is resolved again and the send
+// retried. Fails with EAGAIN when there is no room, with ENOENT when the
+// user has no queue. Under the spool lock.
+int deliver(USER * user, const WIRE_MSG * wire) {
+    if (user->ring != NULL) {
+        int64_t idx = shm_slot_of(SHM_MAP, wire);
+        if (idx >= 0)
+            shm_slot_ref(SHM_MAP, idx);
+        else
+            idx = shm_slot_alloc(SHM_MAP, wire, wire_size(wire));
+        if (idx >= 0 && shm_ring_push(user->ring, idx))
+            return 0;
+        if (idx >= 0)
+            shm_slot_release(SHM_MAP, idx);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    int id = __atomic_load_n(&user->queue_id, __ATOMIC_RELAXED);
+    if (id < 0) {
+        errno = ENOENT;
         return -1;
     }
+    int ret = send_wire(id, wire, IPC_NOWAIT);
+    if (ret < 0 && (errno == EIDRM || errno == EINVAL)) {
+        id = find_queue_id(user->name);
+        __atomic_store_n(&user->queue_id, id, __ATOMIC_RELAXED);
+        if (id < 0) {
+            errno = ENOENT;
+            return -1;
+        }
+        ret = send_wire(id, wire, IPC_NOWAIT);
+    }
+    return ret;
 }
 
-int create_group(char * groupname, char * creator_name) {
-    bool group_exist = false;
-    for (size_t i = 0; i < N_GROUPS; ++i) {
-        if (strcmp(ALL_GROUPS[i].name, groupname) == 0) {
-            group_exist = true;
-            break;
+// Sends what the queue of 'user' has room for. Under the spool lock.
+// Returns true once the spool is empty.
+bool spool_drain(USER * user) {
+    SPOOL * spool = &user->spool;
+    while (true) {
+        if (spool->head == NULL && spool->disk_read < spool->disk_len)
+            spool_load(user);
+        SPOOL_ITEM * item = spool->head;
+        if (item == NULL)
+            return true;
+
+        if (deliver(user, (WIRE_MSG *) item->wire) < 0) {
+            if (errno != EAGAIN && errno != ENOENT)
+                perror("Error in msgsnd...\n");
+            return false;
         }
+
+        spool->head = item->next;
+        if (spool->head == NULL)
+            spool->tail = NULL;
+        --spool->mem_msgs;
+        spool->mem_bytes -= item->len;
+        __atomic_sub_fetch(&SPOOL_TOTALS.mem_msgs, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&SPOOL_TOTALS.mem_bytes, item->len, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&SPOOL_TOTALS.drained, 1, __ATOMIC_RELAXED);
+        free(item);
+        pthread_cond_broadcast(&spool->room);
     }
-    if (!group_exist) {
-        GROUP grp;
-        memset(&grp, 0, sizeof(GROUP));
-        grp.join_time[0] = time(NULL);
-        strcpy(grp.name, groupname);
-        grp.n_members = 1;
-        strcpy(grp.members[0], creator_name);
-        grp.old_msg.start_ptr = 0;
-        grp.old_msg.n_msg = 0;
-        grp.delete_time = 0;
-        ++N_GROUPS;
-        ALL_GROUPS[N_GROUPS++] = grp;
+}
 
-        return 0;
+// Retries the spools on its list every SPOOL_RETRY_MS until they are empty,
+// there is no telling when a queue has room again. Users without a queue are
+// let go, user_seen() puts them back once their client is.
+void * spooler_thread(void * args) {
+    USER ** users = NULL;
+    size_t n_users = 0, users_cap = 0;
+    while (true) {
+        pthread_mutex_lock(&pending_lock);
+        while (n_pending == 0 && n_users == 0)
+            pthread_cond_wait(&pending_cond, &pending_lock);
+        for (size_t i = 0; i < n_pending; ++i) {
+            grow_array((void **) &users, &users_cap, n_users, sizeof(USER *));
+            users[n_users++] = PENDING[i];
+        }
+        n_pending = 0;
+        pthread_mutex_unlock(&pending_lock);
+
+        size_t n_left = 0;
+        for (size_t i = 0; i < n_users; ++i) {
+            USER * user = users[i];
+            pthread_mutex_lock(&user->spool.lock);
+            if (spool_drain(user) || user->queue_id < 0)
+                user->spool.pending = false;
+            else
+                users[n_left++] = user;
+            pthread_mutex_unlock(&user->spool.lock);
+        }
+        n_users = n_left;
+
+        if (n_users > 0)
+            usleep(SPOOL_RETRY_MS * 1000);
     }
-    return -1;
+    return NULL;
 }
 
-void list_group(char * username) {
-    int id = get_queue_id(username);
-    MSG msg = {0};
-    
-    strcpy(msg.body, "");
-    for (size_t i = 0; i < N_GROUPS; ++i) {
-        strcat(msg.body, ALL_GROUPS[i].name);
-        strcat(msg.body, "\n");
+// Sends to 'user' without waiting, see deliver(). If there is no room, or
+// messages to the user are spooled already, 'wire' is spooled. Returns -1 on error; a message dropped by SPOOL_DROP is only counted.
+int send_to_user(USER * user, const WIRE_MSG * wire) {
+    SPOOL * spool = &user->spool;
+    pthread_mutex_lock(&spool->lock);
+
+    // a control message may pass what is spooled, it is received first anyway
+    int ret = 0;
+    if ((spool->head == NULL && spool->disk_len == 0) || wire->mtype == PRIO_CONTROL) {
+        ret = deliver(user, wire);
+        if (ret == 0 || (errno != EAGAIN && errno != ENOENT)) {
+            pthread_mutex_unlock(&spool->lock);
+            return ret;
+        }
     }
-    
-    msg.type = LIST_GROUP_MSG;
-    
-    if(msgsnd(id, &msg, sizeof(msg), 0) < 0)
-        perror("Error in msgsnd...\n");
+
+    // replies to 'list', 'stats' and 'search' are waited for, they are always
+    // spooled, as is the directory, which can't have a gap
+    bool reply = wire->type == LIST_GROUP_MSG || wire->type == STATS_MSG || wire->type == SEARCH_MSG ||
+        wire->type == DIRECTORY_MSG;
+    // nobody is there to wait for, a user without a queue is never blocked on
+    if (!reply && spool_full(user, wire_size(wire))) {
+        if (SPOOL_MODE == SPOOL_DROP || user->queue_id < 0) {
+            __atomic_add_fetch(&SPOOL_TOTALS.dropped, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&spool->lock);
+            return 0;
+        }
+        __atomic_add_fetch(&SPOOL_TOTALS.blocked, 1, __ATOMIC_RELAXED);
+        while (spool_full(user, wire_size(wire)) && user->queue_id >= 0)
+            pthread_cond_wait(&spool->room, &spool->lock);
+    }
+    ret = spool_push(user, wire) ? 0 : -1;
+    pthread_mutex_unlock(&spool->lock);
+    return ret;
+}
+
+// Whether messages to 'user' wait in its spool for room in its queue
+bool spool_backlog(USER * user) {
+    pthread_mutex_lock(&user->spool.lock);
+    bool backlog = user->spool.head != NULL || user->spool.disk_len > 0;
+    pthread_mutex_unlock(&user->spool.lock);
+    return backlog;
+}
+
+// Notes that the client of 'user' is there. If its queue was missing, it is
+// resolved again and what was spooled meanwhile is sent.
+void user_seen(USER * user) {
+    __atomic_store_n(&user->last_seen, time(NULL), __ATOMIC_RELAXED);
+    if (__atomic_load_n(&user->queue_id, __ATOMIC_RELAXED) >= 0)
+        return;
+    pthread_mutex_lock(&user->spool.lock);
+    if (user->queue_id < 0 && (user->queue_id = find_queue_id(user->name)) >= 0 &&
+            (user->spool.head != NULL || user->spool.disk_len > 0))
+        spool_mark_pending(user);
+    pthread_mutex_unlock(&user->spool.lock);
 }
 
-void send_private_msg(MSG * msg) {
-    int id = get_queue_id(msg->receiver);
-    if (msgsnd(id, msg, sizeof(MSG), 0) < 0)
+// Ends a page of the snapshot in 'msg' with "page" or "last" in its first line
+void directory_page_send(USER * user, MSG * msg, bool is_last) {
+    memcpy(msg->body, is_last ? "last" : "page", 4);
+    WIRE_MSG * wire = pack_msg(msg);
+    if (send_to_user(user, wire) < 0)
         perror("Error in msgsnd...\n");
+    free(wire);
+    msg->body_len = (char *) memchr(msg->body, '\n', msg->body_len) + 1 - msg->body;
 }
 
-int send_group_msg(MSG * msg) {
-    GROUP * grp = NULL;
-    for (size_t grp_idx = 0; grp_idx < N_GROUPS; ++grp_idx) {
-        if (strcmp(ALL_GROUPS[grp_idx].name, msg->group) == 0) {
-            grp = &ALL_GROUPS[grp_idx];
-            break;
+// Adds 'name' to the page in 'msg', sending it first if it is full
+void directory_page_add(USER * user, MSG * msg, const char * name) {
+    size_t name_len = strlen(name);
+    if (msg->body_len + name_len + 1 >= MAX_MSG_SIZE)
+        directory_page_send(user, msg, false);
+    memcpy(msg->body + msg->body_len, name, name_len);
+    msg->body[msg->body_len + name_len] = '\n';
+    msg->body_len += name_len + 1;
+}
+
+// Sends 'user' the names of all the groups, a line each, in as many
+// DIRECTORY_MSG as they take. The first line of each is "page <epoch>
+// <version>", "last" instead of "page" in the last one. Under
+// 'subscribers_lock', so the deltas after 'version' come after it.
+void directory_snapshot(USER * user) {
+    MSG msg = {0};
+    msg.type = DIRECTORY_MSG;
+    msg.body_len = snprintf(msg.body, MAX_MSG_SIZE, "page %ld %llu\n", DIR_EPOCH, (unsigned long long) DIR_VERSION);
+    for (size_t s = 0; s < NUM_SHARDS; ++s) {
+        SHARD * shard = &SHARDS[s];
+        pthread_rwlock_rdlock(&shard->lock);
+        for (size_t i = 0; i < shard->dir.n_groups; ++i)
+            directory_page_add(user, &msg, shard->dir.groups[i]->name);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    pthread_rwlock_rdlock(&REMOTE_GROUPS.lock);
+    for (size_t i = 0; i < REMOTE_GROUPS.n_names; ++i)
+        directory_page_add(user, &msg, REMOTE_GROUPS.names[i]);
+    pthread_rwlock_unlock(&REMOTE_GROUPS.lock);
+    directory_page_send(user, &msg, true);
+}
+
+// A client keeping a copy of the group names asks for them, with in 'body'
+// the epoch of the copy it has, if any. A subscriber of this epoch gets the
+// deltas already and is left alone, anyone else gets a snapshot and the
+// deltas after it.
+void directory_subscribe(USER * user, const char * body) {
+    long epoch = 0;
+    sscanf(body, "%ld", &epoch);
+    pthread_mutex_lock(&subscribers_lock);
+    if (!user->subscribed || epoch != DIR_EPOCH) {
+        if (!user->subscribed) {
+            grow_array((void **) &SUBSCRIBERS, &subscribers_cap, n_subscribers, sizeof(USER *));
+            SUBSCRIBERS[n_subscribers++] = user;
+            user->subscribed = true;
         }
+        directory_snapshot(user);
     }
-    if (grp == NULL) {
-        printf("Group '%s' not found...\n", msg->group);
-        return -1;
+    pthread_mutex_unlock(&subscribers_lock);
+}
+
+void directory_unsubscribe(USER * user) {
+    pthread_mutex_lock(&subscribers_lock);
+    for (size_t i = 0; i < n_subscribers && user->subscribed; ++i) {
+        if (SUBSCRIBERS[i] == user) {
+            SUBSCRIBERS[i] = SUBSCRIBERS[--n_subscribers];
+            user->subscribed = false;
+        }
     }
+    pthread_mutex_unlock(&subscribers_lock);
+}
 
-    for (size_t ii = 0; ii < grp->n_members; ++ii) {
-        int id = get_queue_id(grp->members[ii]);
-        if (msgsnd(id, msg, sizeof(MSG), 0) < 0)
-            perror("Error in msgsnd...\n");
+// Pushes to the subscribers that the group 'name' was created, 'op' '+', or
+// removed, '-', as a DIRECTORY_MSG of the first line "delta <epoch>
+// <version>" and a line of 'op' and the name. Groups are only ever created
+// for now, the clients take both.
+void directory_publish(char op, const char * name) {
+    MSG msg = {0};
+    msg.type = DIRECTORY_MSG;
+    pthread_mutex_lock(&subscribers_lock);
+    ++DIR_VERSION;
+    if (n_subscribers > 0) {
+        msg.body_len = snprintf(msg.body, MAX_MSG_SIZE, "delta %ld %llu\n%c%s\n", DIR_EPOCH,
+            (unsigned long long) DIR_VERSION, op, name);
+        WIRE_MSG * wire = pack_msg(&msg);
+        for (size_t i = 0; i < n_subscribers; ++i)
+            if (send_to_user(SUBSCRIBERS[i], wire) < 0)
+                perror("Error in msgsnd...\n");
+        free(wire);
     }
+    pthread_mutex_unlock(&subscribers_lock);
+}
 
-    msg->time = time(NULL);
-    add_old_msg(&(grp->old_msg), msg);
-    return 0;
+// Adds 'wire' to the list from 'head' to 'tail' of messages taken back from
+// the transport of a user, to go to the front of 'spool'
+void spool_take_back(SPOOL * spool, SPOOL_ITEM ** head, SPOOL_ITEM ** tail, const WIRE_MSG * wire, size_t len) {
+    SPOOL_ITEM * item = malloc(sizeof(SPOOL_ITEM) + len);
+    item->next = NULL;
+    item->len = len;
+    memcpy(item->wire, wire, len);
+    if (*tail == NULL)
+        *head = item;
+    else
+        (*tail)->next = item;
+    *tail = item;
+    ++spool->mem_msgs;
+    spool->mem_bytes += len;
+    __atomic_add_fetch(&SPOOL_TOTALS.spooled, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&SPOOL_TOTALS.mem_msgs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&SPOOL_TOTALS.mem_bytes, len, __ATOMIC_RELAXED);
 }
 
-int set_delete_time(MSG * msg) {
-    GROUP * grp = NULL;
-    for (size_t grp_idx = 0; grp_idx < N_GROUPS; ++grp_idx) {
-        if (strcmp(ALL_GROUPS[grp_idx].name, msg->group) == 0) {
-            grp = &ALL_GROUPS[grp_idx];
-            break;
+// Removes the queue of 'user' and releases its ring. What waits in them goes
+// to the front of its spool, as it is older than what is spooled, to be sent
+// if the user comes back, except the directory, sent in full again then.
+// Under the spool lock.
+void remove_queue(USER * user) {
+    SPOOL * spool = &user->spool;
+    SPOOL_ITEM * head = NULL, * tail = NULL;
+    if (user->queue_id >= 0) {
+        size_t cap = WIRE_BUF_SIZE;
+        WIRE_MSG * buf = malloc(cap);
+        ssize_t len;
+        while ((len = recv_wire(user->queue_id, &buf, &cap, IPC_NOWAIT)) >= 0)
+            if (buf->type != DIRECTORY_MSG)
+                spool_take_back(spool, &head, &tail, buf, len);
+        free(buf);
+        msgctl(user->queue_id, IPC_RMID, NULL);
+        user->queue_id = -1;
+    }
+    // sent on the ring since the user last sent on it, so newer
+    if (user->ring != NULL) {
+        uint32_t idx;
+        while (shm_ring_pop(user->ring, &idx)) {
+            SHM_SLOT * slot = shm_slot(SHM_MAP, idx);
+            const WIRE_MSG * wire = (const WIRE_MSG *) slot->data;
+            if (wire->type != DIRECTORY_MSG)
+                spool_take_back(spool, &head, &tail, wire, slot->len);
+            shm_slot_release(SHM_MAP, idx);
         }
+        shm_ring_release(SHM_MAP, user->ring);
+        user->ring = NULL;
     }
-    if (grp == NULL) {
-        printf("Group '%s' not found...\n", msg->group);
-        return -1;
+    if (tail != NULL) {
+        tail->next = spool->head;
+        spool->head = head;
+        if (spool->tail == NULL)
+            spool->tail = tail;
     }
 
-    grp->delete_time = msg->delete_time;
+    __atomic_add_fetch(&SPOOL_TOTALS.queues_removed, 1, __ATOMIC_RELAXED);
+    // senders waiting for room in the spool don't wait for a user who is gone
+    pthread_cond_broadcast(&spool->room);
+}
 
-    return 0;
+// Whether 'user' still has a queue or a ring to be removed
+bool has_transport(USER * user) {
+    return __atomic_load_n(&user->queue_id, __ATOMIC_RELAXED) >= 0 || __atomic_load_n(&user->ring, __ATOMIC_RELAXED) != NULL;
 }
 
-int main() {
-    N_GROUPS = 0;
-    
-    MSG msg;
+// Removes the queues and rings of the users of this server not seen for
+// PRESENCE_SEC at 'now'
+void gc_sweep(time_t now) {
+    USER ** users = NULL;
+    size_t n_users = 0, users_cap = 0;
+    pthread_rwlock_rdlock(&users_lock);
+    for (size_t b = 0; b < USERS.n_buckets; ++b) {
+        for (USER * user = USERS.buckets[b]; user != NULL; user = user->next) {
+            if (user->home != SERVER_INDEX || !has_transport(user) ||
+                    __atomic_load_n(&user->last_seen, __ATOMIC_RELAXED) + PRESENCE_SEC > now)
+                continue;
+            grow_array((void **) &users, &users_cap, n_users, sizeof(USER *));
+            users[n_users++] = user;
+        }
+    }
+    pthread_rwlock_unlock(&users_lock);
 
-    int id = get_queue_id("server");
+    for (size_t i = 0; i < n_users; ++i) {
+        USER * user = users[i];
+        pthread_mutex_lock(&user->spool.lock);
+        // seen again since, or removed by its client
+        bool is_removed = has_transport(user) && __atomic_load_n(&user->last_seen, __ATOMIC_RELAXED) + PRESENCE_SEC <= now;
+        if (is_removed)
+            remove_queue(user);
+        pthread_mutex_unlock(&user->spool.lock);
+        // it subscribes again when it comes back
+        if (is_removed)
+            directory_unsubscribe(user);
+    }
+    free(users);
+}
 
+// Sweeps every PRESENCE_SEC / 4 seconds up to GC_INTERVAL, so the kernel's
+// queues, the rings and the bytes in them stay bounded however many users
+// come and go.
+void * gc_thread(void * args) {
+    time_t interval = PRESENCE_SEC / 4;
+    if (interval < 1)
+        interval = 1;
+    else if (interval > GC_INTERVAL)
+        interval = GC_INTERVAL;
     while (true) {
-        if (msgrcv(id, &msg, sizeof(msg), 0, 0) < 0)
-            perror("Error in msgrcv...\n");
+        sleep(interval);
+        gc_sweep(time(NULL));
+    }
+    return NULL;
+}
 
-        if (fork() == 0) {
-            switch (msg.type) {
-                case PRIVATE_MSG: {
-                    send_private_msg(&msg);
-                    break;
-                }
-                
-                case GROUP_MSG: {
-                    send_group_msg(&msg);
-                    break;
-                }
+// Queues a frame for peer 'to': 'n_names' names taking 'names_len' bytes,
+// then 'wire' if not NULL. The frame is dropped if the peer is too far behind.
+void peer_send(size_t to, PEER_KIND kind, const char * names, size_t n_names, size_t names_len, const WIRE_MSG * wire) {
+    PEER * peer = &PEERS[to];
+    size_t wire_len = (wire != NULL) ? wire_size(wire) : 0;
+    size_t len = offsetof(PEER_MSG, data) + names_len + wire_len;
+    PEER_FRAME * frame = malloc(sizeof(PEER_FRAME) + len);
+    frame->next = NULL;
+    frame->len = len;
+    PEER_MSG * msg = (PEER_MSG *) frame->data;
+    msg->kind = kind;
+    msg->from = SERVER_INDEX;
+    msg->n_names = n_names;
+    msg->names_len = names_len;
+    if (names_len > 0)
+        memcpy(msg->data, names, names_len);
+    if (wire != NULL)
+        memcpy(msg->data + names_len, wire, wire_len);
 
-                case LIST_GROUP_MSG: {
-                    list_group(msg.sender);
-                    break;
-                }
+    pthread_mutex_lock(&peer->lock);
+    if (peer->queued + len > PEER_QUEUE_MAX) {
+        ++peer->dropped;
+        pthread_mutex_unlock(&peer->lock);
+        free(frame);
+        return;
+    }
+    if (peer->tail != NULL)
+        peer->tail->next = frame;
+    else
+        peer->head = frame;
+    peer->tail = frame;
+    peer->queued += len;
+    pthread_cond_signal(&peer->ready);
+    pthread_mutex_unlock(&peer->lock);
+}
 
-                case CREATE_GROUP_MSG: {
-                    create_group(msg.group, msg.sender);
-                    break;
-                }
+// Sends 'names' to peer 'to', with 'wire' if not NULL, in as few frames as they fit in
+void peer_send_names(size_t to, PEER_KIND kind, const char ** names, size_t n_names, const WIRE_MSG * wire) {
+    char buf[PEER_FRAME_MAX];
+    size_t room = PEER_FRAME_MAX - offsetof(PEER_MSG, data) - ((wire != NULL) ? wire_size(wire) : 0);
+    size_t len = 0, n = 0;
+    for (size_t i = 0; i < n_names; ++i) {
+        size_t name_len = strlen(names[i]) + 1;
+        if (len + name_len > room || n == UINT16_MAX) {
+            peer_send(to, kind, buf, n, len, wire);
+            len = n = 0;
+        }
+        memcpy(buf + len, names[i], name_len);
+        len += name_len;
+        ++n;
+    }
+    if (n > 0)
+        peer_send(to, kind, buf, n, len, wire);
+}
 
-                case JOIN_GROUP_MSG: {
-                    join_group(msg.group, msg.sender);
-                    break;
-                }
+// Sends to a user of this server, or has the server owning it do it
+int send_to_member(USER * user, const WIRE_MSG * wire) {
+    if (user->home == SERVER_INDEX)
+        return send_to_user(user, wire);
+    const char * name = user->name;
+    peer_send_names(user->home, PEER_DELIVER, &name, 1, wire);
+    return 0;
+}
+
+// Whether messages to 'user' wait for room, in its spool or on the way to its server
+bool user_backlog(USER * user) {
+    if (user->home == SERVER_INDEX)
+        return spool_backlog(user);
+    PEER * peer = &PEERS[user->home];
+    pthread_mutex_lock(&peer->lock);
+    bool backlog = peer->queued > PEER_BACKLOG;
+    pthread_mutex_unlock(&peer->lock);
+    return backlog;
+}
+
+// Picks up the spool files left by an earlier run
+void load_spools() {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/" SPOOL_DIR, HISTORY_PATH);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        perror("Error in creating spool directory...\n");
+        return;
+    }
+    DIR * dir = opendir(path);
+    if (dir == NULL)
+        return;
+
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char * dot = strchr(entry->d_name, '.');
+        char name[MAX_NAME_LEN];
+        if (dot == NULL || strcmp(dot, ".spool") != 0 || !name_of_file_id(entry->d_name, dot - entry->d_name, name))
+            continue;
+        char file[PATH_MAX + 256];
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (stat(file, &st) < 0 || st.st_size == 0)
+            continue;
+
+        // the records are counted, a torn last one is cut off; the padding
+        // of the last one is never written
+        int fd = open(file, O_RDONLY);
+        if (fd < 0)
+            continue;
+        size_t n_msgs = 0;
+        off_t len = 0;
+        LOG_RECORD rec;
+        while (pread(fd, &rec, sizeof(rec), len) == sizeof(rec) && sizeof(rec) + rec.len <= st.st_size - len) {
+            len += record_size(rec.len);
+            ++n_msgs;
+        }
+        close(fd);
+        if (n_msgs == 0) {
+            unlink(file);
+            continue;
+        }
+
+        USER * user = get_user(name);
+        pthread_mutex_lock(&user->spool.lock);
+        user->spool.disk_len = len;
+        user->spool.disk_msgs = n_msgs;
+        __atomic_add_fetch(&SPOOL_TOTALS.disk_msgs, n_msgs, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&SPOOL_TOTALS.disk_bytes, len, __ATOMIC_RELAXED);
+        spool_mark_pending(user);
+        pthread_mutex_unlock(&user->spool.lock);
+    }
+    closedir(dir);
+}
 
-                case AUTO_DELETE_MSG: {
-                    set_delete_time(&msg);
+// Totals of the spools and the users with the most messages spooled
+void spool_stats(char * body, size_t size) {
+    USER * deepest[SPOOL_STATS_TOP] = {0};
+    size_t depths[SPOOL_STATS_TOP] = {0}, n_spooling = 0, n_absent = 0;
+
+    pthread_rwlock_rdlock(&users_lock);
+    for (size_t b = 0; b < USERS.n_buckets; ++b) {
+        for (USER * user = USERS.buckets[b]; user != NULL; user = user->next) {
+            pthread_mutex_lock(&user->spool.lock);
+            size_t depth = user->spool.mem_msgs + user->spool.disk_msgs;
+            n_absent += user->home == SERVER_INDEX && user->queue_id < 0;
+            pthread_mutex_unlock(&user->spool.lock);
+            if (depth == 0)
+                continue;
+            ++n_spooling;
+            for (size_t i = 0; i < SPOOL_STATS_TOP; ++i) {
+                if (depth > depths[i]) {
+                    memmove(deepest + i + 1, deepest + i, (SPOOL_STATS_TOP - i - 1) * sizeof(USER *));
+                    memmove(depths + i + 1, depths + i, (SPOOL_STATS_TOP - i - 1) * sizeof(size_t));
+                    deepest[i] = user;
+                    depths[i] = depth;
                     break;
                 }
             }
         }
-        else {
-            wait(0);
+    }
+
+    SPOOL_STATS s;
+    s.mem_msgs = __atomic_load_n(&SPOOL_TOTALS.mem_msgs, __ATOMIC_RELAXED);
+    s.mem_bytes = __atomic_load_n(&SPOOL_TOTALS.mem_bytes, __ATOMIC_RELAXED);
+    s.disk_msgs = __atomic_load_n(&SPOOL_TOTALS.disk_msgs, __ATOMIC_RELAXED);
+    s.disk_bytes = __atomic_load_n(&SPOOL_TOTALS.disk_bytes, __ATOMIC_RELAXED);
+    s.spooled = __atomic_load_n(&SPOOL_TOTALS.spooled, __ATOMIC_RELAXED);
+    s.spilled = __atomic_load_n(&SPOOL_TOTALS.spilled, __ATOMIC_RELAXED);
+    s.drained = __atomic_load_n(&SPOOL_TOTALS.drained, __ATOMIC_RELAXED);
+    s.dropped = __atomic_load_n(&SPOOL_TOTALS.dropped, __ATOMIC_RELAXED);
+    s.blocked = __atomic_load_n(&SPOOL_TOTALS.blocked, __ATOMIC_RELAXED);
+    s.queues_removed = __atomic_load_n(&SPOOL_TOTALS.queues_removed, __ATOMIC_RELAXED);
+    size_t len = snprintf(body, size,
+        "spool policy %s, %zu users waiting\n"
+        "in memory %zu messages, %zu bytes\n"
+        "on disk   %zu messages, %zu bytes\n"
+        "spooled %zu, spilled %zu, drained %zu, dropped %zu, blocked %zu\n"
+        "presence %ld s, %zu users without a queue, %zu queues removed\n",
+        (SPOOL_MODE == SPOOL_DROP) ? "drop" : "block", n_spooling,
+        s.mem_msgs, s.mem_bytes, s.disk_msgs, s.disk_bytes,
+        s.spooled, s.spilled, s.drained, s.dropped, s.blocked,
+        (long) PRESENCE_SEC, n_absent, s.queues_removed);
+    for (size_t i = 0; i < SPOOL_STATS_TOP && deepest[i] != NULL && len < size; ++i)
+        len += snprintf(body + len, size - len, "  %-*s %zu\n", MAX_NAME_LEN, deepest[i]->name, depths[i]);
+    pthread_rwlock_unlock(&users_lock);
+}
+
+// Maps 'len' bytes of a segment file, or returns NULL
+char * map_segment(GROUP * grp, uint64_t seq, size_t len, bool writable) {
+    char path[PATH_MAX];
+    segment_path(grp, seq, path);
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    char * map = mmap(NULL, len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    if (writable)
+        __atomic_add_fetch(&N_MAPPED, 1, __ATOMIC_RELAXED);
+    return map;
+}
+
+void unmap_last_segment(HISTORY * hist) {
+    if (hist->map == NULL)
+        return;
+    munmap(hist->map, hist->map_len);
+    hist->map = NULL;
+    __atomic_sub_fetch(&N_MAPPED, 1, __ATOMIC_RELAXED);
+}
+
+bool resize_segment(GROUP * grp, SEGMENT * seg, size_t cap) {
+    char path[PATH_MAX];
+    segment_path(grp, seg->seq, path);
+    int fd = open(path, O_RDWR);
+    if (fd < 0 || ftruncate(fd, cap) < 0) {
+        perror("Error in resizing history segment...\n");
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    close(fd);
+    seg->cap = cap;
+    return true;
+}
+
+SEGMENT * new_segment(GROUP * grp) {
+    HISTORY * hist = &grp->history;
+    unmap_last_segment(hist);
+
+    SEGMENT seg = {0};
+    seg.seq = hist->next_seq++;
+    seg.start = seg.len = strlen(LOG_MAGIC);
+    seg.cap = SEGMENT_MIN_SIZE;
+    seg.last_time = time(NULL);
+
+    char path[PATH_MAX];
+    segment_path(grp, seg.seq, path);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, LOG_MAGIC, seg.len) != seg.len || ftruncate(fd, seg.cap) < 0) {
+        perror("Error in creating history segment...\n");
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    grow_array((void **) &hist->segs, &hist->segs_cap, hist->n_segs, sizeof(SEGMENT));
+    hist->segs[hist->n_segs++] = seg;
+    hist->total_len += seg.len;
+    return &hist->segs[hist->n_segs - 1];
+}
+
+// The bytes of a segment counted in the size of its log
+size_t segment_bytes(const SEGMENT * seg) {
+    return seg->len - seg->start + strlen(LOG_MAGIC);
+}
+
+void drop_oldest_segment(GROUP * grp) {
+    HISTORY * hist = &grp->history;
+    SEGMENT * seg = &hist->segs[0];
+    if (hist->n_segs == 1)
+        unmap_last_segment(hist);
+    char path[PATH_MAX];
+    segment_path(grp, seg->seq, path);
+    unlink(path);
+    hist->total_len -= segment_bytes(seg);
+    free(seg->index);
+    --hist->n_segs;
+    memmove(hist->segs, hist->segs + 1, hist->n_segs * sizeof(SEGMENT));
+}
+
+// Drops the oldest segments while the log is over HISTORY_MAX_BYTES
+void history_retain(GROUP * grp) {
+    while (grp->history.n_segs > 0 && grp->history.total_len > HISTORY_MAX_BYTES)
+        drop_oldest_segment(grp);
+}
+
+// The place of a record in the history of its group, growing as it is appended to
+uint64_t history_position(uint64_t seq, size_t offset) {
+    return (seq << 32) | offset;
+}
+
+// The position of the oldest record kept, those before it expired
+uint64_t history_oldest(HISTORY * hist) {
+    if (hist->n_segs == 0)
+        return history_position(hist->next_seq, 0);
+    return history_position(hist->segs[0].seq, hist->segs[0].start);
+}
+
+// A term is a run of letters and digits, case folded, cut at SEARCH_TERM_MAX
+// bytes and kept by its 64-bit hash. Writes the distinct terms of 'text' to
+// 'terms' in ascending order, at most 'max', and returns how many.
+int compare_term(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+size_t search_terms(const char * text, size_t len, uint64_t * terms, size_t max) {
+    size_t n = 0;
+    for (size_t i = 0; i < len && n < max; ) {
+        if (!isalnum((unsigned char) text[i])) {
+            ++i;
+            continue;
         }
+        // FNV-1a, 0 marks an empty slot of the tail
+        uint64_t h = 14695981039346656037ULL;
+        size_t term_len = 0;
+        for (; i < len && isalnum((unsigned char) text[i]); ++i, ++term_len)
+            if (term_len < SEARCH_TERM_MAX)
+                h = (h ^ (unsigned char) tolower((unsigned char) text[i])) * 1099511628211ULL;
+        terms[n++] = (h == 0) ? 1 : h;
     }
+    qsort(terms, n, sizeof(uint64_t), compare_term);
+    size_t n_distinct = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (n_distinct == 0 || terms[n_distinct - 1] != terms[i])
+            terms[n_distinct++] = terms[i];
+    return n_distinct;
+}
 
-}
\ No newline at end of file
+size_t tail_slot(SEARCH_INDEX * index, uint64_t term) {
+    size_t slot = term & (index->tail_cap - 1);
+    while (index->tail[slot].term != 0 && index->tail[slot].term != term)
+        slot = (slot + 1) & (index->tail_cap - 1);
+    return slot;
+}
+
+void index_path(GROUP * grp, uint64_t seq, char * path) {
+    snprintf(path, PATH_MAX, "%s/%s.%016llx.idx", HISTORY_PATH, grp->file_id, (unsigned long long) seq);
+}
+
+size_t put_varint(uint8_t * p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+uint64_t get_varint(const uint8_t ** p, const uint8_t * end) {
+    uint64_t v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t b = *(*p)++;
+        v |= (uint64_t) (b & 0x7f) << shift;
+        if (b < 0x80)
+            break;
+    }
+    return v;
+}
+
+// The entry of 'term' in a run, binary searched, or NULL
+const RUN_TERM * run_term(const RUN * run, uint64_t term) {
+    const RUN_HEADER * hdr = (const RUN_HEADER *) run->map;
+    const RUN_TERM * terms = (const RUN_TERM *) (run->map + sizeof(RUN_HEADER));
+    size_t lo = 0, hi = hdr->n_terms;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (terms[mid].term < term)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < hdr->n_terms && terms[lo].term == term) ? &terms[lo] : NULL;
+}
+
+// Maps the run file 'seq' and checks it. Returns false if it is unusable.
+bool map_run(GROUP * grp, uint64_t seq, RUN * run) {
+    char path[PATH_MAX];
+    index_path(grp, seq, path);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof(RUN_HEADER)) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    char * map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    const RUN_HEADER * hdr = (const RUN_HEADER *) map;
+    if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->n_terms > (st.st_size - sizeof(RUN_HEADER)) / sizeof(RUN_TERM)) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    run->seq = seq;
+    run->map = map;
+    run->len = st.st_size;
+    return true;
+}
+
+// Writes a run of 'n_terms' terms, ascending, whose postings are encoded
+// back to back in 'postings', then maps it. It is written to a temporary
+// file first, so a run file is always whole.
+bool write_run(GROUP * grp, RUN_HEADER * hdr, RUN_TERM * terms, const uint8_t * postings, size_t postings_len, RUN * run) {
+    SEARCH_INDEX * index = &grp->search;
+    uint64_t seq = index->next_seq++;
+    size_t base = sizeof(RUN_HEADER) + hdr->n_terms * sizeof(RUN_TERM);
+    for (size_t i = 0; i < hdr->n_terms; ++i)
+        terms[i].offset += base;
+    memcpy(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic));
+
+    char path[PATH_MAX], tmp[PATH_MAX + 4];
+    index_path(grp, seq, path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool is_written = fd >= 0 && write(fd, hdr, sizeof(RUN_HEADER)) == sizeof(RUN_HEADER) &&
+        write(fd, terms, hdr->n_terms * sizeof(RUN_TERM)) == hdr->n_terms * sizeof(RUN_TERM) &&
+        write(fd, postings, postings_len) == postings_len;
+    if (fd >= 0)
+        close(fd);
+    if (!is_written || rename(tmp, path) < 0 || !map_run(grp, seq, run)) {
+        perror("Error in writing search index...\n");
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+void drop_run(GROUP * grp, size_t i) {
+    SEARCH_INDEX * index = &grp->search;
+    char path[PATH_MAX];
+    index_path(grp, index->runs[i].seq, path);
+    unlink(path);
+    munmap(index->runs[i].map, index->runs[i].len);
+    --index->n_runs;
+    memmove(index->runs + i, index->runs + i + 1, (index->n_runs - i) * sizeof(RUN));
+}
+
+// Decodes the postings of 'term' in 'run', newest first, after 'n' already in 'pos'
+size_t run_postings(const RUN * run, const RUN_TERM * term, uint64_t * pos, size_t n) {
+    const uint8_t * p = (const uint8_t *) run->map + term->offset, * end = p + term->len;
+    for (size_t i = 0; i < term->count; ++i, ++n)
+        pos[n] = (i == 0) ? get_varint(&p, end) : pos[n - 1] - get_varint(&p, end);
+    return n;
+}
+
+size_t encode_postings(const uint64_t * pos, size_t n, uint8_t * out) {
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i)
+        len += put_varint(out + len, (i == 0) ? pos[0] : pos[i - 1] - pos[i]);
+    return len;
+}
+
+// Merges the two newest runs into one, the postings of a term in the newer
+// run coming before those in the older one
+void merge_runs(GROUP * grp) {
+    SEARCH_INDEX * index = &grp->search;
+    RUN * older = &index->runs[index->n_runs - 2], * newer = &index->runs[index->n_runs - 1];
+    const RUN_HEADER * ho = (const RUN_HEADER *) older->map, * hn = (const RUN_HEADER *) newer->map;
+    const RUN_TERM * to = (const RUN_TERM *) (older->map + sizeof(RUN_HEADER));
+    const RUN_TERM * tn = (const RUN_TERM *) (newer->map + sizeof(RUN_HEADER));
+
+    RUN_HEADER hdr = {{0}, 0, ho->n_postings + hn->n_postings, ho->min_pos, hn->max_pos};
+    RUN_TERM * terms = malloc((ho->n_terms + hn->n_terms) * sizeof(RUN_TERM));
+    // a varint of a difference is never longer than 10 bytes
+    uint8_t * postings = malloc(10 * hdr.n_postings + 1);
+    uint64_t * pos = NULL;
+    size_t pos_cap = 0, len = 0;
+    for (size_t i = 0, j = 0; i < ho->n_terms || j < hn->n_terms; ++hdr.n_terms) {
+        const RUN_TERM * a = (i < ho->n_terms && (j == hn->n_terms || to[i].term <= tn[j].term)) ? &to[i] : NULL;
+        const RUN_TERM * b = (j < hn->n_terms && (i == ho->n_terms || tn[j].term <= to[i].term)) ? &tn[j] : NULL;
+        size_t count = (a ? a->count : 0) + (b ? b->count : 0);
+        if (count > pos_cap) {
+            pos_cap = count;
+            pos = realloc(pos, pos_cap * sizeof(uint64_t));
+        }
+        size_t n = b ? run_postings(newer, b, pos, 0) : 0;
+        n = a ? run_postings(older, a, pos, n) : n;
+        RUN_TERM * t = &terms[hdr.n_terms];
+        t->term = a ? a->term : b->term;
+        t->offset = len;
+        t->count = n;
+        t->len = encode_postings(pos, n, postings + len);
+        len += t->len;
+        i += a != NULL;
+        j += b != NULL;
+    }
+
+    RUN run;
+    if (write_run(grp, &hdr, terms, postings, len, &run)) {
+        drop_run(grp, index->n_runs - 1);
+        drop_run(grp, index->n_runs - 1);
+        index->runs[index->n_runs++] = run;
+    }
+    free(pos);
+    free(postings);
+    free(terms);
+}
+
+// Drops the runs of only expired messages
+void search_prune(GROUP * grp) {
+    SEARCH_INDEX * index = &grp->search;
+    uint64_t oldest = history_oldest(&grp->history);
+    while (index->n_runs > 0 && ((const RUN_HEADER *) index->runs[0].map)->max_pos < oldest)
+        drop_run(grp, 0);
+}
+
+// Writes the postings in memory as a new run, then merges the newest runs
+// while the newer of the two is at least half the size of the older one, so
+// a group has about log2 of its postings over SEARCH_FLUSH runs
+void search_flush(GROUP * grp) {
+    SEARCH_INDEX * index = &grp->search;
+    if (index->n_tail == 0)
+        return;
+    RUN_HEADER hdr = {{0}, 0, index->n_tail, UINT64_MAX, 0};
+    RUN_TERM * terms = malloc(index->n_tail_terms * sizeof(RUN_TERM));
+    for (size_t s = 0; s < index->tail_cap; ++s) {
+        TAIL_TERM * t = &index->tail[s];
+        if (t->term == 0)
+            continue;
+        terms[hdr.n_terms++] = (RUN_TERM) {t->term, s, t->n, 0};
+        if (t->pos[0] < hdr.min_pos)
+            hdr.min_pos = t->pos[0];
+        if (t->pos[t->n - 1] > hdr.max_pos)
+            hdr.max_pos = t->pos[t->n - 1];
+    }
+    qsort(terms, hdr.n_terms, sizeof(RUN_TERM), compare_term);
+
+    uint8_t * postings = malloc(10 * hdr.n_postings);
+    uint64_t * pos = NULL;
+    size_t pos_cap = 0, len = 0;
+    for (size_t i = 0; i < hdr.n_terms; ++i) {
+        TAIL_TERM * t = &index->tail[terms[i].offset];
+        if (t->n > pos_cap) {
+            pos_cap = t->n;
+            pos = realloc(pos, pos_cap * sizeof(uint64_t));
+        }
+        for (size_t k = 0; k < t->n; ++k)
+            pos[k] = t->pos[t->n - 1 - k];
+        terms[i].offset = len;
+        terms[i].len = encode_postings(pos, t->n, postings + len);
+        len += terms[i].len;
+    }
+
+    RUN run;
+    if (write_run(grp, &hdr, terms, postings, len, &run)) {
+        grow_array((void **) &index->runs, &index->runs_cap, index->n_runs, sizeof(RUN));
+        index->runs[index->n_runs++] = run;
+        for (size_t s = 0; s < index->tail_cap; ++s)
+            free(index->tail[s].pos);
+        free(index->tail);
+        index->tail = NULL;
+        index->tail_cap = index->n_tail_terms = index->n_tail = 0;
+    }
+    free(pos);
+    free(postings);
+    free(terms);
+
+    search_prune(grp);
+    while (index->n_runs >= 2 && 2 * ((const RUN_HEADER *) index->runs[index->n_runs - 1].map)->n_postings >=
+            ((const RUN_HEADER *) index->runs[index->n_runs - 2].map)->n_postings)
+        merge_runs(grp);
+}
+
+// Indexes the terms of the body of 'wire', the record at 'pos'
+void search_add(GROUP * grp, uint64_t pos, const WIRE_MSG * wire) {
+    SEARCH_INDEX * index = &grp->search;
+    uint64_t terms[MAX_MSG_SIZE / 2];
+    const char * body = wire->data + wire->sender_len + wire->receiver_len + wire->group_len;
+    size_t n_terms = search_terms(body, wire->body_len, terms, MAX_MSG_SIZE / 2);
+
+    if (2 * (index->n_tail_terms + n_terms) > index->tail_cap) {
+        TAIL_TERM * old = index->tail;
+        size_t old_cap = index->tail_cap;
+        index->tail_cap = (old_cap > 0) ? 2 * old_cap : SEARCH_TAIL_SIZE;
+        while (2 * (index->n_tail_terms + n_terms) > index->tail_cap)
+            index->tail_cap *= 2;
+        index->tail = calloc(index->tail_cap, sizeof(TAIL_TERM));
+        for (size_t s = 0; s < old_cap; ++s)
+            if (old[s].term != 0)
+                index->tail[tail_slot(index, old[s].term)] = old[s];
+        free(old);
+    }
+    for (size_t i = 0; i < n_terms; ++i) {
+        TAIL_TERM * t = &index->tail[tail_slot(index, terms[i])];
+        if (t->term == 0) {
+            t->term = terms[i];
+            ++index->n_tail_terms;
+        }
+        grow_array((void **) &t->pos, &t->cap, t->n, sizeof(uint64_t));
+        t->pos[t->n++] = pos;
+    }
+    index->n_tail += n_terms;
+    index->indexed = pos;
+    if (index->n_tail >= SEARCH_FLUSH)
+        search_flush(grp);
+}
+
+// Seconds the messages of 'grp' are kept for: its delete time, at most HISTORY_MAX_AGE
+time_t group_retention(GROUP * grp) {
+    if (grp->delete_time > 0 && grp->delete_time < HISTORY_MAX_AGE)
+        return grp->delete_time;
+    return HISTORY_MAX_AGE;
+}
+
+void wheel_add(WHEEL * wheel, GROUP * grp, time_t expires) {
+    grp->timer_at = expires;
+    // an empty wheel has nothing to catch up on
+    time_t now = time(NULL);
+    if (wheel->n_timers == 0 && wheel->next < now)
+        wheel->next = now;
+    if (expires < wheel->next)
+        expires = wheel->next;
+
+    time_t delta = expires - wheel->next;
+    size_t level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (time_t) 1 << (WHEEL_BITS * (level + 1)))
+        ++level;
+    if (delta >= (time_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))
+        expires = wheel->next + ((time_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    GROUP ** slot = &wheel->slots[level][(expires >> (WHEEL_BITS * level)) & ((1 << WHEEL_BITS) - 1)];
+    grp->timer_next = *slot;
+    if (*slot != NULL)
+        (*slot)->timer_pprev = &grp->timer_next;
+    *slot = grp;
+    grp->timer_pprev = slot;
+    ++wheel->n_timers;
+}
+
+void wheel_remove(WHEEL * wheel, GROUP * grp) {
+    if (grp->timer_pprev == NULL)
+        return;
+    *grp->timer_pprev = grp->timer_next;
+    if (grp->timer_next != NULL)
+        grp->timer_next->timer_pprev = grp->timer_pprev;
+    grp->timer_pprev = NULL;
+    --wheel->n_timers;
+}
+
+// Fires the second wheel->next: the slots above it coming up are first moved
+// down a level, then the groups of its slot are appended to 'fired'
+void wheel_tick(WHEEL * wheel, GROUP *** fired, size_t * n_fired, size_t * fired_cap) {
+    time_t t = wheel->next;
+    size_t mask = (1 << WHEEL_BITS) - 1;
+    for (size_t level = 1; level < WHEEL_LEVELS && ((t >> (WHEEL_BITS * (level - 1))) & mask) == 0; ++level) {
+        GROUP * grp = wheel->slots[level][(t >> (WHEEL_BITS * level)) & mask];
+        while (grp != NULL) {
+            GROUP * next = grp->timer_next;
+            wheel_remove(wheel, grp);
+            wheel_add(wheel, grp, grp->timer_at);
+            grp = next;
+        }
+    }
+
+    GROUP ** slot = &wheel->slots[0][t & mask];
+    while (*slot != NULL) {
+        GROUP * grp = *slot;
+        wheel_remove(wheel, grp);
+        grow_array((void **) fired, fired_cap, *n_fired, sizeof(GROUP *));
+        (*fired)[(*n_fired)++] = grp;
+    }
+    wheel->next = t + 1;
+}
+
+// The time the oldest stride of the history of 'grp' expires, 0 if it is empty
+time_t history_expiry(GROUP * grp) {
+    HISTORY * hist = &grp->history;
+    if (hist->n_segs == 0)
+        return 0;
+    SEGMENT * seg = &hist->segs[0];
+    time_t oldest = (seg->n_index > 0) ? seg->index[0].last_time : seg->last_time;
+    return oldest + group_retention(grp);
+}
+
+// Puts 'grp' on the timer wheel for its next expiry
+void history_schedule(GROUP * grp) {
+    time_t expires = history_expiry(grp);
+    if (expires == grp->expires)
+        return;
+    grp->expires = expires;
+    wheel_remove(&grp->shard->wheel, grp);
+    if (expires > 0)
+        wheel_add(&grp->shard->wheel, grp, expires);
+}
+
+// Drops the first 'n' strides of the oldest segment. Its first record points
+// past them, and the whole blocks they took are freed in the file.
+void trim_segment(GROUP * grp, SEGMENT * seg, size_t n) {
+    HISTORY * hist = &grp->history;
+    size_t start = seg->index[n].offset;
+    LOG_RECORD mark = {0, start};
+    char path[PATH_MAX];
+    segment_path(grp, seg->seq, path);
+    int fd = open(path, O_RDWR);
+    if (fd < 0 || pwrite(fd, &mark, sizeof(mark), strlen(LOG_MAGIC)) != sizeof(mark)) {
+        perror("Error in expiring history...\n");
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    // the first block holds the mark, a file system without holes keeps the rest
+    size_t hole_end = start & ~(size_t) (HOLE_ALIGN - 1);
+    if (hole_end > HOLE_ALIGN)
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, HOLE_ALIGN, hole_end - HOLE_ALIGN);
+    close(fd);
+
+    hist->total_len -= start - seg->start;
+    seg->start = start;
+    seg->n_records -= n * INDEX_STRIDE;
+    seg->n_index -= n;
+    memmove(seg->index, seg->index + n, seg->n_index * sizeof(INDEX_ENTRY));
+    if (seg->index_cap > 4 && seg->n_index < seg->index_cap / 4) {
+        seg->index_cap /= 2;
+        seg->index = realloc(seg->index, seg->index_cap * sizeof(INDEX_ENTRY));
+    }
+}
+
+// Drops the messages of 'grp' older than its retention, a segment or a stride
+// at a time, then puts the group back on the timer wheel for the next ones
+void history_expire(GROUP * grp, time_t now) {
+    HISTORY * hist = &grp->history;
+    time_t cutoff = now - group_retention(grp);
+    while (hist->n_segs > 0 && hist->segs[0].last_time <= cutoff)
+        drop_oldest_segment(grp);
+    if (hist->n_segs > 0) {
+        SEGMENT * seg = &hist->segs[0];
+        size_t n = 0;
+        while (n < seg->n_index && seg->index[n].last_time <= cutoff)
+            ++n;
+        if (n > 0)
+            trim_segment(grp, seg, n);
+    }
+    search_prune(grp);
+    history_schedule(grp);
+}
+
+// Fires the timer wheel of 'shard' up to now, expiring the history of the groups due
+void expire_groups(SHARD * shard, GROUP *** fired, size_t * fired_cap) {
+    time_t now = time(NULL);
+    size_t n_fired = 0;
+    while (shard->wheel.n_timers > 0 && shard->wheel.next <= now)
+        wheel_tick(&shard->wheel, fired, &n_fired, fired_cap);
+    for (size_t i = 0; i < n_fired; ++i) {
+        (*fired)[i]->expires = 0;
+        history_expire((*fired)[i], now);
+    }
+}
+
+void index_record(SEGMENT * seg, time_t time, size_t offset) {
+    if (seg->n_records % INDEX_STRIDE == 0) {
+        grow_array((void **) &seg->index, &seg->index_cap, seg->n_index, sizeof(INDEX_ENTRY));
+        seg->index[seg->n_index++] = (INDEX_ENTRY) {time, time, offset};
+    }
+    seg->index[seg->n_index - 1].last_time = time;
+    ++seg->n_records;
+    seg->last_time = time;
+}
+
+// Appends 'wire' to the history of 'grp'. The last segment is written through
+// its mapping, or with pwrite if MAX_MAPPED_SEGMENTS are mapped already.
+void history_append(GROUP * grp, const WIRE_MSG * wire) {
+    HISTORY * hist = &grp->history;
+    size_t len = wire_size(wire), rec_size = record_size(len);
+
+    SEGMENT * seg = (hist->n_segs > 0) ? &hist->segs[hist->n_segs - 1] : NULL;
+    if (seg == NULL || seg->len + rec_size > SEGMENT_MAX_SIZE)
+        seg = new_segment(grp);
+    if (seg == NULL)
+        return;
+
+    if (seg->len + rec_size > seg->cap) {
+        size_t cap = seg->cap;
+        while (cap < seg->len + rec_size)
+            cap *= 2;
+        unmap_last_segment(hist);
+        if (!resize_segment(grp, seg, cap))
+            return;
+    }
+    if (hist->map == NULL && __atomic_load_n(&N_MAPPED, __ATOMIC_RELAXED) < MAX_MAPPED_SEGMENTS) {
+        hist->map = map_segment(grp, seg->seq, seg->cap, true);
+        hist->map_len = seg->cap;
+    }
+
+    // the record, then its length, so a torn write is never read back
+    LOG_RECORD rec = {len, 0};
+    if (hist->map != NULL) {
+        memcpy(hist->map + seg->len + sizeof(rec), wire, len);
+        memcpy(hist->map + seg->len, &rec, sizeof(rec));
+    }
+    else {
+        char path[PATH_MAX];
+        segment_path(grp, seg->seq, path);
+        int fd = open(path, O_WRONLY);
+        if (fd < 0 || pwrite(fd, wire, len, seg->len + sizeof(rec)) != len ||
+                pwrite(fd, &rec, sizeof(rec), seg->len) != sizeof(rec)) {
+            perror("Error in appending to history...\n");
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+        close(fd);
+    }
+
+    index_record(seg, wire->time, seg->len);
+    search_add(grp, history_position(seg->seq, seg->len), wire);
+    seg->len += rec_size;
+    hist->total_len += rec_size;
+    history_retain(grp);
+    if (grp->expires == 0)
+        history_schedule(grp);
+}
+
+// Returns the data of the segment at 'pos', mapping it if needed
+const char * history_data(GROUP * grp, HISTORY_POS * pos, SEGMENT * seg) {
+    HISTORY * hist = &grp->history;
+    if (seg == &hist->segs[hist->n_segs - 1] && hist->map != NULL)
+        return hist->map;
+    if (pos->map != NULL && (pos->map_seq != seg->seq || pos->map_len < seg->len)) {
+        munmap(pos->map, pos->map_len);
+        pos->map = NULL;
+    }
+    if (pos->map == NULL) {
+        pos->map = map_segment(grp, seg->seq, seg->len, false);
+        pos->map_len = seg->len;
+        pos->map_seq = seg->seq;
+    }
+    return pos->map;
+}
+
+// The segment at 'pos', or the oldest one after it if it was dropped
+SEGMENT * history_segment(HISTORY * hist, HISTORY_POS * pos) {
+    size_t lo = 0, hi = hist->n_segs;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (hist->segs[mid].seq < pos->seq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == hist->n_segs)
+        return NULL;
+    if (hist->segs[lo].seq != pos->seq) {
+        pos->seq = hist->segs[lo].seq;
+        pos->offset = hist->segs[lo].start;
+    }
+    // expired meanwhile
+    if (pos->offset < hist->segs[lo].start)
+        pos->offset = hist->segs[lo].start;
+    return &hist->segs[lo];
+}
+
+// Places 'pos' at the first message of the history newer than 'after': the
+// segment and its sparse index are binary searched, then the records scanned
+void history_seek(GROUP * grp, time_t after, HISTORY_POS * pos) {
+    HISTORY * hist = &grp->history;
+    memset(pos, 0, sizeof(HISTORY_POS));
+
+    size_t lo = 0, hi = hist->n_segs;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (hist->segs[mid].last_time <= after)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == hist->n_segs) {
+        // nothing newer, at the end for what is appended from now on
+        pos->seq = (hist->n_segs > 0) ? hist->segs[hist->n_segs - 1].seq : hist->next_seq;
+        pos->offset = (hist->n_segs > 0) ? hist->segs[hist->n_segs - 1].len : strlen(LOG_MAGIC);
+        return;
+    }
+    SEGMENT * seg = &hist->segs[lo];
+    pos->seq = seg->seq;
+    pos->offset = seg->start;
+
+    size_t ilo = 0, ihi = seg->n_index;
+    while (ilo < ihi) {
+        size_t mid = (ilo + ihi) / 2;
+        if (seg->index[mid].time <= after)
+            ilo = mid + 1;
+        else
+            ihi = mid;
+    }
+    if (ilo > 0)
+        pos->offset = seg->index[ilo - 1].offset;
+
+    const char * data = history_data(grp, pos, seg);
+    while (data != NULL && pos->offset < seg->len) {
+        LOG_RECORD rec;
+        memcpy(&rec, data + pos->offset, sizeof(rec));
+        const WIRE_MSG * wire = (const WIRE_MSG *) (data + pos->offset + sizeof(rec));
+        if (wire->time > after)
+            break;
+        pos->offset += record_size(rec.len);
+    }
+}
+
+// Sends 'user' up to REPLAY_BATCH messages from 'pos' on.
+// Returns false once the end of the history is reached.
+bool history_replay(GROUP * grp, HISTORY_POS * pos, USER * user) {
+    HISTORY * hist = &grp->history;
+    // sent in the replay class, from a copy as the log is mapped read only
+    long copy[(offsetof(WIRE_MSG, data) + 3 * MAX_NAME_LEN + MAX_MSG_SIZE) / sizeof(long) + 1];
+    WIRE_MSG * replayed = (WIRE_MSG *) copy;
+    SEGMENT * seg = history_segment(hist, pos);
+    for (size_t n = 0; n < REPLAY_BATCH; ) {
+        if (seg == NULL)
+            return false;
+        if (pos->offset >= seg->len) {
+            if (seg == &hist->segs[hist->n_segs - 1])
+                return false;
+            ++seg;
+            pos->seq = seg->seq;
+            pos->offset = seg->start;
+            continue;
+        }
+
+        const char * data = history_data(grp, pos, seg);
+        if (data == NULL)
+            return false;
+        LOG_RECORD rec;
+        memcpy(&rec, data + pos->offset, sizeof(rec));
+        if (rec.len <= sizeof(copy)) {
+            memcpy(replayed, data + pos->offset + sizeof(rec), rec.len);
+            replayed->mtype = PRIO_REPLAY;
+            if (send_to_member(user, replayed) < 0)
+                perror("Error in msgsnd...\n");
+        }
+        pos->offset += record_size(rec.len);
+        ++n;
+    }
+    return true;
+}
+
+void history_pos_close(HISTORY_POS * pos) {
+    if (pos->map != NULL)
+        munmap(pos->map, pos->map_len);
+    pos->map = NULL;
+}
+
+// Rebuilds the index of a segment found at startup
+void load_segment(GROUP * grp, uint64_t seq) {
+    HISTORY * hist = &grp->history;
+    SEGMENT seg = {0};
+    seg.seq = seq;
+
+    char path[PATH_MAX];
+    segment_path(grp, seq, path);
+    struct stat st;
+    if (stat(path, &st) < 0 || st.st_size < strlen(LOG_MAGIC))
+        return;
+    seg.cap = st.st_size;
+    char * data = map_segment(grp, seq, seg.cap, false);
+    if (data == NULL || memcmp(data, LOG_MAGIC, strlen(LOG_MAGIC)) != 0) {
+        if (data != NULL)
+            munmap(data, seg.cap);
+        return;
+    }
+
+    // past the expired records, if any
+    seg.start = seg.len = strlen(LOG_MAGIC);
+    LOG_RECORD mark = {0};
+    if (seg.len + sizeof(mark) <= seg.cap)
+        memcpy(&mark, data + seg.len, sizeof(mark));
+    if (mark.len == 0 && mark.reserved > seg.len && mark.reserved <= seg.cap)
+        seg.start = seg.len = mark.reserved;
+    while (seg.len + sizeof(LOG_RECORD) <= seg.cap) {
+        LOG_RECORD rec;
+        memcpy(&rec, data + seg.len, sizeof(rec));
+        if (rec.len < offsetof(WIRE_MSG, data) || seg.len + record_size(rec.len) > seg.cap)
+            break;
+        const WIRE_MSG * wire = (const WIRE_MSG *) (data + seg.len + sizeof(rec));
+        index_record(&seg, wire->time, seg.len);
+        seg.len += record_size(rec.len);
+    }
+    munmap(data, seg.cap);
+
+    grow_array((void **) &hist->segs, &hist->segs_cap, hist->n_segs, sizeof(SEGMENT));
+    hist->segs[hist->n_segs++] = seg;
+    hist->total_len += segment_bytes(&seg);
+    if (seq >= hist->next_seq)
+        hist->next_seq = seq + 1;
+}
+
+// Appends a line to the '<group file id>.group' file, which records the
+// creation of the group, its members and delete time
+void group_log(GROUP * grp, const char * fmt, ...) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s.group", HISTORY_PATH, grp->file_id);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("Error in opening group file...\n");
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    vdprintf(fd, fmt, args);
+    va_end(args);
+    close(fd);
+}
+
+// Returns the group named 'groupname', or NULL if there is none. On the
+// thread of its shard, which messages to the group are dispatched to.
+GROUP * find_group(const char * groupname) {
+    return lookup_group(shard_of(groupname), groupname);
+}
+
+void cursor_init(POSTING_CURSOR * c, SEARCH_INDEX * index, uint64_t term) {
+    memset(c, 0, sizeof(POSTING_CURSOR));
+    c->index = index;
+    c->term = term;
+    if (index->tail_cap > 0) {
+        TAIL_TERM * t = &index->tail[tail_slot(index, term)];
+        if (t->term == term) {
+            c->tail = t;
+            c->tail_left = c->count = t->n;
+        }
+    }
+    for (size_t i = 0; i < index->n_runs; ++i) {
+        const RUN_TERM * rt = run_term(&index->runs[i], term);
+        c->count += (rt != NULL) ? rt->count : 0;
+    }
+    c->runs_left = index->n_runs;
+}
+
+// Moves to the next older position, 0 once there is none
+uint64_t cursor_next(POSTING_CURSOR * c) {
+    if (c->tail_left > 0)
+        return c->value = c->tail->pos[--c->tail_left];
+    while (c->p == c->end) {
+        if (c->runs_left == 0)
+            return c->value = 0;
+        RUN * run = &c->index->runs[--c->runs_left];
+        const RUN_TERM * rt = run_term(run, c->term);
+        if (rt != NULL && rt->offset + rt->len <= run->len) {
+            c->p = (const uint8_t *) run->map + rt->offset;
+            c->end = c->p + rt->len;
+            c->is_first = true;
+        }
+    }
+    uint64_t v = get_varint(&c->p, c->end);
+    c->value = c->is_first ? v : c->value - v;
+    c->is_first = false;
+    return c->value;
+}
+
+// The message at 'pos' of the history of 'grp', NULL if it expired
+const WIRE_MSG * history_record(GROUP * grp, uint64_t pos, HISTORY_POS * hpos) {
+    HISTORY * hist = &grp->history;
+    hpos->seq = pos >> 32;
+    hpos->offset = pos & 0xffffffffULL;
+    size_t offset = hpos->offset;
+    SEGMENT * seg = history_segment(hist, hpos);
+    if (seg == NULL || seg->seq != pos >> 32 || offset < seg->start || offset + sizeof(LOG_RECORD) > seg->len)
+        return NULL;
+    const char * data = history_data(grp, hpos, seg);
+    if (data == NULL)
+        return NULL;
+    LOG_RECORD rec;
+    memcpy(&rec, data + offset, sizeof(rec));
+    if (rec.len < offsetof(WIRE_MSG, data) || offset + record_size(rec.len) > seg->len)
+        return NULL;
+    return (const WIRE_MSG *) (data + offset + sizeof(rec));
+}
+
+// Replies to 'username' with the newest SEARCH_RESULTS messages of the
+// group holding all the terms of 'query'. The rarest term's postings are
+// walked newest first and the others' skipped along to the same position;
+// each message found is read back to check its terms, hashes may collide.
+int search_group(char * groupname, char * username, const char * query) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    GROUP * grp = find_group(groupname);
+    USER * user = get_user(username);
+    MSG msg = {0};
+    msg.type = SEARCH_MSG;
+    strcpy(msg.group, groupname);
+    if (grp == NULL || !is_member(grp, user)) {
+        snprintf(msg.body, MAX_MSG_SIZE, "not a member of '%s'\n", groupname);
+        msg.body_len = strlen(msg.body);
+        WIRE_MSG * wire = pack_msg(&msg);
+        send_to_member(user, wire);
+        free(wire);
+        return -1;
+    }
+
+    SEARCH_INDEX * index = &grp->search;
+    uint64_t terms[SEARCH_MAX_TERMS];
+    size_t n_terms = search_terms(query, strlen(query), terms, SEARCH_MAX_TERMS);
+    POSTING_CURSOR cursors[SEARCH_MAX_TERMS];
+    for (size_t i = 0; i < n_terms; ++i) {
+        cursor_init(&cursors[i], index, terms[i]);
+        // the rarest first, it leads
+        for (size_t j = i; j > 0 && cursors[j].count < cursors[j - 1].count; --j) {
+            POSTING_CURSOR c = cursors[j];
+            cursors[j] = cursors[j - 1];
+            cursors[j - 1] = c;
+        }
+    }
+
+    char lines[MAX_MSG_SIZE];
+    size_t len = 0, n_found = 0;
+    uint64_t oldest = history_oldest(&grp->history);
+    time_t cutoff = time(NULL) - group_retention(grp);
+    HISTORY_POS hpos = {0};
+    uint64_t target = (n_terms > 0) ? cursor_next(&cursors[0]) : 0;
+    while (target >= oldest && target != 0 && n_found < SEARCH_RESULTS) {
+        bool is_match = true;
+        for (size_t i = 1; i < n_terms && is_match; ++i) {
+            if (cursors[i].value == 0 || cursors[i].value > target)
+                while (cursor_next(&cursors[i]) > target);
+            if (cursors[i].value < target) {
+                // no message newer than this one has term i
+                while (cursor_next(&cursors[0]) > cursors[i].value);
+                is_match = false;
+            }
+        }
+        if (!is_match) {
+            target = cursors[0].value;
+            continue;
+        }
+
+        const WIRE_MSG * wire = history_record(grp, target, &hpos);
+        // due, though its stride isn't expired yet, and so are the ones before it
+        if (wire != NULL && wire->time <= cutoff)
+            break;
+        uint64_t found[MAX_MSG_SIZE / 2];
+        size_t n_found_terms = 0;
+        const char * body = (wire != NULL) ? wire->data + wire->sender_len + wire->receiver_len + wire->group_len : NULL;
+        if (wire != NULL)
+            n_found_terms = search_terms(body, wire->body_len, found, MAX_MSG_SIZE / 2);
+        for (size_t i = 0; i < n_terms && is_match; ++i)
+            is_match = bsearch(&terms[i], found, n_found_terms, sizeof(uint64_t), compare_term) != NULL;
+        if (is_match) {
+            char stamp[32];
+            time_t t = wire->time;
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+            int body_len = (wire->body_len > SEARCH_SNIPPET) ? SEARCH_SNIPPET : wire->body_len;
+            int n = snprintf(lines + len, sizeof(lines) - len, "[%s] %.*s: %.*s%s\n", stamp,
+                wire->sender_len, wire->data, body_len, body, (body_len < wire->body_len) ? "..." : "");
+            if (len + n >= sizeof(lines) - 64)
+                break;
+            len += n;
+            ++n_found;
+        }
+        target = cursor_next(&cursors[0]);
+    }
+    history_pos_close(&hpos);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    snprintf(msg.body, MAX_MSG_SIZE, "%zu newest matches, %.3f ms\n%.*s", n_found, ms, (int) len, lines);
+    msg.body_len = strlen(msg.body);
+    WIRE_MSG * wire = pack_msg(&msg);
+    if (send_to_member(user, wire) < 0)
+        perror("Error in msgsnd...\n");
+    free(wire);
+    return 0;
+}
+
+// Adds the run file 'seq' found at startup. A run merged from others before
+// they were removed covers them, they are removed now.
+void search_load_run(GROUP * grp, uint64_t seq) {
+    SEARCH_INDEX * index = &grp->search;
+    RUN run;
+    if (!map_run(grp, seq, &run)) {
+        char path[PATH_MAX];
+        index_path(grp, seq, path);
+        unlink(path);
+        return;
+    }
+    uint64_t min_pos = ((const RUN_HEADER *) run.map)->min_pos;
+    while (index->n_runs > 0 && ((const RUN_HEADER *) index->runs[index->n_runs - 1].map)->min_pos >= min_pos)
+        drop_run(grp, index->n_runs - 1);
+    grow_array((void **) &index->runs, &index->runs_cap, index->n_runs, sizeof(RUN));
+    index->runs[index->n_runs++] = run;
+    index->indexed = ((const RUN_HEADER *) run.map)->max_pos;
+    if (seq >= index->next_seq)
+        index->next_seq = seq + 1;
+}
+
+// Indexes the history after what the runs found at startup hold, the
+// postings that were in memory when the server stopped
+void search_catch_up(GROUP * grp) {
+    HISTORY * hist = &grp->history;
+    SEARCH_INDEX * index = &grp->search;
+    search_prune(grp);
+    HISTORY_POS hpos = {0};
+    for (size_t i = 0; i < hist->n_segs; ++i) {
+        SEGMENT * seg = &hist->segs[i];
+        if (history_position(seg->seq, seg->len) <= index->indexed)
+            continue;
+        hpos.seq = seg->seq;
+        const char * data = history_data(grp, &hpos, seg);
+        for (size_t offset = seg->start; data != NULL && offset < seg->len; ) {
+            LOG_RECORD rec;
+            memcpy(&rec, data + offset, sizeof(rec));
+            if (history_position(seg->seq, offset) > index->indexed)
+                search_add(grp, history_position(seg->seq, offset), (const WIRE_MSG *) (data + offset + sizeof(rec)));
+            offset += record_size(rec.len);
+        }
+    }
+    history_pos_close(&hpos);
+}
+
+bool is_joining(GROUP * grp, USER * user) {
+    for (REPLAY * r = grp->shard->replays; r != NULL; r = r->next)
+        if (r->grp == grp && r->user == user)
+            return true;
+    return false;
+}
+
+// Makes 'user' a member once replay has caught up
+int finish_join(GROUP * grp, USER * user, time_t join_time) {
+    add_member(grp, user)->join_time = join_time;
+    group_log(grp, "join %s %ld\n", user->name, (long) join_time);
+    add_user_group(user, grp);
+    return grp->n_members;
+}
+
+int join_group(char * groupname, char * username) {
+    USER * user = get_user(username);
+    GROUP * grp = find_group(groupname);
+    if (grp == NULL) {
+        printf("Group '%s' not found...\n", groupname);
+        return -1;
+    }
+
+    if (is_member(grp, user) || is_joining(grp, user)) {
+        printf("Member '%s' already present in group...\n", username);
+        return -1;
+    }
+
+    // send old messages, those of the last 'delete_time' seconds, at most the
+    // retention: older ones may still be in a stride not yet expired. What the
+    // first batch doesn't cover is replayed between the other messages of the
+    // shard, see replay_joins(), messages to the group meanwhile included.
+    time_t join_time = time(NULL);
+    if (grp->delete_time > 0) {
+        REPLAY * replay = calloc(1, sizeof(REPLAY));
+        history_seek(grp, join_time - group_retention(grp), &replay->pos);
+        if (history_replay(grp, &replay->pos, user)) {
+            replay->grp = grp;
+            replay->user = user;
+            replay->join_time = join_time;
+            REPLAY ** last = &grp->shard->replays;
+            while (*last != NULL)
+                last = &(*last)->next;
+            *last = replay;
+            return 0;
+        }
+        history_pos_close(&replay->pos);
+        free(replay);
+    }
+    return finish_join(grp, user, join_time);
+}
+
+// Replays a batch to each user joining a group of 'shard', the ones caught up
+// become members. Users whose queue is full are skipped until their spool has
+// drained, or users of another server until the frames to it have, so the
+// history doesn't pile up in front of their other messages.
+// Returns false if all were skipped.
+bool replay_joins(SHARD * shard) {
+    bool replayed = false;
+    REPLAY ** p = &shard->replays;
+    while (*p != NULL) {
+        REPLAY * replay = *p;
+        if (user_backlog(replay->user)) {
+            p = &replay->next;
+            continue;
+        }
+        replayed = true;
+        if (history_replay(replay->grp, &replay->pos, replay->user)) {
+            p = &replay->next;
+            continue;
+        }
+        history_pos_close(&replay->pos);
+        finish_join(replay->grp, replay->user, replay->join_time);
+        *p = replay->next;
+        free(replay);
+    }
+    return replayed;
+}
+
+// Adds a group with no members. Under the lock of its shard held for writing.
+GROUP * new_group(const char * groupname) {
+    GROUP * grp = calloc(1, sizeof(GROUP));
+    strcpy(grp->name, groupname);
+    file_id_of(groupname, grp->file_id);
+    grp->index_cap = MEMBER_INDEX_SIZE;
+    grp->member_index = calloc(grp->index_cap, sizeof(size_t));
+    grp->delete_time = 0;
+    grp->shard = shard_of(groupname);
+    insert_group(grp);
+    return grp;
+}
+
+int create_group(char * groupname, char * creator_name) {
+    USER * creator = get_user(creator_name);
+    if (find_group(groupname) != NULL) {
+        printf("Group '%s' already exists...\n", groupname);
+        return -1;
+    }
+
+    SHARD * shard = shard_of(groupname);
+    pthread_rwlock_wrlock(&shard->lock);
+    GROUP * grp = new_group(groupname);
+    pthread_rwlock_unlock(&shard->lock);
+    MEMBER * member = add_member(grp, creator);
+    // a new file, any left by a group of the same name is replaced
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s.group", HISTORY_PATH, grp->file_id);
+    unlink(path);
+    group_log(grp, "join %s %ld\n", creator_name, (long) member->join_time);
+
+    add_user_group(creator, grp);
+    directory_publish('+', grp->name);
+    // the other servers list it too
+    const char * name = grp->name;
+    for (size_t s = 0; s < SERVERS.n_servers; ++s)
+        if (s != SERVER_INDEX)
+            peer_send_names(s, PEER_GROUPS, &name, 1, NULL);
+    return 0;
+}
+
+size_t name_slot(NAME_SET * set, const char * name) {
+    size_t slot = hash((unsigned char *) name) & (set->index_cap - 1);
+    while (set->index[slot] != 0 && strcmp(set->names[set->index[slot] - 1], name) != 0)
+        slot = (slot + 1) & (set->index_cap - 1);
+    return slot;
+}
+
+// Adds 'name' to 'set' unless it is there already. Returns whether it was added.
+bool name_set_add(NAME_SET * set, const char * name) {
+    pthread_rwlock_wrlock(&set->lock);
+    if (2 * (set->n_names + 1) > set->index_cap) {
+        free(set->index);
+        set->index_cap = (set->index_cap > 0) ? 2 * set->index_cap : NAME_INDEX_SIZE;
+        set->index = calloc(set->index_cap, sizeof(size_t));
+        for (size_t i = 0; i < set->n_names; ++i)
+            set->index[name_slot(set, set->names[i])] = i + 1;
+    }
+    size_t slot = name_slot(set, name);
+    bool is_added = set->index[slot] == 0;
+    if (is_added) {
+        grow_array((void **) &set->names, &set->names_cap, set->n_names, sizeof(*set->names));
+        strcpy(set->names[set->n_names++], name);
+        set->index[slot] = set->n_names;
+    }
+    pthread_rwlock_unlock(&set->lock);
+    return is_added;
+}
+
+// Lists as many groups as fit in one message, shard by shard, then those of
+// the other servers of a federation
+void list_group(char * username) {
+    USER * user = get_user(username);
+    MSG msg = {0};
+    
+    size_t len = 0;
+    for (size_t s = 0; s < NUM_SHARDS; ++s) {
+        SHARD * shard = &SHARDS[s];
+        pthread_rwlock_rdlock(&shard->lock);
+        for (size_t i = 0; i < shard->dir.n_groups; ++i) {
+            size_t name_len = strlen(shard->dir.groups[i]->name);
+            if (len + name_len + 1 >= MAX_MSG_SIZE)
+                break;
+            memcpy(msg.body + len, shard->dir.groups[i]->name, name_len);
+            msg.body[len + name_len] = '\n';
+            len += name_len + 1;
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    pthread_rwlock_rdlock(&REMOTE_GROUPS.lock);
+    for (size_t i = 0; i < REMOTE_GROUPS.n_names; ++i) {
+        size_t name_len = strlen(REMOTE_GROUPS.names[i]);
+        if (len + name_len + 1 >= MAX_MSG_SIZE)
+            break;
+        memcpy(msg.body + len, REMOTE_GROUPS.names[i], name_len);
+        msg.body[len + name_len] = '\n';
+        len += name_len + 1;
+    }
+    pthread_rwlock_unlock(&REMOTE_GROUPS.lock);
+    msg.body[len] = '\0';
+    
+    msg.type = LIST_GROUP_MSG;
+    msg.body_len = len;
+    
+    WIRE_MSG * wire = pack_msg(&msg);
+    if (send_to_user(user, wire) < 0)
+        perror("Error in msgsnd...\n");
+    free(wire);
+}
+
+// Appends a line per peer of a federation to 'body'
+void peer_stats(char * body, size_t size) {
+    size_t len = 0;
+    for (size_t s = 0; s < SERVERS.n_servers && len < size; ++s) {
+        if (s == SERVER_INDEX)
+            continue;
+        PEER * peer = &PEERS[s];
+        pthread_mutex_lock(&peer->lock);
+        len += snprintf(body + len, size - len, "peer %zu %s: %zu frames sent, %zu bytes waiting, %zu dropped\n",
+            s, peer->connected ? "up" : "down", peer->sent, peer->queued, peer->dropped);
+        pthread_mutex_unlock(&peer->lock);
+    }
+}
+
+void send_stats(char * username) {
+    MSG msg = {0};
+    spool_stats(msg.body, MAX_MSG_SIZE);
+    size_t len = strlen(msg.body);
+    peer_stats(msg.body + len, MAX_MSG_SIZE - len);
+    msg.type = STATS_MSG;
+    msg.body_len = strlen(msg.body);
+
+    WIRE_MSG * wire = pack_msg(&msg);
+    if (send_to_user(get_user(username), wire) < 0)
+        perror("Error in msgsnd...\n");
+    free(wire);
+}
+
+// 'wire' is forwarded as it was received, in the chat class
+void send_private_msg(MSG * msg, WIRE_MSG * wire) {
+    wire->mtype = PRIO_CHAT;
+    if (send_to_user(get_user(msg->receiver), wire) < 0)
+        perror("Error in msgsnd...\n");
+}
+
+int send_group_msg(MSG * msg, WIRE_MSG * wire) {
+    GROUP * grp = find_group(msg->group);
+    if (grp == NULL) {
+        printf("Group '%s' not found...\n", msg->group);
+        return -1;
+    }
+
+    wire->time = time(NULL);
+    wire->mtype = PRIO_CHAT;
+    size_t n_remote = 0;
+    for (size_t ii = 0; ii < grp->n_members; ++ii) {
+        USER * user = grp->members[ii].user;
+        if (user->home != SERVER_INDEX)
+            ++n_remote;
+        else if (send_to_user(user, wire) < 0)
+            perror("Error in msgsnd...\n");
+    }
+    // members owned by other servers, named in as few frames to each as fit
+    if (n_remote > 0) {
+        const char ** names = malloc(n_remote * sizeof(char *));
+        for (size_t s = 0; s < SERVERS.n_servers; ++s) {
+            size_t n = 0;
+            for (size_t ii = 0; ii < grp->n_members && s != SERVER_INDEX; ++ii)
+                if (grp->members[ii].user->home == s)
+                    names[n++] = grp->members[ii].user->name;
+            if (n > 0)
+                peer_send_names(s, PEER_DELIVER, names, n, wire);
+        }
+        free(names);
+    }
+
+    history_append(grp, wire);
+    return 0;
+}
+
+int set_delete_time(MSG * msg) {
+    GROUP * grp = find_group(msg->group);
+    if (grp == NULL) {
+        printf("Group '%s' not found...\n", msg->group);
+        return -1;
+    }
+
+    grp->delete_time = msg->delete_time;
+    group_log(grp, "delete %ld\n", (long) grp->delete_time);
+    // the retention changed, so does the expiry of what is kept
+    history_expire(grp, time(NULL));
+    return 0;
+}
+
+// Loads the groups and their history from HISTORY_PATH, see group_log()
+void load_history() {
+    if (mkdir(HISTORY_PATH, 0755) < 0 && errno != EEXIST) {
+        perror("Error in creating history directory...\n");
+        return;
+    }
+    DIR * dir = opendir(HISTORY_PATH);
+    if (dir == NULL) {
+        perror("Error in opening history directory...\n");
+        return;
+    }
+
+    // the groups first, then their segments in order
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char * dot = strchr(entry->d_name, '.');
+        char name[MAX_NAME_LEN];
+        if (dot == NULL || strcmp(dot, ".group") != 0 || !name_of_file_id(entry->d_name, dot - entry->d_name, name))
+            continue;
+
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "%s/%s", HISTORY_PATH, entry->d_name);
+        FILE * fp = fopen(path, "r");
+        if (fp == NULL)
+            continue;
+        GROUP * grp = new_group(name);
+        char line[2 * MAX_NAME_LEN + 64], username[MAX_NAME_LEN];
+        long t;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "join %29s %ld", username, &t) == 2) {
+                USER * user = get_user(username);
+                if (!is_member(grp, user)) {
+                    add_member(grp, user)->join_time = t;
+                    add_user_group(user, grp);
+                }
+            }
+            else if (sscanf(line, "delete %ld", &t) == 1)
+                grp->delete_time = t;
+        }
+        fclose(fp);
+    }
+
+    // the runs of their search index too, by the same order
+    typedef struct { GROUP * grp; uint64_t seq; bool is_run; } FOUND;
+    FOUND * found = NULL;
+    size_t n_found = 0, found_cap = 0;
+    rewinddir(dir);
+    while ((entry = readdir(dir)) != NULL) {
+        char * dot = strchr(entry->d_name, '.');
+        char name[MAX_NAME_LEN];
+        unsigned long long seq;
+        char ext[8];
+        if (dot == NULL || sscanf(dot, ".%llx.%7s", &seq, ext) != 2 || (strcmp(ext, "log") != 0 && strcmp(ext, "idx") != 0) ||
+                !name_of_file_id(entry->d_name, dot - entry->d_name, name))
+            continue;
+        GROUP * grp = find_group(name);
+        if (grp == NULL)
+            continue;
+        grow_array((void **) &found, &found_cap, n_found, sizeof(FOUND));
+        found[n_found++] = (FOUND) {grp, seq, strcmp(ext, "idx") == 0};
+    }
+    closedir(dir);
+
+    // insertion sort by group then sequence, segments of a group are few
+    for (size_t i = 1; i < n_found; ++i) {
+        FOUND f = found[i];
+        size_t j = i;
+        while (j > 0 && (found[j - 1].grp > f.grp || (found[j - 1].grp == f.grp && found[j - 1].seq > f.seq))) {
+            found[j] = found[j - 1];
+            --j;
+        }
+        found[j] = f;
+    }
+    size_t n_records = 0;
+    for (size_t i = 0; i < n_found; ++i) {
+        if (found[i].is_run)
+            search_load_run(found[i].grp, found[i].seq);
+        else
+            load_segment(found[i].grp, found[i].seq);
+    }
+    for (size_t s = 0; s < NUM_SHARDS; ++s) {
+        for (size_t i = 0; i < SHARDS[s].dir.n_groups; ++i) {
+            GROUP * grp = SHARDS[s].dir.groups[i];
+            history_retain(grp);
+            history_expire(grp, time(NULL));
+            search_catch_up(grp);
+            for (size_t j = 0; j < grp->history.n_segs; ++j)
+                n_records += grp->history.segs[j].n_records;
+        }
+    }
+    free(found);
+
+    printf("Loaded %zu groups with %zu messages of history...\n", count_groups(), n_records);
+}
+
+// A received message is malloc'd, or in a slot of the shared memory transport
+void release_wire(WIRE_MSG * wire) {
+    int64_t idx = shm_slot_of(SHM_MAP, wire);
+    if (idx >= 0)
+        shm_slot_release(SHM_MAP, idx);
+    else
+        free(wire);
+}
+
+// A user is reached on the transport it last sent on
+void set_transport(USER * user, bool on_ring) {
+    if ((user->ring != NULL) == on_ring)
+        return;
+    SHM_RING * ring = on_ring ? shm_ring_find(SHM_MAP, user->name, false) : NULL;
+    pthread_mutex_lock(&user->spool.lock);
+    user->ring = ring;
+    pthread_mutex_unlock(&user->spool.lock);
+}
+
+void handle_msg(WIRE_MSG * wire, size_t size) {
+    MSG unpacked;
+    MSG * msg = &unpacked;
+    if (!unpack_msg(wire, size, msg)) {
+        printf("Malformed message dropped...\n");
+        release_wire(wire);
+        return;
+    }
+    // registers the sender, its queue is resolved from then on; a message
+    // from a user of another server is no sign of presence here
+    if (msg->sender[0] != '\0') {
+        USER * sender = get_user(msg->sender);
+        set_transport(sender, shm_slot_of(SHM_MAP, wire) >= 0);
+        if (sender->home == SERVER_INDEX)
+            user_seen(sender);
+    }
+
+    switch (msg->type) {
+        case PRIVATE_MSG: {
+            send_private_msg(msg, wire);
+            break;
+        }
+        
+        case GROUP_MSG: {
+            send_group_msg(msg, wire);
+            break;
+        }
+
+        case LIST_GROUP_MSG: {
+            list_group(msg->sender);
+            break;
+        }
+
+        case CREATE_GROUP_MSG: {
+            create_group(msg->group, msg->sender);
+            break;
+        }
+
+        case JOIN_GROUP_MSG: {
+            join_group(msg->group, msg->sender);
+            break;
+        }
+
+        case AUTO_DELETE_MSG: {
+            set_delete_time(msg);
+            break;
+        }
+
+        case STATS_MSG: {
+            send_stats(msg->sender);
+            break;
+        }
+
+        case HEARTBEAT_MSG: {
+            break;
+        }
+
+        case SEARCH_MSG: {
+            search_group(msg->group, msg->sender, msg->body);
+            break;
+        }
+
+        case DIRECTORY_MSG: {
+            directory_subscribe(get_user(msg->sender), msg->body);
+            break;
+        }
+
+        default: {
+            printf("Unknown message type %d dropped...\n", msg->type);
+            break;
+        }
+    }
+    release_wire(wire);
+}
+
+// Waits for messages with 'not_full' when the work queue is full, they then
+// pile up in the server queue until the threads handling them catch up
+void push_work(WORK_QUEUE * work, WIRE_MSG * msg, size_t size) {
+    pthread_mutex_lock(&work->lock);
+    while (work->n_msg == WORK_QUEUE_SIZE)
+        pthread_cond_wait(&work->not_full, &work->lock);
+    size_t tail = (work->head + work->n_msg) % WORK_QUEUE_SIZE;
+    work->msg[tail] = msg;
+    work->size[tail] = size;
+    ++work->n_msg;
+    pthread_cond_signal(&work->not_empty);
+    pthread_mutex_unlock(&work->lock);
+}
+
+// Returns the next message, or NULL if none came by 'until', if given
+WIRE_MSG * pop_work(WORK_QUEUE * work, size_t * size, const struct timespec * until) {
+    pthread_mutex_lock(&work->lock);
+    while (work->n_msg == 0) {
+        if (until == NULL)
+            pthread_cond_wait(&work->not_empty, &work->lock);
+        else if (pthread_cond_timedwait(&work->not_empty, &work->lock, until) == ETIMEDOUT && work->n_msg == 0) {
+            pthread_mutex_unlock(&work->lock);
+            return NULL;
+        }
+    }
+    WIRE_MSG * msg = work->msg[work->head];
+    *size = work->size[work->head];
+    work->head = (work->head + 1) % WORK_QUEUE_SIZE;
+    --work->n_msg;
+    pthread_cond_signal(&work->not_full);
+    pthread_mutex_unlock(&work->lock);
+    return msg;
+}
+
+// Hands a received message to the shard of its group, or to the private lane.
+// In a federation, a message to a group or user of another server is sent on
+// to it instead. Only the group or receiver is read here, the rest is checked
+// by handle_msg().
+void dispatch(WIRE_MSG * wire, size_t size) {
+    WORK_QUEUE * work = &PRIVATE_WORK;
+    bool is_sized = size >= offsetof(WIRE_MSG, data) && size == wire_size(wire);
+    bool to_group = is_sized && (wire->type == GROUP_MSG || wire->type == CREATE_GROUP_MSG ||
+        wire->type == JOIN_GROUP_MSG || wire->type == AUTO_DELETE_MSG || wire->type == SEARCH_MSG);
+    char name[MAX_NAME_LEN];
+    if (to_group && wire->group_len < MAX_NAME_LEN) {
+        memcpy(name, wire->data + wire->sender_len + wire->receiver_len, wire->group_len);
+        name[wire->group_len] = '\0';
+        work = &shard_of(name)->work;
+    }
+    else if (is_sized && wire->type == PRIVATE_MSG && wire->receiver_len < MAX_NAME_LEN) {
+        memcpy(name, wire->data + wire->sender_len, wire->receiver_len);
+        name[wire->receiver_len] = '\0';
+    }
+    else {
+        push_work(work, wire, size);
+        return;
+    }
+
+    size_t owner = partition_of(&SERVERS, name);
+    if (owner != SERVER_INDEX) {
+        peer_send(owner, PEER_REQUEST, NULL, 0, 0, wire);
+        release_wire(wire);
+        return;
+    }
+    push_work(work, wire, size);
+}
+
+// Sends peer 'to' the names of all the groups of this server
+void peer_sync(size_t to) {
+    for (size_t s = 0; s < NUM_SHARDS; ++s) {
+        SHARD * shard = &SHARDS[s];
+        pthread_rwlock_rdlock(&shard->lock);
+        size_t n = shard->dir.n_groups;
+        const char ** names = malloc((n + 1) * sizeof(char *));
+        for (size_t i = 0; i < n; ++i)
+            names[i] = shard->dir.groups[i]->name;
+        pthread_rwlock_unlock(&shard->lock);
+        peer_send_names(to, PEER_GROUPS, names, n, NULL);
+        free(names);
+    }
+}
+
+// Handles a frame from another server, of 'len' bytes
+void peer_receive(const PEER_MSG * msg, size_t len) {
+    if (len < offsetof(PEER_MSG, data) || msg->names_len > len - offsetof(PEER_MSG, data) ||
+            msg->from >= SERVERS.n_servers) {
+        printf("Malformed frame from a peer dropped...\n");
+        return;
+    }
+    const char * names[PEER_FRAME_MAX];
+    size_t n_names = 0;
+    for (size_t off = 0; off < msg->names_len && n_names < msg->n_names; ++n_names) {
+        size_t name_len = strnlen(msg->data + off, msg->names_len - off);
+        if (off + name_len == msg->names_len || name_len >= MAX_NAME_LEN)
+            return;
+        names[n_names] = msg->data + off;
+        off += name_len + 1;
+    }
+    size_t size = len - offsetof(PEER_MSG, data) - msg->names_len;
+
+    switch (msg->kind) {
+        case PEER_REQUEST: {
+            WIRE_MSG * wire = malloc(size);
+            memcpy(wire, msg->data + msg->names_len, size);
+            dispatch(wire, size);
+            break;
+        }
+
+        case PEER_DELIVER: {
+            // the names leave the wire unaligned
+            WIRE_MSG * wire = malloc(size);
+            memcpy(wire, msg->data + msg->names_len, size);
+            if (size >= offsetof(WIRE_MSG, data) && size == wire_size(wire)) {
+                for (size_t i = 0; i < n_names; ++i)
+                    if (send_to_user(get_user(names[i]), wire) < 0)
+                        perror("Error in msgsnd...\n");
+            }
+            free(wire);
+            break;
+        }
+
+        case PEER_GROUPS: {
+            for (size_t i = 0; i < n_names; ++i)
+                if (name_set_add(&REMOTE_GROUPS, names[i]))
+                    directory_publish('+', names[i]);
+            break;
+        }
+
+        case PEER_SYNC: {
+            peer_sync(msg->from);
+            break;
+        }
+    }
+}
+
+// Receives the frames of one connection from a peer
+void * peer_reader_thread(void * args) {
+    int fd = (int) (intptr_t) args;
+    PEER_MSG * msg = malloc(PEER_FRAME_MAX);
+    while (true) {
+        ssize_t len = recv(fd, msg, PEER_FRAME_MAX, 0);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+        peer_receive(msg, len);
+    }
+    free(msg);
+    close(fd);
+    return NULL;
+}
+
+// The address of server 'index', in the abstract namespace so nothing is left
+// on disk when the server stops
+socklen_t peer_address(size_t index, struct sockaddr_un * addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "msgq_server.%zu", index);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+// Accepts the connections of the peers on 'args', the listening socket
+void * peer_listen_thread(void * args) {
+    int fd = (int) (intptr_t) args;
+    while (true) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno != EINTR)
+                perror("Error in accept...\n");
+            continue;
+        }
+        pthread_t tid;
+        pthread_create(&tid, NULL, peer_reader_thread, (void *) (intptr_t) conn);
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+// Sends the frames queued for a peer, in order, connecting again whenever the
+// connection is lost. A frame is only dequeued once sent. The first frame on
+// a connection asks for the groups of the peer.
+void * peer_thread(void * args) {
+    PEER * peer = (PEER *) args;
+    int fd = -1;
+    while (true) {
+        if (fd < 0) {
+            struct sockaddr_un addr;
+            socklen_t addr_len = peer_address(peer->index, &addr);
+            fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+            PEER_MSG sync = {PEER_SYNC, SERVER_INDEX, 0, 0};
+            if (fd < 0 || connect(fd, (struct sockaddr *) &addr, addr_len) < 0 ||
+                    send(fd, &sync, sizeof(sync), MSG_NOSIGNAL) < 0) {
+                if (fd >= 0)
+                    close(fd);
+                fd = -1;
+                usleep(PEER_RETRY_MS * 1000);
+                continue;
+            }
+            pthread_mutex_lock(&peer->lock);
+            peer->connected = true;
+            pthread_mutex_unlock(&peer->lock);
+        }
+
+        pthread_mutex_lock(&peer->lock);
+        while (peer->head == NULL)
+            pthread_cond_wait(&peer->ready, &peer->lock);
+        PEER_FRAME * frame = peer->head;
+        pthread_mutex_unlock(&peer->lock);
+        if (send(fd, frame->data, frame->len, MSG_NOSIGNAL) < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            fd = -1;
+            pthread_mutex_lock(&peer->lock);
+            peer->connected = false;
+            pthread_mutex_unlock(&peer->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&peer->lock);
+        peer->head = frame->next;
+        if (peer->head == NULL)
+            peer->tail = NULL;
+        peer->queued -= frame->len;
+        ++peer->sent;
+        pthread_mutex_unlock(&peer->lock);
+        free(frame);
+    }
+    return NULL;
+}
+
+// Listens for the other servers of the federation and starts a sender
+// thread for each of them. Returns false if this server's address is taken.
+bool start_peers() {
+    struct sockaddr_un addr;
+    socklen_t addr_len = peer_address(SERVER_INDEX, &addr);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, addr_len) < 0 || listen(fd, PARTITION_MAX) < 0) {
+        perror("Error in listening for the other servers...\n");
+        return false;
+    }
+    pthread_t tid;
+    pthread_create(&tid, NULL, peer_listen_thread, (void *) (intptr_t) fd);
+    pthread_detach(tid);
+
+    for (size_t s = 0; s < SERVERS.n_servers; ++s) {
+        if (s == SERVER_INDEX)
+            continue;
+        pthread_create(&tid, NULL, peer_thread, &PEERS[s]);
+        pthread_detach(tid);
+    }
+    return true;
+}
+
+// Receives from the inbox of the shared memory transport, as main() does from
+// the server queue. The messages are dispatched in their slots.
+void * inbox_thread(void * args) {
+    SHM_QUEUE * inbox = SHM_MAP->inbox;
+    while (true) {
+        uint32_t idx;
+        if (!shm_queue_pop(inbox, &idx)) {
+            uint32_t seq = doorbell_prepare(&SHM_MAP->hdr->inbox_bell);
+            doorbell_wait(&SHM_MAP->hdr->inbox_bell, seq, shm_queue_count(inbox) == 0);
+            continue;
+        }
+        doorbell_ring(&SHM_MAP->hdr->inbox_room);
+        if (idx >= SHM_SLOTS)
+            continue;
+        SHM_SLOT * slot = shm_slot(SHM_MAP, idx);
+        dispatch((WIRE_MSG *) slot->data, slot->len);
+    }
+    return NULL;
+}
+
+// Handles the messages to the groups of a shard in order of arrival. Joins
+// replaying history go on between them, and the timer wheel is fired as the
+// seconds pass.
+void * shard_thread(void * args) {
+    SHARD * shard = (SHARD *) args;
+    GROUP ** fired = NULL;
+    size_t fired_cap = 0;
+    bool replaying = false;
+    while (true) {
+        // wake up for the next second, after SPOOL_RETRY_MS for joins waiting
+        // for room, or not wait while joins are replaying
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        if (shard->replays == NULL) {
+            ++until.tv_sec;
+            until.tv_nsec = 0;
+        }
+        else if (!replaying) {
+            until.tv_nsec += SPOOL_RETRY_MS * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                ++until.tv_sec;
+                until.tv_nsec -= 1000000000L;
+            }
+        }
+        size_t size;
+        WIRE_MSG * msg = pop_work(&shard->work, &size, &until);
+        if (msg != NULL)
+            handle_msg(msg, size);
+        replaying = replay_joins(shard);
+        expire_groups(shard, &fired, &fired_cap);
+    }
+    return NULL;
+}
+
+void * private_thread(void * args) {
+    while (true) {
+        size_t size;
+        WIRE_MSG * msg = pop_work(&PRIVATE_WORK, &size, NULL);
+        handle_msg(msg, size);
+    }
+    return NULL;
+}
+
+// The main thread receives from the server queue and dispatches the messages
+// to NUM_SHARDS threads, each owning the groups of its shard, and to a thread
+// for private messages. Groups and their
+// history are kept in the directory given as argument, or HISTORY_DIR.
+// '-s drop|block' sets what is done with messages to a user whose spool is full.
+// Clients are served on the SysV queues and on the shared memory transport alike.
+// '-n servers -i index' makes the server one of a federation of 'servers' on
+// this host, owning a partition of the users and groups; it is then served on
+// the SysV queues only, with a queue and a history directory of its own.
+// '-g seconds' sets how long a user without messages or heartbeats keeps its
+// queue, PRESENCE_TTL by default.
+int main(int argc, char * argv[]) {
+    int opt;
+    long n_servers = 1, index = 0;
+    bool is_usage = false;
+    while ((opt = getopt(argc, argv, "s:n:i:g:")) != -1) {
+        if (opt == 's' && strcmp(optarg, "drop") == 0)
+            SPOOL_MODE = SPOOL_DROP;
+        else if (opt == 's' && strcmp(optarg, "block") == 0)
+            SPOOL_MODE = SPOOL_BLOCK;
+        else if (opt == 'n')
+            n_servers = atol(optarg);
+        else if (opt == 'i')
+            index = atol(optarg);
+        else if (opt == 'g' && atol(optarg) > 0)
+            PRESENCE_SEC = atol(optarg);
+        else
+            is_usage = true;
+    }
+    if (is_usage || n_servers < 1 || n_servers > PARTITION_MAX || index < 0 || index >= n_servers) {
+        fprintf(stderr, "Usage: %s [-s drop|block] [-n servers -i index] [-g presence seconds] [history_dir]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    SERVER_INDEX = index;
+    partition_init(&SERVERS, n_servers);
+    for (size_t s = 0; s < PARTITION_MAX; ++s) {
+        PEERS[s].index = s;
+        pthread_mutex_init(&PEERS[s].lock, NULL);
+        pthread_cond_init(&PEERS[s].ready, NULL);
+    }
+
+    static char history_path[PATH_MAX];
+    if (optind < argc)
+        HISTORY_PATH = argv[optind];
+    else if (n_servers > 1) {
+        snprintf(history_path, PATH_MAX, HISTORY_DIR ".%zu", SERVER_INDEX);
+        HISTORY_PATH = history_path;
+    }
+    // the segments of the shared memory transport are for a single server
+    static SHM shm;
+    if (n_servers == 1 && shm_attach(&shm, true))
+        SHM_MAP = &shm;
+    else if (n_servers == 1)
+        perror("Shared memory transport not available...\n");
+    directory_init();
+    load_history();
+    load_spools();
+    if (n_servers > 1 && !start_peers())
+        return EXIT_FAILURE;
+
+    pthread_t spooler;
+    pthread_create(&spooler, NULL, spooler_thread, NULL);
+    pthread_detach(spooler);
+    pthread_t gc;
+    pthread_create(&gc, NULL, gc_thread, NULL);
+    pthread_detach(gc);
+    
+    size_t cap = WIRE_BUF_SIZE;
+    WIRE_MSG * buf = malloc(cap);
+
+    char queue_name[MAX_NAME_LEN];
+    partition_queue_name(n_servers, SERVER_INDEX, queue_name, sizeof(queue_name));
+    int id = get_queue_id(queue_name);
+
+    for (size_t i = 0; i < NUM_SHARDS; ++i) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, shard_thread, &SHARDS[i]);
+        pthread_detach(tid);
+    }
+    pthread_t lane;
+    pthread_create(&lane, NULL, private_thread, NULL);
+    pthread_detach(lane);
+    if (SHM_MAP != NULL) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, inbox_thread, NULL);
+        pthread_detach(tid);
+    }
+
+    while (true) {
+        ssize_t size = recv_wire(id, &buf, &cap, 0);
+        if (size < 0) {
+            perror("Error in msgrcv...\n");
+            continue;
+        }
+
+        WIRE_MSG * msg = malloc(size);
+        memcpy(msg, buf, size);
+        dispatch(msg, size);
+    }
+
+}
@@ -0,0 +1,305 @@
+// Benchmark of the two transports end to end: a sender sends group messages
+// to a group of BENCH_MEMBERS members through the server, once on the SysV
+// queues and once on the shared memory transport, with bodies of a few sizes.
+// The server is compiled in and runs on threads of its own, the sender and
+// the members are threads using the transport as the clients do. The time of
+// sending is carried in the body, for the latency. The sender stays at most
+// BENCH_WINDOW messages ahead of the slowest member, so the queues never fill
+// and what is measured is the transport rather than the spool. The server
+// queue is the real one, so no other server should be running.
+// Then more names than there are rings register over time on the shared
+// memory transport, each batch collected as users gone a while are, to check
+// that their rings are released and claimed again.
+#include "msgq_bench.h"
+
+#define BENCH_MEMBERS 8
+#define BENCH_MSGS 20000    // group messages sent per run
+#define BENCH_WINDOW 4      // messages sent ahead of the slowest member
+#define BENCH_TIMEOUT 60    // seconds a run may take
+#define BENCH_CHURN (4 * SHM_RINGS)     // names registered over time
+
+typedef struct _BENCH_CLIENT {
+    char name[MAX_NAME_LEN];
+    bool use_shm;
+    int id;                 // the client queue
+    SHM_RING * ring;
+    uint32_t ring_epoch;    // of the ring when claimed
+    size_t expected;        // group messages to receive
+    size_t received;
+    double latency_us;      // summed over the messages received
+    double last_us;         // when the last one arrived
+    bool stop;
+    pthread_t tid;
+} BENCH_CLIENT;
+
+SHM BENCH_SHM;              // a mapping of its own, as a client has
+int SERVER_ID;
+
+void * server_thread(void * args) {
+    char ** argv = (char **) args;
+    msgq_server_main(2, argv);
+    return NULL;
+}
+
+// The group named 'name' once its shard added it, looked up as another thread than the shard's
+GROUP * bench_group(const char * name) {
+    SHARD * shard = shard_of(name);
+    pthread_rwlock_rdlock(&shard->lock);
+    GROUP * grp = lookup_group(shard, name);
+    pthread_rwlock_unlock(&shard->lock);
+    return grp;
+}
+
+void bench_send(BENCH_CLIENT * client, MSG * msg) {
+    strcpy(msg->sender, client->name);
+    WIRE_MSG * wire = pack_msg(msg);
+    if (client->use_shm) {
+        if (!shm_send(&BENCH_SHM, wire, wire_size(wire)))
+            perror("Error in shm_send...\n");
+    }
+    else if (send_wire(SERVER_ID, wire, 0) < 0)
+        perror("Error in msgsnd...\n");
+    free(wire);
+}
+
+// Receives group messages until the expected number arrived or 'stop' is set
+void * receive_thread(void * args) {
+    BENCH_CLIENT * client = (BENCH_CLIENT *) args;
+    size_t cap = WIRE_BUF_SIZE;
+    WIRE_MSG * wire = malloc(cap);
+    MSG * msg = malloc(sizeof(MSG));
+
+    while (client->received < client->expected) {
+        bool is_valid;
+        if (client->use_shm) {
+            uint32_t idx;
+            if (!shm_ring_wait(client->ring, client->ring_epoch, &idx, &client->stop))
+                break;
+            SHM_SLOT * slot = shm_slot(&BENCH_SHM, idx);
+            is_valid = unpack_msg((WIRE_MSG *) slot->data, slot->len, msg);
+            shm_slot_release(&BENCH_SHM, idx);
+        }
+        else {
+            ssize_t size = recv_wire(client->id, &wire, &cap, 0);
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size < 0)
+                break;
+            is_valid = unpack_msg(wire, size, msg);
+            if (is_valid && msg->type == SHUTDOWN_MSG)
+                break;
+        }
+        if (!is_valid || msg->type != GROUP_MSG)
+            continue;
+
+        double now = now_us();
+        client->latency_us += now - atof(msg->body);
+        client->last_us = now;
+        __atomic_add_fetch(&client->received, 1, __ATOMIC_RELEASE);
+    }
+    free(msg);
+    free(wire);
+    return NULL;
+}
+
+void start_client(BENCH_CLIENT * client, const char * name, bool use_shm, size_t expected) {
+    memset(client, 0, sizeof(BENCH_CLIENT));
+    strcpy(client->name, name);
+    client->use_shm = use_shm;
+    client->expected = expected;
+    client->id = get_queue_id(name);
+    if (use_shm) {
+        client->ring = shm_ring_find(&BENCH_SHM, name, true);
+        client->ring_epoch = client->ring->epoch;
+    }
+    pthread_create(&client->tid, NULL, receive_thread, client);
+}
+
+// Waits for the client to receive what it expects, or stops it at 'deadline'
+void stop_client(BENCH_CLIENT * client, double deadline) {
+    while (__atomic_load_n(&client->received, __ATOMIC_RELAXED) < client->expected && now_us() < deadline)
+        usleep(1000);
+    if (client->use_shm) {
+        __atomic_store_n(&client->stop, true, __ATOMIC_RELEASE);
+        doorbell_force(&client->ring->bell);
+    }
+    else {
+        MSG msg = {0};
+        msg.type = SHUTDOWN_MSG;
+        WIRE_MSG * wire = pack_msg(&msg);
+        send_wire(client->id, wire, 0);
+        free(wire);
+    }
+    pthread_join(client->tid, NULL);
+}
+
+// One run: sends BENCH_MSGS messages with 'body_len' bytes of body
+void run(bool use_shm, size_t body_len) {
+    const char * transport = use_shm ? "shm" : "sysv";
+    char group[MAX_NAME_LEN], name[MAX_NAME_LEN];
+    snprintf(group, sizeof(group), "tb_%s_%zu", transport, body_len);
+
+    // the sender is a member too, as the creator of the group
+    BENCH_CLIENT * clients = malloc((BENCH_MEMBERS + 1) * sizeof(BENCH_CLIENT));
+    for (size_t i = 0; i <= BENCH_MEMBERS; ++i) {
+        snprintf(name, sizeof(name), "tb_%s_%zu_%zu", transport, body_len, i);
+        start_client(&clients[i], name, use_shm, BENCH_MSGS);
+    }
+    MSG msg = {0};
+    msg.type = CREATE_GROUP_MSG;
+    strcpy(msg.group, group);
+    bench_send(&clients[0], &msg);
+    GROUP * grp;
+    while ((grp = bench_group(group)) == NULL)
+        usleep(1000);
+    msg.type = JOIN_GROUP_MSG;
+    for (size_t i = 1; i <= BENCH_MEMBERS; ++i)
+        bench_send(&clients[i], &msg);
+
+    // the joins are handled by the thread of the group's shard, wait for them
+    while (__atomic_load_n(&grp->n_members, __ATOMIC_ACQUIRE) < BENCH_MEMBERS + 1)
+        usleep(1000);
+
+    msg.type = GROUP_MSG;
+    memset(msg.body, 'x', body_len);
+    msg.body[body_len] = '\0';
+    double start = now_us();
+    for (size_t i = 0; i < BENCH_MSGS; ++i) {
+        for (size_t j = 0; j <= BENCH_MEMBERS; ++j)
+            while (__atomic_load_n(&clients[j].received, __ATOMIC_ACQUIRE) + BENCH_WINDOW < i)
+                sched_yield();
+        // the time of sending, padded to 'body_len' by the x's after it
+        int len = snprintf(msg.body, body_len + 1, "%.3f", now_us());
+        if (len < body_len)
+            msg.body[len] = ' ';
+        msg.body_len = body_len;
+        bench_send(&clients[0], &msg);
+    }
+
+    size_t received = 0;
+    double latency_us = 0, end_us = start;
+    double deadline = now_us() + BENCH_TIMEOUT * 1e6;
+    for (size_t i = 0; i <= BENCH_MEMBERS; ++i) {
+        stop_client(&clients[i], deadline);
+        received += clients[i].received;
+        latency_us += clients[i].latency_us;
+        if (clients[i].last_us > end_us)
+            end_us = clients[i].last_us;
+        msgctl(clients[i].id, IPC_RMID, NULL);
+    }
+    free(clients);
+
+    printf("%-10s %-8zu %-10zu %-12.0f %-14.0f %-12.1f %zu/%zu\n", transport, body_len, (size_t) BENCH_MEMBERS + 1,
+        BENCH_MSGS / ((end_us - start) / 1e6), received / ((end_us - start) / 1e6),
+        (received > 0) ? latency_us / received : 0, received, (size_t) BENCH_MSGS * (BENCH_MEMBERS + 1));
+}
+
+// The user 'name' once the server handled a message from it on its ring
+USER * bench_user_on_ring(const char * name) {
+    while (true) {
+        pthread_rwlock_rdlock(&users_lock);
+        USER * user = lookup_user(name);
+        pthread_rwlock_unlock(&users_lock);
+        if (user != NULL && __atomic_load_n(&user->ring, __ATOMIC_ACQUIRE) != NULL)
+            return user;
+        usleep(1000);
+    }
+}
+
+// Registers BENCH_CHURN names on the shared memory transport, SHM_RINGS / 2 at
+// a time: each claims a ring and sends a heartbeat, the second sends the first
+// a message, then the batch is collected as if gone for the presence TTL. The
+// message left in the ring goes to the spool. Returns false if a name found no
+// ring, a ring wasn't released or the message was lost.
+bool churn() {
+    size_t batch = SHM_RINGS / 2, n_claimed = 0, n_failed = 0, n_kept = 0, n_lost = 0;
+    BENCH_CLIENT * clients = calloc(batch, sizeof(BENCH_CLIENT));
+    MSG msg = {0};
+    for (size_t n = 0; n < BENCH_CHURN; n += batch) {
+        for (size_t i = 0; i < batch; ++i) {
+            BENCH_CLIENT * client = &clients[i];
+            snprintf(client->name, sizeof(client->name), "tb_churn_%zu", n + i);
+            client->use_shm = true;
+            client->id = get_queue_id(client->name);
+            client->ring = shm_ring_find(&BENCH_SHM, client->name, true);
+            if (client->ring == NULL) {
+                ++n_failed;
+                continue;
+            }
+            ++n_claimed;
+            client->ring_epoch = client->ring->epoch;
+            msg.type = HEARTBEAT_MSG;
+            bench_send(client, &msg);
+        }
+        for (size_t i = 0; i < batch; ++i)
+            if (clients[i].ring != NULL)
+                bench_user_on_ring(clients[i].name);
+
+        USER * first = NULL;
+        if (clients[0].ring != NULL && clients[1].ring != NULL) {
+            first = bench_user_on_ring(clients[0].name);
+            msg.type = PRIVATE_MSG;
+            strcpy(msg.receiver, clients[0].name);
+            strcpy(msg.body, "left in the ring");
+            msg.body_len = strlen(msg.body);
+            bench_send(&clients[1], &msg);
+            while (__atomic_load_n(&clients[0].ring->tail, __ATOMIC_ACQUIRE) == clients[0].ring->head)
+                usleep(1000);
+        }
+
+        gc_sweep(time(NULL) + PRESENCE_SEC);
+        for (size_t i = 0; i < batch; ++i) {
+            if (clients[i].ring != NULL && clients[i].ring->epoch == clients[i].ring_epoch)
+                ++n_kept;
+            msgctl(clients[i].id, IPC_RMID, NULL);
+        }
+        if (first != NULL) {
+            pthread_mutex_lock(&first->spool.lock);
+            n_lost += first->spool.head == NULL;
+            pthread_mutex_unlock(&first->spool.lock);
+        }
+        memset(clients, 0, batch * sizeof(BENCH_CLIENT));
+    }
+    free(clients);
+
+    printf("\n%zu names on %d rings: %zu claimed, %zu found no ring, %zu rings kept, %zu messages lost\n",
+        (size_t) BENCH_CHURN, SHM_RINGS, n_claimed, n_failed, n_kept, n_lost);
+    return n_failed == 0 && n_kept == 0 && n_lost == 0;
+}
+
+int main(int argc, char * argv[]) {
+    // the groups' history goes to a directory of its own, removed at the end
+    char history_path[] = "/tmp/msgq_bench_XXXXXX";
+    if (mkdtemp(history_path) == NULL) {
+        perror("Error in mkdtemp...\n");
+        return EXIT_FAILURE;
+    }
+    char * server_argv[] = {"msgq_server", history_path, NULL};
+    pthread_t tid;
+    pthread_create(&tid, NULL, server_thread, server_argv);
+    pthread_detach(tid);
+
+    SERVER_ID = get_queue_id("server");
+    double deadline = now_us() + 5e6;
+    while (!shm_attach(&BENCH_SHM, false)) {
+        if (now_us() > deadline) {
+            fprintf(stderr, "Shared memory transport not available...\n");
+            return EXIT_FAILURE;
+        }
+        usleep(10000);
+    }
+    // the server attaches before it loads the groups, wait for it to finish
+    while (__atomic_load_n(&SHARDS[NUM_SHARDS - 1].dir.buckets, __ATOMIC_ACQUIRE) == NULL)
+        usleep(1000);
+
+    printf("%-10s %-8s %-10s %-12s %-14s %-12s %s\n", "transport", "body", "members", "sends/s", "deliveries/s", "latency (us)", "received");
+    size_t body_lens[] = {32, 512, 2000};
+    for (size_t i = 0; i < sizeof(body_lens) / sizeof(body_lens[0]); ++i) {
+        run(false, body_lens[i]);
+        run(true, body_lens[i]);
+    }
+    bool is_ok = churn();
+
+    nftw(history_path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return is_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
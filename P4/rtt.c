@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <signal.h>
@@ -23,21 +24,69 @@
 
 
 #define NUM_MAX_EVENTS  10      // maximum triggered events received from epoll_wait
-#define EPOLL_TIMEOUT   30000   // maximum timeout for epoll_wait in milliseconds
-#define MAX_RETRIES     1000    // Maximum number of retries for open file socket
+#define EPOLL_TIMEOUT   10000   // maximum timeout for epoll_wait in milliseconds
+#define NUM_PROBES      3       // ICMP echo requests sent to each host
+#define MAX_HOSTS       (UINT32_MAX / NUM_PROBES)  // a probe is numbered in 32 bits, see probe_id()
+#define MAX_IN_FLIGHT   4096    // probes sent and not answered yet, so replies fit in the socket buffers
+#define PROBE_TIMEOUT   1000    // milliseconds after it is sent, then a probe not answered is given up
+#define SOCKET_BUF_SIZE (8 << 20)   // bytes of the send and receive buffers of each socket
+#define RECV_BUF_SIZE   2048    // bytes of a received packet, IP header included
 
+#ifndef ICMP_FILTER
+#define ICMP_FILTER     1       // from linux/icmp.h, which clashes with netinet/ip_icmp.h
+#endif
 
-int n_complete, n_retries;
+
+int n_complete, n_send_failed;
 int sigint_rcvd = false;
+bool send_done = false;
+
+// One raw socket per address family for all the hosts, -1 if there is no
+// host of that family. A reply is matched to its probe by the ICMP id and
+// sequence, and by the token of the run in its data.
+int sock_v4 = -1, sock_v6 = -1;
+uint32_t run_token;
+
+// The window of probes in flight, between the sending and the receiving
+// thread. A probe is counted once, as answered by the receiver or as given up
+// by the sender, whichever comes first. The hosts from 'retire_idx' to the
+// next one to send are those with probes neither answered nor given up yet,
+// oldest first.
+long n_sent, n_answered, n_given_up;
+size_t retire_idx;
+pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t window_cond;     // on CLOCK_MONOTONIC, as the send times
 
 struct host_info {
-    bool valid;
-    char    ip[41];
     bool    isIPv6;
-    double   RTT[3]; // in milliseconds
+    union {
+        struct in_addr v4;
+        struct in6_addr v6;
+    } addr;
+    double  RTT[NUM_PROBES]; // in milliseconds
+    struct timespec send_time; // of the first probe
+    // bit 'seq' is set when probe 'seq' is answered, so a duplicate reply is
+    // not counted twice, and bit NUM_PROBES + 'seq' when it is given up
+    unsigned char probe_state;
     short int n_rtt_rcvd;
 };
 
+// The data of an echo request, sent back in the reply
+struct probe_data {
+    struct timespec send_time;
+    uint32_t token;
+};
+
+struct echo_v4 {
+    struct icmphdr icmp;
+    struct probe_data data;
+};
+
+struct echo_v6 {
+    struct icmp6_hdr icmp6;
+    struct probe_data data;
+};
+
 struct pthread_args {
     struct  host_info * hosts;
     size_t  num_hosts;
@@ -57,7 +106,7 @@ unsigned short checksum(void *b, int len) {
     unsigned short *buf = b;
     unsigned int sum=0;
     unsigned short result;
-    
+
     // 16 bit words... sizeof(unsigned short) = 2UL
     for (sum = 0; len > 1; len -= 2)
         sum += *buf++;
@@ -69,33 +118,46 @@ unsigned short checksum(void *b, int len) {
     return result;
 }
 
-int send_v4(char ip[41], int epoll_fd) {
-    int sock_fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-    if (sock_fd == -1 && errno == EACCES)
-        err_exit("Permission denied! Try using 'sudo'. Exiting...\n");
-    while (sock_fd == -1 && errno == EMFILE && n_retries > 0) {
-        sleep(1);
-        sock_fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-        --n_retries;
-    }
-    if (n_retries <= 0)
-        return -1;
-
-    int sock_flags = fcntl(sock_fd, F_GETFL, 0);
-    fcntl(sock_fd, F_SETFL, sock_flags | O_NONBLOCK);
+// Probe 'seq' of the host at 'idx' is numbered idx * NUM_PROBES + seq, its
+// high 16 bits sent as the ICMP id and its low 16 bits as the sequence
+void set_probe_id(uint32_t probe, uint16_t * id, uint16_t * sequence) {
+    *id = htons(probe >> 16);
+    *sequence = htons(probe & 0xFFFF);
+}
 
-    int ttl = 32;
-    if (setsockopt(sock_fd, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl)) == -1)
-        err_exit("Error in setting TTL option. Exiting...\n");
+uint32_t probe_id(uint16_t id, uint16_t sequence) {
+    return ((uint32_t) ntohs(id) << 16) | ntohs(sequence);
+}
 
-    struct sockaddr_in cli_addr = {0};
-    // ICMP has no ports
-    cli_addr.sin_family = AF_INET;
-    if (inet_pton(AF_INET, ip, &cli_addr.sin_addr) == 0)
-        err_exit("Invalid IPv4 address. Exiting...\n");
+// Opens the raw socket of 'family', passing only echo replies to it
+int open_socket(int family, int epoll_fd) {
+    int sock_fd = socket(family, SOCK_RAW, (family == AF_INET) ? IPPROTO_ICMP : IPPROTO_ICMPV6);
+    if (sock_fd == -1 && (errno == EACCES || errno == EPERM))
+        err_exit("Permission denied! Try using 'sudo'. Exiting...\n");
+    if (sock_fd == -1)
+        err_exit("Error in creating socket. Exiting...\n");
+
+    // the limits of the system are exceeded with the privilege of raw sockets
+    int buf_size = SOCKET_BUF_SIZE;
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUFFORCE, &buf_size, sizeof(buf_size)) == -1)
+        setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUFFORCE, &buf_size, sizeof(buf_size)) == -1)
+        setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+
+    if (family == AF_INET) {
+        int ttl = 32;
+        if (setsockopt(sock_fd, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl)) == -1)
+            err_exit("Error in setting TTL option. Exiting...\n");
+        uint32_t filter = ~(1U << ICMP_ECHOREPLY);
+        setsockopt(sock_fd, SOL_RAW, ICMP_FILTER, &filter, sizeof(filter));
+    }
+    else {
+        struct icmp6_filter filter;
+        ICMP6_FILTER_SETBLOCKALL(&filter);
+        ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+        setsockopt(sock_fd, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter));
+    }
 
-    connect(sock_fd, (struct sockaddr *) &cli_addr, sizeof(struct sockaddr));
-    
     struct epoll_event event;
     event.events = EPOLLIN;
     event.data.fd = sock_fd;
@@ -104,118 +166,148 @@ int send_v4(char ip[41], int epoll_fd) {
         close(epoll_fd);
         err_exit("Error in adding socket to epoll. Try using 'sudo'. Exiting...\n");
     }
+    return sock_fd;
+}
 
-    struct timespec send_time;
-
-    size_t icmp_payload_len = sizeof(struct icmphdr) + sizeof(struct timespec);
-    void * icmp_payload = malloc(icmp_payload_len);
-    memset(icmp_payload, 0, icmp_payload_len);
-
-    struct icmphdr * icmp = (struct icmphdr *) icmp_payload;
-    icmp->type = ICMP_ECHO;
-    icmp->code = 0;
-    icmp->un.echo.id = sock_fd;
-    icmp->un.echo.sequence = 0;
-
-    clock_gettime(CLOCK_MONOTONIC, &send_time);
-    memcpy(icmp + 1, &send_time, sizeof(struct timespec)); // Set send time
-    icmp->checksum = checksum(icmp_payload, icmp_payload_len);
-
-    sendto(sock_fd, icmp_payload, icmp_payload_len, 0, (struct sockaddr *) &cli_addr, sizeof(struct sockaddr));
-
-    icmp->un.echo.sequence = 1;
-    icmp->checksum = 0;
-
-    clock_gettime(CLOCK_MONOTONIC, &send_time);
-    memcpy(icmp + 1, &send_time, sizeof(struct timespec)); // Set send time
-    icmp->checksum = checksum(icmp_payload, icmp_payload_len);
-
-    sendto(sock_fd, icmp_payload, icmp_payload_len, 0, (struct sockaddr *) &cli_addr, sizeof(struct sockaddr));
-
-    icmp->un.echo.sequence = 2;
-    icmp->checksum = 0;
-
-    clock_gettime(CLOCK_MONOTONIC, &send_time);
-    memcpy(icmp + 1, &send_time, sizeof(struct timespec)); // Set send time
-    icmp->checksum = checksum(icmp_payload, icmp_payload_len);
-
-    sendto(sock_fd, icmp_payload, icmp_payload_len, 0, (struct sockaddr *) &cli_addr, sizeof(struct sockaddr));
+// True if 'ts' is PROBE_TIMEOUT or more before 'now'. Sets 'ts' to its expiry.
+bool probe_expired(struct timespec * ts, const struct timespec * now) {
+    ts->tv_sec += PROBE_TIMEOUT / 1000;
+    ts->tv_nsec += (PROBE_TIMEOUT % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ++ts->tv_sec;
+        ts->tv_nsec -= 1000000000L;
+    }
+    return ts->tv_sec < now->tv_sec || (ts->tv_sec == now->tv_sec && ts->tv_nsec <= now->tv_nsec);
+}
 
-    free(icmp_payload);
+// Waits for room in the window of probes in flight before the host at 'idx'
+// is sent. The socket blocks sending when its buffer is full, but replies
+// beyond the receive buffer would be lost. A probe not answered
+// PROBE_TIMEOUT after it was sent is given up, the oldest first.
+void wait_window(struct host_info * hosts, size_t idx) {
+    pthread_mutex_lock(&window_lock);
+    while (n_sent - n_answered - n_given_up + NUM_PROBES > MAX_IN_FLIGHT) {
+        struct timespec now, expiry;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (; retire_idx < idx; ++retire_idx) {
+            struct host_info * host = &hosts[retire_idx];
+            unsigned char state = __atomic_load_n(&host->probe_state, __ATOMIC_ACQUIRE);
+            if ((state & ((1 << NUM_PROBES) - 1)) == (1 << NUM_PROBES) - 1)
+                continue;
+            expiry = host->send_time;
+            if (!probe_expired(&expiry, &now))
+                break;
+            for (int seq = 0; seq < NUM_PROBES; ++seq) {
+                state = __atomic_fetch_or(&host->probe_state, 1 << (NUM_PROBES + seq), __ATOMIC_ACQ_REL);
+                if (!(state & (1 << seq)))
+                    ++n_given_up;
+            }
+        }
+        if (n_sent - n_answered - n_given_up + NUM_PROBES <= MAX_IN_FLIGHT)
+            break;
+
+        // until a reply comes or the oldest probe in flight expires
+        long answered = n_answered;
+        int ret = 0;
+        while (n_answered == answered && ret != ETIMEDOUT)
+            ret = pthread_cond_timedwait(&window_cond, &window_lock, &expiry);
+    }
+    n_sent += NUM_PROBES;
+    pthread_mutex_unlock(&window_lock);
+}
 
-    return sock_fd;
+void send_probe(int sock_fd, const void * payload, size_t len, const struct sockaddr * addr, socklen_t addr_len) {
+    ssize_t ret;
+    while ((ret = sendto(sock_fd, payload, len, 0, addr, addr_len)) == -1 && errno == EINTR)
+        ;
+    if (ret == -1)
+        ++n_send_failed;
 }
 
-int send_v6(char ip[41], int epoll_fd) {
-    int sock_fd = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
-    if (sock_fd == -1 && errno == EACCES)
-        err_exit("Permission denied! Try using 'sudo'. Exiting...\n");
-    while (sock_fd == -1 && errno == EMFILE && n_retries > 0) {
-        sleep(1);
-        sock_fd = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
-        --n_retries;
+void send_v4(struct host_info * hosts, uint32_t idx) {
+    struct sockaddr_in cli_addr = {0};
+    // ICMP has no ports
+    cli_addr.sin_family = AF_INET;
+    cli_addr.sin_addr = hosts[idx].addr.v4;
+
+    struct echo_v4 echo;
+    for (uint32_t seq = 0; seq < NUM_PROBES; ++seq) {
+        memset(&echo, 0, sizeof(echo));
+        echo.icmp.type = ICMP_ECHO;
+        echo.icmp.code = 0;
+        set_probe_id(idx * NUM_PROBES + seq, &echo.icmp.un.echo.id, &echo.icmp.un.echo.sequence);
+        echo.data.token = run_token;
+        clock_gettime(CLOCK_MONOTONIC, &echo.data.send_time); // Set send time
+        if (seq == 0)
+            hosts[idx].send_time = echo.data.send_time;
+        echo.icmp.checksum = checksum(&echo, sizeof(echo));
+
+        send_probe(sock_v4, &echo, sizeof(echo), (struct sockaddr *) &cli_addr, sizeof(cli_addr));
     }
-    if (n_retries <= 0)
-        return -1;
-    
-    int sock_flags = fcntl(sock_fd, F_GETFL, 0);
-    fcntl(sock_fd, F_SETFL, sock_flags | O_NONBLOCK);
+}
 
+void send_v6(struct host_info * hosts, uint32_t idx) {
     struct sockaddr_in6 cli_addr = {0};
     // ICMP has no ports
     cli_addr.sin6_family = AF_INET6;
-    if (inet_pton(AF_INET6, ip, &cli_addr.sin6_addr) == 0)
-        err_exit("Invalid IPv6 address. Exiting...\n");
-    
-    connect(sock_fd, (struct sockaddr_in6 *) &cli_addr, sizeof(struct sockaddr_in6));
-    struct epoll_event event;
-    event.events = EPOLLIN;
-    event.data.fd = sock_fd;
-
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &event) == -1) {
-        close(epoll_fd);
-        err_exit("Error in adding socket to epoll. Try using 'sudo'. Exiting...\n");
+    cli_addr.sin6_addr = hosts[idx].addr.v6;
+
+    // the kernel computes the ICMPv6 checksum, over the IPv6 pseudo header
+    struct echo_v6 echo;
+    for (uint32_t seq = 0; seq < NUM_PROBES; ++seq) {
+        memset(&echo, 0, sizeof(echo));
+        echo.icmp6.icmp6_type = ICMP6_ECHO_REQUEST;
+        echo.icmp6.icmp6_code = 0;
+        set_probe_id(idx * NUM_PROBES + seq, &echo.icmp6.icmp6_id, &echo.icmp6.icmp6_seq);
+        echo.data.token = run_token;
+        clock_gettime(CLOCK_MONOTONIC, &echo.data.send_time); // Set send time
+        if (seq == 0)
+            hosts[idx].send_time = echo.data.send_time;
+
+        send_probe(sock_v6, &echo, sizeof(echo), (struct sockaddr *) &cli_addr, sizeof(cli_addr));
     }
+}
 
-    struct timespec send_time;
-
-    size_t icmp_payload_len = sizeof(struct icmp6_hdr) + sizeof(struct timespec);
-    void * icmp_payload = malloc(icmp_payload_len);
-    memset(icmp_payload, 0, icmp_payload_len);
-    
-    struct icmp6_hdr * icmp6 = (struct icmp6_hdr *) icmp_payload;
-    icmp6->icmp6_type = ICMP6_ECHO_REQUEST;
-    icmp6->icmp6_code = 0;
-    icmp6->icmp6_id = sock_fd;
-    icmp6->icmp6_seq = 0;
-    
-    clock_gettime(CLOCK_MONOTONIC, &send_time);
-    memcpy(icmp6 + 1, &send_time, sizeof(struct timespec)); // Set send time
-    // icmp6->icmp6_cksum = htons(checksum(icmp_payload, icmp_payload_len));
-
-    sendto(sock_fd, icmp_payload, icmp_payload_len, 0, (struct sockaddr_in6 *) &cli_addr, sizeof(struct sockaddr_in6));
-
-    icmp6->icmp6_seq = 1;
-    // icmp6->icmp6_cksum = htons(0);
-
-    clock_gettime(CLOCK_MONOTONIC, &send_time);
-    memcpy(icmp6 + 1, &send_time, sizeof(struct timespec)); // Set send time
-    // icmp6->icmp6_cksum = htons(checksum(icmp_payload, icmp_payload_len));
-
-    sendto(sock_fd, icmp_payload, icmp_payload_len, 0, (struct sockaddr_in6 *) &cli_addr, sizeof(struct sockaddr_in6));
-
-    icmp6->icmp6_seq = 2;
-    // icmp6->icmp6_cksum = htons(0);
-
-    clock_gettime(CLOCK_MONOTONIC, &send_time);
-    memcpy(icmp6 + 1, &send_time, sizeof(struct timespec)); // Set send time
-    // icmp6->icmp6_cksum = htons(checksum(icmp_payload, icmp_payload_len));
-
-    sendto(sock_fd, icmp_payload, icmp_payload_len, 0, (struct sockaddr_in6 *) &cli_addr, sizeof(struct sockaddr_in6));
-
-    free(icmp_payload);
+// The probe an IPv4 packet of 'len' bytes answers, in 'probe' and 'send_time'.
+// Returns false if it is not a reply to a probe of this run.
+bool match_v4(struct host_info * hosts, size_t num_hosts, const char * packet, ssize_t len,
+        uint32_t * probe, struct timespec * send_time) {
+    const struct iphdr * ip = (const struct iphdr *) packet;
+    if (len < (ssize_t) sizeof(struct iphdr) || len < ip->ihl * 4 + (ssize_t) sizeof(struct echo_v4))
+        return false;
+    struct echo_v4 echo;
+    memcpy(&echo, packet + ip->ihl * 4, sizeof(echo));
+    if (echo.icmp.type != ICMP_ECHOREPLY || echo.data.token != run_token)
+        return false;
+
+    *probe = probe_id(echo.icmp.un.echo.id, echo.icmp.un.echo.sequence);
+    if (*probe >= num_hosts * NUM_PROBES)
+        return false;
+    struct host_info * host = &hosts[*probe / NUM_PROBES];
+    if (host->isIPv6 || host->addr.v4.s_addr != ip->saddr)
+        return false;
+    *send_time = echo.data.send_time;
+    return true;
+}
 
-    return sock_fd;
+// As match_v4(), the packet has no IP header and comes 'from'
+bool match_v6(struct host_info * hosts, size_t num_hosts, const char * packet, ssize_t len,
+        const struct sockaddr_in6 * from, uint32_t * probe, struct timespec * send_time) {
+    if (len < (ssize_t) sizeof(struct echo_v6))
+        return false;
+    struct echo_v6 echo;
+    memcpy(&echo, packet, sizeof(echo));
+    if (echo.icmp6.icmp6_type != ICMP6_ECHO_REPLY || echo.data.token != run_token)
+        return false;
+
+    *probe = probe_id(echo.icmp6.icmp6_id, echo.icmp6.icmp6_seq);
+    if (*probe >= num_hosts * NUM_PROBES)
+        return false;
+    struct host_info * host = &hosts[*probe / NUM_PROBES];
+    if (!host->isIPv6 || memcmp(&host->addr.v6, &from->sin6_addr, sizeof(struct in6_addr)) != 0)
+        return false;
+    *send_time = echo.data.send_time;
+    return true;
 }
 
 void * receive_reply_func(void * args) {
@@ -226,97 +318,85 @@ void * receive_reply_func(void * args) {
     size_t num_hosts = ((struct pthread_args *)args)->num_hosts;
     int epoll_fd = ((struct pthread_args *)args)->epoll_fd;
 
-    size_t hosts_len = (num_hosts+10 < 1024)? num_hosts+10 : 1024;
-
     struct epoll_event trig_events[NUM_MAX_EVENTS];
 
     struct timespec recv_time, send_time;
-    size_t icmp_payload_len = sizeof(struct timespec) +
-                                ((sizeof(struct icmphdr) > sizeof(struct icmp6_hdr)) ? sizeof(struct icmphdr) : sizeof(struct icmp6_hdr));
-    void * ip_icmp_payload = malloc(sizeof(struct iphdr) + icmp_payload_len);
-    void * icmp_payload;
+    char * packet = malloc(RECV_BUF_SIZE);
+    char ip[INET6_ADDRSTRLEN];
 
-    bool run_flag = true;
+    bool run_flag = n_complete < num_hosts;
     while (run_flag) {
         if (sigint_rcvd) {
             printf("\nNumber of IPs pinged: %d\n", n_complete);
-            free(ip_icmp_payload);
-            sigint_rcvd = false;
+            free(packet);
             return NULL;
         }
 
-        // Create a new thread to handle searching and updating the hosts data
-        int event_count = epoll_wait(epoll_fd, trig_events, NUM_MAX_EVENTS, 10000);
-        clock_gettime(CLOCK_MONOTONIC, &recv_time); // get receive time
-        
+        int event_count = epoll_wait(epoll_fd, trig_events, NUM_MAX_EVENTS, EPOLL_TIMEOUT);
+
         if (event_count == 0) {
             printf("\nMaximum epoll wait timeout reached!\n");
-            for (int i = 0; i < hosts_len; ++i) {
-                if (hosts[i].valid) {
-                    hosts[i].valid = false;
-                    close(i);
-                }
-            }
+            // the probes not answered by now are lost
+            if (__atomic_load_n(&send_done, __ATOMIC_ACQUIRE))
+                break;
             continue;
         }
+        else if (event_count == -1 && errno == EINTR)
+            continue;
         else if (event_count == -1)
             err_exit("Error in epoll wait. Try using 'sudo'. Exiting...\n");
-        
-        for (int i = 0; i < event_count; ++i) {
-            struct epoll_event * event = &(trig_events[i]);
-            if (!hosts[event->data.fd].isIPv6) {
-                // Receive IPv4 ICMP echo reply
-                recvfrom(event->data.fd, ip_icmp_payload, sizeof(struct iphdr) + icmp_payload_len, 0, NULL, NULL);
-                
-                icmp_payload = ((struct iphdr *) ip_icmp_payload) + 1;
-                if (((struct icmphdr *) icmp_payload)->type == ICMP_ECHOREPLY) {
-                    short int rtt_idx = ((struct icmphdr *) icmp_payload)->un.echo.sequence;
-                    send_time = *((struct timespec *) (((struct icmphdr *) icmp_payload)+1));
-
-                    // Time difference for RTT in milliseconds
-                    double rtt = ((double)(recv_time.tv_sec - send_time.tv_sec)*1000.0) + (double)(recv_time.tv_nsec - send_time.tv_nsec)/1000000.0;
-                    hosts[event->data.fd].RTT[rtt_idx] = rtt;
-                    if (++hosts[event->data.fd].n_rtt_rcvd == 3) {
-                        printf("%-41s - %.2f %.2f %.2f\t\t(ms)\n", hosts[event->data.fd].ip,
-                            hosts[event->data.fd].RTT[0],
-                            hosts[event->data.fd].RTT[1],
-                            hosts[event->data.fd].RTT[2]);
-                        close(event->data.fd);
-                        ++n_complete;
-                        if (n_complete == num_hosts)
-                            run_flag = false;
-                    }
+
+        for (int i = 0; i < event_count && run_flag; ++i) {
+            int sock_fd = trig_events[i].data.fd;
+            long n_matched = 0;
+
+            // every reply waiting on the socket
+            while (run_flag) {
+                struct sockaddr_in6 from;
+                socklen_t from_len = sizeof(from);
+                ssize_t len = recvfrom(sock_fd, packet, RECV_BUF_SIZE, MSG_DONTWAIT, (struct sockaddr *) &from, &from_len);
+                if (len == -1)
+                    break;
+                clock_gettime(CLOCK_MONOTONIC, &recv_time); // get receive time
+
+                uint32_t probe;
+                bool is_match = (sock_fd == sock_v4) ?
+                    match_v4(hosts, num_hosts, packet, len, &probe, &send_time) :
+                    match_v6(hosts, num_hosts, packet, len, &from, &probe, &send_time);
+                if (!is_match)
+                    continue;
+                struct host_info * host = &hosts[probe / NUM_PROBES];
+                short int rtt_idx = probe % NUM_PROBES;
+                unsigned char state = __atomic_fetch_or(&host->probe_state, 1 << rtt_idx, __ATOMIC_ACQ_REL);
+                if (state & (1 << rtt_idx))
+                    continue;
+                // a late reply still has its RTT, the sender has counted it out of the window
+                if (!(state & (1 << (NUM_PROBES + rtt_idx))))
+                    ++n_matched;
+
+                // Time difference for RTT in milliseconds
+                double rtt = ((double)(recv_time.tv_sec - send_time.tv_sec)*1000.0) + (double)(recv_time.tv_nsec - send_time.tv_nsec)/1000000.0;
+                host->RTT[rtt_idx] = rtt;
+                if (++host->n_rtt_rcvd == NUM_PROBES) {
+                    inet_ntop(host->isIPv6 ? AF_INET6 : AF_INET, &host->addr, ip, sizeof(ip));
+                    printf("%-41s - %.2f %.2f %.2f\t\t(ms)\n", ip, host->RTT[0], host->RTT[1], host->RTT[2]);
+                    ++n_complete;
+                    if (n_complete == num_hosts)
+                        run_flag = false;
                 }
             }
-            else {
-                // Receive IPv6 ICMP echo reply
-                recvfrom(event->data.fd, ip_icmp_payload, icmp_payload_len, 0, NULL, NULL);
-                
-                icmp_payload = ip_icmp_payload;
-                if (((struct icmp6_hdr *) icmp_payload)->icmp6_type == ICMP6_ECHO_REPLY) {
-                    short int rtt_idx = ((struct icmp6_hdr *) icmp_payload)->icmp6_seq;
-                    send_time = *((struct timespec *) (((struct icmp6_hdr *) icmp_payload)+1));
-
-                    // Time difference for RTT in milliseconds
-                    double rtt = ((double)(recv_time.tv_sec - send_time.tv_sec)*1000.0) + (double)(recv_time.tv_nsec - send_time.tv_nsec)/1000000.0;
-                    hosts[event->data.fd].RTT[rtt_idx] = rtt;
-                    if (++hosts[event->data.fd].n_rtt_rcvd == 3) {
-                        printf("%-41s - %.2f %.2f %.2f\t\t(ms)\n", hosts[event->data.fd].ip,
-                            hosts[event->data.fd].RTT[0],
-                            hosts[event->data.fd].RTT[1],
-                            hosts[event->data.fd].RTT[2]);
-                        close(event->data.fd);
-                        ++n_complete;
-                        if (n_complete == num_hosts)
-                            run_flag = false;
-                    }
-                }
+
+            if (n_matched > 0) {
+                pthread_mutex_lock(&window_lock);
+                n_answered += n_matched;
+                pthread_cond_signal(&window_cond);
+                pthread_mutex_unlock(&window_lock);
             }
         }
     }
     printf("\nNumber of IPs pinged: %d\n", n_complete);
 
-    free(ip_icmp_payload);
+    free(packet);
 
     // Output of thread. In this case, there is nothing to return
     return NULL;
@@ -330,30 +410,57 @@ int main(int argc, char * argv[]) {
     // Assumption: All the hosts in the file are unique
     size_t num_hosts = 0;
     n_complete = 0;
-    n_retries = MAX_RETRIES;
-    
+    n_send_failed = 0;
+
     FILE * hosts_fp;
     if ((hosts_fp = fopen(argv[1], "r")) == NULL)
         err_exit("Error opening HOSTS FILE. Exiting...\n");
 
-    int _c;
-    while (EOF != (_c=fgetc(hosts_fp)))
-        if (_c == '\n')
-            ++num_hosts;
-    fseek(hosts_fp, 0, SEEK_SET);
-
-    // 'sock_fd' is directly used as index for the hosts array of structures
-    // +10 is a safety limit to ensure that every 'sock_fd' is < '(num_hosts + 10)'
-    // because 0 and 1 are used up by stdin and stdout
-    // So, safety limit has to be atleast +2
-    size_t hosts_len = (num_hosts+10 < 1024)? num_hosts+10 : 1024;
-    struct host_info * hosts = malloc(sizeof(struct host_info) * hosts_len);
-    memset(hosts, 0, sizeof(struct host_info) * hosts_len);
-
-    // size_t num_forks = 0;
+    // The hosts are read up front into a table grown as needed. A host is
+    // its index in it, which numbers its probes.
+    size_t hosts_cap = 1024;
+    struct host_info * hosts = malloc(sizeof(struct host_info) * hosts_cap);
+    bool has_v4 = false, has_v6 = false;
+    char * line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &line_cap, hosts_fp)) != -1) {
+        while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r' || line[line_len - 1] == ' '))
+            line[--line_len] = '\0';
+        if (line_len == 0)
+            continue;
+        if (num_hosts == MAX_HOSTS)
+            err_exit("Too many hosts. Exiting...\n");
+        if (num_hosts == hosts_cap) {
+            hosts_cap *= 2;
+            hosts = realloc(hosts, sizeof(struct host_info) * hosts_cap);
+        }
+
+        struct host_info * host = &hosts[num_hosts++];
+        memset(host, 0, sizeof(struct host_info));
+        // Differentiate between ipv4 and ipv6
+        if (inet_pton(AF_INET, line, &host->addr.v4) == 1)
+            has_v4 = true;
+        else if (inet_pton(AF_INET6, line, &host->addr.v6) == 1)
+            host->isIPv6 = has_v6 = true;
+        else
+            err_exit("Invalid IP address. Exiting...\n");
+    }
+    free(line);
+    fclose(hosts_fp);
+
     int epoll_fd = epoll_create1(0);
     if (epoll_fd == -1)
         err_exit("Error in epoll. Exiting...\n");
+    if (has_v4)
+        sock_v4 = open_socket(AF_INET, epoll_fd);
+    if (has_v6)
+        sock_v6 = open_socket(AF_INET6, epoll_fd);
+
+    // tells the replies to this run from those to another ping on the host
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    run_token = (uint32_t) (now.tv_nsec ^ now.tv_sec ^ ((long) getpid() << 16));
 
     // Set up signal handler
     struct sigaction sigint;
@@ -364,43 +471,33 @@ int main(int argc, char * argv[]) {
 
     sigaction(SIGINT, &sigint, NULL);
 
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&window_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
     pthread_t thread_id;
     struct pthread_args args = {hosts, num_hosts, epoll_fd};
     pthread_create(&thread_id, NULL, receive_reply_func, &args);
-    
-    // Sending ICMP echo requests to all IPs
-    char ip[41];
-    for (size_t idx = 0; idx < num_hosts; ++idx) {
-        fgets(ip, 41, hosts_fp);
-        if (ip[strlen(ip) - 1] == '\n')
-            ip[strlen(ip) - 1] = '\0';
 
-        int sock_fd;
-        // Differentiate between ipv4 and ipv6
-        if (strstr(ip, ".")) {
-            // ipv4 address
-            sock_fd = send_v4(ip, epoll_fd);
-            if (sock_fd == -1 && n_retries <= 0) {
-                printf("\nMaximum number of retries reached. Exiting...\n");
-                break;
-            }
-            hosts[sock_fd].isIPv6 = 0;
-        }
-        else {
-            // ipv6 address
-            sock_fd = send_v6(ip, epoll_fd);
-            if (sock_fd == -1 && n_retries <= 0) {
-                printf("\nMaximum number of retries reached. Exiting...\n");
-                break;
-            }
-            hosts[sock_fd].isIPv6 = 1;
-        }
-        hosts[sock_fd].valid = true;
-        strncpy(hosts[sock_fd].ip, ip, 41);
-        hosts[sock_fd].n_rtt_rcvd = 0;
+    // Sending ICMP echo requests to all IPs
+    for (size_t idx = 0; idx < num_hosts && !sigint_rcvd; ++idx) {
+        wait_window(hosts, idx);
+        if (hosts[idx].isIPv6)
+            send_v6(hosts, idx);
+        else
+            send_v4(hosts, idx);
     }
+    __atomic_store_n(&send_done, true, __ATOMIC_RELEASE);
 
     pthread_join(thread_id, NULL);
+    if (n_send_failed > 0)
+        printf("Echo requests not sent: %d\n", n_send_failed);
+    if (sock_v4 != -1)
+        close(sock_v4);
+    if (sock_v6 != -1)
+        close(sock_v6);
     close(epoll_fd);
     free(hosts);
 